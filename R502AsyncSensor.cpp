@@ -0,0 +1,325 @@
+#include "R502AsyncSensor.hpp"
+
+const char *R502AsyncSensor::TAG = "R502Async";
+
+R502UartLink::R502UartLink(R502Interface &_iface) : iface(_iface),
+    irq_seen(_iface.interrupt)
+{
+}
+
+esp_err_t R502UartLink::write(const uint8_t *data, size_t len)
+{
+    // Commands fit in the hardware fifo, so this doesn't wait on the wire
+    int written = uart_write_bytes(iface.uart_num, (const char *)data, len);
+    if(written < 0) return ESP_ERR_INVALID_STATE;
+    if(written != len) return ESP_ERR_INVALID_SIZE;
+    return ESP_OK;
+}
+
+size_t R502UartLink::available()
+{
+    size_t buffered = 0;
+    uart_get_buffered_data_len(iface.uart_num, &buffered);
+    return buffered;
+}
+
+int R502UartLink::read(uint8_t *data, size_t len)
+{
+    return uart_read_bytes(iface.uart_num, data, len, 0);
+}
+
+void R502UartLink::discard()
+{
+    uart_flush_input(iface.uart_num);
+}
+
+bool R502UartLink::take_irq()
+{
+    int count = iface.interrupt;
+    if(count == irq_seen) return false;
+    irq_seen = count;
+    return true;
+}
+
+bool R502UartLink::try_acquire()
+{
+    // The scheduler task may already hold the recursive mutex for another
+    // exchange on this link
+    if(held) return false;
+    if(iface.bus_mutex &&
+        xSemaphoreTakeRecursive(iface.bus_mutex, 0) != pdTRUE)
+    {
+        return false;
+    }
+    held = true;
+    return true;
+}
+
+void R502UartLink::release()
+{
+    held = false;
+    if(iface.bus_mutex){
+        xSemaphoreGiveRecursive(iface.bus_mutex);
+    }
+}
+
+QueueHandle_t R502UartLink::rx_events()
+{
+    // The uart driver posts UART_DATA as bytes come in
+    return iface.uart_queue;
+}
+
+bool R502UartLink::wake_on_irq(SemaphoreHandle_t wake)
+{
+    iface.irq_wake = wake;
+    return true;
+}
+
+R502AsyncSensor::R502AsyncSensor(R502Scheduler &_scheduler,
+    R502Interface &_iface, R502AsyncLink &_link) : scheduler(_scheduler),
+    iface(_iface), link(_link)
+{
+}
+
+R502Scheduler &R502AsyncSensor::get_scheduler()
+{
+    return scheduler;
+}
+
+R502Task<esp_err_t> R502AsyncSensor::wait_for_finger(int timeout_ms)
+{
+    int64_t deadline = scheduler.now_us() + (int64_t)timeout_ms * 1000;
+    bool touched = co_await scheduler.wait_irq(link, deadline);
+    co_return touched ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+R502Task<R502_async_result_t> R502AsyncSensor::gen_image()
+{
+    R502_DataPkg_t pkg;
+    R502_GeneralCommand_t *data = &pkg.data.general;
+
+    // Fill package
+    iface.set_headers(pkg, R502_pid_command, sizeof(R502_GeneralCommand_t));
+    data->instr_code = R502_ic_gen_img;
+    iface.fill_checksum(pkg);
+
+    R502_async_result_t result = co_await general_command(pkg);
+    if(!result.err && result.conf_code == R502_ok &&
+        iface.boot_timing.first_capture_us < 0)
+    {
+        iface.boot_timing.first_capture_us = esp_timer_get_time();
+    }
+    co_return result;
+}
+
+R502Task<R502_async_result_t> R502AsyncSensor::img_2_tz(
+    R502_char_buffer_t buffer_id)
+{
+    R502_DataPkg_t pkg;
+    R502_Img2Tz_t *data = &pkg.data.img_2_tz;
+
+    // Fill package
+    iface.set_headers(pkg, R502_pid_command, sizeof(R502_Img2Tz_t));
+    data->instr_code = R502_ic_img_2_tz;
+    data->buffer_id = buffer_id;
+    iface.fill_checksum(pkg);
+
+    if(buffer_id == R502_char_buffer_2) iface.resident_page = -1;
+    co_return co_await general_command(pkg);
+}
+
+R502Task<R502_async_search_t> R502AsyncSensor::search(
+    R502_char_buffer_t buffer_id, uint16_t start_page, uint16_t page_num)
+{
+    R502_DataPkg_t pkg;
+    R502_Search_t *data = &pkg.data.search;
+
+    // Fill package
+    iface.set_headers(pkg, R502_pid_command, sizeof(R502_Search_t));
+    data->instr_code = R502_ic_search;
+    data->buffer_id = buffer_id;
+    iface.conv_16_to_8(start_page, data->start_page);
+    iface.conv_16_to_8(page_num, data->page_num);
+    iface.fill_checksum(pkg);
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_SearchAck_t *receive_data = &receive_pkg.data.search_ack;
+    R502_async_search_t result = {ESP_OK, R502_fail, 0, 0};
+    result.err = co_await exchange(pkg, receive_pkg, sizeof(*receive_data));
+    if(result.err) co_return result;
+
+    // Return result
+    result.conf_code = (R502_conf_code_t)receive_data->conf_code;
+    result.page_id = iface.conv_8_to_16(receive_data->page_id);
+    result.match_score = iface.conv_8_to_16(receive_data->match_score);
+    co_return result;
+}
+
+R502Task<R502_async_result_t> R502AsyncSensor::store(
+    R502_char_buffer_t buffer_id, uint16_t page_id)
+{
+    R502_DataPkg_t pkg;
+    R502_Store_t *data = &pkg.data.store;
+
+    // Fill package
+    iface.set_headers(pkg, R502_pid_command, sizeof(R502_Store_t));
+    data->instr_code = R502_ic_store;
+    data->buffer_id = buffer_id;
+    iface.conv_16_to_8(page_id, data->page_id);
+    iface.fill_checksum(pkg);
+
+    if(page_id == iface.resident_page) iface.resident_page = -1;
+    R502_async_result_t result = co_await general_command(pkg);
+    if(!result.err && result.conf_code == R502_ok){
+        iface.template_index.mark_used(page_id);
+    }
+    co_return result;
+}
+
+R502Task<R502_async_result_t> R502AsyncSensor::template_num(
+    uint16_t &template_num)
+{
+    R502_DataPkg_t pkg;
+    R502_GeneralCommand_t *data = &pkg.data.general;
+
+    // Fill package
+    iface.set_headers(pkg, R502_pid_command, sizeof(R502_GeneralCommand_t));
+    data->instr_code = R502_ic_template_num;
+    iface.fill_checksum(pkg);
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_TemplateNumAck_t *receive_data = &receive_pkg.data.template_num_ack;
+    R502_async_result_t result = {ESP_OK, R502_fail};
+    result.err = co_await exchange(pkg, receive_pkg, sizeof(*receive_data));
+    if(result.err) co_return result;
+
+    // Return result
+    result.conf_code = (R502_conf_code_t)receive_data->conf_code;
+    template_num = iface.conv_8_to_16(receive_data->template_num);
+    co_return result;
+}
+
+R502Task<R502_async_result_t> R502AsyncSensor::general_command(
+    R502_DataPkg_t pkg)
+{
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    R502_async_result_t result = {ESP_OK, R502_fail};
+    result.err = co_await exchange(pkg, receive_pkg, sizeof(*receive_data));
+    if(!result.err){
+        result.conf_code = (R502_conf_code_t)receive_data->conf_code;
+    }
+    co_return result;
+}
+
+R502Task<esp_err_t> R502AsyncSensor::exchange(R502_DataPkg_t pkg,
+    R502_DataPkg_t &receive_pkg, int data_rec_length)
+{
+    co_await scheduler.acquire(link);
+
+    R502FrameEncoder frame(pkg);
+    uint8_t instr_code = frame.instr_code();
+    int send_length = frame.length();
+    int receive_length = data_rec_length + R502Interface::header_size;
+    int timeout_ms = iface.timeout_model.timeout_ms(instr_code, send_length,
+        receive_length, iface.cur_baud);
+
+    int64_t start = scheduler.now_us();
+    link.discard();
+    R502Trace::record(R502_trace_tx_start, instr_code, send_length);
+    esp_err_t err = link.write_segments(frame.segments(), 
+        frame.segment_count());
+    R502Trace::record(R502_trace_tx_end, instr_code, send_length);
+    if(!err){
+        err = co_await receive(receive_pkg, receive_length,
+            start + (int64_t)timeout_ms * 1000);
+    }
+
+    if(!err){
+        iface.timeout_model.record(instr_code, scheduler.now_us() - start,
+            send_length, receive_length, iface.cur_baud);
+    }
+    else if(err == ESP_ERR_NOT_FOUND || err == ESP_ERR_INVALID_RESPONSE){
+        iface.timeout_model.record_timeout(instr_code);
+    }
+    link.release();
+    co_return err;
+}
+
+R502Task<esp_err_t> R502AsyncSensor::receive(R502_DataPkg_t &rec_pkg,
+    int data_length, int64_t deadline_us)
+{
+    const int header_size = R502Interface::header_size;
+    uint8_t *buf = (uint8_t *)&rec_pkg;
+    int len = 0;
+    int skipped = 0;
+    bool arrived = true;
+
+    // Header first, skipping anything before the start code
+    while(len < header_size && arrived){
+        arrived = co_await scheduler.wait_rx(link, header_size - len,
+            deadline_us);
+        int read = link.read(buf + len, header_size - len);
+        if(read < 0){
+            ESP_LOGE(TAG, "uart read error, parameter error");
+            co_return ESP_ERR_INVALID_STATE;
+        }
+        len += read;
+        int dropped = iface.sync_to_start(buf, len);
+        skipped += dropped;
+        len -= dropped;
+    }
+    if(skipped){
+        ESP_LOGW(TAG, "skipped %d bytes before package start", skipped);
+    }
+
+    // Then exactly as much as the header announces
+    if(len == header_size){
+        int announced = iface.conv_8_to_16(rec_pkg.length);
+        R502Trace::record(R502_trace_rx_header, rec_pkg.pid, announced);
+        if(announced < R502_cs_len || announced > sizeof(rec_pkg.data)){
+            ESP_LOGE(TAG, "Response has invalid length, %d", announced);
+            link.discard();
+            co_return ESP_ERR_INVALID_RESPONSE;
+        }
+        int total = header_size + announced;
+        while(len < total && arrived){
+            arrived = co_await scheduler.wait_rx(link, total - len,
+                deadline_us);
+            int read = link.read(buf + len, total - len);
+            if(read < 0){
+                ESP_LOGE(TAG, "uart read error, parameter error");
+                co_return ESP_ERR_INVALID_STATE;
+            }
+            len += read;
+        }
+    }
+
+    if(!arrived && len == 0){
+        ESP_LOGE(TAG, "uart read error, R502 not found");
+        co_return ESP_ERR_NOT_FOUND;
+    }
+    else if(!arrived){
+        ESP_LOGE(TAG, "uart read error, not enough bytes read, %d < %d",
+            len, data_length);
+        link.discard();
+        co_return ESP_ERR_INVALID_RESPONSE;
+    }
+    R502Trace::record(R502_trace_rx_complete, rec_pkg.pid, len);
+
+    // Verify response
+    if(!iface.verify_checksum(rec_pkg)){
+        ESP_LOGE(TAG, "uart read error, invalid CRC");
+        link.discard();
+        co_return ESP_ERR_INVALID_CRC;
+    }
+    R502Trace::record(R502_trace_checksum_ok, rec_pkg.pid,
+        iface.conv_8_to_16(rec_pkg.length));
+    esp_err_t err = iface.verify_headers(rec_pkg, data_length - header_size);
+    if(err){
+        link.discard();
+    }
+    co_return err;
+}
@@ -0,0 +1,216 @@
+#include "R502BurstCapture.hpp"
+#include <algorithm>
+#include "esp_heap_caps.h"
+
+static const char *TAG = "R502Burst";
+
+// A command and its acknowledgement without data, on the wire
+static const int exchange_bytes = 24;
+// Header and checksum around the data of each package
+static const int package_overhead = 9 + R502_cs_len;
+
+R502BurstCapture::~R502BurstCapture()
+{
+    heap_caps_free(images[0]);
+    heap_caps_free(images[1]);
+    heap_caps_free(arena);
+}
+
+esp_err_t R502BurstCapture::run(const R502_burst_config_t &config,
+    R502_burst_result_t &result)
+{
+    int64_t start = esp_timer_get_time();
+    result = {};
+    result.best = -1;
+    result.res = R502_fail;
+    have_best = false;
+    stats = {};
+    if(config.budget_ms <= 0 || config.max_captures <= 0){
+        return ESP_ERR_INVALID_ARG;
+    }
+    bool image_mode = config.mode == R502_burst_image;
+    if(image_mode && !allocate()) return ESP_ERR_NO_MEM;
+
+    int64_t deadline = start + (int64_t)config.budget_ms * 1000;
+    // Until a capture is measured, the timeout model's idea of one
+    int64_t slowest_us = 0;
+    int64_t finish_us = 0;
+    estimate(config, slowest_us, finish_us);
+    bool best_is_latest = false;
+    esp_err_t err = ESP_OK;
+    while(result.captures < config.max_captures){
+        int64_t now = esp_timer_get_time();
+        // Extracting the best image costs about as much as capturing it did
+        int64_t reserve_us = finish_us ? std::max(finish_us, slowest_us) : 0;
+        if(now + slowest_us + reserve_us > deadline){
+            if(result.captures == 0){
+                ESP_LOGW(TAG, "a capture doesn't fit in %d ms",
+                    config.budget_ms);
+            }
+            break;
+        }
+
+        R502_conf_code_t res = R502_fail;
+        err = iface.gen_image(res);
+        if(err) break;
+        if(res == R502_err_no_finger){
+            // Before the first capture the finger may still be arriving
+            if(result.captures == 0){
+                result.res = res;
+                continue;
+            }
+            result.finger_lifted = true;
+            break;
+        }
+        result.captures++;
+        best_is_latest = false;
+        bool usable = false;
+        if(res != R502_ok){
+            result.res = res;
+        }
+        else if(image_mode){
+            err = score_image(result, usable);
+            best_is_latest = usable && result.best == result.captures - 1;
+        }
+        else{
+            err = iface.img_2_tz(config.buffer, res);
+            result.res = res;
+            usable = !err && res == R502_ok;
+            if(usable){
+                result.best = result.captures - 1;
+                result.best_quality = 100;
+            }
+        }
+        if(err) break;
+        if(!usable) result.rejected++;
+        slowest_us = std::max(slowest_us, esp_timer_get_time() - now);
+
+        if(!image_mode && usable) break;
+        if(image_mode && have_best &&
+            result.best_quality >= config.target_quality)
+        {
+            break;
+        }
+    }
+
+    if(!err && image_mode && have_best && config.extract_best){
+        R502_conf_code_t res = R502_ok;
+        if(!best_is_latest){
+            // A later capture replaced it in img_buffer
+            err = iface.down_image(
+                iface.get_link_config().data_package_length,
+                images[best_index], image_bytes[best_index], res);
+        }
+        if(!err && res == R502_ok){
+            err = iface.img_2_tz(config.buffer, res);
+        }
+        result.res = res;
+    }
+    result.elapsed_us = esp_timer_get_time() - start;
+    if(err){
+        ESP_LOGE(TAG, "burst stopped after %d captures: %s",
+            result.captures, esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t R502BurstCapture::score_image(R502_burst_result_t &result,
+    bool &usable)
+{
+    usable = false;
+    int spare = have_best ? 1 - best_index : best_index;
+    R502_conf_code_t res = R502_fail;
+    R502_image_info_t info = {};
+    esp_err_t err = iface.up_image(
+        iface.get_link_config().data_package_length, res, images[spare],
+        image_capacity, R502_image_packed, info);
+    result.res = res;
+    if(err == ESP_ERR_INVALID_SIZE){
+        ESP_LOGW(TAG, "image is %d bytes, not scored", (int)info.bytes);
+        return ESP_OK;
+    }
+    if(err || res != R502_ok) return err;
+
+    R502_batch_image_t image = {};
+    image.packed = R502ByteSpan(images[spare], info.bytes);
+    R502ImageBatch::process_one(image, arena);
+    if(!image.valid) return ESP_OK;
+    usable = true;
+    if(have_best && image.stats.quality <= result.best_quality){
+        return ESP_OK;
+    }
+    best_index = spare;
+    image_bytes[spare] = info.bytes;
+    have_best = true;
+    stats = image.stats;
+    result.best = result.captures - 1;
+    result.best_quality = image.stats.quality;
+    return ESP_OK;
+}
+
+void R502BurstCapture::estimate(const R502_burst_config_t &config,
+    int64_t &capture_us, int64_t &finish_us)
+{
+    R502_baud_t baud = iface.get_link_config().baud;
+    int64_t gen_img_us = latency_us(R502_ic_gen_img) +
+        R502TimeoutModel::wire_time_us(exchange_bytes, baud);
+    int64_t img_2_tz_us = latency_us(R502_ic_img_2_tz) +
+        R502TimeoutModel::wire_time_us(exchange_bytes, baud);
+    finish_us = 0;
+    if(config.mode != R502_burst_image){
+        capture_us = gen_img_us + img_2_tz_us;
+        return;
+    }
+
+    int data_len = R502_data_len_bytes(
+        iface.get_link_config().data_package_length);
+    int image_bytes = image_capacity +
+        image_capacity / data_len * package_overhead;
+    int64_t image_wire_us = R502TimeoutModel::wire_time_us(
+        exchange_bytes + image_bytes, baud);
+    capture_us = gen_img_us + latency_us(R502_ic_up_image) + image_wire_us;
+    if(config.extract_best){
+        finish_us = latency_us(R502_ic_down_image) + image_wire_us +
+            img_2_tz_us;
+    }
+}
+
+int64_t R502BurstCapture::latency_us(uint8_t instr_code)
+{
+    const R502TimeoutModel &model = iface.get_timeout_model();
+    const R502_latency_stats_t &stats = model.get_stats(instr_code);
+    if(stats.samples) return stats.smoothed_us;
+    // Nothing measured yet, the quickest the model would allow
+    int floor_ms = 0;
+    int ceiling_ms = 0;
+    model.get_allowance(instr_code, floor_ms, ceiling_ms);
+    return (int64_t)floor_ms * 1000;
+}
+
+R502ByteSpan R502BurstCapture::best_image() const
+{
+    if(!have_best) return R502ByteSpan();
+    return R502ByteSpan(images[best_index], image_bytes[best_index]);
+}
+
+bool R502BurstCapture::allocate()
+{
+    if(images[0] && images[1] && arena) return true;
+    size_t sizes[3] = {image_capacity, image_capacity,
+        R502ImageBatch::arena_size};
+    uint8_t **buffers[3] = {&images[0], &images[1], &arena};
+    for(int i = 0; i < 3; i++){
+        if(*buffers[i]) continue;
+        *buffers[i] = (uint8_t *)heap_caps_malloc(sizes[i],
+            MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if(!*buffers[i]){
+            *buffers[i] = (uint8_t *)heap_caps_malloc(sizes[i],
+                MALLOC_CAP_8BIT);
+        }
+        if(!*buffers[i]){
+            ESP_LOGE(TAG, "no memory for a %d byte buffer", (int)sizes[i]);
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,215 @@
+#include "R502Bus.hpp"
+
+const char *R502Bus::TAG = "R502Bus";
+
+const std::array<uint8_t, 4> R502Bus::default_adder = {0xFF, 0xFF, 0xFF, 0xFF};
+
+R502Bus::~R502Bus()
+{
+    deinit();
+    if(mutex) vSemaphoreDelete(mutex);
+    if(stats_mutex) vSemaphoreDelete(stats_mutex);
+}
+
+esp_err_t R502Bus::init(uart_port_t _uart_num, gpio_num_t _pin_txd,
+    gpio_num_t _pin_rxd, R502_baud_t _baud)
+{
+    if(initialized) return ESP_OK;
+    uart_num = _uart_num;
+    pin_txd = _pin_txd;
+    pin_rxd = _pin_rxd;
+    baud = _baud;
+    if(!mutex) mutex = xSemaphoreCreateRecursiveMutex();
+    if(!stats_mutex) stats_mutex = xSemaphoreCreateMutex();
+    if(!mutex || !stats_mutex) return ESP_ERR_NO_MEM;
+
+    uart_config_t uart_config = {
+        .baud_rate = 9600*baud,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .rx_flow_ctrl_thresh = 0,
+        .use_ref_tick = false
+    };
+    esp_err_t err = uart_param_config(uart_num, &uart_config);
+    if(err) return err;
+    err = uart_set_pin(uart_num, pin_txd, pin_rxd, UART_PIN_NO_CHANGE,
+        UART_PIN_NO_CHANGE);
+    if(err) return err;
+    // Sized like a single module's
+    err = uart_driver_install(uart_num,
+        R502Interface::uart_buffer_size(R502_max_data_len), 0,
+        R502Interface::uart_queue_size, &uart_queue, 0);
+    if(err) return err;
+    unrouted = 0;
+    initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t R502Bus::deinit()
+{
+    if(!initialized) return ESP_OK;
+    esp_err_t first_err = ESP_OK;
+    while(count > 0){
+        // Each deinit takes its module off the bus
+        esp_err_t err = modules[count - 1]->deinit();
+        if(err && !first_err) first_err = err;
+    }
+    initialized = false;
+    esp_err_t err = uart_driver_delete(uart_num);
+    uart_queue = nullptr;
+    if(err && !first_err) first_err = err;
+    return first_err;
+}
+
+esp_err_t R502Bus::add(R502Interface &module,
+    const std::array<uint8_t, 4> &address, gpio_num_t pin_irq)
+{
+    if(!initialized || module.initialized) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    bool full = count == max_modules;
+    bool taken = find(address.data()) >= 0;
+    bool default_taken = find(default_adder.data()) >= 0;
+    xSemaphoreGive(stats_mutex);
+    if(full){
+        ESP_LOGE(TAG, "bus is full");
+        return ESP_ERR_NO_MEM;
+    }
+    if(taken){
+        ESP_LOGE(TAG, "address %02X%02X%02X%02X is already on the bus",
+            address[0], address[1], address[2], address[3]);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Share the uart and its mutex, the module only adds its irq pin
+    module.boot_timing = {esp_timer_get_time(), -1, -1, false, 0};
+    module.bus = this;
+    module.uart_num = uart_num;
+    module.uart_queue = uart_queue;
+    module.pin_txd = pin_txd;
+    module.pin_rxd = pin_rxd;
+    module.pin_rts = (gpio_num_t)UART_PIN_NO_CHANGE;
+    module.pin_cts = (gpio_num_t)UART_PIN_NO_CHANGE;
+    module.cur_baud = baud;
+    if(module.bus_mutex) vSemaphoreDelete(module.bus_mutex);
+    module.bus_mutex = mutex;
+    memcpy(module.adder, address.data(), sizeof(module.adder));
+    esp_err_t err = module.install_irq(pin_irq);
+    if(err){
+        module.bus = nullptr;
+        module.bus_mutex = nullptr;
+        return err;
+    }
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    modules[count] = &module;
+    stats[count] = {};
+    count++;
+    xSemaphoreGive(stats_mutex);
+    module.initialized = true;
+
+    // A module given its address in an earlier session answers at it
+    R502_conf_code_t res = R502_fail;
+    R502_sys_para_t sys_para;
+    err = module.read_sys_para(res, sys_para,
+        R502Interface::probe_read_delay);
+    if((err || res != R502_ok) && address != default_adder &&
+        !default_taken)
+    {
+        memcpy(module.adder, default_adder.data(), sizeof(module.adder));
+        err = module.read_sys_para(res, sys_para,
+            R502Interface::probe_read_delay);
+        if(!err && res == R502_ok){
+            ESP_LOGI(TAG, "assigning address %02X%02X%02X%02X", address[0],
+                address[1], address[2], address[3]);
+            err = module.set_adder(address, res);
+        }
+    }
+    if(!err && res != R502_ok){
+        err = ESP_ERR_NOT_FOUND;
+    }
+    if(err){
+        ESP_LOGE(TAG, "no module for address %02X%02X%02X%02X: %s",
+            address[0], address[1], address[2], address[3],
+            esp_err_to_name(err));
+        module.deinit();
+        return err;
+    }
+    module.cur_data_len = sys_para.data_package_length;
+    module.boot_timing.link_ready_us = esp_timer_get_time();
+    return ESP_OK;
+}
+
+R502_bus_stats_t R502Bus::get_stats(const R502Interface &module) const
+{
+    R502_bus_stats_t copy = {};
+    if(!stats_mutex) return copy;
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    for(int i = 0; i < count; i++){
+        if(modules[i] == &module) copy = stats[i];
+    }
+    xSemaphoreGive(stats_mutex);
+    return copy;
+}
+
+int R502Bus::find(const uint8_t adder[4]) const
+{
+    for(int i = 0; i < count; i++){
+        if(memcmp(modules[i]->adder, adder, sizeof(modules[i]->adder)) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+void R502Bus::route(const uint8_t adder[4], bool valid)
+{
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    int i = valid ? find(adder) : -1;
+    if(i >= 0){
+        stats[i].stray_packages++;
+    }
+    else{
+        unrouted++;
+    }
+    xSemaphoreGive(stats_mutex);
+    ESP_LOGW(TAG, "dropped %s package from %02X%02X%02X%02X",
+        i >= 0 ? "stray" : "unrouted", adder[0], adder[1], adder[2],
+        adder[3]);
+}
+
+void R502Bus::record(const R502Interface &module, esp_err_t err,
+    int64_t elapsed_us)
+{
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    for(int i = 0; i < count; i++){
+        if(modules[i] != &module) continue;
+        R502_bus_stats_t &s = stats[i];
+        s.exchanges++;
+        if(err){
+            s.failures++;
+            if(err == ESP_ERR_NOT_FOUND) s.timeouts++;
+        }
+        else{
+            s.total_us += elapsed_us;
+            if(elapsed_us > s.max_us) s.max_us = elapsed_us;
+        }
+    }
+    xSemaphoreGive(stats_mutex);
+}
+
+void R502Bus::remove(R502Interface &module)
+{
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    for(int i = 0; i < count; i++){
+        if(modules[i] != &module) continue;
+        for(int j = i + 1; j < count; j++){
+            modules[j - 1] = modules[j];
+            stats[j - 1] = stats[j];
+        }
+        count--;
+        modules[count] = nullptr;
+        break;
+    }
+    xSemaphoreGive(stats_mutex);
+}
@@ -0,0 +1,456 @@
+#include "R502CaptureArchive.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unistd.h>
+
+const char *R502CaptureArchiveWriter::TAG = "R502CaptureArchive";
+
+static const size_t file_header_size = sizeof(R502_capture_file_header_t);
+static const size_t capture_header_size = sizeof(R502_capture_header_t);
+static const size_t index_entry_size = sizeof(R502_capture_index_t);
+
+static uint32_t module_key(const uint8_t adder[4])
+{
+    return (uint32_t)adder[0] << 24 | (uint32_t)adder[1] << 16 |
+        (uint32_t)adder[2] << 8 | adder[3];
+}
+
+static bool by_time_order(const R502_capture_index_t &a,
+    const R502_capture_index_t &b)
+{
+    if(a.timestamp_us != b.timestamp_us) return a.timestamp_us < b.timestamp_us;
+    return a.sequence < b.sequence;
+}
+
+static bool by_module_order(const R502_capture_index_t &a,
+    const R502_capture_index_t &b)
+{
+    if(a.module != b.module) return a.module < b.module;
+    return by_time_order(a, b);
+}
+
+esp_err_t R502CaptureArchiveWriter::open()
+{
+    opened = false;
+    capturing = false;
+    index.clear();
+    next_sequence = 0;
+
+    size_t total = size();
+    if(total == 0){
+        esp_err_t err = write_file_header(0);
+        if(err) return err;
+        end_offset = file_header_size;
+        opened = true;
+        return ESP_OK;
+    }
+
+    R502_capture_file_header_t header;
+    esp_err_t err = read_at(0, (uint8_t *)&header, file_header_size);
+    if(err == ESP_ERR_INVALID_SIZE) return ESP_ERR_INVALID_VERSION;
+    if(err) return err;
+    if(memcmp(header.magic, "RCAP", 4) != 0 ||
+        header.version != format_version ||
+        header.capture_header_size != capture_header_size)
+    {
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    bool indexed = header.index_offset >= file_header_size &&
+        header.index_offset % alignment == 0 &&
+        header.index_offset <= total &&
+        header.count <= (total - header.index_offset) / (2 * index_entry_size);
+    if(!indexed){
+        if(header.index_offset != 0){
+            ESP_LOGW(TAG, "index is cut short, walking the captures");
+        }
+        err = recover(file_header_size, total);
+    }
+    else{
+        // The entries by time are all the writer needs, close sorts anyway
+        index.resize(header.count);
+        err = read_at(header.index_offset, (uint8_t *)index.data(),
+            index.size() * index_entry_size);
+        if(err) return err;
+        for(const R502_capture_index_t &entry : index){
+            next_sequence = std::max(next_sequence, entry.sequence + 1);
+        }
+        end_offset = header.index_offset;
+        err = truncate(end_offset);
+    }
+    if(err) return err;
+    // Reading now needs recovery, until close writes the index again
+    err = write_file_header(0);
+    if(err) return err;
+    opened = true;
+    return ESP_OK;
+}
+
+esp_err_t R502CaptureArchiveWriter::recover(size_t offset, size_t total)
+{
+    while(offset + capture_header_size <= total){
+        R502_capture_header_t header;
+        esp_err_t err = read_at(offset, (uint8_t *)&header,
+            capture_header_size);
+        if(err) return err;
+        bool complete = memcmp(header.magic, "CAPT", 4) == 0 &&
+            header.bytes > 0 &&
+            header.record_size >= (uint64_t)capture_header_size +
+                header.bytes &&
+            header.record_size % alignment == 0 &&
+            header.record_size <= total - offset;
+        if(!complete) break;
+
+        R502_capture_index_t entry;
+        entry.timestamp_us = header.timestamp_us;
+        entry.module = module_key(header.adder);
+        entry.sequence = header.sequence;
+        entry.offset = offset;
+        index.push_back(entry);
+        next_sequence = std::max(next_sequence, header.sequence + 1);
+        offset += header.record_size;
+    }
+    end_offset = offset;
+    if(offset == total) return ESP_OK;
+    ESP_LOGW(TAG, "dropping %d bytes after the last complete capture",
+        (int)(total - offset));
+    return truncate(offset);
+}
+
+esp_err_t R502CaptureArchiveWriter::write_file_header(uint64_t index_offset)
+{
+    R502_capture_file_header_t header = {};
+    memcpy(header.magic, "RCAP", 4);
+    header.version = format_version;
+    header.capture_header_size = capture_header_size;
+    header.count = index.size();
+    header.index_offset = index_offset;
+    if(size() == 0){
+        return append((const uint8_t *)&header, file_header_size);
+    }
+    return write_at(0, (const uint8_t *)&header, file_header_size);
+}
+
+esp_err_t R502CaptureArchiveWriter::begin(const R502_capture_meta_t &meta)
+{
+    if(!opened || capturing) return ESP_ERR_INVALID_STATE;
+    current = {};
+    memcpy(current.magic, "CAPT", 4);
+    current.timestamp_us = meta.timestamp_us;
+    current.sequence = next_sequence;
+    memcpy(current.adder, meta.link.adder, sizeof(current.adder));
+    current.baud = meta.link.baud;
+    current.data_len = meta.link.data_package_length;
+    current.format = meta.format;
+    memset(histogram, 0, sizeof(histogram));
+    capture_err = ESP_OK;
+
+    // Written with record_size 0, so a capture cut short is never taken for
+    // a complete one
+    esp_err_t err = append((const uint8_t *)&current, capture_header_size);
+    if(err){
+        truncate(end_offset);
+        return err;
+    }
+    capturing = true;
+    return ESP_OK;
+}
+
+void R502CaptureArchiveWriter::operator()(R502ByteSpan frame)
+{
+    if(!capturing || capture_err) return;
+    for(size_t i = 0; i < frame.size(); i++){
+        histogram[frame[i] & 0xf]++;
+        histogram[frame[i] >> 4]++;
+    }
+    current.frames++;
+
+    if(current.format == R502_image_packed){
+        capture_err = append(frame.data(), frame.size());
+        current.bytes += frame.size();
+        return;
+    }
+    // Expanded as R502ImageAssembler does, a chunk at a time
+    uint8_t expanded[128];
+    for(size_t i = 0; i < frame.size() && !capture_err;
+        i += sizeof(expanded) / 2)
+    {
+        size_t len = std::min(frame.size() - i, sizeof(expanded) / 2);
+        for(size_t j = 0; j < len; j++){
+            expanded[j*2] = (frame[i + j] & 0xf) << 4;
+            expanded[j*2+1] = frame[i + j] & 0xf0;
+        }
+        capture_err = append(expanded, len * 2);
+        current.bytes += len * 2;
+    }
+}
+
+esp_err_t R502CaptureArchiveWriter::end()
+{
+    if(!capturing) return ESP_ERR_INVALID_STATE;
+    esp_err_t err = capture_err;
+    if(!err && current.bytes == 0) err = ESP_ERR_INVALID_SIZE;
+
+    uint64_t pixels = 0;
+    uint64_t sum = 0;
+    uint64_t sum_sq = 0;
+    current.pixel_min = 0xff;
+    for(int v = 0; v < 16; v++){
+        if(!histogram[v]) continue;
+        uint8_t pixel = v << 4;
+        pixels += histogram[v];
+        sum += (uint64_t)histogram[v] * pixel;
+        sum_sq += (uint64_t)histogram[v] * pixel * pixel;
+        current.pixel_min = std::min(current.pixel_min, pixel);
+        current.pixel_max = std::max(current.pixel_max, pixel);
+    }
+    if(pixels){
+        double mean = (double)sum / pixels;
+        double variance = (double)sum_sq / pixels - mean * mean;
+        current.pixel_mean = std::lround(mean * 256);
+        current.pixel_stddev = std::lround(
+            std::sqrt(std::max(variance, 0.0)) * 256);
+    }
+    current.width = R502_image_width;
+    current.height = pixels / R502_image_width;
+
+    size_t unpadded = capture_header_size + current.bytes;
+    current.record_size = (unpadded + alignment - 1) / alignment * alignment;
+    if(!err && current.record_size > unpadded){
+        const uint8_t padding[alignment] = {};
+        err = append(padding, current.record_size - unpadded);
+    }
+    if(!err){
+        err = write_at(end_offset, (const uint8_t *)&current,
+            capture_header_size);
+    }
+    if(err){
+        ESP_LOGE(TAG, "dropping capture %d: %s", (int)current.sequence,
+            esp_err_to_name(err));
+        cancel();
+        return err;
+    }
+
+    R502_capture_index_t entry;
+    entry.timestamp_us = current.timestamp_us;
+    entry.module = module_key(current.adder);
+    entry.sequence = current.sequence;
+    entry.offset = end_offset;
+    index.push_back(entry);
+    next_sequence++;
+    end_offset += current.record_size;
+    capturing = false;
+    return ESP_OK;
+}
+
+esp_err_t R502CaptureArchiveWriter::cancel()
+{
+    if(!capturing) return ESP_OK;
+    capturing = false;
+    return truncate(end_offset);
+}
+
+esp_err_t R502CaptureArchiveWriter::capture(R502Interface &iface,
+    int64_t timestamp_us, R502_image_format_t format, R502_conf_code_t &res)
+{
+    R502_capture_meta_t meta;
+    meta.timestamp_us = timestamp_us;
+    meta.link = iface.get_link_config();
+    meta.format = format;
+    esp_err_t err = begin(meta);
+    if(err) return err;
+    err = iface.up_image(meta.link.data_package_length, res, *this);
+    if(err || res != R502_ok){
+        cancel();
+        return err;
+    }
+    return end();
+}
+
+esp_err_t R502CaptureArchiveWriter::close()
+{
+    if(!opened) return ESP_ERR_INVALID_STATE;
+    esp_err_t err = cancel();
+    if(err) return err;
+
+    std::vector<R502_capture_index_t> sorted(index);
+    std::sort(sorted.begin(), sorted.end(), by_time_order);
+    err = append((const uint8_t *)sorted.data(),
+        sorted.size() * index_entry_size);
+    if(err) return err;
+    std::sort(sorted.begin(), sorted.end(), by_module_order);
+    err = append((const uint8_t *)sorted.data(),
+        sorted.size() * index_entry_size);
+    if(err) return err;
+    err = write_file_header(end_offset);
+    if(err) return err;
+    opened = false;
+    return ESP_OK;
+}
+
+R502FileCaptureArchiveWriter::R502FileCaptureArchiveWriter(
+    const char *_path) : path(_path)
+{
+}
+
+R502FileCaptureArchiveWriter::~R502FileCaptureArchiveWriter()
+{
+    if(file) fclose(file);
+}
+
+esp_err_t R502FileCaptureArchiveWriter::read_at(size_t offset,
+    uint8_t *data, size_t len)
+{
+    FILE *f = get_file();
+    if(!f) return ESP_FAIL;
+    if(fseek(f, offset, SEEK_SET) != 0) return ESP_FAIL;
+    if(fread(data, 1, len, f) != len) return ESP_ERR_INVALID_SIZE;
+    return ESP_OK;
+}
+
+esp_err_t R502FileCaptureArchiveWriter::write_at(size_t offset,
+    const uint8_t *data, size_t len)
+{
+    FILE *f = get_file();
+    if(!f) return ESP_FAIL;
+    if(fseek(f, offset, SEEK_SET) != 0) return ESP_FAIL;
+    size_t written = fwrite(data, 1, len, f);
+    // Also flushes the frames appended before, which aren't flushed one by
+    // one. Only the header is overwritten, so its commits reach the disk
+    // before end or close returns
+    if(fflush(f) != 0 || written != len) return ESP_FAIL;
+    if(fsync(fileno(f)) != 0) return ESP_FAIL;
+    return ESP_OK;
+}
+
+esp_err_t R502FileCaptureArchiveWriter::append(const uint8_t *data,
+    size_t len)
+{
+    FILE *f = get_file();
+    if(!f) return ESP_FAIL;
+    if(fseek(f, 0, SEEK_END) != 0) return ESP_FAIL;
+    if(fwrite(data, 1, len, f) != len) return ESP_FAIL;
+    return ESP_OK;
+}
+
+size_t R502FileCaptureArchiveWriter::size()
+{
+    FILE *f = get_file();
+    if(!f || fseek(f, 0, SEEK_END) != 0) return 0;
+    long end = ftell(f);
+    return end < 0 ? 0 : end;
+}
+
+esp_err_t R502FileCaptureArchiveWriter::truncate(size_t new_size)
+{
+    FILE *f = get_file();
+    if(!f || fflush(f) != 0) return ESP_FAIL;
+    if(ftruncate(fileno(f), new_size) != 0) return ESP_FAIL;
+    return ESP_OK;
+}
+
+FILE *R502FileCaptureArchiveWriter::get_file()
+{
+    if(!file) file = fopen(path, "r+b");
+    if(!file) file = fopen(path, "w+b");
+    return file;
+}
+
+esp_err_t R502CaptureArchiveReader::open(const void *data, size_t size)
+{
+    base = nullptr;
+    length = 0;
+    n = 0;
+    if((uintptr_t)data % R502CaptureArchiveWriter::alignment != 0){
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(size < file_header_size) return ESP_ERR_INVALID_VERSION;
+    const R502_capture_file_header_t *header =
+        (const R502_capture_file_header_t *)data;
+    if(memcmp(header->magic, "RCAP", 4) != 0 ||
+        header->version != R502CaptureArchiveWriter::format_version ||
+        header->capture_header_size != capture_header_size)
+    {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if(header->index_offset == 0) return ESP_ERR_INVALID_STATE;
+    if(header->index_offset % R502CaptureArchiveWriter::alignment != 0 ||
+        header->index_offset > size || header->count >
+        (size - header->index_offset) / (2 * index_entry_size))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    base = (const uint8_t *)data;
+    length = size;
+    n = header->count;
+    time_index = (const R502_capture_index_t *)(base + header->index_offset);
+    module_index = time_index + n;
+    return ESP_OK;
+}
+
+R502_capture_view_t R502CaptureArchiveReader::by_time(size_t pos) const
+{
+    if(pos >= n) return {nullptr, R502ByteSpan()};
+    return view(time_index[pos]);
+}
+
+R502_capture_view_t R502CaptureArchiveReader::by_module(size_t pos) const
+{
+    if(pos >= n) return {nullptr, R502ByteSpan()};
+    return view(module_index[pos]);
+}
+
+R502_capture_range_t R502CaptureArchiveReader::time_range(int64_t from_us,
+    int64_t to_us) const
+{
+    auto before = [](const R502_capture_index_t &entry, int64_t t){
+        return entry.timestamp_us < t;
+    };
+    const R502_capture_index_t *end = time_index + n;
+    size_t first = std::lower_bound(time_index, end, from_us, before) -
+        time_index;
+    size_t last = std::lower_bound(time_index, end, to_us, before) -
+        time_index;
+    return {first, std::max(first, last)};
+}
+
+R502_capture_range_t R502CaptureArchiveReader::module_range(
+    const std::array<uint8_t, 4> &adder, int64_t from_us, int64_t to_us) const
+{
+    uint32_t module = module_key(adder.data());
+    auto before = [module](const R502_capture_index_t &entry, int64_t t){
+        if(entry.module != module) return entry.module < module;
+        return entry.timestamp_us < t;
+    };
+    const R502_capture_index_t *end = module_index + n;
+    size_t first = std::lower_bound(module_index, end, from_us, before) -
+        module_index;
+    size_t last = std::lower_bound(module_index, end, to_us, before) -
+        module_index;
+    return {first, std::max(first, last)};
+}
+
+R502_capture_view_t R502CaptureArchiveReader::view(
+    const R502_capture_index_t &entry) const
+{
+    R502_capture_view_t result = {nullptr, R502ByteSpan()};
+    if(entry.offset % R502CaptureArchiveWriter::alignment != 0 ||
+        entry.offset > length || length - entry.offset < capture_header_size)
+    {
+        return result;
+    }
+    const R502_capture_header_t *header =
+        (const R502_capture_header_t *)(base + entry.offset);
+    if(memcmp(header->magic, "CAPT", 4) != 0 ||
+        header->record_size < (uint64_t)capture_header_size + header->bytes ||
+        header->record_size > length - entry.offset)
+    {
+        return result;
+    }
+    result.header = header;
+    result.image = R502ByteSpan(base + entry.offset + capture_header_size,
+        header->bytes);
+    return result;
+}
@@ -0,0 +1,178 @@
+#include "R502CommandBatch.hpp"
+#include <algorithm>
+#include <new>
+
+const char *R502CommandBatch::TAG = "R502Batch";
+
+/**
+ * \brief R502BatchPort over the interface's uart, used with the bus held
+ */
+class R502CommandBatch::UartPort : public R502BatchPort {
+public:
+    UartPort(R502Interface &_iface) : iface(_iface) {}
+
+    esp_err_t send(const R502FrameEncoder &frame) override {
+        return iface.send_package(frame);
+    }
+
+    esp_err_t receive(R502_DataPkg_t &pkg, int data_length,
+        uint8_t instr_code) override
+    {
+        // The command is already sent, only the reply is left to wait for
+        int receive_length = data_length + R502Interface::header_size;
+        int timeout_ms = iface.timeout_model.timeout_ms(instr_code, 0,
+            receive_length, iface.cur_baud);
+        return iface.receive_package(pkg, receive_length, timeout_ms);
+    }
+
+    void resync(const uint8_t *in_flight, int count) override {
+        // Wait out the slowest command that might still be acknowledged, so
+        // a late reply isn't taken for the next command's
+        int receive_length = sizeof(R502_GeneralAck_t) +
+            R502Interface::header_size;
+        int window_ms = 0;
+        for(int i = 0; i < count; i++){
+            window_ms = std::max(window_ms, iface.timeout_model.timeout_ms(
+                in_flight[i], 0, receive_length, iface.cur_baud));
+        }
+        iface.drain_to_boundary(window_ms);
+    }
+
+private:
+    R502Interface &iface;
+};
+
+esp_err_t R502CommandBatch::led_config(R502_led_ctrl_t ctrl, uint8_t speed,
+    R502_led_colour_t colour, uint8_t times)
+{
+    R502FrameEncoder *frame = add(R502_ic_led_config);
+    if(!frame) return ESP_ERR_NO_MEM;
+    frame->add_field(ctrl);
+    frame->add_field(speed);
+    frame->add_field(colour);
+    frame->add_field(times);
+    frame->finish();
+    return ESP_OK;
+}
+
+esp_err_t R502CommandBatch::write_notepad(uint8_t page_number,
+    const std::array<uint8_t, R502_notepad_page_size> &content)
+{
+    if(page_number >= R502_notepad_pages){
+        ESP_LOGE(TAG, "invalid notepad page, %d", page_number);
+        return ESP_ERR_INVALID_ARG;
+    }
+    R502FrameEncoder *frame = add(R502_ic_write_notepad);
+    if(!frame) return ESP_ERR_NO_MEM;
+    frame->add_field(page_number);
+    frame->add_payload(content.data(), R502_notepad_page_size);
+    frame->finish();
+    return ESP_OK;
+}
+
+esp_err_t R502CommandBatch::set_security_level(uint8_t security_level)
+{
+    if(security_level < 1 || security_level > 5){
+        ESP_LOGE(TAG, "invalid security level, %d", security_level);
+        return ESP_ERR_INVALID_ARG;
+    }
+    R502FrameEncoder *frame = add(R502_ic_set_sys_para);
+    if(!frame) return ESP_ERR_NO_MEM;
+    frame->add_field(R502_para_num_security_level);
+    frame->add_field(security_level);
+    frame->finish();
+    return ESP_OK;
+}
+
+esp_err_t R502CommandBatch::execute(int window)
+{
+    R502Interface::BusLock lock(iface.bus_mutex);
+    if(iface.idle){
+        ESP_LOGE(TAG, "batch sent while idle, call exit_idle first");
+        return ESP_ERR_INVALID_STATE;
+    }
+    UartPort port(iface);
+    return execute(port, window);
+}
+
+esp_err_t R502CommandBatch::execute(R502BatchPort &port, int window)
+{
+    if(window < 1) return ESP_ERR_INVALID_ARG;
+
+    const int ack_length = sizeof(R502_GeneralAck_t);
+    esp_err_t first_err = ESP_OK;
+    int sent = 0;
+    int acked = 0;
+    // Last command sent with nothing in flight, acknowledgements from here on
+    // are matched by position alone
+    int sync_point = 0;
+    while(acked < count){
+        // Keep window commands ahead of the acknowledgement awaited
+        esp_err_t err = ESP_OK;
+        while(!err && sent < count && sent - acked < window){
+            const R502FrameEncoder *frame =
+                (const R502FrameEncoder *)frame_storage[sent];
+            err = port.send(*frame);
+            sent++;
+        }
+
+        R502_DataPkg_t receive_pkg;
+        if(!err){
+            const R502FrameEncoder *frame =
+                (const R502FrameEncoder *)frame_storage[acked];
+            err = port.receive(receive_pkg, ack_length, frame->instr_code());
+        }
+        if(!err){
+            results[acked].err = ESP_OK;
+            results[acked].conf_code =
+                (R502_conf_code_t)receive_pkg.data.general_ack.conf_code;
+            acked++;
+            if(acked == sent) sync_point = acked;
+            continue;
+        }
+
+        // A command the module dropped shifts every acknowledgement after
+        // it, so none since the last sync point can be trusted
+        ESP_LOGW(TAG, "%s at command %d of %d, failing commands %d to %d",
+            esp_err_to_name(err), acked, count, sync_point, sent - 1);
+        if(!first_err) first_err = err;
+        for(int i = sync_point; i < sent; i++){
+            results[i].err = err;
+            results[i].conf_code = R502_fail;
+        }
+        uint8_t in_flight[max_commands];
+        int in_flight_count = 0;
+        for(int i = acked; i < sent; i++){
+            const R502FrameEncoder *frame =
+                (const R502FrameEncoder *)frame_storage[i];
+            in_flight[in_flight_count++] = frame->instr_code();
+        }
+        acked = sent;
+        sync_point = sent;
+        port.resync(in_flight, in_flight_count);
+    }
+    return first_err;
+}
+
+int R502CommandBatch::get_failed() const
+{
+    int failed = 0;
+    for(int i = 0; i < count; i++){
+        if(results[i].err || results[i].conf_code != R502_ok) failed++;
+    }
+    return failed;
+}
+
+R502FrameEncoder *R502CommandBatch::add(uint8_t instr_code)
+{
+    if(count == max_commands){
+        ESP_LOGE(TAG, "batch is full");
+        return nullptr;
+    }
+    R502FrameEncoder *frame = new(frame_storage[count])
+        R502FrameEncoder(iface.adder, R502_pid_command);
+    frame->add_field(instr_code);
+    results[count] = {ESP_ERR_INVALID_STATE, R502_fail};
+    count++;
+    return frame;
+}
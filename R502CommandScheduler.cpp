@@ -0,0 +1,328 @@
+#include "R502CommandScheduler.hpp"
+#include "esp_timer.h"
+
+static const char *TAG = "R502Sched";
+
+esp_err_t R502Job::wait(int timeout_ms)
+{
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    while(!done){
+        int64_t left_us = deadline - esp_timer_get_time();
+        if(left_us <= 0) return ESP_ERR_TIMEOUT;
+        // Rounded up, so the last wait doesn't come back a tick early
+        TickType_t ticks = (left_us / 1000 + portTICK_PERIOD_MS - 1) /
+            portTICK_PERIOD_MS;
+        ulTaskNotifyTake(pdTRUE, ticks);
+    }
+    return result;
+}
+
+R502IdentifyJob::R502IdentifyJob(uint16_t _start_page, uint16_t _page_num,
+    int _max_polls) : start_page(_start_page), page_num(_page_num),
+    max_polls(_max_polls)
+{
+}
+
+esp_err_t R502IdentifyJob::step(R502Interface &iface, bool &done)
+{
+    esp_err_t err = ESP_OK;
+    last_write = 0;
+    switch(stage){
+    case capture:
+        err = iface.gen_image(conf_code);
+        last_write = R502_mem_image;
+        if(err) return err;
+        if(conf_code == R502_err_no_finger && ++polls < max_polls){
+            return ESP_OK;
+        }
+        stage = extract;
+        break;
+    case extract:
+        err = iface.img_2_tz(R502_char_buffer_1, conf_code);
+        last_write = R502_mem_char_1;
+        if(err) return err;
+        stage = match;
+        break;
+    case match:
+        err = iface.search(R502_char_buffer_1, start_page, page_num,
+            conf_code, page_id, match_score);
+        done = true;
+        return err;
+    }
+    // Any failure of the module ends the job, with its code in conf_code
+    done = conf_code != R502_ok;
+    return ESP_OK;
+}
+
+void R502IdentifyJob::restart()
+{
+    stage = capture;
+    polls = 0;
+}
+
+uint32_t R502IdentifyJob::depends_on() const
+{
+    switch(stage){
+    case extract: return R502_mem_image;
+    case match: return R502_mem_char_1;
+    default: return 0;
+    }
+}
+
+uint32_t R502IdentifyJob::overwrote() const
+{
+    return last_write;
+}
+
+R502UploadJob::R502UploadJob(R502_data_len_t _data_len, uint8_t *_buffer,
+    size_t _capacity, R502_image_format_t _format, int _max_polls) :
+    data_len(_data_len), buffer(_buffer), capacity(_capacity),
+    format(_format), max_polls(_max_polls)
+{
+}
+
+esp_err_t R502UploadJob::step(R502Interface &iface, bool &done)
+{
+    last_write = 0;
+    if(stage == capture){
+        esp_err_t err = iface.gen_image(conf_code);
+        last_write = R502_mem_image;
+        if(err) return err;
+        if(conf_code == R502_err_no_finger && ++polls < max_polls){
+            return ESP_OK;
+        }
+        stage = upload;
+        done = conf_code != R502_ok;
+        return ESP_OK;
+    }
+    done = true;
+    return iface.up_image(data_len, conf_code, buffer, capacity, format,
+        info);
+}
+
+void R502UploadJob::restart()
+{
+    stage = capture;
+    polls = 0;
+}
+
+uint32_t R502UploadJob::depends_on() const
+{
+    return stage == upload ? R502_mem_image : 0;
+}
+
+uint32_t R502UploadJob::overwrote() const
+{
+    return last_write;
+}
+
+esp_err_t R502IndexSyncJob::step(R502Interface &iface, bool &done)
+{
+    if(stage == 0){
+        R502_sys_para_t sys_para;
+        esp_err_t err = iface.read_sys_para(conf_code, sys_para);
+        if(err) return err;
+        done = conf_code != R502_ok;
+        index.reset(sys_para.finger_library_size);
+        stage++;
+        return ESP_OK;
+    }
+
+    const int templates_per_page = R502_index_table_len * 8;
+    int page = stage - 1;
+    std::array<uint8_t, R502_index_table_len> table;
+    esp_err_t err = iface.read_index_table(page, conf_code, table);
+    if(err) return err;
+    if(conf_code != R502_ok){
+        done = true;
+        return ESP_OK;
+    }
+    index.load_page(page, table);
+    stage++;
+    if((page + 1) * templates_per_page >= index.capacity()){
+        index.mark_synced();
+        {
+            // store and delete_char update the index under the bus lock
+            R502Interface::BusLock lock(iface.bus_mutex);
+            iface.template_index = index;
+        }
+        done = true;
+    }
+    return ESP_OK;
+}
+
+void R502IndexSyncJob::restart()
+{
+    stage = 0;
+}
+
+uint32_t R502IndexSyncJob::depends_on() const
+{
+    return stage > 0 ? R502_mem_library : 0;
+}
+
+R502CommandScheduler::R502CommandScheduler(R502Interface &_iface,
+    int _queue_len) : iface(_iface), queue_len(_queue_len)
+{
+    running = false;
+    task_alive = false;
+}
+
+R502CommandScheduler::~R502CommandScheduler()
+{
+    stop();
+    for(int i = 0; i < R502_priority_classes; i++){
+        if(queues[i]) vQueueDelete(queues[i]);
+    }
+    if(stats_mutex) vSemaphoreDelete(stats_mutex);
+}
+
+esp_err_t R502CommandScheduler::start(UBaseType_t priority)
+{
+    if(task_alive) return ESP_OK;
+    for(int i = 0; i < R502_priority_classes; i++){
+        if(!queues[i]) queues[i] = xQueueCreate(queue_len, sizeof(R502Job *));
+        if(!queues[i]) return ESP_ERR_NO_MEM;
+    }
+    if(!stats_mutex) stats_mutex = xSemaphoreCreateMutex();
+    if(!stats_mutex) return ESP_ERR_NO_MEM;
+
+    running = true;
+    task_alive = true;
+    if(xTaskCreate(scheduler_task, "r502_sched", 3072, this, priority,
+        &task) != pdPASS)
+    {
+        running = false;
+        task_alive = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void R502CommandScheduler::stop()
+{
+    running = false;
+    if(task) xTaskNotifyGive(task);
+    while(task_alive){
+        vTaskDelay(1);
+    }
+    task = nullptr;
+}
+
+esp_err_t R502CommandScheduler::submit(R502Job &job, R502_priority_t priority)
+{
+    if(priority < 0 || priority >= R502_priority_classes){
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(!running || !job.done) return ESP_ERR_INVALID_STATE;
+
+    job.restart();
+    job.result = ESP_OK;
+    job.waiter = xTaskGetCurrentTaskHandle();
+    job.submitted_us = esp_timer_get_time();
+    job.done = false;
+    R502Job *ptr = &job;
+    if(xQueueSend(queues[priority], &ptr, 0) != pdTRUE){
+        job.done = true;
+        return ESP_ERR_NO_MEM;
+    }
+    xTaskNotifyGive(task);
+    return ESP_OK;
+}
+
+R502_sched_stats_t R502CommandScheduler::get_stats(
+    R502_priority_t priority) const
+{
+    R502_sched_stats_t copy = {};
+    if(priority < 0 || priority >= R502_priority_classes || !stats_mutex){
+        return copy;
+    }
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    copy = stats[priority];
+    xSemaphoreGive(stats_mutex);
+    return copy;
+}
+
+void R502CommandScheduler::scheduler_task(void *arg)
+{
+    R502CommandScheduler *me = (R502CommandScheduler *)arg;
+    while(me->running){
+        int cls = me->next_class();
+        if(cls < 0){
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        R502Job *job = me->active[cls];
+        bool done = false;
+        esp_err_t err = job->step(me->iface, done);
+        uint32_t overwrote = job->overwrote();
+        if(err || done){
+            me->finish(cls, err);
+        }
+
+        // Lower classes waiting on memory this step replaced start over
+        for(int i = 0; overwrote && i < R502_priority_classes; i++){
+            R502Job *other = me->active[i];
+            if(i == cls || !other || !(other->depends_on() & overwrote)){
+                continue;
+            }
+            ESP_LOGW(TAG, "restarting priority %d job, its module memory "
+                "was overwritten", i);
+            other->restart();
+            xSemaphoreTake(me->stats_mutex, portMAX_DELAY);
+            me->stats[i].restarts++;
+            xSemaphoreGive(me->stats_mutex);
+        }
+    }
+
+    // Nobody is left to run them
+    for(int i = 0; i < R502_priority_classes; i++){
+        if(me->active[i]) me->finish(i, ESP_ERR_INVALID_STATE);
+        while(xQueueReceive(me->queues[i], &me->active[i], 0) == pdTRUE){
+            me->finish(i, ESP_ERR_INVALID_STATE);
+        }
+    }
+    me->task_alive = false;
+    vTaskDelete(nullptr);
+}
+
+int R502CommandScheduler::next_class()
+{
+    for(int cls = 0; cls < R502_priority_classes; cls++){
+        if(!active[cls]){
+            R502Job *job;
+            if(xQueueReceive(queues[cls], &job, 0) != pdTRUE) continue;
+            active[cls] = job;
+            int64_t wait_us = esp_timer_get_time() - job->submitted_us;
+            xSemaphoreTake(stats_mutex, portMAX_DELAY);
+            stats[cls].jobs++;
+            stats[cls].total_wait_us += wait_us;
+            if(wait_us > stats[cls].max_wait_us){
+                stats[cls].max_wait_us = wait_us;
+            }
+            xSemaphoreGive(stats_mutex);
+        }
+
+        // Moving to a higher class sets aside the job of the last one
+        if(last_class > cls && active[last_class]){
+            xSemaphoreTake(stats_mutex, portMAX_DELAY);
+            stats[last_class].preemptions++;
+            xSemaphoreGive(stats_mutex);
+        }
+        last_class = cls;
+        return cls;
+    }
+    return -1;
+}
+
+void R502CommandScheduler::finish(int cls, esp_err_t err)
+{
+    R502Job *job = active[cls];
+    active[cls] = nullptr;
+    job->result = err;
+    TaskHandle_t waiter = job->waiter;
+    // The job may be destroyed as soon as done is seen
+    job->done = true;
+    if(waiter) xTaskNotifyGive(waiter);
+}
@@ -0,0 +1,250 @@
+#include "R502Coroutine.hpp"
+#include <algorithm>
+#include "esp_timer.h"
+
+R502Scheduler::~R502Scheduler()
+{
+    // Workflows still parked are destroyed with their tasks
+    parked.clear();
+    workflows.clear();
+}
+
+void R502Scheduler::spawn(R502Task<void> task)
+{
+    std::coroutine_handle<> handle = task.handle;
+    workflows.push_back(std::move(task));
+    // Runs until its first wait, which parks it
+    handle.resume();
+    reap();
+}
+
+size_t R502Scheduler::run_once(int max_wait_ms)
+{
+    // Anything parked while resuming goes after what was already waiting
+    std::vector<parked_t> waiting;
+    waiting.swap(parked);
+    std::vector<parked_t> kept;
+    bool resumed = false;
+    for(parked_t &entry : waiting){
+        Waiter &waiter = *entry.waiter;
+        // idle may have found it ready already
+        if(!waiter.fired) waiter.fired = check(waiter);
+        if(waiter.fired || now_us() >= waiter.deadline_us){
+            entry.handle.resume();
+            resumed = true;
+        }
+        else{
+            kept.push_back(entry);
+        }
+    }
+    kept.insert(kept.end(), parked.begin(), parked.end());
+    parked.swap(kept);
+    reap();
+
+    if(!resumed && !parked.empty()){
+        int64_t until = now_us() + (int64_t)max_wait_ms * 1000;
+        for(const parked_t &entry : parked){
+            until = std::min(until, entry.waiter->deadline_us);
+        }
+        idle(until);
+    }
+    return workflows.size();
+}
+
+void R502Scheduler::run()
+{
+    while(run_once(INT32_MAX / 1000) > 0){
+    }
+}
+
+size_t R502Scheduler::pending() const
+{
+    return workflows.size();
+}
+
+bool R502Scheduler::check(Waiter &waiter)
+{
+    switch(waiter.kind){
+        case wait_rx_kind:
+            return waiter.link->available() >= waiter.bytes;
+        case wait_irq_kind:
+            return waiter.link->take_irq();
+        case wait_link_kind:
+            return waiter.link->try_acquire();
+        default:
+            return false;
+    }
+}
+
+bool R502Scheduler::recheck()
+{
+    bool ready = false;
+    for(parked_t &entry : parked){
+        Waiter &waiter = *entry.waiter;
+        if(!waiter.fired) waiter.fired = check(waiter);
+        ready = ready || waiter.fired;
+    }
+    return ready;
+}
+
+void R502Scheduler::park(Waiter &waiter, std::coroutine_handle<> handle)
+{
+    parked.push_back(parked_t{handle, &waiter});
+}
+
+void R502Scheduler::reap()
+{
+    workflows.erase(std::remove_if(workflows.begin(), workflows.end(),
+        [](const R502Task<void> &task){ return task.handle.done(); }),
+        workflows.end());
+}
+
+R502TaskScheduler::R502TaskScheduler()
+{
+    wake = xSemaphoreCreateBinary();
+}
+
+R502TaskScheduler::~R502TaskScheduler()
+{
+    if(wake_set){
+        xSemaphoreTake(wake, 0);
+        xQueueRemoveFromSet(wake, wake_set);
+        vQueueDelete(wake_set);
+    }
+    if(wake){
+        vSemaphoreDelete(wake);
+    }
+}
+
+int64_t R502TaskScheduler::now_us()
+{
+    return esp_timer_get_time();
+}
+
+void R502TaskScheduler::notify()
+{
+    if(wake){
+        xSemaphoreGive(wake);
+    }
+}
+
+void R502TaskScheduler::idle(int64_t until_us)
+{
+    // What the parked coroutines wait on. A link that can't tell when it's
+    // ready, or that another task holds, is checked every tick
+    bool poll = false;
+    UBaseType_t length = 1;
+    rx_queues.clear();
+    irq_links.clear();
+    for(size_t i = 0; i < parked_count(); i++){
+        const Waiter &waiter = parked_waiter(i);
+        if(waiter.kind == wait_rx_kind){
+            QueueHandle_t queue = waiter.link->rx_events();
+            if(!queue){
+                poll = true;
+            }
+            else if(std::find(rx_queues.begin(), rx_queues.end(), queue) ==
+                rx_queues.end())
+            {
+                rx_queues.push_back(queue);
+                length += uxQueueMessagesWaiting(queue) + 
+                    uxQueueSpacesAvailable(queue);
+            }
+        }
+        else if(waiter.kind == wait_irq_kind){
+            if(std::find(irq_links.begin(), irq_links.end(), waiter.link) ==
+                irq_links.end())
+            {
+                irq_links.push_back(waiter.link);
+            }
+        }
+        else if(waiter.kind == wait_link_kind){
+            poll = true;
+        }
+    }
+    if(!reserve_set(length)){
+        vTaskDelay(1);
+        return;
+    }
+
+    for(R502AsyncLink *link : irq_links){
+        if(!link->wake_on_irq(wake)) poll = true;
+    }
+    // Earlier events are stale, available() counts the data they were for.
+    // Only an empty queue can join, so a failed add means data came in
+    size_t added = 0;
+    for(QueueHandle_t queue : rx_queues){
+        xQueueReset(queue);
+        if(xQueueAddToSet(queue, wake_set) != pdPASS) break;
+        added++;
+    }
+    bool ready = added < rx_queues.size();
+    rx_queues.resize(added);
+    // Anything that happened between run_once's checks and arming the
+    // wakeups wouldn't wake the set
+    ready = ready || recheck();
+
+    QueueSetMemberHandle_t member = nullptr;
+    if(!ready){
+        const int64_t tick_us = portTICK_PERIOD_MS * 1000;
+        int64_t ticks = (until_us - now_us() + tick_us - 1) / tick_us;
+        if(poll) ticks = std::min<int64_t>(ticks, 1);
+        ticks = std::max<int64_t>(ticks, 0);
+        member = xQueueSelectFromSet(wake_set, 
+            (TickType_t)std::min<int64_t>(ticks, portMAX_DELAY));
+    }
+
+    // Leave nothing armed or in the set but wake, events that came in
+    // meanwhile are drained with the rest
+    for(R502AsyncLink *link : irq_links){
+        link->wake_on_irq(nullptr);
+    }
+    for(QueueHandle_t queue : rx_queues){
+        do{
+            xQueueReset(queue);
+        } while(xQueueRemoveFromSet(queue, wake_set) != pdPASS);
+    }
+    do{
+        if(member == wake){
+            xSemaphoreTake(wake, 0);
+        }
+        member = xQueueSelectFromSet(wake_set, 0);
+    } while(member);
+}
+
+bool R502TaskScheduler::reserve_set(UBaseType_t length)
+{
+    if(length <= wake_set_length) return true;
+    if(!wake) return false;
+    // Only an empty semaphore can leave or join a set. A notify taken on
+    // the way is given again after
+    bool notified = xSemaphoreTake(wake, 0) == pdTRUE;
+    if(wake_set){
+        xQueueRemoveFromSet(wake, wake_set);
+        vQueueDelete(wake_set);
+    }
+    wake_set = xQueueCreateSet(length);
+    wake_set_length = wake_set ? length : 0;
+    if(wake_set){
+        xQueueAddToSet(wake, wake_set);
+    }
+    if(notified){
+        xSemaphoreGive(wake);
+    }
+    return wake_set != nullptr;
+}
+
+int64_t R502HostScheduler::now_us()
+{
+    return clock_us;
+}
+
+void R502HostScheduler::advance(int64_t us)
+{
+    clock_us += us;
+}
+
+void R502HostScheduler::idle(int64_t until_us)
+{
+    clock_us = std::max(clock_us, until_us);
+}
@@ -0,0 +1,240 @@
+#include "R502EntropyPool.hpp"
+#include <string.h>
+#include <algorithm>
+#include "esp_system.h"
+
+static const char *TAG = "R502Entropy";
+
+R502EntropyPool::R502EntropyPool(R502Interface &_iface, size_t _capacity,
+    size_t _low_water) : iface(_iface), capacity(std::max<int>(_capacity, 32)),
+    low_water(std::min<int>(_low_water, capacity - 4))
+{
+    // Start from the chip's own generator, so the key is never predictable
+    // even before the module's bytes are mixed in
+    for(int i = 0; i < key_words; i++){
+        key[i].store(esp_random(), std::memory_order_relaxed);
+    }
+    sequence = 0;
+    counter = 0;
+    seeded = false;
+    entropy = 0;
+    refill_pending = false;
+    running = false;
+    task_alive = false;
+    bytes_served = 0;
+    bytes_mixed = 0;
+    refills = 0;
+    refill_errors = 0;
+    starved = 0;
+    refill_mutex = xSemaphoreCreateMutex();
+}
+
+R502EntropyPool::~R502EntropyPool()
+{
+    stop();
+    if(refill_mutex){
+        vSemaphoreDelete(refill_mutex);
+    }
+}
+
+esp_err_t R502EntropyPool::start(R502_conf_code_t &res, UBaseType_t priority)
+{
+    if(task_alive) return ESP_OK;
+    esp_err_t err = refill(res);
+    if(err || res != R502_ok) return err;
+
+    running = true;
+    task_alive = true;
+    if(xTaskCreate(refill_task, "r502_entropy", 2048, this, priority,
+        &task) != pdPASS)
+    {
+        running = false;
+        task_alive = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void R502EntropyPool::stop()
+{
+    if(!task_alive) return;
+    running = false;
+    xTaskNotifyGive(task);
+    while(task_alive){
+        vTaskDelay(1);
+    }
+    task = nullptr;
+}
+
+esp_err_t R502EntropyPool::fill(uint8_t *out, size_t len)
+{
+    if(!seeded) return ESP_ERR_INVALID_STATE;
+
+    size_t done = 0;
+    while(done < len){
+        uint32_t snapshot[key_words];
+        uint32_t block_counter;
+        uint32_t seq_start;
+        do{
+            seq_start = sequence.load(std::memory_order_acquire);
+            for(int i = 0; i < key_words; i++){
+                snapshot[i] = key[i].load(std::memory_order_relaxed);
+            }
+            block_counter = counter.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while((seq_start & 1) ||
+            sequence.load(std::memory_order_relaxed) != seq_start);
+
+        uint32_t block[block_size / 4];
+        const uint32_t nonce[3] = {seq_start, 0, 0};
+        chacha20_block(snapshot, block_counter, nonce, block);
+        size_t count = std::min<size_t>(len - done, block_size);
+        memcpy(out + done, block, count);
+        done += count;
+    }
+
+    bytes_served += len;
+    int left = entropy.fetch_sub(len) - (int)len;
+    if(left <= 0){
+        starved++;
+    }
+    if(left < low_water){
+        request_refill();
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502EntropyPool::refill(R502_conf_code_t &res)
+{
+    res = R502_ok;
+    xSemaphoreTake(refill_mutex, portMAX_DELAY);
+
+    // At least a full key's worth, so every reseed changes the whole key
+    int needed = std::max(capacity - std::max<int>(entropy, 0),
+        key_words * 4);
+    uint8_t material[key_words * 4];
+    int gathered = 0;
+    esp_err_t err = ESP_OK;
+    while(gathered < needed){
+        uint32_t number = 0;
+        err = iface.get_random_code(res, number);
+        if(err || res != R502_ok) break;
+
+        int offset = gathered % sizeof(material);
+        memcpy(material + offset, &number, sizeof(number));
+        gathered += sizeof(number);
+        if(gathered % sizeof(material) == 0){
+            reseed(material, sizeof(material));
+        }
+    }
+    if(gathered % sizeof(material)){
+        reseed(material, gathered % sizeof(material));
+    }
+
+    if(gathered > 0){
+        bytes_mixed += gathered;
+        refills++;
+        seeded = true;
+        int current = entropy;
+        while(!entropy.compare_exchange_weak(current,
+            std::min(capacity, std::max(current, 0) + gathered)))
+        {
+        }
+    }
+    if(err || res != R502_ok){
+        refill_errors++;
+        ESP_LOGW(TAG, "refill stopped after %d bytes: %s, conf code %d",
+            gathered, esp_err_to_name(err), res);
+    }
+    xSemaphoreGive(refill_mutex);
+    return err;
+}
+
+int R502EntropyPool::level() const
+{
+    return std::max<int>(entropy, 0);
+}
+
+R502_entropy_stats_t R502EntropyPool::get_stats() const
+{
+    return {bytes_served, bytes_mixed, refills, refill_errors, starved};
+}
+
+void R502EntropyPool::refill_task(void *arg)
+{
+    R502EntropyPool *me = (R502EntropyPool *)arg;
+    while(me->running){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if(!me->running) break;
+
+        R502_conf_code_t res;
+        me->refill(res);
+        // a failed refill is asked for again by the next fill
+        me->refill_pending = false;
+    }
+    me->task_alive = false;
+    vTaskDelete(NULL);
+}
+
+void R502EntropyPool::request_refill()
+{
+    if(!task_alive) return;
+    if(!refill_pending.exchange(true)){
+        xTaskNotifyGive(task);
+    }
+}
+
+void R502EntropyPool::reseed(const uint8_t *material, size_t len)
+{
+    // New key = ChaCha20(old key xor material), so it depends on everything
+    // mixed in so far and an old key can't be recovered from a new one
+    uint32_t next[key_words];
+    for(int i = 0; i < key_words; i++){
+        next[i] = key[i].load(std::memory_order_relaxed);
+    }
+    uint8_t *bytes = (uint8_t *)next;
+    for(size_t i = 0; i < len; i++){
+        bytes[i] ^= material[i];
+    }
+    uint32_t block[block_size / 4];
+    const uint32_t nonce[3] = {~reseeds++, 0, 0};
+    chacha20_block(next, 0, nonce, block);
+
+    uint32_t seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for(int i = 0; i < key_words; i++){
+        key[i].store(block[i], std::memory_order_relaxed);
+    }
+    sequence.store(seq + 2, std::memory_order_release);
+}
+
+#define R502_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define R502_QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = R502_ROTL(d, 16); \
+    c += d; b ^= c; b = R502_ROTL(b, 12); \
+    a += b; d ^= a; d = R502_ROTL(d, 8); \
+    c += d; b ^= c; b = R502_ROTL(b, 7);
+
+void R502EntropyPool::chacha20_block(const uint32_t key[key_words],
+    uint32_t counter, const uint32_t nonce[3], uint32_t out[16])
+{
+    // "expand 32-byte k", key, block counter, nonce
+    uint32_t in[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+        key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+        counter, nonce[0], nonce[1], nonce[2]};
+    memcpy(out, in, sizeof(in));
+    for(int i = 0; i < 10; i++){
+        R502_QUARTER_ROUND(out[0], out[4], out[8], out[12]);
+        R502_QUARTER_ROUND(out[1], out[5], out[9], out[13]);
+        R502_QUARTER_ROUND(out[2], out[6], out[10], out[14]);
+        R502_QUARTER_ROUND(out[3], out[7], out[11], out[15]);
+        R502_QUARTER_ROUND(out[0], out[5], out[10], out[15]);
+        R502_QUARTER_ROUND(out[1], out[6], out[11], out[12]);
+        R502_QUARTER_ROUND(out[2], out[7], out[8], out[13]);
+        R502_QUARTER_ROUND(out[3], out[4], out[9], out[14]);
+    }
+    for(int i = 0; i < 16; i++){
+        out[i] += in[i];
+    }
+}
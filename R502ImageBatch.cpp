@@ -0,0 +1,237 @@
+#include "R502ImageBatch.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+R502ImageBatch::R502ImageBatch(int threads)
+{
+    if(threads <= 0) threads = std::thread::hardware_concurrency();
+    if(threads <= 0) threads = 1;
+    // Every worker exists before any thread starts, as they steal from each
+    // other
+    for(int i = 0; i < threads; i++){
+        workers.emplace_back(new worker_t);
+        workers.back()->arena.resize(arena_size);
+    }
+    for(int i = 0; i < threads; i++){
+        workers[i]->thread = std::thread(&R502ImageBatch::run, this, i);
+    }
+}
+
+R502ImageBatch::~R502ImageBatch()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for(auto &worker : workers){
+        worker->thread.join();
+    }
+}
+
+void R502ImageBatch::process(R502_batch_image_t *_images, size_t count)
+{
+    auto start = std::chrono::steady_clock::now();
+    stats = {};
+    if(count > 0){
+        // A few chunks per thread, so there's something left to steal
+        size_t chunk = std::max<size_t>(1, count / (workers.size() * 4));
+        std::unique_lock<std::mutex> lock(mutex);
+        images = _images;
+        remaining = count;
+        // Workers steal as soon as a chunk is queued, even one still
+        // finishing the last batch, so the counts are reset before that
+        for(auto &worker : workers){
+            worker->steals = 0;
+        }
+        size_t w = 0;
+        for(size_t first = 0; first < count; first += chunk){
+            worker_t &worker = *workers[w];
+            std::lock_guard<std::mutex> queue_lock(worker.mutex);
+            worker.chunks.push_back({first, std::min(first + chunk, count)});
+            w = (w + 1) % workers.size();
+        }
+        generation++;
+        work_ready.notify_all();
+        work_done.wait(lock, [this]{ return remaining == 0; });
+    }
+
+    stats.images = count;
+    stats.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    if(stats.elapsed_us > 0){
+        stats.images_per_second = (uint64_t)count * 1000000 / stats.elapsed_us;
+    }
+    for(auto &worker : workers){
+        stats.steals += worker->steals;
+    }
+}
+
+void R502ImageBatch::run(int id)
+{
+    worker_t &self = *workers[id];
+    uint32_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true){
+        work_ready.wait(lock, [&]{ return stopping || generation != seen; });
+        if(stopping) return;
+        seen = generation;
+        lock.unlock();
+
+        chunk_t chunk;
+        while(next_chunk(id, chunk)){
+            for(size_t i = chunk.first; i < chunk.last; i++){
+                process_one(images[i], self.arena.data());
+            }
+            lock.lock();
+            remaining -= chunk.last - chunk.first;
+            if(remaining == 0) work_done.notify_one();
+            lock.unlock();
+        }
+        lock.lock();
+    }
+}
+
+bool R502ImageBatch::next_chunk(int id, chunk_t &chunk)
+{
+    worker_t &self = *workers[id];
+    {
+        // Own chunks newest first, the images nearest those just processed
+        std::lock_guard<std::mutex> lock(self.mutex);
+        if(!self.chunks.empty()){
+            chunk = self.chunks.back();
+            self.chunks.pop_back();
+            return true;
+        }
+    }
+    for(size_t i = 1; i < workers.size(); i++){
+        worker_t &victim = *workers[(id + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if(!victim.chunks.empty()){
+            chunk = victim.chunks.front();
+            victim.chunks.pop_front();
+            self.steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void R502ImageBatch::process_one(R502_batch_image_t &image, uint8_t *arena)
+{
+    const int width = R502_image_width;
+    const size_t row_bytes = width / 2;
+    const size_t len = image.packed.size();
+    image.valid = len > 0 && len % row_bytes == 0 &&
+        len / row_bytes <= (size_t)R502_image_height;
+    if(!image.valid) return;
+    const int height = len / row_bytes;
+    const uint8_t *packed = image.packed.data();
+    uint8_t *pixels = arena;
+    uint32_t *counts = (uint32_t *)(arena + R502_image_width *
+        R502_image_height);
+
+    // Counting packed bytes takes half the increments of counting pixels,
+    // the nibbles are split when folding
+    memset(counts, 0, 256 * sizeof(uint32_t));
+    for(size_t i = 0; i < len; i++){
+        counts[packed[i]]++;
+    }
+    for(size_t i = 0; i < len; i++){
+        pixels[i*2] = (packed[i] & 0xf) << 4;
+        pixels[i*2+1] = packed[i] & 0xf0;
+    }
+
+    R502_image_stats_t &stats = image.stats;
+    stats = {};
+    for(int b = 0; b < 256; b++){
+        stats.histogram[b & 0xf] += counts[b];
+        stats.histogram[b >> 4] += counts[b];
+    }
+    uint64_t n = len * 2;
+    uint64_t sum = 0;
+    uint64_t sum_sq = 0;
+    stats.pixel_min = 0xff;
+    for(int v = 0; v < 16; v++){
+        if(!stats.histogram[v]) continue;
+        uint8_t pixel = v << 4;
+        sum += (uint64_t)stats.histogram[v] * pixel;
+        sum_sq += (uint64_t)stats.histogram[v] * pixel * pixel;
+        stats.pixel_min = std::min(stats.pixel_min, pixel);
+        stats.pixel_max = std::max(stats.pixel_max, pixel);
+    }
+    double mean = (double)sum / n;
+    double stddev = std::sqrt(std::max((double)sum_sq / n - mean * mean, 0.0));
+    stats.pixel_mean = std::lround(mean * 256);
+    stats.pixel_stddev = std::lround(stddev * 256);
+
+    // Per row sums fit in 32 bits, 191 differences of at most 240
+    uint64_t total = 0;
+    for(int y = 0; y < height; y++){
+        const uint8_t *row = pixels + y * width;
+        int32_t row_sum = 0;
+        for(int x = 0; x < width - 1; x++){
+            int32_t d = row[x + 1] - row[x];
+            row_sum += d * d;
+        }
+        total += row_sum;
+    }
+    for(int y = 0; y < height - 1; y++){
+        const uint8_t *row = pixels + y * width;
+        const uint8_t *below = row + width;
+        int32_t row_sum = 0;
+        for(int x = 0; x < width; x++){
+            int32_t d = below[x] - row[x];
+            row_sum += d * d;
+        }
+        total += row_sum;
+    }
+    uint64_t pairs = (uint64_t)height * (width - 1) +
+        (uint64_t)(height - 1) * width;
+    stats.sharpness = pairs ? total / pairs : 0;
+    double contrast = std::min(stddev / 64, 1.0);
+    double edges = std::min(std::sqrt((double)stats.sharpness) / 32, 1.0);
+    stats.quality = std::lround(100 * contrast * edges);
+
+    if(image.normalized){
+        // Stretch each of the 16 levels, then look up both pixels of a
+        // packed byte at once
+        uint8_t level[16];
+        int range = stats.pixel_max - stats.pixel_min;
+        for(int v = 0; v < 16; v++){
+            int pixel = v << 4;
+            level[v] = range ? std::min(std::max(
+                (pixel - stats.pixel_min) * 255 / range, 0), 255) : pixel;
+        }
+        uint8_t pair[256][2];
+        for(int b = 0; b < 256; b++){
+            pair[b][0] = level[b & 0xf];
+            pair[b][1] = level[b >> 4];
+        }
+        for(size_t i = 0; i < len; i++){
+            image.normalized[i*2] = pair[packed[i]][0];
+            image.normalized[i*2+1] = pair[packed[i]][1];
+        }
+    }
+
+    if(image.thumbnail){
+        const int scale = thumbnail_scale;
+        for(int ty = 0; ty < height / scale; ty++){
+            uint16_t acc[thumbnail_width] = {};
+            for(int dy = 0; dy < scale; dy++){
+                const uint8_t *row = pixels + (ty * scale + dy) * width;
+                for(int tx = 0; tx < thumbnail_width; tx++){
+                    for(int dx = 0; dx < scale; dx++){
+                        acc[tx] += row[tx * scale + dx];
+                    }
+                }
+            }
+            uint8_t *out = image.thumbnail + ty * thumbnail_width;
+            for(int tx = 0; tx < thumbnail_width; tx++){
+                out[tx] = (acc[tx] + scale * scale / 2) / (scale * scale);
+            }
+        }
+    }
+}
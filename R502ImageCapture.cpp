@@ -0,0 +1,176 @@
+#include "R502ImageCapture.hpp"
+#include "esp_heap_caps.h"
+
+static const char *TAG = "R502Capture";
+
+R502ImageCapture::R502ImageCapture(R502Interface &_iface,
+    R502_image_format_t _format) : iface(_iface), format(_format)
+{
+    running = false;
+    task_alive = false;
+    captures = 0;
+    no_finger = 0;
+    errors = 0;
+    resizes = 0;
+}
+
+R502ImageCapture::~R502ImageCapture()
+{
+    stop();
+    for(int i = 0; i < buffer_count; i++){
+        heap_caps_free(buffers[i]);
+    }
+    if(free_queue) vQueueDelete(free_queue);
+    if(ready_queue) vQueueDelete(ready_queue);
+}
+
+esp_err_t R502ImageCapture::start(R502_data_len_t _data_len,
+    UBaseType_t priority)
+{
+    if(task_alive) return ESP_OK;
+    data_len = _data_len;
+
+    // A starting point, capture grows a buffer if the image is bigger
+    size_t size = format == R502_image_packed ? R502_image_size / 2 :
+        R502_image_size;
+    for(int i = 0; i < buffer_count; i++){
+        if(!buffers[i] && !allocate(i, size)) return ESP_ERR_NO_MEM;
+    }
+    if(!free_queue) free_queue = xQueueCreate(buffer_count, sizeof(int));
+    if(!ready_queue) ready_queue = xQueueCreate(buffer_count, sizeof(int));
+    if(!free_queue || !ready_queue) return ESP_ERR_NO_MEM;
+    xQueueReset(free_queue);
+    xQueueReset(ready_queue);
+    for(int i = 0; i < buffer_count; i++){
+        xQueueSend(free_queue, &i, 0);
+    }
+
+    running = true;
+    task_alive = true;
+    if(xTaskCreate(capture_task, "r502_capture", 3072, this, priority,
+        nullptr) != pdPASS)
+    {
+        running = false;
+        task_alive = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void R502ImageCapture::stop()
+{
+    running = false;
+    while(task_alive){
+        vTaskDelay(1);
+    }
+}
+
+esp_err_t R502ImageCapture::acquire(R502_captured_image_t &image,
+    int timeout_ms)
+{
+    if(!ready_queue) return ESP_ERR_INVALID_STATE;
+    int index;
+    if(xQueueReceive(ready_queue, &index, timeout_ms / portTICK_PERIOD_MS)
+        != pdTRUE)
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+    image = images[index];
+    return ESP_OK;
+}
+
+void R502ImageCapture::release(const R502_captured_image_t &image)
+{
+    xQueueSend(free_queue, &image.index, 0);
+}
+
+bool R502ImageCapture::in_psram() const
+{
+    return psram;
+}
+
+R502_capture_stats_t R502ImageCapture::get_stats() const
+{
+    R502_capture_stats_t stats;
+    stats.captures = captures;
+    stats.no_finger = no_finger;
+    stats.errors = errors;
+    stats.resizes = resizes;
+    return stats;
+}
+
+void R502ImageCapture::capture_task(void *arg)
+{
+    R502ImageCapture *me = (R502ImageCapture *)arg;
+    const TickType_t poll_ticks = me->finger_poll_ms / portTICK_PERIOD_MS;
+    while(me->running){
+        int index;
+        if(xQueueReceive(me->free_queue, &index, poll_ticks) != pdTRUE){
+            continue;
+        }
+        // Keep trying this buffer until it holds an image
+        while(me->running && !me->capture(index)){
+            vTaskDelay(poll_ticks);
+        }
+        if(me->running){
+            me->captures++;
+            xQueueSend(me->ready_queue, &index, 0);
+        }
+    }
+    me->task_alive = false;
+    vTaskDelete(nullptr);
+}
+
+bool R502ImageCapture::capture(int index)
+{
+    R502_conf_code_t res = R502_fail;
+    esp_err_t err = iface.gen_image(res);
+    if(!err && res == R502_err_no_finger){
+        no_finger++;
+        return false;
+    }
+    int64_t captured_us = esp_timer_get_time();
+    R502_image_info_t info = {};
+    if(!err && res == R502_ok){
+        err = iface.up_image(data_len, res, buffers[index], 
+            capacities[index], format, info);
+    }
+    if(err == ESP_ERR_INVALID_SIZE){
+        // Grown to what actually arrived, the next capture fits
+        ESP_LOGW(TAG, "image is %d bytes, growing buffer", (int)info.bytes);
+        resizes++;
+        if(!allocate(index, info.bytes)){
+            errors++;
+        }
+        return false;
+    }
+    if(err || res != R502_ok){
+        errors++;
+        return false;
+    }
+
+    R502_captured_image_t &image = images[index];
+    image.data = buffers[index];
+    image.info = info;
+    image.captured_us = captured_us;
+    image.index = index;
+    return true;
+}
+
+bool R502ImageCapture::allocate(int index, size_t size)
+{
+    heap_caps_free(buffers[index]);
+    // An image or two would crowd internal RAM, PSRAM is roomier
+    buffers[index] = (uint8_t *)heap_caps_malloc(size,
+        MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    psram = buffers[index] != nullptr;
+    if(!buffers[index]){
+        buffers[index] = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    capacities[index] = buffers[index] ? size : 0;
+    if(!buffers[index]){
+        ESP_LOGE(TAG, "no memory for a %d byte image", (int)size);
+        return false;
+    }
+    return true;
+}
@@ -1,4 +1,5 @@
 #include "R502Interface.hpp"
+#include "R502Bus.hpp"
 
 const char *R502Interface::TAG = "R502";
 
@@ -9,7 +10,68 @@ esp_err_t R502Interface::init(uart_port_t _uart_num, gpio_num_t _pin_txd,
     if(initialized){
         return ESP_OK;
     }
+    boot_timing = {esp_timer_get_time(), -1, -1, false, 0};
+    esp_err_t err = init_hardware(_uart_num, _pin_txd, _pin_rxd, _pin_irq, 
+        _baud);
+    if(err) return err;
+
+    // wait for R502 to prepare itself
+    vTaskDelay(200 / portTICK_PERIOD_MS);
+    boot_timing.link_ready_us = esp_timer_get_time();
+    initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::warm_init(uart_port_t _uart_num, gpio_num_t _pin_txd,
+    gpio_num_t _pin_rxd, gpio_num_t _pin_irq, R502LinkStore &store)
+{
+    if(initialized){
+        return ESP_OK;
+    }
+    boot_timing = {esp_timer_get_time(), -1, -1, false, 0};
+
+    R502_link_config_t config;
+    esp_err_t err = store.load(config);
+    bool have_config = (err == ESP_OK);
+    if(!have_config){
+        ESP_LOGW(TAG, "no stored link config: %s", esp_err_to_name(err));
+        config.baud = R502_baud_57600;
+        config.data_package_length = R502_data_len_128;
+        memset(config.adder, 0xff, sizeof(config.adder));
+    }
+    memcpy(adder, config.adder, sizeof(adder));
+
+    err = init_hardware(_uart_num, _pin_txd, _pin_rxd, _pin_irq, config.baud);
+    if(err) return err;
+    link_store = &store;
+    initialized = true;
+
+    R502_sys_para_t sys_para;
+    err = wait_until_ready(warm_ready_timeout, sys_para, 
+        boot_timing.round_trips);
+    if(err){
+        // The stored baud rate is wrong or there was nothing stored
+        ESP_LOGW(TAG, "no response at stored baud rate, probing all");
+        err = discover_baud_rate(sys_para);
+        if(err) return err;
+    }
+    cur_data_len = sys_para.data_package_length;
+
+    boot_timing.warm = have_config && cur_baud == config.baud &&
+        cur_data_len == config.data_package_length;
+    if(!boot_timing.warm){
+        save_link_config();
+    }
+    boot_timing.link_ready_us = esp_timer_get_time();
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::init_hardware(uart_port_t _uart_num, 
+    gpio_num_t _pin_txd, gpio_num_t _pin_rxd, gpio_num_t _pin_irq, 
+    R502_baud_t _baud)
+{
     cur_baud = _baud;
+    resident_page = -1;
     pin_txd = _pin_txd;
     pin_rxd = _pin_rxd;
     pin_irq = _pin_irq;
@@ -32,40 +94,131 @@ esp_err_t R502Interface::init(uart_port_t _uart_num, gpio_num_t _pin_txd,
     if(err) return err;
     err = uart_set_pin(uart_num, pin_txd, pin_rxd, pin_rts, pin_cts);
     if(err) return err;
-    err = uart_driver_install(uart_num, 
-        std::max<int>(sizeof(R502_DataPkg_t), min_uart_buffer_size), 0, 0, NULL,
-        0);
+    err = install_uart_driver();
     if(err) return err;
+    if(!bus_mutex){
+        bus_mutex = xSemaphoreCreateRecursiveMutex();
+        if(!bus_mutex) return ESP_ERR_NO_MEM;
+    }
+    return install_irq(_pin_irq);
+}
 
-    err = gpio_set_direction(pin_irq, GPIO_MODE_INPUT);
+esp_err_t R502Interface::install_irq(gpio_num_t _pin_irq)
+{
+    pin_irq = _pin_irq;
+    esp_err_t err = gpio_set_direction(pin_irq, GPIO_MODE_INPUT);
     if(err) return err;
     err = gpio_set_intr_type(pin_irq, GPIO_INTR_POSEDGE);
     if(err) return err;
     err = gpio_intr_enable(pin_irq);
     if(err) return err;
+    // Another module on the bus may have installed the service already
     err = gpio_install_isr_service(0);
-    if(err) return err;
+    if(err && err != ESP_ERR_INVALID_STATE) return err;
     err = gpio_isr_handler_add(pin_irq, irq_intr, this);
     if(err) return err;
-
-    // wait for R502 to prepare itself
-    vTaskDelay(200 / portTICK_PERIOD_MS);
-    initialized = true;
     return ESP_OK;
 }
 
+esp_err_t R502Interface::install_uart_driver()
+{
+    // The event queue wakes receive_package as data arrives, instead of it
+    // blocking for a fixed byte count
+    return uart_driver_install(uart_num, uart_buffer_size(max_data_len), 0,
+        uart_queue_size, &uart_queue, 0);
+}
+
+esp_err_t R502Interface::wait_until_ready(int timeout_ms, 
+    R502_sys_para_t &sys_para, int &round_trips)
+{
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    while(esp_timer_get_time() < deadline){
+        // A module that is still starting sends one byte when it's ready, a
+        // module that was already running never will, so ask it directly
+        uint8_t byte = 0;
+        int len = uart_read_bytes(uart_num, &byte, 1, 
+            ready_listen_time / portTICK_PERIOD_MS);
+        if(len == 1 && byte != power_on_ready_byte){
+            // line noise while the module powers up
+            continue;
+        }
+
+        R502_conf_code_t res = R502_fail;
+        round_trips++;
+        esp_err_t err = read_sys_para(res, sys_para, probe_read_delay);
+        if(!err && res == R502_ok){
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t R502Interface::discover_baud_rate(R502_sys_para_t &sys_para)
+{
+    const R502_baud_t bauds[] = { R502_baud_57600, R502_baud_115200,
+        R502_baud_9600, R502_baud_19200, R502_baud_38400 };
+    R502_baud_t tried = cur_baud;
+
+    for(R502_baud_t baud : bauds){
+        if(baud == tried) continue;
+        esp_err_t err = uart_set_baudrate(uart_num, 9600*baud);
+        if(err) return err;
+        cur_baud = baud;
+
+        R502_conf_code_t res = R502_fail;
+        boot_timing.round_trips++;
+        err = read_sys_para(res, sys_para, probe_read_delay);
+        if(!err && res == R502_ok){
+            ESP_LOGI(TAG, "found module at baud setting %d", baud);
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+void R502Interface::save_link_config()
+{
+    if(!link_store) return;
+
+    esp_err_t err = link_store->save(get_link_config());
+    if(err){
+        ESP_LOGW(TAG, "couldn't save link config: %s", esp_err_to_name(err));
+    }
+}
+
 esp_err_t R502Interface::deinit()
 {
     if(initialized){
         initialized = false;
-        esp_err_t err_uart_driver = uart_driver_delete(uart_num);
+        esp_err_t err_uart_driver = ESP_OK;
         esp_err_t err_isr_remove = gpio_isr_handler_remove(pin_irq);
-        gpio_uninstall_isr_service();
+        if(bus){
+            // The uart, its mutex and the isr service stay with the bus
+            bus->remove(*this);
+            bus = nullptr;
+            bus_mutex = nullptr;
+        }
+        else{
+            err_uart_driver = uart_driver_delete(uart_num);
+            gpio_uninstall_isr_service();
+        }
+        uart_queue = nullptr;
         if(err_uart_driver) return err_uart_driver;
         if(err_isr_remove) return err_isr_remove;
 
         // reset up_image_cb
         up_image_cb = nullptr;
+
+        if(idle && idle_config.light_sleep){
+            gpio_wakeup_disable(pin_irq);
+        }
+        idle = false;
+
+        // a different module may be connected next time
+        template_index.invalidate();
+        resident_page = -1;
+        link_store = nullptr;
+        timeout_model.reset();
     }
     return ESP_OK;
 }
@@ -73,7 +226,170 @@ esp_err_t R502Interface::deinit()
 void IRAM_ATTR R502Interface::irq_intr(void *arg)
 {
     R502Interface *me = (R502Interface *)arg;
-    me->interrupt++;
+    me->interrupt = me->interrupt + 1;
+    me->last_irq_us = esp_timer_get_time();
+    BaseType_t woken = pdFALSE;
+    TaskHandle_t waiter = me->irq_waiter;
+    if(waiter){
+        vTaskNotifyGiveFromISR(waiter, &woken);
+    }
+    SemaphoreHandle_t wake = me->irq_wake;
+    if(wake){
+        xSemaphoreGiveFromISR(wake, &woken);
+    }
+    if(woken){
+        portYIELD_FROM_ISR();
+    }
+}
+
+esp_err_t R502Interface::enter_idle(const R502_idle_config_t &config)
+{
+    if(!initialized) return ESP_ERR_INVALID_STATE;
+    if(idle) return ESP_OK;
+    if(bus){
+        ESP_LOGE(TAG, "enter_idle on a shared bus");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    // let an exchange in progress finish first
+    BusLock lock(bus_mutex);
+
+    idle_config = config;
+    wake_timing = {esp_timer_get_time(), -1, -1, -1, 0};
+    esp_err_t err = uart_wait_tx_done(uart_num, 
+        (probe_read_delay + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+    if(err) return err;
+    err = uart_disable_rx_intr(uart_num);
+    if(err) return err;
+
+    bool powered_down = config.pin_power != GPIO_NUM_NC;
+    if(powered_down){
+        // An unpowered module would draw current through its rx pin
+        err = gpio_set_direction(pin_txd, GPIO_MODE_INPUT);
+        if(!err){
+            err = gpio_set_level(config.pin_power, !config.power_on_level);
+        }
+        // and forgets its character buffers
+        resident_page = -1;
+    }
+    if(!err && config.light_sleep){
+        // Level wakeup would also make the edge interrupt level triggered,
+        // wait_for_touch reads the pin instead
+        err = gpio_intr_disable(pin_irq);
+        if(!err){
+            err = gpio_wakeup_enable(pin_irq, GPIO_INTR_HIGH_LEVEL);
+        }
+        if(!err){
+            err = esp_sleep_enable_gpio_wakeup();
+        }
+    }
+    if(err){
+        ESP_LOGE(TAG, "enter_idle failed: %s", esp_err_to_name(err));
+        restore_link(powered_down, config.light_sleep);
+        return err;
+    }
+    idle = true;
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::wait_for_touch(int timeout_ms)
+{
+    if(!idle) return ESP_ERR_INVALID_STATE;
+
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    int seen = interrupt;
+    irq_waiter = xTaskGetCurrentTaskHandle();
+    esp_err_t err = ESP_OK;
+    while(true){
+        // A finger may already be on the sensor
+        if(interrupt != seen || gpio_get_level(pin_irq)){
+            break;
+        }
+        int64_t remaining_us = deadline - esp_timer_get_time();
+        if(remaining_us <= 0){
+            err = ESP_ERR_TIMEOUT;
+            break;
+        }
+        if(idle_config.light_sleep){
+            esp_sleep_enable_timer_wakeup(remaining_us);
+            esp_light_sleep_start();
+        }
+        else{
+            ulTaskNotifyTake(pdTRUE, 
+                (remaining_us / 1000 + portTICK_PERIOD_MS) / 
+                portTICK_PERIOD_MS);
+        }
+    }
+    irq_waiter = nullptr;
+    if(idle_config.light_sleep){
+        esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_TIMER);
+    }
+    if(err) return err;
+
+    // The isr doesn't run for a touch that woke the chip from light sleep
+    wake_timing.touch_us = interrupt != seen ? (int64_t)last_irq_us : 
+        esp_timer_get_time();
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::exit_idle()
+{
+    if(!idle) return ESP_OK;
+    bool powered_down = idle_config.pin_power != GPIO_NUM_NC;
+    esp_err_t err = restore_link(powered_down, idle_config.light_sleep);
+    if(err) return err;
+    idle = false;
+
+    // Link settings haven't changed, one answer confirms them
+    R502_sys_para_t sys_para;
+    if(powered_down){
+        err = wait_until_ready(warm_ready_timeout, sys_para, 
+            wake_timing.round_trips);
+    }
+    else{
+        R502_conf_code_t res = R502_fail;
+        wake_timing.round_trips++;
+        err = read_sys_para(res, sys_para);
+        if(!err && res != R502_ok){
+            err = ESP_ERR_NOT_FOUND;
+        }
+    }
+    if(err){
+        ESP_LOGW(TAG, "no response after idle: %s", esp_err_to_name(err));
+        return ESP_ERR_NOT_FOUND;
+    }
+    wake_timing.link_ready_us = esp_timer_get_time();
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::restore_link(bool powered_down, bool light_sleep)
+{
+    // Every step is safe to repeat, or to run when enter_idle stopped
+    // before the matching step
+    esp_err_t err;
+    if(light_sleep){
+        err = gpio_wakeup_disable(pin_irq);
+        if(err) return err;
+        err = gpio_set_intr_type(pin_irq, GPIO_INTR_POSEDGE);
+        if(err) return err;
+        err = gpio_intr_enable(pin_irq);
+        if(err) return err;
+    }
+    if(powered_down){
+        err = gpio_set_level(idle_config.pin_power, 
+            idle_config.power_on_level);
+        if(err) return err;
+        err = uart_set_pin(uart_num, pin_txd, pin_rxd, pin_rts, pin_cts);
+        if(err) return err;
+    }
+    return uart_enable_rx_intr(uart_num);
+}
+
+bool R502Interface::is_idle(){
+    return idle;
+}
+
+const R502_wake_timing_t &R502Interface::get_wake_timing(){
+    return wake_timing;
 }
 
 uint8_t *R502Interface::get_module_address(){
@@ -84,6 +400,34 @@ void R502Interface::set_up_image_cb(up_image_cb_t _up_image_cb){
     up_image_cb = _up_image_cb;
 }
 
+const R502TemplateIndex &R502Interface::get_template_index(){
+    return template_index;
+}
+
+const R502_boot_timing_t &R502Interface::get_boot_timing(){
+    return boot_timing;
+}
+
+R502_link_config_t R502Interface::get_link_config(){
+    R502_link_config_t config;
+    config.baud = cur_baud;
+    config.data_package_length = cur_data_len;
+    memcpy(config.adder, adder, sizeof(adder));
+    return config;
+}
+
+const R502TimeoutModel &R502Interface::get_timeout_model(){
+    return timeout_model;
+}
+
+void R502Interface::set_retry_config(const R502_retry_config_t &config){
+    retry_policy.set_config(config);
+}
+
+const R502_retry_stats_t &R502Interface::get_retry_stats(){
+    return retry_policy.get_stats();
+}
+
 esp_err_t R502Interface::vfy_pass(const std::array<uint8_t, 4> &pass, 
     R502_conf_code_t &res)
 {
@@ -173,6 +517,10 @@ esp_err_t R502Interface::set_sys_para(R502_para_num parameter_num, int value,
 
 esp_err_t R502Interface::set_baud_rate(R502_baud_t baud, R502_conf_code_t &res)
 {
+    if(bus){
+        ESP_LOGE(TAG, "set_baud_rate on a shared bus");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
     esp_err_t err = set_sys_para(R502_para_num_baud_control, baud, res);
     if(err){
         ESP_LOGE(TAG, "set_sys_para err %s", esp_err_to_name(err));
@@ -202,13 +550,14 @@ esp_err_t R502Interface::set_baud_rate(R502_baud_t baud, R502_conf_code_t &res)
             esp_err_to_name(err));
     }
 
-    err = uart_driver_install(uart_num, 
-        std::max<int>(sizeof(R502_DataPkg_t), min_uart_buffer_size), 0, 0, NULL,
-        0);
+    err = install_uart_driver();
     if(err){
         ESP_LOGE(TAG, "error installing uart driver: %s",  
             esp_err_to_name(err));
     }
+    if(res == R502_ok){
+        save_link_config();
+    }
     return ESP_OK;
 }
 
@@ -220,16 +569,61 @@ esp_err_t R502Interface::set_security_level(uint8_t security_level,
     return err;
 }
 
+esp_err_t R502Interface::set_adder(const std::array<uint8_t, 4> &new_adder,
+    R502_conf_code_t &res)
+{
+    // Fill package, it still goes to the current address
+    R502FrameEncoder frame(adder, R502_pid_command);
+    frame.add_field(R502_ic_set_adder);
+    frame.add_fields(new_adder.data(), new_adder.size());
+    frame.finish();
+
+    // The acknowledgement comes from the new address
+    uint8_t old_adder[4];
+    memcpy(old_adder, adder, sizeof(adder));
+    memcpy(adder, new_adder.data(), sizeof(adder));
+
+    // Send package, get response. A repeat would go to an address the
+    // module may have left
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_frame(frame, false, receive_pkg, 
+        sizeof(*receive_data));
+    if(err || receive_data->conf_code != R502_ok){
+        memcpy(adder, old_adder, sizeof(adder));
+    }
+    if(err) return err;
+
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res == R502_ok){
+        save_link_config();
+    }
+    return ESP_OK;
+}
+
 esp_err_t R502Interface::set_data_package_length(R502_data_len_t data_length,
     R502_conf_code_t &res)
 {
-    esp_err_t err = set_sys_para(R502_para_num_data_pkg_len, data_length, res);
+    esp_err_t err = check_data_len(data_length);
     if(err) return err;
+    err = set_sys_para(R502_para_num_data_pkg_len, data_length, res);
+    if(err) return err;
+    if(res == R502_ok){
+        cur_data_len = data_length;
+        save_link_config();
+    }
     return ESP_OK;
 }
 
 esp_err_t R502Interface::read_sys_para(R502_conf_code_t &res, 
     R502_sys_para_t &sys_para)
+{
+    return read_sys_para(res, sys_para, model_read_delay);
+}
+
+esp_err_t R502Interface::read_sys_para(R502_conf_code_t &res, 
+    R502_sys_para_t &sys_para, int read_delay_ms)
 {
     R502_DataPkg_t pkg;
     R502_GeneralCommand_t *data = &pkg.data.general;
@@ -243,7 +637,7 @@ esp_err_t R502Interface::read_sys_para(R502_conf_code_t &res,
     R502_DataPkg_t receive_pkg;
     R502_ReadSysParaAck_t *receive_data = &receive_pkg.data.read_sys_para_ack;
     esp_err_t err = send_command_package(pkg, receive_pkg, 
-        sizeof(*receive_data));
+        sizeof(*receive_data), read_delay_ms);
     if(err) return err;
 
     // Return result
@@ -287,177 +681,809 @@ esp_err_t R502Interface::template_num(R502_conf_code_t &res,
     res = (R502_conf_code_t)receive_data->conf_code;
     template_num = conv_8_to_16(receive_data->template_num);
 
+    // A count that disagrees with the index means something changed the 
+    // library behind our back
+    if(res == R502_ok && template_index.is_synced() && 
+        template_index.used_count() != template_num)
+    {
+        ESP_LOGW(TAG, "template index out of sync, %d vs %d templates", 
+            template_index.used_count(), template_num);
+        template_index.invalidate();
+    }
+
     return ESP_OK;
 }
 
-esp_err_t R502Interface::gen_image(R502_conf_code_t &res)
+esp_err_t R502Interface::read_index_table(uint8_t index_page, 
+    R502_conf_code_t &res, std::array<uint8_t, R502_index_table_len> &table)
 {
+    if(index_page >= R502_index_table_pages){
+        ESP_LOGE(TAG, "invalid index table page, %d", index_page);
+        return ESP_ERR_INVALID_ARG;
+    }
+
     R502_DataPkg_t pkg;
-    R502_GeneralCommand_t *data = &pkg.data.general;
+    R502_ReadIndexTable_t *data = &pkg.data.read_index_table;
 
     // Fill package
-    set_headers(pkg, R502_pid_command, sizeof(R502_GeneralCommand_t));
-    data->instr_code = R502_ic_gen_img;
+    set_headers(pkg, R502_pid_command, sizeof(R502_ReadIndexTable_t));
+    data->instr_code = R502_ic_read_index_table;
+    data->index_page = index_page;
     fill_checksum(pkg);
 
     // Send package, get response
     R502_DataPkg_t receive_pkg;
-    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    R502_ReadIndexTableAck_t *receive_data = 
+        &receive_pkg.data.read_index_table_ack;
     esp_err_t err = send_command_package(pkg, receive_pkg, 
-        sizeof(*receive_data), read_delay_gen_image);
+        sizeof(*receive_data));
     if(err) return err;
 
     // Return result
     res = (R502_conf_code_t)receive_data->conf_code;
+    memcpy(table.data(), receive_data->index, R502_index_table_len);
     return ESP_OK;
 }
 
-esp_err_t R502Interface::up_image(R502_data_len_t data_len, 
+esp_err_t R502Interface::write_notepad(uint8_t page_number, 
+    const std::array<uint8_t, R502_notepad_page_size> &content,
     R502_conf_code_t &res)
 {
-    R502_DataPkg_t pkg;
-    R502_GeneralCommand_t *data = &pkg.data.general;
-
-    if(!up_image_cb){
-        ESP_LOGW(TAG, "up_image callback not set");
-        return ESP_ERR_INVALID_STATE;
+    if(page_number >= R502_notepad_pages){
+        ESP_LOGE(TAG, "invalid notepad page, %d", page_number);
+        return ESP_ERR_INVALID_ARG;
     }
-    
-    // TODO: Check stored parameters to see if the R502 has an image ready
-    // to send. If not, still perform the transfer, but send a warning
 
-    // Fill package
-    set_headers(pkg, R502_pid_command, sizeof(R502_GeneralCommand_t));
-    data->instr_code = R502_ic_up_image;
-    fill_checksum(pkg);
+    // Fill package, the content goes out from the caller's array
+    R502FrameEncoder frame(adder, R502_pid_command);
+    frame.add_field(R502_ic_write_notepad);
+    frame.add_field(page_number);
+    frame.add_payload(content.data(), R502_notepad_page_size);
+    frame.finish();
 
     // Send package, get response
     R502_DataPkg_t receive_pkg;
     R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
-    esp_err_t err = send_command_package(pkg, receive_pkg, 
-        sizeof(*receive_data), read_delay_gen_image);
+    esp_err_t err = send_command_frame(frame, true, receive_pkg, 
+        sizeof(*receive_data));
     if(err) return err;
 
+    // Return result
     res = (R502_conf_code_t)receive_data->conf_code;
-    if(res != R502_ok){ 
-        // The esp side of things is ok, but the module isn't ready to send
-        return ESP_OK;
-    }
-    int data_len_i = 0;
-    switch(data_len){
-        case R502_data_len_32:
-            data_len_i = 32;
-            break;
-        case R502_data_len_64:
-            data_len_i = 64;
-            break;
-        case R502_data_len_128:
-            data_len_i = 128;
-            break;
-        case R502_data_len_256:
-            data_len_i = 256;
-            break;
-        default:
-            ESP_LOGE(TAG, "invalid data length, use enum");
-            return ESP_ERR_INVALID_ARG;
-    }
+    return ESP_OK;
+}
 
-    // receive data packages
-    R502_pid_t pid = R502_pid_data;
-    std::array<uint8_t, R502_max_data_len * 2> data_cb_buffer;
-    uint8_t *rec_data = receive_pkg.data.data.content;
-    int bytes_received = 0;
-    while(pid == R502_pid_data){
-        err = receive_package(receive_pkg, 
-            data_len_i+R502_cs_len+header_size);
-        if(err) return err;
-        bytes_received += data_len_i;
+esp_err_t R502Interface::read_notepad(uint8_t page_number, 
+    R502_conf_code_t &res, 
+    std::array<uint8_t, R502_notepad_page_size> &content)
+{
+    if(page_number >= R502_notepad_pages){
+        ESP_LOGE(TAG, "invalid notepad page, %d", page_number);
+        return ESP_ERR_INVALID_ARG;
+    }
 
-        pid = (R502_pid_t)receive_pkg.pid;
+    R502_DataPkg_t pkg;
+    R502_ReadNotepad_t *data = &pkg.data.read_notepad;
 
-        // convert 4bit bytes to 8bit in an expanded buffer
-        for(int i = 0; i < data_len_i; i++){
-            // Low four bytes
-            data_cb_buffer[i*2] = (rec_data[i] & 0xf) << 4;
-            // High four bytes
-            data_cb_buffer[i*2+1] = rec_data[i] & 0xf0;
-        }
+    // Fill package
+    set_headers(pkg, R502_pid_command, sizeof(R502_ReadNotepad_t));
+    data->instr_code = R502_ic_read_notepad;
+    data->page_number = page_number;
+    fill_checksum(pkg);
 
-        // call callback
-        up_image_cb(data_cb_buffer, data_len_i * 2);
-    }
-    ESP_LOGI(TAG, "bytes received %d", bytes_received);
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_ReadNotepadAck_t *receive_data = &receive_pkg.data.read_notepad_ack;
+    esp_err_t err = send_command_package(pkg, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
 
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    memcpy(content.data(), receive_data->content, R502_notepad_page_size);
     return ESP_OK;
 }
 
-esp_err_t R502Interface::send_command_package(const R502_DataPkg_t &pkg,
-    R502_DataPkg_t &receive_pkg, int data_rec_length, int read_delay_ms)
+esp_err_t R502Interface::get_random_code(R502_conf_code_t &res, 
+    uint32_t &number)
 {
-    esp_err_t err = send_package(pkg);
+    R502_DataPkg_t pkg;
+    R502_GeneralCommand_t *data = &pkg.data.general;
+
+    // Fill package
+    set_headers(pkg, R502_pid_command, sizeof(R502_GeneralCommand_t));
+    data->instr_code = R502_ic_get_random_code;
+    fill_checksum(pkg);
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_GetRandomCodeAck_t *receive_data = 
+        &receive_pkg.data.get_random_code_ack;
+    esp_err_t err = send_command_package(pkg, receive_pkg, 
+        sizeof(*receive_data));
     if(err) return err;
-    return receive_package(receive_pkg, data_rec_length + header_size, 
-        read_delay_ms);
-}
 
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    number = (conv_8_to_16(receive_data->random_number) << 16) | 
+        conv_8_to_16(receive_data->random_number + 2);
+    return ESP_OK;
+}
 
-esp_err_t R502Interface::send_package(const R502_DataPkg_t &pkg)
+esp_err_t R502Interface::sync_template_index(R502_conf_code_t &res)
 {
-    int pkg_len = package_length(pkg);
-    if(pkg_len < header_size + sizeof(R502_GeneralCommand_t) || 
-        pkg_len > sizeof(R502_DataPkg_t))
-    {
-        ESP_LOGE(TAG, "package length not set correctly");
-        return ESP_ERR_INVALID_ARG;
-    }
-
-    //printf("Send Data\n");
-    //int printed = 0;
-    //while(printed < pkg_len){
-        //for(int i = 0; i < 8 && printed < pkg_len; i++){
-            //printf("0x%02X ", *((uint8_t *)&pkg+printed));
-            //printed++;
-        //}
-        //printf("\n");
-    //}
+    R502_sys_para_t sys_para;
+    esp_err_t err = read_sys_para(res, sys_para);
+    if(err) return err;
+    if(res != R502_ok) return ESP_OK;
 
-    int len = uart_write_bytes(uart_num, (char *)&pkg, pkg_len);
-    if(len == -1){
-        ESP_LOGE(TAG, "uart write error, parameter error");
-        return ESP_ERR_INVALID_STATE;
-    }
-    else if(len != package_length(pkg)){
-        // not all data transferred
-        ESP_LOGE(TAG, "uart write error, wrong number of bytes written");
-        return ESP_ERR_INVALID_SIZE;
+    template_index.reset(sys_para.finger_library_size);
+    const int templates_per_page = R502_index_table_len * 8;
+    std::array<uint8_t, R502_index_table_len> table;
+    for(int page = 0; page * templates_per_page < template_index.capacity();
+        page++)
+    {
+        err = read_index_table(page, res, table);
+        if(err) return err;
+        if(res != R502_ok) return ESP_OK;
+        template_index.load_page(page, table);
     }
+    template_index.mark_synced();
     return ESP_OK;
 }
 
-esp_err_t R502Interface::receive_package(const R502_DataPkg_t &rec_pkg,
+esp_err_t R502Interface::find_free_page(R502_conf_code_t &res, 
+    uint16_t &page_id)
+{
+    res = R502_ok;
+    if(!template_index.is_synced()){
+        esp_err_t err = sync_template_index(res);
+        if(err) return err;
+        if(res != R502_ok) return ESP_OK;
+    }
+
+    int free_page = template_index.find_free();
+    if(free_page < 0){
+        return ESP_ERR_NOT_FOUND;
+    }
+    page_id = free_page;
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::gen_image(R502_conf_code_t &res)
+{
+    R502_DataPkg_t pkg;
+    R502_GeneralCommand_t *data = &pkg.data.general;
+
+    // Fill package
+    set_headers(pkg, R502_pid_command, sizeof(R502_GeneralCommand_t));
+    data->instr_code = R502_ic_gen_img;
+    fill_checksum(pkg);
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_package(pkg, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res == R502_ok && boot_timing.first_capture_us < 0){
+        boot_timing.first_capture_us = esp_timer_get_time();
+    }
+    if(res == R502_ok && wake_timing.link_ready_us >= 0 && 
+        wake_timing.first_capture_us < 0)
+    {
+        wake_timing.first_capture_us = esp_timer_get_time();
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::up_image(R502_data_len_t data_len, 
+    R502_conf_code_t &res)
+{
+    if(!up_image_cb){
+        ESP_LOGW(TAG, "up_image callback not set");
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = check_data_len(data_len);
+    if(err) return err;
+
+    std::array<uint8_t, R502_max_data_len * 2> data_cb_buffer;
+    auto expand = [&](R502ByteSpan frame){
+        // convert 4bit bytes to 8bit in an expanded buffer
+        for(size_t i = 0; i < frame.size(); i++){
+            // Low four bytes
+            data_cb_buffer[i*2] = (frame[i] & 0xf) << 4;
+            // High four bytes
+            data_cb_buffer[i*2+1] = frame[i] & 0xf0;
+        }
+
+        // call callback
+        up_image_cb(data_cb_buffer, frame.size() * 2);
+    };
+    return up_image_frames<R502_max_data_len>(R502_data_len_bytes(data_len),
+        res, expand);
+}
+
+esp_err_t R502Interface::up_image(R502_data_len_t data_len, 
+    R502_conf_code_t &res, up_image_frame_ref_t consumer)
+{
+    esp_err_t err = check_data_len(data_len);
+    if(err) return err;
+    return up_image_frames<R502_max_data_len>(R502_data_len_bytes(data_len),
+        res, consumer);
+}
+
+esp_err_t R502Interface::up_image(R502_data_len_t data_len, 
+    R502_conf_code_t &res, uint8_t *buffer, size_t capacity, 
+    R502_image_format_t format, R502_image_info_t &info)
+{
+    esp_err_t err = check_data_len(data_len);
+    if(err) return err;
+    R502ImageAssembler assembler(buffer, capacity, format);
+    err = up_image_frames<R502_max_data_len>(R502_data_len_bytes(data_len),
+        res, assembler);
+    info = assembler.get_info();
+    if(err) return err;
+    if(assembler.overflowed()){
+        ESP_LOGE(TAG, "image of %d bytes doesn't fit in %d", (int)info.bytes,
+            (int)capacity);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::down_image(R502_data_len_t data_len,
+    const uint8_t *image, size_t len, R502_conf_code_t &res)
+{
+    esp_err_t err = check_data_len(data_len);
+    if(err) return err;
+    if(len == 0){
+        ESP_LOGE(TAG, "no image to download");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    R502FrameEncoder frame(adder, R502_pid_command);
+    frame.add_field(R502_ic_down_image);
+    frame.finish();
+
+    // The data packages have to follow the acknowledgement, without another
+    // task's command in between
+    BusLock lock(bus_mutex);
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    err = send_command_frame(frame, false, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res != R502_ok) return ESP_OK;
+    return send_data_packages(image, len, R502_data_len_bytes(data_len));
+}
+
+esp_err_t R502Interface::check_data_len(R502_data_len_t data_len)
+{
+    if(data_len < R502_data_len_32 || data_len > R502_data_len_256){
+        ESP_LOGE(TAG, "invalid data length, use enum");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(R502_data_len_bytes(data_len) > max_data_len){
+        ESP_LOGE(TAG, "data length %d longer than this interface receives, %d",
+            R502_data_len_bytes(data_len), max_data_len);
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::img_2_tz(R502_char_buffer_t buffer_id, 
+    R502_conf_code_t &res)
+{
+    R502_DataPkg_t pkg;
+    R502_Img2Tz_t *data = &pkg.data.img_2_tz;
+
+    // Fill package
+    set_headers(pkg, R502_pid_command, sizeof(R502_Img2Tz_t));
+    data->instr_code = R502_ic_img_2_tz;
+    data->buffer_id = buffer_id;
+    fill_checksum(pkg);
+    if(buffer_id == R502_char_buffer_2) resident_page = -1;
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_package(pkg, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::match(R502_conf_code_t &res, uint16_t &match_score)
+{
+    // Fill package
+    R502FrameEncoder frame(adder, R502_pid_command);
+    frame.add_field(R502_ic_match);
+    frame.finish();
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_MatchAck_t *receive_data = &receive_pkg.data.match_ack;
+    esp_err_t err = send_command_frame(frame, true, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    match_score = conv_8_to_16(receive_data->match_score);
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::verify(uint16_t page_id, R502_conf_code_t &res,
+    uint16_t &match_score)
+{
+    match_score = 0;
+    esp_err_t err = img_2_tz(R502_char_buffer_1, res);
+    if(err || res != R502_ok) return err;
+    if(!is_resident(page_id)){
+        err = load_char(R502_char_buffer_2, page_id, res);
+        if(err || res != R502_ok) return err;
+    }
+    return match(res, match_score);
+}
+
+esp_err_t R502Interface::search(R502_char_buffer_t buffer_id, 
+    uint16_t start_page, uint16_t page_num, R502_conf_code_t &res, 
+    uint16_t &page_id, uint16_t &match_score)
+{
+    R502_DataPkg_t pkg;
+    R502_Search_t *data = &pkg.data.search;
+
+    // Fill package
+    set_headers(pkg, R502_pid_command, sizeof(R502_Search_t));
+    data->instr_code = R502_ic_search;
+    data->buffer_id = buffer_id;
+    conv_16_to_8(start_page, data->start_page);
+    conv_16_to_8(page_num, data->page_num);
+    fill_checksum(pkg);
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_SearchAck_t *receive_data = &receive_pkg.data.search_ack;
+    esp_err_t err = send_command_package(pkg, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    page_id = conv_8_to_16(receive_data->page_id);
+    match_score = conv_8_to_16(receive_data->match_score);
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::store(R502_char_buffer_t buffer_id, uint16_t page_id,
+    R502_conf_code_t &res)
+{
+    R502_DataPkg_t pkg;
+    R502_Store_t *data = &pkg.data.store;
+
+    // Fill package
+    set_headers(pkg, R502_pid_command, sizeof(R502_Store_t));
+    data->instr_code = R502_ic_store;
+    data->buffer_id = buffer_id;
+    conv_16_to_8(page_id, data->page_id);
+    fill_checksum(pkg);
+    if(page_id == resident_page) resident_page = -1;
+
+    // Held until the index is updated, R502IndexSyncJob installs its copy
+    // under the same lock
+    BusLock lock(bus_mutex);
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_package(pkg, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res == R502_ok){
+        template_index.mark_used(page_id);
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::delete_char(uint16_t page_id, uint16_t count, 
+    R502_conf_code_t &res)
+{
+    R502_DataPkg_t pkg;
+    R502_DeletChar_t *data = &pkg.data.delet_char;
+
+    // Fill package
+    set_headers(pkg, R502_pid_command, sizeof(R502_DeletChar_t));
+    data->instr_code = R502_ic_delet_char;
+    conv_16_to_8(page_id, data->page_id);
+    conv_16_to_8(count, data->number_of_templates);
+    fill_checksum(pkg);
+    if(resident_page >= page_id && resident_page < page_id + count){
+        resident_page = -1;
+    }
+
+    // Held until the index is updated, see store
+    BusLock lock(bus_mutex);
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_package(pkg, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res == R502_ok){
+        template_index.mark_free(page_id, count);
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::empty(R502_conf_code_t &res)
+{
+    R502_DataPkg_t pkg;
+    R502_GeneralCommand_t *data = &pkg.data.general;
+
+    // Fill package
+    set_headers(pkg, R502_pid_command, sizeof(R502_GeneralCommand_t));
+    data->instr_code = R502_ic_empty;
+    fill_checksum(pkg);
+    resident_page = -1;
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_package(pkg, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res == R502_ok){
+        template_index.clear();
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::load_char(R502_char_buffer_t buffer_id,
+    uint16_t page_id, R502_conf_code_t &res)
+{
+    // Fill package
+    R502FrameEncoder frame(adder, R502_pid_command);
+    frame.add_field(R502_ic_load_char);
+    frame.add_field(buffer_id);
+    frame.add_field16(page_id);
+    frame.finish();
+    if(buffer_id == R502_char_buffer_2) resident_page = -1;
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_frame(frame, true, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    // Return result
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res == R502_ok && buffer_id == R502_char_buffer_2){
+        resident_page = page_id;
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::up_char(R502_char_buffer_t buffer_id,
+    R502_conf_code_t &res,
+    std::array<uint8_t, R502_character_file_size> &char_file)
+{
+    R502FrameEncoder frame(adder, R502_pid_command);
+    frame.add_field(R502_ic_up_char);
+    frame.add_field(buffer_id);
+    frame.finish();
+
+    // The data packages follow the acknowledgement, nothing may cut in
+    BusLock lock(bus_mutex);
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_frame(frame, false, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res != R502_ok) return ESP_OK;
+
+    // receive data packages, too long for receive_pkg
+    const int data_len = R502_data_len_bytes(cur_data_len);
+    if(data_len > R502_max_data_len){
+        ESP_LOGE(TAG, "data packages of %d bytes don't fit", data_len);
+        drain_to_boundary(0);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    R502_DataPkgN_t<R502_max_data_len> data_pkg;
+    const int package_len = data_len + R502_cs_len + header_size;
+    const uint8_t key = R502TimeoutModel::data_package_key;
+    R502_pid_t pid = R502_pid_data;
+    size_t received = 0;
+    while(pid == R502_pid_data){
+        int read_delay_ms = timeout_model.timeout_ms(key, 0, package_len, 
+            cur_baud);
+        // Same header layout, receive_package only reads package_len bytes
+        err = receive_package((R502_DataPkg_t &)data_pkg, package_len, 
+            read_delay_ms);
+        if(err) return err;
+        pid = (R502_pid_t)data_pkg.pid;
+        if(received + data_len > char_file.size()){
+            ESP_LOGE(TAG, "character file longer than %d bytes",
+                R502_character_file_size);
+            drain_to_boundary(0);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(char_file.data() + received, data_pkg.data.content, data_len);
+        received += data_len;
+    }
+    if(received != char_file.size()){
+        ESP_LOGE(TAG, "character file is %d bytes", (int)received);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::down_char(R502_char_buffer_t buffer_id,
+    const std::array<uint8_t, R502_character_file_size> &char_file,
+    R502_conf_code_t &res)
+{
+    R502FrameEncoder frame(adder, R502_pid_command);
+    frame.add_field(R502_ic_down_char);
+    frame.add_field(buffer_id);
+    frame.finish();
+    if(buffer_id == R502_char_buffer_2) resident_page = -1;
+
+    // The data packages have to follow the acknowledgement, without another
+    // task's command in between
+    BusLock lock(bus_mutex);
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_frame(frame, false, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res != R502_ok) return ESP_OK;
+    return send_data_packages(char_file.data(), char_file.size(),
+        R502_data_len_bytes(cur_data_len));
+}
+
+esp_err_t R502Interface::send_command_package(const R502_DataPkg_t &pkg,
+    R502_DataPkg_t &receive_pkg, int data_rec_length, int read_delay_ms)
+{
+    R502FrameEncoder frame(pkg);
+    return send_command_frame(frame, R502RetryPolicy::is_idempotent(pkg),
+        receive_pkg, data_rec_length, read_delay_ms);
+}
+
+esp_err_t R502Interface::send_command_frame(const R502FrameEncoder &frame,
+    bool idempotent, R502_DataPkg_t &receive_pkg, int data_rec_length, 
+    int read_delay_ms)
+{
+    // Callers that pick their own delay are probing, they do their own retry
+    idempotent = idempotent && read_delay_ms == model_read_delay;
+    BusLock lock(bus_mutex);
+    if(idle){
+        ESP_LOGE(TAG, "command sent while idle, call exit_idle first");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = ESP_OK;
+    int attempt = 1;
+    for(;; attempt++){
+        err = send_and_receive(frame, receive_pkg, data_rec_length, 
+            read_delay_ms);
+        if(!retry_policy.should_retry(err, attempt, idempotent)){
+            break;
+        }
+        // A late reply to the failed attempt mustn't be taken as the reply
+        // to the next one
+        int drained = drain_to_boundary(retry_policy.backoff_ms(attempt));
+        retry_policy.record_drained(drained);
+        ESP_LOGW(TAG, "retrying instruction 0x%02X after %s, drained %d", 
+            frame.instr_code(), esp_err_to_name(err), drained);
+    }
+    retry_policy.record_outcome(err, attempt);
+    return err;
+}
+
+int R502Interface::drain_to_boundary(int window_ms)
+{
+    // Throw away whatever arrives during the window, then keep going until
+    // the line has been quiet for longer than any gap inside a package
+    int64_t idle_us = std::max<int64_t>(
+        R502TimeoutModel::wire_time_us(header_size, cur_baud),
+        portTICK_PERIOD_MS * 1000);
+    int64_t window_end = esp_timer_get_time() + (int64_t)window_ms * 1000;
+    int64_t quiet_until = std::max(window_end, esp_timer_get_time() + idle_us);
+
+    int drained = 0;
+    uint8_t discard[32];
+    while(wait_for_rx(1, quiet_until) == ESP_OK){
+        int read = uart_read_bytes(uart_num, discard, sizeof(discard), 0);
+        if(read <= 0) break;
+        drained += read;
+        quiet_until = std::max(window_end, esp_timer_get_time() + idle_us);
+    }
+    return drained;
+}
+
+esp_err_t R502Interface::send_and_receive(const R502FrameEncoder &frame,
+    R502_DataPkg_t &receive_pkg, int data_rec_length, int read_delay_ms)
+{
+    uint8_t instr_code = frame.instr_code();
+    int send_length = frame.length();
+    int receive_length = data_rec_length + header_size;
+    bool use_model = (read_delay_ms == model_read_delay);
+    if(use_model){
+        read_delay_ms = timeout_model.timeout_ms(instr_code, send_length, 
+            receive_length, cur_baud);
+    }
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = send_package(frame);
+    if(err) return err;
+    err = receive_package(receive_pkg, receive_length, read_delay_ms);
+
+    // Learn from the response. A miss only counts against the model if the
+    // model chose the timeout, probes for a missing module shouldn't skew it
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    if(!err){
+        timeout_model.record(instr_code, elapsed_us, send_length, 
+            receive_length, cur_baud);
+    }
+    else if(use_model && 
+        (err == ESP_ERR_NOT_FOUND || err == ESP_ERR_INVALID_RESPONSE))
+    {
+        timeout_model.record_timeout(instr_code);
+    }
+    if(bus){
+        bus->record(*this, err, elapsed_us);
+    }
+    return err;
+}
+
+
+esp_err_t R502Interface::send_package(const R502FrameEncoder &frame)
+{
+    if(!frame.valid()){
+        ESP_LOGE(TAG, "package length not set correctly");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    R502Trace::record(R502_trace_tx_start, frame.instr_code(), 
+        frame.length());
+    int written = 0;
+    esp_err_t err = frame.write([&](const uint8_t *data, size_t len) 
+        -> esp_err_t
+    {
+        int len_written = uart_write_bytes(uart_num, (const char *)data, 
+            len);
+        if(len_written == -1){
+            ESP_LOGE(TAG, "uart write error, parameter error");
+            return ESP_ERR_INVALID_STATE;
+        }
+        written += len_written;
+        if(len_written != len){
+            // not all data transferred
+            ESP_LOGE(TAG, "uart write error, wrong number of bytes written");
+            return ESP_ERR_INVALID_SIZE;
+        }
+        return ESP_OK;
+    });
+    R502Trace::record(R502_trace_tx_end, frame.instr_code(), written);
+    return err;
+}
+
+esp_err_t R502Interface::send_data_packages(const uint8_t *data, size_t len,
+    int data_len)
+{
+    for(size_t sent = 0; sent < len; sent += data_len){
+        size_t chunk = std::min<size_t>(data_len, len - sent);
+        R502_pid_t pid = sent + chunk < len ? R502_pid_data : 
+            R502_pid_end_of_data;
+        R502FrameEncoder frame(adder, pid);
+        frame.add_payload(data + sent, chunk);
+        frame.finish();
+        esp_err_t err = send_package(frame);
+        if(err) return err;
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::receive_package(const R502_DataPkg_t &rec_pkg,
     int data_length, int read_delay_ms)
 {
-    int len = uart_read_bytes(uart_num, (uint8_t *)&rec_pkg, data_length,
-        read_delay_ms / portTICK_RATE_MS);
+    uint8_t *buf = (uint8_t *)&rec_pkg;
+    int64_t deadline = esp_timer_get_time() + (int64_t)read_delay_ms * 1000;
+
+    // Events from earlier transfers are stale. What's already buffered is
+    // checked before waiting on the queue, so nothing is missed
+    xQueueReset(uart_queue);
+
+    // Read the header, dropping anything in front of the start code
+    int len = 0;
+    int skipped = 0;
+    esp_err_t err = ESP_OK;
+    while(len < header_size){
+        err = wait_for_rx(header_size - len, deadline);
+        if(err) break;
+        int read = uart_read_bytes(uart_num, buf + len, header_size - len, 0);
+        if(read < 0){
+            ESP_LOGE(TAG, "uart read error, parameter error");
+            return ESP_ERR_INVALID_STATE;
+        }
+        len += read;
+        int dropped = sync_to_start(buf, len);
+        skipped += dropped;
+        len -= dropped;
+
+        // On a shared line the package may be another module's. It's taken
+        // off the line and the wait goes on for this module's
+        if(len == header_size && bus && 
+            memcmp(rec_pkg.adder, adder, sizeof(adder)) != 0)
+        {
+            len = 0;
+            err = skip_package(rec_pkg, deadline);
+            if(err) break;
+        }
+    }
+    if(skipped){
+        ESP_LOGW(TAG, "skipped %d bytes before package start", skipped);
+    }
+
+    // Then exactly as much as the header announces
+    if(!err){
+        int announced = conv_8_to_16(rec_pkg.length);
+        R502Trace::record(R502_trace_rx_header, rec_pkg.pid, announced);
+        // Longer than expected would overrun a buffer sized for data_length
+        if(announced < R502_cs_len || announced > data_length - header_size){
+            ESP_LOGE(TAG, "Response has invalid length, %d", announced);
+            uart_flush(uart_num);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        int total = header_size + announced;
+        while(len < total){
+            err = wait_for_rx(total - len, deadline);
+            if(err) break;
+            int read = uart_read_bytes(uart_num, buf + len, total - len, 0);
+            if(read < 0){
+                ESP_LOGE(TAG, "uart read error, parameter error");
+                return ESP_ERR_INVALID_STATE;
+            }
+            len += read;
+        }
+    }
     
     //ESP_LOGI(TAG, "received %d bytes", len);
 
-    if(len == -1){
-        ESP_LOGE(TAG, "uart read error, parameter error");
-        return ESP_ERR_INVALID_STATE;
-    }
-    else if(len == 0){
+    if(err == ESP_ERR_TIMEOUT && len == 0){
         ESP_LOGE(TAG, "uart read error, R502 not found");
         return ESP_ERR_NOT_FOUND;
     }
-    // This check is uncesseccary, it'll probably fail the crc cause it doesn't
-    // write data into the last crc byte if this is the case
-    else if(len < data_length){
+    else if(err){
         ESP_LOGE(TAG, "uart read error, not enough bytes read, %d < %d", 
             len, data_length);
         uart_flush(uart_num);
         return ESP_ERR_INVALID_RESPONSE;
     }
+    R502Trace::record(R502_trace_rx_complete, rec_pkg.pid, len);
 
 //    printf("response Data\n");
     //int printed = 0;
@@ -475,18 +1501,97 @@ esp_err_t R502Interface::receive_package(const R502_DataPkg_t &rec_pkg,
         uart_flush(uart_num);
         return ESP_ERR_INVALID_CRC;
     }
-    esp_err_t err = verify_headers(rec_pkg, len - header_size);
+    R502Trace::record(R502_trace_checksum_ok, rec_pkg.pid, 
+        conv_8_to_16(rec_pkg.length));
+    err = verify_headers(rec_pkg, data_length - header_size);
     if(err){
         uart_flush(uart_num);
     }
     return err;
 }
 
-void R502Interface::busy_delay(int64_t microseconds)
+esp_err_t R502Interface::skip_package(const R502_DataPkg_t &header,
+    int64_t deadline)
 {
-    // wait
-    int64_t time_start = esp_timer_get_time();
-    while(esp_timer_get_time() < time_start + microseconds);
+    int remaining = conv_8_to_16(header.length);
+    if(remaining < R502_cs_len || 
+        remaining > R502_max_data_len + R502_cs_len)
+    {
+        // Not a package header after all, look for the next start code
+        bus->route(header.adder, false);
+        return ESP_OK;
+    }
+
+    // Summed as it goes by, a corrupted address mustn't be counted against
+    // another module
+    int sum = header.pid + header.length[0] + header.length[1];
+    int checksum = 0;
+    uint8_t discard[32];
+    while(remaining > 0){
+        esp_err_t err = wait_for_rx(1, deadline);
+        if(err) return err;
+        int read = uart_read_bytes(uart_num, discard, 
+            std::min<int>(remaining, sizeof(discard)), 0);
+        if(read < 0){
+            ESP_LOGE(TAG, "uart read error, parameter error");
+            return ESP_ERR_INVALID_STATE;
+        }
+        for(int i = 0; i < read; i++, remaining--){
+            if(remaining > R502_cs_len){
+                sum += discard[i];
+            }
+            else{
+                checksum = (checksum << 8) | discard[i];
+            }
+        }
+    }
+    bus->route(header.adder, (sum & 0xffff) == checksum);
+    return ESP_OK;
+}
+
+esp_err_t R502Interface::wait_for_rx(int length, int64_t deadline)
+{
+    size_t buffered = 0;
+    uart_get_buffered_data_len(uart_num, &buffered);
+    while(buffered < length){
+        int64_t remaining_us = deadline - esp_timer_get_time();
+        if(remaining_us <= 0){
+            return ESP_ERR_TIMEOUT;
+        }
+        // Sleep until the driver reports data, the task is blocked so the
+        // cpu is free in the meantime
+        TickType_t ticks = (remaining_us / 1000 + portTICK_PERIOD_MS) / 
+            portTICK_PERIOD_MS;
+        uart_event_t event;
+        if(xQueueReceive(uart_queue, &event, ticks) != pdTRUE){
+            continue;
+        }
+        if(event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL){
+            ESP_LOGE(TAG, "uart receive overflow, event %d", event.type);
+            uart_flush(uart_num);
+            xQueueReset(uart_queue);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        uart_get_buffered_data_len(uart_num, &buffered);
+    }
+    return ESP_OK;
+}
+
+int R502Interface::sync_to_start(uint8_t *buf, int len)
+{
+    // The hardware pattern detector only matches runs of a single repeated
+    // character, so the two byte start code is found here instead
+    int i = 0;
+    while(i < len){
+        if(buf[i] == start[0] && (i + 1 == len || buf[i+1] == start[1])){
+            break;
+        }
+        i++;
+    }
+    if(i > 0){
+        memmove(buf, buf + i, len - i);
+    }
+    return i;
 }
 
 void R502Interface::fill_checksum(R502_DataPkg_t &package)
@@ -571,7 +1676,3 @@ void R502Interface::conv_16_to_8(const uint16_t in, uint8_t out[2])
     out[0] = (in >> 8) & 0xff;
     out[1] = in & 0xff;
 }
-
-uint16_t R502Interface::package_length(const R502_DataPkg_t &pkg){
-    return sizeof(pkg) - sizeof(pkg.data) + conv_8_to_16(pkg.length);
-}
\ No newline at end of file
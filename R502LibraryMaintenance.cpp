@@ -0,0 +1,123 @@
+#include "R502LibraryMaintenance.hpp"
+#include <algorithm>
+
+static const char *TAG = "R502Maintenance";
+
+esp_err_t R502LibraryMaintenance::delete_pages(const uint16_t *page_ids,
+    size_t count, R502_conf_code_t &res)
+{
+    esp_err_t err = prepare(res);
+    if(err || res != R502_ok) return err;
+    std::vector<uint16_t> pages(page_ids, page_ids + count);
+    std::vector<R502_delete_run_t> runs;
+    plan_deletes(iface.get_template_index(), pages, runs);
+    err = delete_planned(pages, runs, res);
+    if(!err && res == R502_ok) stats.pages_deleted += pages.size();
+    return err;
+}
+
+esp_err_t R502LibraryMaintenance::compact(moved_cb_t moved,
+    R502_conf_code_t &res, int max_moves)
+{
+    esp_err_t err = prepare(res);
+    if(err || res != R502_ok) return err;
+    const R502TemplateIndex &index = iface.get_template_index();
+
+    // The lowest free page takes the highest template not yet moved
+    std::vector<uint16_t> sources;
+    int free_page = index.find_free();
+    int top = index.capacity() - 1;
+    while(free_page >= 0 && (int)sources.size() < max_moves){
+        while(top > free_page && !index.is_used(top)) top--;
+        if(top <= free_page) break;
+
+        err = iface.load_char(R502_char_buffer_2, top, res);
+        stats.round_trips++;
+        if(err || res != R502_ok) break;
+        err = iface.store(R502_char_buffer_2, free_page, res);
+        stats.round_trips++;
+        if(err || res != R502_ok) break;
+        stats.moves++;
+        moved(top, free_page);
+        // Counted as used until the delete, so it isn't picked again
+        sources.push_back(top);
+        top--;
+        free_page = index.find_free();
+    }
+    if(err || res != R502_ok){
+        ESP_LOGE(TAG, "compaction stopped after %d moves: %s, code %d",
+            (int)sources.size(), esp_err_to_name(err), res);
+    }
+
+    // Even after a failure, the templates copied so far mustn't stay twice.
+    // Only the deletes can be saved, the loads and stores are one per move
+    // either way
+    esp_err_t move_err = err;
+    R502_conf_code_t delete_res = R502_ok;
+    std::vector<R502_delete_run_t> runs;
+    plan_deletes(index, sources, runs);
+    err = delete_planned(sources, runs, delete_res);
+    if(res == R502_ok) res = delete_res;
+    return move_err ? move_err : err;
+}
+
+void R502LibraryMaintenance::plan_deletes(const R502TemplateIndex &index,
+    std::vector<uint16_t> &pages, std::vector<R502_delete_run_t> &runs)
+{
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+    pages.erase(std::remove_if(pages.begin(), pages.end(),
+        [&index](uint16_t page){ return !index.is_used(page); }),
+        pages.end());
+
+    runs.clear();
+    for(uint16_t page : pages){
+        if(!runs.empty()){
+            // Extend the run over the free pages in between
+            R502_delete_run_t &run = runs.back();
+            uint16_t end = run.page_id + run.count;
+            if(index.used_in_range(end, page - end) == 0){
+                run.count = page + 1 - run.page_id;
+                continue;
+            }
+        }
+        runs.push_back({page, 1});
+    }
+}
+
+esp_err_t R502LibraryMaintenance::prepare(R502_conf_code_t &res)
+{
+    res = R502_ok;
+    if(iface.get_template_index().is_synced()) return ESP_OK;
+    return iface.sync_template_index(res);
+}
+
+esp_err_t R502LibraryMaintenance::delete_planned(
+    const std::vector<uint16_t> &pages,
+    const std::vector<R502_delete_run_t> &runs, R502_conf_code_t &res)
+{
+    res = R502_ok;
+    if(pages.empty()) return ESP_OK;
+    uint32_t sent = 0;
+    esp_err_t err = ESP_OK;
+    if(pages.size() == iface.get_template_index().used_count()){
+        sent++;
+        err = iface.empty(res);
+    }
+    else{
+        for(const R502_delete_run_t &run : runs){
+            sent++;
+            err = iface.delete_char(run.page_id, run.count, res);
+            if(err || res != R502_ok) break;
+        }
+    }
+    if(err) return err;
+    stats.delete_commands += sent;
+    stats.round_trips += sent;
+    if(res != R502_ok){
+        ESP_LOGE(TAG, "delete failed with code %d", res);
+        return ESP_OK;
+    }
+    stats.round_trips_saved += pages.size() - sent;
+    return ESP_OK;
+}
@@ -0,0 +1,127 @@
+#include "R502LinkStore.hpp"
+#include <stdio.h>
+#include <cstring>
+#include "nvs.h"
+
+// Record layout
+//  Byte | Content
+//  ---- | ----------------------------------------
+//  0    | 'R'
+//  1    | record version
+//  2    | baud setting
+//  3    | data package length setting
+//  4-7  | module address
+//  8-9  | sum of bytes 0 to 7, big endian
+
+esp_err_t R502LinkStore::load(R502_link_config_t &config)
+{
+    uint8_t record[record_size];
+    esp_err_t err = read_record(record);
+    if(err) return err;
+
+    int sum = 0;
+    for(int i = 0; i < 8; i++){
+        sum += record[i];
+    }
+    if(record[8] != ((sum >> 8) & 0xff) || record[9] != (sum & 0xff)){
+        return ESP_ERR_INVALID_CRC;
+    }
+    if(record[0] != 'R' || record[1] != record_version){
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    // A record from a newer version, or corrupted with a matching sum, may
+    // hold settings this one can't drive the UART with
+    switch(record[2]){
+    case R502_baud_9600:
+    case R502_baud_19200:
+    case R502_baud_38400:
+    case R502_baud_57600:
+    case R502_baud_115200:
+        break;
+    default:
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if(record[3] > R502_data_len_256) return ESP_ERR_INVALID_VERSION;
+
+    config.baud = (R502_baud_t)record[2];
+    config.data_package_length = (R502_data_len_t)record[3];
+    memcpy(config.adder, record + 4, sizeof(config.adder));
+    return ESP_OK;
+}
+
+esp_err_t R502LinkStore::save(const R502_link_config_t &config)
+{
+    uint8_t record[record_size];
+    record[0] = 'R';
+    record[1] = record_version;
+    record[2] = config.baud;
+    record[3] = config.data_package_length;
+    memcpy(record + 4, config.adder, sizeof(config.adder));
+
+    int sum = 0;
+    for(int i = 0; i < 8; i++){
+        sum += record[i];
+    }
+    record[8] = (sum >> 8) & 0xff;
+    record[9] = sum & 0xff;
+    return write_record(record);
+}
+
+R502NvsLinkStore::R502NvsLinkStore(const char *_nvs_namespace,
+    const char *_key) : nvs_namespace(_nvs_namespace), key(_key)
+{
+}
+
+esp_err_t R502NvsLinkStore::read_record(uint8_t (&record)[record_size])
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(nvs_namespace, NVS_READONLY, &handle);
+    if(err == ESP_ERR_NVS_NOT_FOUND) return ESP_ERR_NOT_FOUND;
+    if(err) return err;
+
+    size_t len = record_size;
+    err = nvs_get_blob(handle, key, record, &len);
+    nvs_close(handle);
+    if(err == ESP_ERR_NVS_NOT_FOUND) return ESP_ERR_NOT_FOUND;
+    if(err) return err;
+    if(len != record_size) return ESP_ERR_INVALID_VERSION;
+    return ESP_OK;
+}
+
+esp_err_t R502NvsLinkStore::write_record(const uint8_t (&record)[record_size])
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(nvs_namespace, NVS_READWRITE, &handle);
+    if(err) return err;
+    err = nvs_set_blob(handle, key, record, record_size);
+    if(!err){
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+R502FileLinkStore::R502FileLinkStore(const char *_path) : path(_path)
+{
+}
+
+esp_err_t R502FileLinkStore::read_record(uint8_t (&record)[record_size])
+{
+    FILE *file = fopen(path, "rb");
+    if(!file) return ESP_ERR_NOT_FOUND;
+    size_t len = fread(record, 1, record_size, file);
+    fclose(file);
+    if(len != record_size) return ESP_ERR_INVALID_VERSION;
+    return ESP_OK;
+}
+
+esp_err_t R502FileLinkStore::write_record(const uint8_t (&record)[record_size])
+{
+    FILE *file = fopen(path, "wb");
+    if(!file) return ESP_FAIL;
+    size_t len = fwrite(record, 1, record_size, file);
+    int close_err = fclose(file);
+    if(len != record_size || close_err) return ESP_FAIL;
+    return ESP_OK;
+}
@@ -0,0 +1,356 @@
+#include "R502NotepadStore.hpp"
+#include <string.h>
+#include <algorithm>
+
+// Page layout
+//  Byte  | Content
+//  ----- | ----------------------------------------
+//  0-27  | stream bytes
+//  28-29 | generation of the flush that wrote the page, big endian
+//  30-31 | CRC16 over the page number and bytes 0 to 29, big endian
+//
+// Stream layout, spread over the stream bytes of consecutive pages
+//  Byte | Content
+//  ---- | ----------------------------------------
+//  0    | 'N'
+//  1    | stream version
+//  2-3  | stream length in bytes including this header, big endian
+//  4-5  | generation of the last flush, big endian
+//  6-7  | CRC16 over the stream without these two bytes, big endian
+//  8-   | entries of key length, value length, key, value
+
+// Out of line as well, push_back takes them by reference
+constexpr uint8_t R502NotepadStore::stream_magic;
+constexpr uint8_t R502NotepadStore::stream_version;
+
+// CRC16-CCITT, continuing from crc
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+    for(size_t i = 0; i < len; i++){
+        crc ^= data[i] << 8;
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+R502NotepadStore::R502NotepadStore(R502Interface &_iface, uint8_t _first_page,
+    uint8_t _page_count) : iface(_iface), first_page(_first_page),
+    page_count(_page_count)
+{
+    if(first_page >= R502_notepad_pages){
+        first_page = R502_notepad_pages - 1;
+    }
+    if(page_count > R502_notepad_pages - first_page){
+        page_count = R502_notepad_pages - first_page;
+    }
+    pages.resize(page_count);
+}
+
+esp_err_t R502NotepadStore::load(R502_conf_code_t &res)
+{
+    loaded = false;
+    for(int i = 0; i < page_count; i++){
+        esp_err_t err = iface.read_notepad(first_page + i, res, pages[i]);
+        if(err) return err;
+        if(res != R502_ok) return ESP_OK;
+        stats.pages_read++;
+    }
+
+    esp_err_t err = decode();
+    if(err){
+        // start over empty, so the store can be rewritten
+        entries.clear();
+    }
+    loaded = true;
+    dirty = false;
+    return err;
+}
+
+esp_err_t R502NotepadStore::get(const char *key, uint8_t *value,
+    size_t &len) const
+{
+    if(!loaded) return ESP_ERR_INVALID_STATE;
+    std::vector<entry_t>::const_iterator it = find(key);
+    if(it == entries.end()) return ESP_ERR_NOT_FOUND;
+
+    size_t available = len;
+    len = it->value.size();
+    if(available < len) return ESP_ERR_INVALID_SIZE;
+    std::copy(it->value.begin(), it->value.end(), value);
+    return ESP_OK;
+}
+
+esp_err_t R502NotepadStore::set(const char *key, const uint8_t *value,
+    size_t len)
+{
+    if(!loaded) return ESP_ERR_INVALID_STATE;
+    size_t key_len = strlen(key);
+    if(key_len == 0 || key_len > max_key_len || len > max_value_len){
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    std::vector<entry_t>::iterator it = find(key);
+    size_t old_size = 0;
+    if(it != entries.end()){
+        old_size = 2 + key_len + it->value.size();
+    }
+    size_t capacity = (size_t)page_count * page_payload;
+    if(stream_size() - old_size + 2 + key_len + len > capacity){
+        return ESP_ERR_NO_MEM;
+    }
+
+    if(it == entries.end()){
+        entries.push_back(entry_t{key, std::vector<uint8_t>()});
+        it = entries.end() - 1;
+    }
+    else if(it->value.size() == len &&
+        std::equal(it->value.begin(), it->value.end(), value))
+    {
+        // unchanged, nothing to write back
+        return ESP_OK;
+    }
+    it->value.assign(value, value + len);
+    dirty = true;
+    return ESP_OK;
+}
+
+esp_err_t R502NotepadStore::erase(const char *key)
+{
+    if(!loaded) return ESP_ERR_INVALID_STATE;
+    std::vector<entry_t>::iterator it = find(key);
+    if(it == entries.end()) return ESP_ERR_NOT_FOUND;
+    entries.erase(it);
+    dirty = true;
+    return ESP_OK;
+}
+
+esp_err_t R502NotepadStore::flush(R502_conf_code_t &res)
+{
+    res = R502_ok;
+    if(!loaded) return ESP_ERR_INVALID_STATE;
+    if(!dirty) return ESP_OK;
+
+    std::vector<page_t> images;
+    uint16_t next_generation = generation + 1;
+    int used_pages = encode(next_generation, images);
+    bool wrote = false;
+    // The first page last, its header makes the new pages current
+    for(int n = 0; n < used_pages; n++){
+        int i = (n + 1) % used_pages;
+        if(images[i] == pages[i]){
+            stats.pages_skipped++;
+            continue;
+        }
+        esp_err_t err = iface.write_notepad(first_page + i, images[i], res);
+        if(err) return err;
+        if(res != R502_ok) return ESP_OK;
+        pages[i] = images[i];
+        stats.pages_written++;
+        wrote = true;
+    }
+    // Pages past the end of the stream are never read, leave them be
+    stats.pages_skipped += page_count - used_pages;
+    if(wrote){
+        stats.flushes++;
+    }
+    generation = next_generation;
+    dirty = false;
+    return ESP_OK;
+}
+
+bool R502NotepadStore::is_dirty() const
+{
+    return dirty;
+}
+
+size_t R502NotepadStore::bytes_free() const
+{
+    return (size_t)page_count * page_payload - stream_size();
+}
+
+const R502_notepad_stats_t &R502NotepadStore::get_stats() const
+{
+    return stats;
+}
+
+int R502NotepadStore::encode(uint16_t next_generation,
+    std::vector<page_t> &images) const
+{
+    std::vector<uint8_t> stream;
+    size_t size = stream_size();
+    stream.reserve(size);
+    stream.push_back(stream_magic);
+    stream.push_back(stream_version);
+    stream.push_back((size >> 8) & 0xff);
+    stream.push_back(size & 0xff);
+    stream.push_back((next_generation >> 8) & 0xff);
+    stream.push_back(next_generation & 0xff);
+    stream.push_back(0);
+    stream.push_back(0);
+    for(const entry_t &entry : entries){
+        stream.push_back(entry.key.size());
+        stream.push_back(entry.value.size());
+        stream.insert(stream.end(), entry.key.begin(), entry.key.end());
+        stream.insert(stream.end(), entry.value.begin(), entry.value.end());
+    }
+    uint16_t crc = crc16(0xffff, stream.data(), 6);
+    crc = crc16(crc, stream.data() + stream_header_size,
+        stream.size() - stream_header_size);
+    stream[6] = (crc >> 8) & 0xff;
+    stream[7] = crc & 0xff;
+
+    images = pages;
+    int used_pages = (stream.size() + page_payload - 1) / page_payload;
+    for(int i = 0; i < used_pages; i++){
+        page_t &image = images[i];
+        page_t cached = image;
+        image.fill(0);
+        size_t offset = i * page_payload;
+        size_t count = std::min<size_t>(page_payload, stream.size() - offset);
+        std::copy(stream.begin() + offset, stream.begin() + offset + count,
+            image.begin());
+
+        // An unchanged page is kept while it is valid and not so old that
+        // its generation could pass for a newer one than the header's
+        uint16_t cached_crc = (cached[page_payload + 2] << 8) |
+            cached[page_payload + 3];
+        uint16_t age = next_generation - page_generation(cached);
+        if(i > 0 && std::equal(image.begin(), image.begin() + page_payload,
+            cached.begin()) && age < max_page_age &&
+            cached_crc == page_crc(first_page + i, cached))
+        {
+            image = cached;
+            continue;
+        }
+        image[page_payload] = (next_generation >> 8) & 0xff;
+        image[page_payload + 1] = next_generation & 0xff;
+        crc = page_crc(first_page + i, image);
+        image[page_payload + 2] = (crc >> 8) & 0xff;
+        image[page_payload + 3] = crc & 0xff;
+    }
+    return used_pages;
+}
+
+esp_err_t R502NotepadStore::decode()
+{
+    entries.clear();
+    generation = 0;
+    if(page_count == 0) return ESP_OK;
+
+    // A notepad that was never written
+    const page_t &first = pages[0];
+    bool blank = true;
+    for(uint8_t byte : first){
+        if(byte != first[0] || (byte != 0x00 && byte != 0xff)){
+            blank = false;
+            break;
+        }
+    }
+    if(blank) return ESP_OK;
+
+    std::vector<uint8_t> stream;
+    uint16_t stream_generation = 0;
+    for(int i = 0; i < page_count; i++){
+        const page_t &page = pages[i];
+        uint16_t crc = (page[page_payload + 2] << 8) | page[page_payload + 3];
+        if(crc != page_crc(first_page + i, page)){
+            return ESP_ERR_INVALID_CRC;
+        }
+        stream.insert(stream.end(), page.begin(),
+            page.begin() + page_payload);
+
+        if(i == 0){
+            if(stream[0] != stream_magic || stream[1] != stream_version){
+                return ESP_ERR_INVALID_VERSION;
+            }
+            stream_generation = (stream[4] << 8) | stream[5];
+        }
+        // Written after the header, by a flush that didn't finish
+        uint16_t age = stream_generation - page_generation(page);
+        if(age >= 0x8000 || (i == 0 && age != 0)){
+            return ESP_ERR_INVALID_CRC;
+        }
+        size_t size = (stream[2] << 8) | stream[3];
+        if(size < stream_header_size ||
+            size > (size_t)page_count * page_payload)
+        {
+            return ESP_ERR_INVALID_CRC;
+        }
+        if(stream.size() >= size){
+            stream.resize(size);
+            break;
+        }
+    }
+
+    // Catches a header written after only some of the other pages
+    uint16_t crc = crc16(0xffff, stream.data(), 6);
+    crc = crc16(crc, stream.data() + stream_header_size,
+        stream.size() - stream_header_size);
+    if(crc != ((stream[6] << 8) | stream[7])) return ESP_ERR_INVALID_CRC;
+
+    size_t pos = stream_header_size;
+    while(pos < stream.size()){
+        if(pos + 2 > stream.size()) return ESP_ERR_INVALID_CRC;
+        size_t key_len = stream[pos];
+        size_t value_len = stream[pos + 1];
+        pos += 2;
+        if(pos + key_len + value_len > stream.size()) {
+            return ESP_ERR_INVALID_CRC;
+        }
+        entry_t entry;
+        entry.key.assign(stream.begin() + pos, stream.begin() + pos + key_len);
+        pos += key_len;
+        entry.value.assign(stream.begin() + pos,
+            stream.begin() + pos + value_len);
+        pos += value_len;
+        entries.push_back(entry);
+    }
+    generation = stream_generation;
+    return ESP_OK;
+}
+
+size_t R502NotepadStore::stream_size() const
+{
+    size_t size = stream_header_size;
+    for(const entry_t &entry : entries){
+        size += 2 + entry.key.size() + entry.value.size();
+    }
+    return size;
+}
+
+uint16_t R502NotepadStore::page_crc(uint8_t page_number,
+    const page_t &page) const
+{
+    // With the page number first so pages can't be swapped
+    uint16_t crc = crc16(0xffff, &page_number, 1);
+    return crc16(crc, page.data(), page_payload + 2);
+}
+
+uint16_t R502NotepadStore::page_generation(const page_t &page) const
+{
+    return (page[page_payload] << 8) | page[page_payload + 1];
+}
+
+std::vector<R502NotepadStore::entry_t>::iterator R502NotepadStore::find(
+    const char *key)
+{
+    for(std::vector<entry_t>::iterator it = entries.begin();
+        it != entries.end(); it++)
+    {
+        if(it->key == key) return it;
+    }
+    return entries.end();
+}
+
+std::vector<R502NotepadStore::entry_t>::const_iterator R502NotepadStore::find(
+    const char *key) const
+{
+    for(std::vector<entry_t>::const_iterator it = entries.begin();
+        it != entries.end(); it++)
+    {
+        if(it->key == key) return it;
+    }
+    return entries.end();
+}
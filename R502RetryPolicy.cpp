@@ -0,0 +1,124 @@
+#include "R502RetryPolicy.hpp"
+
+R502RetryPolicy::R502RetryPolicy()
+{
+    config = {3, 10, 100};
+    reset_stats();
+}
+
+bool R502RetryPolicy::is_idempotent(const R502_DataPkg_t &pkg)
+{
+    switch(pkg.data.general.instr_code){
+        case R502_ic_gen_img:
+        case R502_ic_img_2_tz:
+        case R502_ic_match:
+        case R502_ic_search:
+        case R502_ic_load_char:
+        case R502_ic_read_sys_para:
+        case R502_ic_vfy_pwd:
+        case R502_ic_get_random_code:
+        case R502_ic_read_notepad:
+        case R502_ic_write_notepad:
+        case R502_ic_template_num:
+        case R502_ic_read_index_table:
+        case R502_ic_led_config:
+            return true;
+        case R502_ic_set_sys_para:
+            // The module switches baud rate after acknowledging, a repeat
+            // would go out at the old one
+            return pkg.data.set_sys_para.parameter_number !=
+                R502_para_num_baud_control;
+        default:
+            // Store, Empty, DeletChar, RegModel, SetPwd, SetAdder and the
+            // multi-package transfers
+            return false;
+    }
+}
+
+bool R502RetryPolicy::is_transient(esp_err_t err)
+{
+    return err == ESP_ERR_NOT_FOUND || err == ESP_ERR_INVALID_RESPONSE ||
+        err == ESP_ERR_INVALID_CRC;
+}
+
+bool R502RetryPolicy::should_retry(esp_err_t err, int attempt,
+    bool idempotent)
+{
+    switch(err){
+        case ESP_OK:
+            return false;
+        case ESP_ERR_NOT_FOUND:
+            stats.timeouts++;
+            break;
+        case ESP_ERR_INVALID_RESPONSE:
+            stats.short_reads++;
+            break;
+        case ESP_ERR_INVALID_CRC:
+            stats.crc_errors++;
+            break;
+        default:
+            break;
+    }
+    if(!is_transient(err)){
+        return false;
+    }
+    if(!idempotent){
+        stats.not_retryable++;
+        return false;
+    }
+    if(attempt >= config.max_attempts){
+        return false;
+    }
+    stats.retries++;
+    return true;
+}
+
+void R502RetryPolicy::record_outcome(esp_err_t err, int attempts)
+{
+    stats.commands++;
+    if(attempts > 1){
+        if(err == ESP_OK){
+            stats.recovered++;
+        }
+        else{
+            stats.exhausted++;
+        }
+    }
+}
+
+void R502RetryPolicy::record_drained(int bytes)
+{
+    stats.drained_bytes += bytes;
+}
+
+int R502RetryPolicy::backoff_ms(int attempt) const
+{
+    int backoff = config.base_backoff_ms;
+    for(int i = 1; i < attempt && backoff < config.max_backoff_ms; i++){
+        backoff *= 2;
+    }
+    return backoff < config.max_backoff_ms ? backoff : config.max_backoff_ms;
+}
+
+void R502RetryPolicy::set_config(const R502_retry_config_t &_config)
+{
+    config = _config;
+    if(config.max_attempts < 1){
+        config.max_attempts = 1;
+    }
+}
+
+const R502_retry_config_t &R502RetryPolicy::get_config() const
+{
+    return config;
+}
+
+const R502_retry_stats_t &R502RetryPolicy::get_stats() const
+{
+    return stats;
+}
+
+void R502RetryPolicy::reset_stats()
+{
+    stats = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+}
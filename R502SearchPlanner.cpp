@@ -0,0 +1,271 @@
+#include "R502SearchPlanner.hpp"
+#include <algorithm>
+#include <cmath>
+
+static const char *TAG = "R502Planner";
+
+// Scores are scaled down once weight passes this, far from float's limit
+// even with every page at full weight
+static const float max_weight = 1e30f;
+
+R502SearchPlanner::R502SearchPlanner(R502Interface &_iface) : iface(_iface)
+{
+    set_config({32, 256, 50});
+}
+
+void R502SearchPlanner::set_config(const R502_planner_config_t &_config)
+{
+    config = _config;
+    config.min_hot_share = std::min<uint8_t>(config.min_hot_share, 100);
+    growth = config.half_life ? std::exp2(1.0f / config.half_life) : 1;
+}
+
+void R502SearchPlanner::reset(uint16_t capacity)
+{
+    scores.assign(capacity, 0);
+    weight = 1;
+    total = 0;
+    stats = {};
+}
+
+esp_err_t R502SearchPlanner::identify(R502_char_buffer_t buffer_id,
+    R502_conf_code_t &res, uint16_t &page_id, uint16_t &match_score)
+{
+    esp_err_t err = prepare(res);
+    if(err || res != R502_ok) return err;
+    const uint16_t capacity = scores.size();
+    R502_search_range_t hot = hot_range();
+    stats.identifies++;
+
+    R502_search_range_t ranges[3];
+    int range_count = 0;
+    if(hot.page_num){
+        // then the rest of the library, in at most two searches
+        uint16_t hot_end = hot.start_page + hot.page_num;
+        ranges[range_count++] = hot;
+        if(hot_end < capacity){
+            ranges[range_count++] = {hot_end, (uint16_t)(capacity - hot_end)};
+        }
+        if(hot.start_page){
+            ranges[range_count++] = {0, hot.start_page};
+        }
+    }
+    else{
+        ranges[range_count++] = {0, capacity};
+        stats.full_searches++;
+    }
+    for(int i = 0; i < range_count; i++){
+        err = iface.search(buffer_id, ranges[i].start_page,
+            ranges[i].page_num, res, page_id, match_score);
+        if(err) return err;
+        stats.pages_searched += ranges[i].page_num;
+        if(res != R502_err_not_found) break;
+        if(i == 0 && hot.page_num) stats.fallbacks++;
+    }
+    if(res == R502_ok){
+        if(hot.page_num && page_id >= hot.start_page &&
+            page_id < hot.start_page + hot.page_num)
+        {
+            stats.hot_hits++;
+        }
+        record_hit(page_id);
+    }
+    else{
+        tick();
+    }
+    return ESP_OK;
+}
+
+void R502SearchPlanner::record_hit(uint16_t page_id)
+{
+    tick();
+    if(page_id >= scores.size()) return;
+    scores[page_id] += weight;
+    total += weight;
+}
+
+void R502SearchPlanner::forget(uint16_t page_id, uint16_t count)
+{
+    size_t end = std::min<size_t>(page_id + count, scores.size());
+    for(size_t id = page_id; id < end; id++){
+        total -= scores[id];
+        scores[id] = 0;
+    }
+    total = std::max(total, 0.0f);
+}
+
+float R502SearchPlanner::score(uint16_t page_id) const
+{
+    if(page_id >= scores.size()) return 0;
+    return scores[page_id] / weight;
+}
+
+R502_search_range_t R502SearchPlanner::hot_range() const
+{
+    const size_t window = config.hot_pages;
+    if(window == 0 || window >= scores.size() || total <= 0) return {0, 0};
+
+    // Sum in double, so adding and dropping pages doesn't drift
+    double sum = 0;
+    for(size_t i = 0; i < window; i++){
+        sum += scores[i];
+    }
+    double best = sum;
+    size_t best_start = 0;
+    for(size_t start = 1; start + window <= scores.size(); start++){
+        sum += scores[start + window - 1] - scores[start - 1];
+        if(sum > best){
+            best = sum;
+            best_start = start;
+        }
+    }
+    if(best * 100 < (double)total * config.min_hot_share) return {0, 0};
+    return {(uint16_t)best_start, (uint16_t)window};
+}
+
+esp_err_t R502SearchPlanner::enroll_page(R502_conf_code_t &res,
+    uint16_t &page_id)
+{
+    esp_err_t err = prepare(res);
+    if(err || res != R502_ok) return err;
+    int free_page = free_page_from(config.hot_pages);
+    if(free_page < 0) free_page = free_page_from(0);
+    if(free_page < 0) return ESP_ERR_NOT_FOUND;
+    page_id = free_page;
+    return ESP_OK;
+}
+
+esp_err_t R502SearchPlanner::compact(moved_cb_t moved, R502_conf_code_t &res,
+    int max_moves)
+{
+    esp_err_t err = prepare(res);
+    if(err || res != R502_ok) return err;
+    const R502TemplateIndex &index = iface.get_template_index();
+    const uint16_t capacity = scores.size();
+    const uint16_t hot_end = std::min(config.hot_pages, capacity);
+
+    // The hot set, highest scores first, only pages that ever matched
+    std::vector<uint16_t> ranked;
+    for(uint16_t page = 0; page < capacity; page++){
+        if(index.is_used(page) && scores[page] > 0) ranked.push_back(page);
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+        [this](uint16_t a, uint16_t b){ return scores[a] > scores[b]; });
+    if(ranked.size() > hot_end) ranked.resize(hot_end);
+    std::vector<bool> hot(capacity, false);
+    for(uint16_t page : ranked){
+        hot[page] = true;
+    }
+
+    int moves = 0;
+    uint16_t target = 0;
+    for(uint16_t page : ranked){
+        if(page < hot_end) continue;
+        // Lowest page below hot_end that isn't already hot
+        while(target < hot_end && hot[target]) target++;
+        if(target == hot_end) break;
+
+        int spare = -1;
+        if(index.is_used(target)){
+            spare = free_page_from(hot_end);
+            if(spare < 0){
+                if(moves + 2 > max_moves) break;
+                err = swap(page, target, moved, res);
+                if(err || res != R502_ok) return err;
+                moves += 2;
+                hot[page] = false;
+                hot[target] = true;
+                continue;
+            }
+        }
+        if(moves + (spare < 0 ? 1 : 2) > max_moves) break;
+        if(spare >= 0){
+            err = move(target, spare, moved, res);
+            if(err || res != R502_ok) return err;
+            moves++;
+        }
+        err = move(page, target, moved, res);
+        if(err || res != R502_ok) return err;
+        moves++;
+        hot[page] = false;
+        hot[target] = true;
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502SearchPlanner::prepare(R502_conf_code_t &res)
+{
+    res = R502_ok;
+    const R502TemplateIndex &index = iface.get_template_index();
+    if(!index.is_synced()){
+        esp_err_t err = iface.sync_template_index(res);
+        if(err || res != R502_ok) return err;
+    }
+    if(scores.empty()){
+        reset(index.capacity());
+    }
+    else if(scores.size() != index.capacity()){
+        ESP_LOGW(TAG, "library is %d pages, not %d, scores reset",
+            index.capacity(), (int)scores.size());
+        reset(index.capacity());
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502SearchPlanner::move(uint16_t from, uint16_t to,
+    moved_cb_t moved, R502_conf_code_t &res)
+{
+    esp_err_t err = iface.load_char(R502_char_buffer_2, from, res);
+    if(err || res != R502_ok) return err;
+    err = iface.store(R502_char_buffer_2, to, res);
+    if(err || res != R502_ok) return err;
+    // Only deleted once the copy is stored, so a failure leaves two copies
+    // rather than none
+    err = iface.delete_char(from, 1, res);
+    if(err || res != R502_ok) return err;
+    scores[to] = scores[from];
+    scores[from] = 0;
+    stats.moves++;
+    moved(from, to, false);
+    return ESP_OK;
+}
+
+esp_err_t R502SearchPlanner::swap(uint16_t a, uint16_t b, moved_cb_t moved,
+    R502_conf_code_t &res)
+{
+    esp_err_t err = iface.load_char(R502_char_buffer_1, a, res);
+    if(err || res != R502_ok) return err;
+    err = iface.load_char(R502_char_buffer_2, b, res);
+    if(err || res != R502_ok) return err;
+    err = iface.store(R502_char_buffer_1, b, res);
+    if(err || res != R502_ok) return err;
+    err = iface.store(R502_char_buffer_2, a, res);
+    if(err || res != R502_ok){
+        ESP_LOGE(TAG, "template of page %d only in character buffer 2", b);
+        return err;
+    }
+    std::swap(scores[a], scores[b]);
+    stats.moves += 2;
+    moved(a, b, true);
+    return ESP_OK;
+}
+
+int R502SearchPlanner::free_page_from(uint16_t first) const
+{
+    const R502TemplateIndex &index = iface.get_template_index();
+    for(int page = first; page < (int)scores.size(); page++){
+        if(!index.is_used(page)) return page;
+    }
+    return -1;
+}
+
+void R502SearchPlanner::tick()
+{
+    weight *= growth;
+    if(weight < max_weight) return;
+    for(float &score : scores){
+        score /= weight;
+    }
+    total /= weight;
+    weight = 1;
+}
@@ -0,0 +1,421 @@
+#include "R502TemplateArchive.hpp"
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+
+const char *R502TemplateArchive::TAG = "R502Archive";
+
+static void put_be(uint8_t *out, uint64_t value, int bytes)
+{
+    for(int i = bytes - 1; i >= 0; i--){
+        out[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be(const uint8_t *in, int bytes)
+{
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++){
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+esp_err_t R502TemplateArchive::open()
+{
+    opened = false;
+    blobs.clear();
+    slots.clear();
+
+    size_t total = size();
+    if(total == 0){
+        const uint8_t header[header_size] = {'R', 'T', 'A', format_version};
+        esp_err_t err = append(header, header_size);
+        if(err) return err;
+        opened = true;
+        return ESP_OK;
+    }
+
+    uint8_t header[header_size];
+    esp_err_t err = read_at(0, header, header_size);
+    if(err == ESP_ERR_INVALID_SIZE) return ESP_ERR_INVALID_VERSION;
+    if(err) return err;
+    if(memcmp(header, "RTA", 3) != 0 || header[3] != format_version){
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    // Only the headers are read, blobs are skipped over
+    size_t offset = header_size;
+    while(offset < total){
+        uint8_t record[slot_record_size];
+        err = read_at(offset, record, 1);
+        if(err) return err;
+        size_t record_size = 0;
+        size_t checked = 0;
+        if(record[0] == 'B'){
+            record_size = blob_record_size;
+            checked = blob_header_size;
+        }
+        else if(record[0] == 'S'){
+            record_size = slot_record_size;
+            checked = slot_record_size;
+        }
+        else{
+            ESP_LOGE(TAG, "unknown record at %d", (int)offset);
+            return ESP_ERR_INVALID_CRC;
+        }
+        if(offset + record_size > total){
+            ESP_LOGW(TAG, "dropping record cut short at %d", (int)offset);
+            err = truncate(offset);
+            if(err) return err;
+            break;
+        }
+
+        err = read_at(offset, record, checked);
+        if(err) return err;
+        uint16_t crc = get_be(record + checked - 2, 2);
+        if(crc != crc16(record, checked - 2)){
+            ESP_LOGE(TAG, "corrupt record at %d", (int)offset);
+            return ESP_ERR_INVALID_CRC;
+        }
+        if(record[0] == 'B'){
+            blobs.push_back({get_be(record + 1, 8),
+                offset + blob_header_size});
+        }
+        else{
+            index_slot(get_be(record + 1, 4), get_be(record + 5, 2),
+                get_be(record + 7, 8));
+        }
+        offset += record_size;
+    }
+    std::sort(blobs.begin(), blobs.end(),
+        [](const blob_entry_t &a, const blob_entry_t &b){
+            return a.hash < b.hash;
+        });
+    opened = true;
+    return ESP_OK;
+}
+
+esp_err_t R502TemplateArchive::backup(R502Interface &iface,
+    uint32_t module_id, R502_conf_code_t &res, bool full)
+{
+    if(!opened) return ESP_ERR_INVALID_STATE;
+    stats = {};
+    esp_err_t err = iface.sync_template_index(res);
+    if(err || res != R502_ok) return err;
+    const R502TemplateIndex &index = iface.get_template_index();
+
+    R502_char_file_t char_file;
+    for(uint16_t slot = 0; slot < index.capacity(); slot++){
+        stats.slots_checked++;
+        uint64_t known = lookup(module_id, slot);
+        if(!index.is_used(slot)){
+            if(known){
+                stats.slots_deleted++;
+                err = set_slot(module_id, slot, 0);
+                if(err) return err;
+            }
+            continue;
+        }
+        if(known && !full) continue;
+
+        err = iface.load_char(R502_char_buffer_1, slot, res);
+        if(err || res != R502_ok) return err;
+        err = iface.up_char(R502_char_buffer_1, res, char_file);
+        if(err || res != R502_ok) return err;
+        stats.slots_pulled++;
+
+        uint64_t hash = 0;
+        err = put(char_file, hash);
+        if(err) return err;
+        err = set_slot(module_id, slot, hash);
+        if(err) return err;
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502TemplateArchive::restore(R502Interface &iface,
+    uint32_t module_id, uint32_t source_id, R502_conf_code_t &res,
+    bool verify)
+{
+    if(!opened) return ESP_ERR_INVALID_STATE;
+    stats = {};
+    esp_err_t err = iface.sync_template_index(res);
+    if(err || res != R502_ok) return err;
+    const R502TemplateIndex &index = iface.get_template_index();
+
+    // Check the whole library fits before changing anything
+    for(const slot_entry_t &entry : slots){
+        if(entry.module_id == source_id && entry.slot >= index.capacity()){
+            ESP_LOGE(TAG, "slot %d is past the end of the library",
+                entry.slot);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    // The source's slots are copied first, restoring onto the source
+    // records over them as it goes
+    std::vector<slot_entry_t> wanted;
+    for(const slot_entry_t &entry : slots){
+        if(entry.module_id == source_id) wanted.push_back(entry);
+    }
+    std::vector<slot_entry_t>::const_iterator next = wanted.begin();
+
+    R502_char_file_t char_file;
+    for(uint16_t slot = 0; slot < index.capacity(); slot++){
+        stats.slots_checked++;
+        uint64_t want = 0;
+        if(next != wanted.end() && next->slot == slot){
+            want = next->hash;
+            next++;
+        }
+        bool used = index.is_used(slot);
+        // An occupied slot the archive knows nothing of is overwritten
+        uint64_t have = used ? lookup(module_id, slot) : 0;
+
+        if(!want){
+            if(!used) continue;
+            err = iface.delete_char(slot, 1, res);
+            if(err || res != R502_ok) return err;
+            stats.slots_deleted++;
+            err = set_slot(module_id, slot, 0);
+            if(err) return err;
+            continue;
+        }
+        if(used && verify){
+            // What the module holds, the record may be stale or, when
+            // restoring onto the source, the very template wanted
+            err = iface.load_char(R502_char_buffer_1, slot, res);
+            if(err || res != R502_ok) return err;
+            err = iface.up_char(R502_char_buffer_1, res, char_file);
+            if(err || res != R502_ok) return err;
+            stats.slots_pulled++;
+            have = content_hash(char_file);
+        }
+        if(used && have == want){
+            err = set_slot(module_id, slot, want);
+            if(err) return err;
+            continue;
+        }
+
+        err = get(want, char_file);
+        if(err) return err;
+        err = iface.down_char(R502_char_buffer_1, char_file, res);
+        if(err || res != R502_ok) return err;
+        err = iface.store(R502_char_buffer_1, slot, res);
+        if(err || res != R502_ok) return err;
+        stats.slots_pushed++;
+        err = set_slot(module_id, slot, want);
+        if(err) return err;
+    }
+    return ESP_OK;
+}
+
+esp_err_t R502TemplateArchive::put(const R502_char_file_t &char_file,
+    uint64_t &hash)
+{
+    if(!opened) return ESP_ERR_INVALID_STATE;
+    hash = content_hash(char_file);
+    std::vector<blob_entry_t>::const_iterator it = find_blob(hash);
+    if(it != blobs.end() && it->hash == hash){
+        // Make sure it's the same template, not just the same hash
+        R502_char_file_t stored;
+        esp_err_t err = read_at(it->offset, stored.data(), stored.size());
+        if(err) return err;
+        if(stored != char_file){
+            ESP_LOGE(TAG, "another template has hash %016llx",
+                (unsigned long long)hash);
+            return ESP_ERR_INVALID_CRC;
+        }
+        return ESP_OK;
+    }
+
+    // One append, so a crash leaves at most a record cut short
+    uint8_t record[blob_record_size];
+    record[0] = 'B';
+    put_be(record + 1, hash, 8);
+    put_be(record + 9, crc16(record, 9), 2);
+    memcpy(record + blob_header_size, char_file.data(), char_file.size());
+    size_t offset = size();
+    esp_err_t err = append(record, blob_record_size);
+    if(err) return err;
+
+    blob_entry_t entry = {hash, offset + blob_header_size};
+    blobs.insert(blobs.begin() + (it - blobs.begin()), entry);
+    stats.blobs_added++;
+    return ESP_OK;
+}
+
+esp_err_t R502TemplateArchive::get(uint64_t hash, R502_char_file_t &char_file)
+{
+    if(!opened) return ESP_ERR_INVALID_STATE;
+    std::vector<blob_entry_t>::const_iterator it = find_blob(hash);
+    if(it == blobs.end() || it->hash != hash) return ESP_ERR_NOT_FOUND;
+    esp_err_t err = read_at(it->offset, char_file.data(), char_file.size());
+    if(err) return err;
+    if(content_hash(char_file) != hash){
+        ESP_LOGE(TAG, "template %016llx is corrupt",
+            (unsigned long long)hash);
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+uint64_t R502TemplateArchive::lookup(uint32_t module_id, uint16_t slot) const
+{
+    std::vector<slot_entry_t>::const_iterator it = find_slot(module_id, slot);
+    if(it == slots.end() || it->module_id != module_id || it->slot != slot){
+        return 0;
+    }
+    return it->hash;
+}
+
+size_t R502TemplateArchive::slot_count(uint32_t module_id) const
+{
+    size_t count = 0;
+    for(std::vector<slot_entry_t>::const_iterator it =
+        find_slot(module_id, 0);
+        it != slots.end() && it->module_id == module_id; it++)
+    {
+        count++;
+    }
+    return count;
+}
+
+uint64_t R502TemplateArchive::content_hash(const R502_char_file_t &char_file)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(uint8_t byte : char_file){
+        hash ^= byte;
+        hash *= 0x100000001b3ULL;
+    }
+    // 0 stands for an empty slot
+    return hash ? hash : 1;
+}
+
+esp_err_t R502TemplateArchive::set_slot(uint32_t module_id, uint16_t slot,
+    uint64_t hash)
+{
+    if(lookup(module_id, slot) == hash) return ESP_OK;
+
+    uint8_t record[slot_record_size];
+    record[0] = 'S';
+    put_be(record + 1, module_id, 4);
+    put_be(record + 5, slot, 2);
+    put_be(record + 7, hash, 8);
+    put_be(record + 15, crc16(record, 15), 2);
+    esp_err_t err = append(record, slot_record_size);
+    if(err) return err;
+    index_slot(module_id, slot, hash);
+    return ESP_OK;
+}
+
+void R502TemplateArchive::index_slot(uint32_t module_id, uint16_t slot,
+    uint64_t hash)
+{
+    std::vector<slot_entry_t>::const_iterator it = find_slot(module_id, slot);
+    std::vector<slot_entry_t>::iterator pos =
+        slots.begin() + (it - slots.begin());
+    bool found = pos != slots.end() && pos->module_id == module_id &&
+        pos->slot == slot;
+    if(!found){
+        if(hash) slots.insert(pos, {module_id, slot, hash});
+    }
+    else if(hash){
+        pos->hash = hash;
+    }
+    else{
+        slots.erase(pos);
+    }
+}
+
+std::vector<R502TemplateArchive::blob_entry_t>::const_iterator
+    R502TemplateArchive::find_blob(uint64_t hash) const
+{
+    std::vector<blob_entry_t>::const_iterator it = std::lower_bound(
+        blobs.begin(), blobs.end(), hash,
+        [](const blob_entry_t &entry, uint64_t value){
+            return entry.hash < value;
+        });
+    // First entry not below hash, put inserts there if it's another hash
+    return it;
+}
+
+std::vector<R502TemplateArchive::slot_entry_t>::const_iterator
+    R502TemplateArchive::find_slot(uint32_t module_id, uint16_t slot) const
+{
+    // First entry at or after (module_id, slot)
+    return std::lower_bound(slots.begin(), slots.end(),
+        ((uint64_t)module_id << 16) | slot,
+        [](const slot_entry_t &entry, uint64_t key){
+            return (((uint64_t)entry.module_id << 16) | entry.slot) < key;
+        });
+}
+
+uint16_t R502TemplateArchive::crc16(const uint8_t *data, size_t len)
+{
+    // CRC16-CCITT, as the notepad store uses
+    uint16_t crc = 0xffff;
+    for(size_t i = 0; i < len; i++){
+        crc ^= data[i] << 8;
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+R502FileTemplateArchive::R502FileTemplateArchive(const char *_path) :
+    path(_path)
+{
+}
+
+R502FileTemplateArchive::~R502FileTemplateArchive()
+{
+    if(file) fclose(file);
+}
+
+esp_err_t R502FileTemplateArchive::read_at(size_t offset, uint8_t *data,
+    size_t len)
+{
+    FILE *f = get_file();
+    if(!f) return ESP_FAIL;
+    if(fseek(f, offset, SEEK_SET) != 0) return ESP_FAIL;
+    if(fread(data, 1, len, f) != len) return ESP_ERR_INVALID_SIZE;
+    return ESP_OK;
+}
+
+esp_err_t R502FileTemplateArchive::append(const uint8_t *data, size_t len)
+{
+    FILE *f = get_file();
+    if(!f) return ESP_FAIL;
+    if(fseek(f, 0, SEEK_END) != 0) return ESP_FAIL;
+    size_t written = fwrite(data, 1, len, f);
+    if(fflush(f) != 0 || written != len) return ESP_FAIL;
+    return ESP_OK;
+}
+
+size_t R502FileTemplateArchive::size()
+{
+    FILE *f = get_file();
+    if(!f || fseek(f, 0, SEEK_END) != 0) return 0;
+    long end = ftell(f);
+    return end < 0 ? 0 : end;
+}
+
+esp_err_t R502FileTemplateArchive::truncate(size_t new_size)
+{
+    FILE *f = get_file();
+    if(!f || fflush(f) != 0) return ESP_FAIL;
+    if(ftruncate(fileno(f), new_size) != 0) return ESP_FAIL;
+    return ESP_OK;
+}
+
+FILE *R502FileTemplateArchive::get_file()
+{
+    if(!file) file = fopen(path, "r+b");
+    if(!file) file = fopen(path, "w+b");
+    return file;
+}
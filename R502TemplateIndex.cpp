@@ -0,0 +1,157 @@
+#include "R502TemplateIndex.hpp"
+
+static_assert(R502TemplateIndex::max_capacity <= 32 * 32,
+    "free_summary must have one bit per bitmap word");
+
+void R502TemplateIndex::reset(uint16_t _capacity)
+{
+    cap = _capacity > max_capacity ? max_capacity : _capacity;
+    used.fill(0);
+    free_summary = 0;
+    for(int word = 0; word < word_count; word++){
+        update_summary(word);
+    }
+    synced = false;
+}
+
+void R502TemplateIndex::load_page(uint8_t index_page,
+    const std::array<uint8_t, R502_index_table_len> &table)
+{
+    if(index_page >= R502_index_table_pages) return;
+
+    // bit 0 of byte 0 is the first template of the page
+    int first_word = index_page * R502_index_table_len * 8 / word_bits;
+    for(int i = 0; i < R502_index_table_len / 4; i++){
+        int word = first_word + i;
+        used[word] = table[i*4] | (table[i*4+1] << 8) |
+            (table[i*4+2] << 16) | ((uint32_t)table[i*4+3] << 24);
+        // ignore anything the module reports past the library size
+        used[word] &= ~out_of_range_mask(word);
+        update_summary(word);
+    }
+}
+
+void R502TemplateIndex::mark_synced()
+{
+    synced = true;
+}
+
+void R502TemplateIndex::invalidate()
+{
+    synced = false;
+}
+
+bool R502TemplateIndex::is_synced() const
+{
+    return synced;
+}
+
+void R502TemplateIndex::mark_used(uint16_t page_id)
+{
+    if(page_id >= cap) return;
+    int word = page_id / word_bits;
+    used[word] |= 1u << (page_id % word_bits);
+    update_summary(word);
+}
+
+void R502TemplateIndex::mark_free(uint16_t page_id, uint16_t count)
+{
+    int end = page_id + count;
+    if(end > cap) end = cap;
+    for(int id = page_id; id < end; id++){
+        used[id / word_bits] &= ~(1u << (id % word_bits));
+    }
+    for(int word = page_id / word_bits; word * word_bits < end; word++){
+        update_summary(word);
+    }
+}
+
+void R502TemplateIndex::clear()
+{
+    bool was_synced = synced;
+    reset(cap);
+    synced = was_synced;
+}
+
+bool R502TemplateIndex::is_used(uint16_t page_id) const
+{
+    if(page_id >= cap) return false;
+    return used[page_id / word_bits] & (1u << (page_id % word_bits));
+}
+
+int R502TemplateIndex::find_free() const
+{
+    if(free_summary == 0) return -1;
+    int word = __builtin_ctz(free_summary);
+    uint32_t free_bits = ~(used[word] | out_of_range_mask(word));
+    return word * word_bits + __builtin_ctz(free_bits);
+}
+
+int R502TemplateIndex::allocate()
+{
+    int page_id = find_free();
+    if(page_id >= 0){
+        mark_used(page_id);
+    }
+    return page_id;
+}
+
+uint16_t R502TemplateIndex::capacity() const
+{
+    return cap;
+}
+
+uint16_t R502TemplateIndex::used_count() const
+{
+    int total = 0;
+    for(int word = 0; word < word_count; word++){
+        total += __builtin_popcount(used[word]);
+    }
+    return total;
+}
+
+uint16_t R502TemplateIndex::free_count() const
+{
+    return cap - used_count();
+}
+
+uint16_t R502TemplateIndex::used_in_range(uint16_t page_id,
+    uint16_t count) const
+{
+    int end = page_id + count;
+    if(end > cap) end = cap;
+    if(page_id >= end) return 0;
+
+    int first_word = page_id / word_bits;
+    int last_word = (end - 1) / word_bits;
+    int total = 0;
+    for(int word = first_word; word <= last_word; word++){
+        uint32_t bits = used[word];
+        if(word == first_word){
+            bits &= ~0u << (page_id % word_bits);
+        }
+        if(word == last_word && end % word_bits){
+            bits &= ~(~0u << (end % word_bits));
+        }
+        total += __builtin_popcount(bits);
+    }
+    return total;
+}
+
+uint32_t R502TemplateIndex::out_of_range_mask(int word) const
+{
+    int first_id = word * word_bits;
+    if(first_id >= cap) return ~0u;
+    if(first_id + word_bits <= cap) return 0;
+    return ~0u << (cap - first_id);
+}
+
+void R502TemplateIndex::update_summary(int word)
+{
+    if((used[word] | out_of_range_mask(word)) != ~0u){
+        free_summary |= 1u << word;
+    }
+    else{
+        free_summary &= ~(1u << word);
+    }
+}
@@ -0,0 +1,125 @@
+#include "R502TimeoutModel.hpp"
+#include <algorithm>
+
+R502TimeoutModel::R502TimeoutModel()
+{
+    reset();
+}
+
+int R502TimeoutModel::timeout_ms(uint8_t instr_code, int tx_bytes,
+    int rx_bytes, R502_baud_t baud) const
+{
+    int floor_ms = 0;
+    int ceiling_ms = 0;
+    get_allowance(instr_code, floor_ms, ceiling_ms);
+
+    int64_t allowance_us = (int64_t)ceiling_ms * 1000;
+    const R502_latency_stats_t &s = stats[slot(instr_code)];
+    if(s.samples >= min_samples){
+        int64_t envelope_us = (int64_t)s.smoothed_us + 4 * s.variation_us;
+        envelope_us = std::max<int64_t>(envelope_us, (int64_t)floor_ms * 1000);
+        // Past the ceiling after at most 16 doublings of a floor of 10ms
+        envelope_us <<= std::min<uint32_t>(s.backoff, 16);
+        allowance_us = std::min<int64_t>(allowance_us, envelope_us);
+    }
+
+    int64_t total_us = wire_time_us(tx_bytes + rx_bytes, baud) + allowance_us;
+    // round up, a timeout of 0 would never wait
+    return (total_us + 999) / 1000;
+}
+
+void R502TimeoutModel::record(uint8_t instr_code, int64_t elapsed_us,
+    int tx_bytes, int rx_bytes, R502_baud_t baud)
+{
+    int64_t latency = elapsed_us - wire_time_us(tx_bytes + rx_bytes, baud);
+    int32_t latency_us = (int32_t)std::max<int64_t>(latency, 0);
+
+    R502_latency_stats_t &s = stats[slot(instr_code)];
+    if(s.samples == 0){
+        s.smoothed_us = latency_us;
+        s.variation_us = latency_us / 2;
+    }
+    else{
+        int32_t deviation = latency_us - s.smoothed_us;
+        if(deviation < 0) deviation = -deviation;
+        s.variation_us += (deviation - s.variation_us) / 4;
+        s.smoothed_us += (latency_us - s.smoothed_us) / 8;
+    }
+    s.samples++;
+    s.backoff = 0;
+    s.last_us = latency_us;
+    s.max_us = std::max(s.max_us, latency_us);
+}
+
+void R502TimeoutModel::record_timeout(uint8_t instr_code)
+{
+    // back off, the next wait is twice as long up to the ceiling
+    R502_latency_stats_t &s = stats[slot(instr_code)];
+    s.timeouts++;
+    s.backoff++;
+}
+
+const R502_latency_stats_t &R502TimeoutModel::get_stats(
+    uint8_t instr_code) const
+{
+    return stats[slot(instr_code)];
+}
+
+void R502TimeoutModel::get_allowance(uint8_t instr_code, int &floor_ms,
+    int &ceiling_ms) const
+{
+    switch(instr_code){
+        case R502_ic_gen_img:
+            // much quicker without a finger than with one
+            floor_ms = 600;
+            ceiling_ms = 2000;
+            break;
+        case R502_ic_search:
+        case R502_ic_empty:
+            floor_ms = 300;
+            ceiling_ms = 1500;
+            break;
+        case R502_ic_img_2_tz:
+        case R502_ic_reg_model:
+        case R502_ic_store:
+        case R502_ic_delet_char:
+            floor_ms = 100;
+            ceiling_ms = 1000;
+            break;
+        case R502_ic_match:
+        case R502_ic_load_char:
+        case R502_ic_up_char:
+        case R502_ic_down_char:
+        case R502_ic_up_image:
+        case R502_ic_down_image:
+        case R502_ic_write_notepad:
+            floor_ms = 50;
+            ceiling_ms = 500;
+            break;
+        case data_package_key:
+            // packages of a transfer follow each other closely
+            floor_ms = 10;
+            ceiling_ms = 200;
+            break;
+        default:
+            floor_ms = 20;
+            ceiling_ms = 200;
+            break;
+    }
+}
+
+void R502TimeoutModel::reset()
+{
+    stats.fill(R502_latency_stats_t{0, 0, 0, 0, 0, 0, 0});
+}
+
+int64_t R502TimeoutModel::wire_time_us(int bytes, R502_baud_t baud)
+{
+    return (int64_t)bytes * 10 * 1000000 / (9600 * (int)baud);
+}
+
+int R502TimeoutModel::slot(uint8_t instr_code) const
+{
+    // anything unknown shares the last slot
+    return instr_code < table_size ? instr_code : table_size;
+}
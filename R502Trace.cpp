@@ -0,0 +1,65 @@
+#include "R502Trace.hpp"
+#include <stdio.h>
+#include <atomic>
+#include "esp_timer.h"
+
+// Only linked in when something records, so a build without R502_TRACE
+// doesn't pay for the buffer
+static R502_trace_record_t records[R502_TRACE_RECORDS];
+// Counts every record ever written, the slot is head % R502_TRACE_RECORDS
+static std::atomic<uint32_t> head(0);
+static uint32_t tail = 0;
+static uint32_t overwritten = 0;
+
+void R502BufferTrace::record(R502_trace_event_t event, uint8_t code,
+    uint16_t arg)
+{
+    uint32_t i = head.fetch_add(1, std::memory_order_relaxed);
+    R502_trace_record_t &rec = records[i % R502_TRACE_RECORDS];
+    rec.time_us = (uint32_t)esp_timer_get_time();
+    rec.event = event;
+    rec.code = code;
+    rec.arg = arg;
+}
+
+size_t R502BufferTrace::read(R502_trace_record_t *out, size_t max)
+{
+    uint32_t end = head.load(std::memory_order_acquire);
+    if(end - tail > R502_TRACE_RECORDS){
+        overwritten += end - tail - R502_TRACE_RECORDS;
+        tail = end - R502_TRACE_RECORDS;
+    }
+    size_t n = 0;
+    while(tail != end && n < max){
+        out[n++] = records[tail++ % R502_TRACE_RECORDS];
+    }
+    return n;
+}
+
+void R502BufferTrace::dump()
+{
+    // Eight records per line keeps each line under the console's limit
+    R502_trace_record_t batch[8];
+    size_t n;
+    while((n = read(batch, 8)) > 0){
+        printf("R502T:");
+        for(size_t i = 0; i < n; i++){
+            printf("%08x%02x%02x%04x", (unsigned)batch[i].time_us,
+                batch[i].event, batch[i].code, batch[i].arg);
+        }
+        printf("\n");
+    }
+    if(overwritten){
+        printf("R502T dropped %u\n", (unsigned)overwritten);
+    }
+}
+
+uint32_t R502BufferTrace::dropped()
+{
+    return overwritten;
+}
+
+void R502BufferTrace::clear()
+{
+    tail = head.load(std::memory_order_acquire);
+}
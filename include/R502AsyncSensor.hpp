@@ -0,0 +1,158 @@
+/**
+ * \file R502AsyncSensor.hpp
+ * \brief Awaitable R502 commands, for composing workflows as coroutines
+ *
+ * Needs a compiler with coroutine support, build with -std=gnu++20
+ * -fcoroutines
+ */
+
+#pragma once
+#include <stdint.h>
+#include <array>
+
+#include "R502Interface.hpp"
+#include "R502Coroutine.hpp"
+
+/**
+ * \brief Result of an awaitable command
+ */
+struct R502_async_result_t {
+    esp_err_t err; //!< See R502Interface::vfy_pass for all possible values
+    R502_conf_code_t conf_code; //!< Confirmation code, if err is ESP_OK
+};
+
+/**
+ * \brief Result of an awaitable search
+ */
+struct R502_async_search_t {
+    esp_err_t err; //!< See R502Interface::vfy_pass for all possible values
+    R502_conf_code_t conf_code; //!< Confirmation code, if err is ESP_OK
+    uint16_t page_id; //!< Library position of the match
+    uint16_t match_score; //!< How closely it matched
+};
+
+/**
+ * \brief R502AsyncLink over the uart and irq pin of an initialized
+ * R502Interface
+ *
+ * Taking the link takes the interface's bus mutex, so blocking commands from
+ * other tasks wait for the exchange in progress, and the other way round
+ */
+class R502UartLink : public R502AsyncLink {
+public:
+    R502UartLink(R502Interface &_iface);
+
+    esp_err_t write(const uint8_t *data, size_t len) override;
+    size_t available() override;
+    int read(uint8_t *data, size_t len) override;
+    void discard() override;
+    bool take_irq() override;
+    bool try_acquire() override;
+    void release() override;
+    QueueHandle_t rx_events() override;
+    bool wake_on_irq(SemaphoreHandle_t wake) override;
+
+private:
+    R502Interface &iface;
+    int irq_seen;
+    bool held = false;
+};
+
+/**
+ * \brief Awaitable versions of the R502Interface commands
+ *
+ * Each command sends its package and suspends until the acknowledgement is
+ * in, instead of blocking the task, so a capture, extract, search, store
+ * sequence reads as straight-line code while the scheduler runs other
+ * workflows in between:
+ *
+ *     R502Task<void> enroll(R502AsyncSensor &sensor, uint16_t page_id)
+ *     {
+ *         if(co_await sensor.wait_for_finger(5000)) co_return;
+ *         R502_async_result_t res = co_await sensor.gen_image();
+ *         if(res.err || res.conf_code != R502_ok) co_return;
+ *         res = co_await sensor.img_2_tz(R502_char_buffer_1);
+ *         ...
+ *     }
+ *     scheduler.spawn(enroll(sensor, 3));
+ *     scheduler.run();
+ *
+ * Timeouts come from the interface's timeout model, as for the blocking
+ * commands. Failed exchanges aren't retried, the result says why
+ */
+class R502AsyncSensor {
+public:
+    /**
+     * \param _scheduler Scheduler every workflow using the sensor runs on
+     * \param _iface Interface that builds and checks the packages, its
+     * module address and timeout model are used
+     * \param _link Link to the module, must outlive the sensor
+     */
+    R502AsyncSensor(R502Scheduler &_scheduler, R502Interface &_iface,
+        R502AsyncLink &_link);
+
+    /**
+     * \brief Wait for the touch irq
+     * \retval ESP_OK: a finger touched the sensor
+     *         ESP_ERR_TIMEOUT: no touch within timeout_ms
+     */
+    R502Task<esp_err_t> wait_for_finger(int timeout_ms);
+
+    /**
+     * \brief Awaitable R502Interface::gen_image
+     */
+    R502Task<R502_async_result_t> gen_image();
+
+    /**
+     * \brief Awaitable R502Interface::img_2_tz
+     */
+    R502Task<R502_async_result_t> img_2_tz(R502_char_buffer_t buffer_id);
+
+    /**
+     * \brief Awaitable R502Interface::search
+     */
+    R502Task<R502_async_search_t> search(R502_char_buffer_t buffer_id,
+        uint16_t start_page, uint16_t page_num);
+
+    /**
+     * \brief Awaitable R502Interface::store, updates the interface's template
+     * index the same way
+     */
+    R502Task<R502_async_result_t> store(R502_char_buffer_t buffer_id,
+        uint16_t page_id);
+
+    /**
+     * \brief Awaitable R502Interface::template_num
+     */
+    R502Task<R502_async_result_t> template_num(uint16_t &template_num);
+
+    /**
+     * \brief Send a filled command package and wait for its acknowledgement
+     * \param pkg Package to send
+     * \param receive_pkg OUT package to read the response into
+     * \param data_rec_length number of data bytes to receive
+     * \retval See R502Interface::vfy_pass for all possible return values
+     */
+    R502Task<esp_err_t> exchange(R502_DataPkg_t pkg,
+        R502_DataPkg_t &receive_pkg, int data_rec_length);
+
+    R502Scheduler &get_scheduler();
+
+private:
+    /**
+     * \brief Receive a package, see R502Interface::receive_package
+     */
+    R502Task<esp_err_t> receive(R502_DataPkg_t &rec_pkg, int data_length,
+        int64_t deadline_us);
+
+    /**
+     * \brief Send a command with a general acknowledgement
+     */
+    R502Task<R502_async_result_t> general_command(R502_DataPkg_t pkg);
+
+    static const char *TAG;
+
+    R502Scheduler &scheduler;
+    R502Interface &iface;
+    R502AsyncLink &link;
+};
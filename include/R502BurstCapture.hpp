@@ -0,0 +1,145 @@
+/**
+ * \file R502BurstCapture.hpp
+ * \brief Several captures while the finger is down, keeping only the best
+ */
+
+#pragma once
+#include "R502Interface.hpp"
+#include "R502ImageBatch.hpp"
+
+/**
+ * \brief How a burst scores its candidates
+ */
+typedef enum {
+    /// img_2_tz each capture, ending at the first the module extracts.
+    /// Cheap, one command per candidate, but the module only passes or
+    /// fails an extraction, so any that passes is as good as it can tell
+    R502_burst_extract,
+    /// Upload each capture and score it with R502ImageBatch's quality,
+    /// keeping the best image on the host. A whole upload per candidate
+    R502_burst_image,
+} R502_burst_mode_t;
+
+/**
+ * \brief What a burst does, and how long it may take
+ */
+struct R502_burst_config_t {
+    R502_burst_mode_t mode;
+    /// The whole burst, including the final extraction, ends within this
+    int budget_ms;
+    /// Most captures to take with a finger on the sensor
+    int max_captures;
+    /// R502_burst_image: stop at the first image at least this good, 0 to
+    /// 100. Above 100 always uses the whole budget
+    uint8_t target_quality;
+    /// R502_burst_image: extract the best image into buffer, downloading it
+    /// back to the module if a later capture replaced it
+    bool extract_best;
+    /// Character buffer the best candidate is extracted into
+    R502_char_buffer_t buffer;
+};
+
+/**
+ * \brief How a burst went
+ */
+struct R502_burst_result_t {
+    int captures; //!< gen_image calls that found a finger
+    int rejected; //!< Captures that failed, or that the module couldn't use
+    int best; //!< Capture chosen, counted from 0, -1 if none was usable
+    /// Quality of the best, 100 for an extraction that passed
+    uint8_t best_quality;
+    /// Confirmation code of the best's extraction, or of the last failure
+    R502_conf_code_t res;
+    bool finger_lifted; //!< The burst ended with no finger on the sensor
+    int64_t elapsed_us;
+};
+
+/**
+ * \brief Takes captures in a burst while the finger stays down, so one
+ * badly placed or smudged capture doesn't make the user lift and retouch
+ *
+ * Call run once a finger is detected, e.g. after wait_for_touch or a
+ * gen_image that found one. Each capture is scored as it's taken, and only
+ * the best goes on to extraction, or stays on the host for the application
+ * to use. A capture is only started if the slowest one so far still fits in
+ * what's left of the budget, with room for downloading and extracting the
+ * best image when that is to be done at the end. Before the first capture
+ * the timeout model's learned latencies, or its floors, and the wire time at
+ * the current baud rate stand in for a measured one, so a budget too short
+ * for even one capture takes none.
+ *
+ * Image mode needs two packed images and an R502ImageBatch arena, about
+ * 75KB, which run allocates once, in PSRAM when there is some
+ */
+class R502BurstCapture {
+public:
+    /**
+     * \param _iface Interface to the module, must be initialized before run
+     */
+    R502BurstCapture(R502Interface &_iface) : iface(_iface) {}
+    ~R502BurstCapture();
+
+    /**
+     * \brief Capture until a candidate is good enough, the finger is
+     * lifted, or the budget or captures run out
+     * \param config What to do
+     * \param result OUT how it went
+     * \retval ESP_OK: The burst ran, result.best is the candidate chosen or
+     *         -1 if none was usable, or the budget had no room for one
+     *         ESP_ERR_INVALID_ARG: budget_ms or max_captures isn't positive
+     *         ESP_ERR_NO_MEM: Couldn't allocate the image mode buffers
+     *         See vfy_pass for all other return values, the burst stopped
+     *         at a link error
+     */
+    esp_err_t run(const R502_burst_config_t &config,
+        R502_burst_result_t &result);
+
+    /**
+     * \brief The best image of the last image mode burst, packed as up_image
+     * receives it. Empty if there was none
+     */
+    R502ByteSpan best_image() const;
+
+    /**
+     * \brief Measurements of the best image of the last image mode burst
+     */
+    const R502_image_stats_t &best_stats() const { return stats; }
+
+private:
+    static const size_t image_capacity = R502_image_size / 2;
+
+    /**
+     * \brief Upload and score one capture in image mode, keeping it if it's
+     * the best
+     * \param usable OUT whether the image could be scored
+     */
+    esp_err_t score_image(R502_burst_result_t &result, bool &usable);
+
+    /**
+     * \brief Estimate a capture, and the extraction at the end of an image
+     * mode burst, from the timeout model and the link
+     * \param capture_us OUT one capture, scored
+     * \param finish_us OUT downloading and extracting the best image, 0 if
+     * the burst doesn't
+     */
+    void estimate(const R502_burst_config_t &config, int64_t &capture_us,
+        int64_t &finish_us);
+
+    /**
+     * \brief Learned processing time of an instruction, or its floor
+     */
+    int64_t latency_us(uint8_t instr_code);
+
+    /**
+     * \brief Allocate images and arena, if they aren't yet
+     */
+    bool allocate();
+
+    R502Interface &iface;
+    uint8_t *images[2] = {};
+    size_t image_bytes[2] = {};
+    int best_index = 0; // of images, the other is filled next
+    bool have_best = false;
+    uint8_t *arena = nullptr;
+    R502_image_stats_t stats = {};
+};
@@ -0,0 +1,157 @@
+/**
+ * \file R502Bus.hpp
+ * \brief Several modules on one uart, told apart by their addresses
+ */
+
+#pragma once
+#include <stdint.h>
+#include <array>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "R502Interface.hpp"
+
+/**
+ * \brief Link counters of one module on a bus
+ */
+struct R502_bus_stats_t {
+    uint32_t exchanges; //!< Command and acknowledgement exchanges attempted
+    uint32_t failures; //!< Exchanges that ended in an error
+    uint32_t timeouts; //!< Failures where nothing came back at all
+    /// Packages from this module that arrived while another module's
+    /// response was awaited, e.g. a reply after its exchange timed out
+    uint32_t stray_packages;
+    int64_t total_us; //!< Command sent to acknowledgement received, summed
+                      //!< over successful exchanges
+    int64_t max_us; //!< Slowest successful exchange
+};
+
+/**
+ * \brief One uart shared by modules with different addresses
+ *
+ * Wire the modules' tx lines so they can share the host's rx pin, e.g. open
+ * drain with a pull up, and run them all at the same baud rate. Each module
+ * gets its own R502Interface, added to the bus with a unique address. From
+ * then on it's used like any other interface, only enter_idle and
+ * set_baud_rate aren't supported.
+ *
+ * The modules share one rx line, so exchanges take turns on the bus mutex
+ * rather than overlapping. Whichever interface is receiving parses every
+ * package on the line and routes it by its address field. Its own are
+ * returned, another module's are counted against that module as stray and
+ * dropped, so a late reply is never taken as the reply of the next module
+ * asked. For a request queue per module, give each interface its own
+ * R502CommandScheduler.
+ *
+ * The coroutine API's R502UartLink reads the uart directly, don't use it on
+ * a bus
+ */
+class R502Bus {
+public:
+    static const int max_modules = 8;
+    /// Address every module answers to until it's given another
+    static const std::array<uint8_t, 4> default_adder;
+
+    R502Bus() {}
+    ~R502Bus();
+
+    /**
+     * \brief Configure the uart the modules share
+     * \param _uart_num The uart hardware port to use for communication
+     * \param _pin_txd Pin to transmit to the modules
+     * \param _pin_rxd Pin to receive from the modules
+     * \param _baud Baud rate every module on the bus is set to
+     * \retval ESP_OK: successful
+     *         ESP_ERR_NO_MEM: Couldn't create the mutexes
+     *         Any error from configuring the uart
+     */
+    esp_err_t init(uart_port_t _uart_num, gpio_num_t _pin_txd,
+        gpio_num_t _pin_rxd, R502_baud_t _baud = R502_baud_57600);
+
+    /**
+     * \brief Deinitialize every module still on the bus, then free the uart
+     */
+    esp_err_t deinit();
+
+    /**
+     * \brief Initialize module as the bus's module at address
+     * \param module An interface that isn't initialized
+     * \param address Unique address of the module on this bus
+     * \param pin_irq Pin to receive the module's interrupt requests on
+     * \retval ESP_OK: successful, the module answered at address
+     *         ESP_ERR_INVALID_STATE: The bus or module is already in use
+     *         ESP_ERR_INVALID_ARG: Another module on the bus has address
+     *         ESP_ERR_NO_MEM: The bus is full
+     *         ESP_ERR_NOT_FOUND: No module answered
+     *         Any error from configuring pin_irq or from set_adder
+     *
+     * A module that doesn't answer at address is looked for at
+     * default_adder and given address. Every module answering at
+     * default_adder takes it, so power them up one at a time, adding each
+     * before switching on the next. Once given, the address is kept by the
+     * module across power cycles
+     */
+    esp_err_t add(R502Interface &module, const std::array<uint8_t, 4> &address,
+        gpio_num_t pin_irq);
+
+    /**
+     * \brief Number of modules on the bus
+     */
+    int size() const { return count; }
+
+    /**
+     * \brief Link counters of module, all zero if it isn't on the bus
+     */
+    R502_bus_stats_t get_stats(const R502Interface &module) const;
+
+    /**
+     * \brief Packages from an address no module on the bus has, or whose
+     * checksum failed so the address can't be trusted
+     */
+    uint32_t get_unrouted() const { return unrouted; }
+
+private:
+    friend class R502Interface;
+    static const char *TAG;
+
+    /**
+     * \brief Position of the module with address adder, or -1
+     */
+    int find(const uint8_t adder[4]) const;
+
+    /**
+     * \brief Count a package that arrived for another module than the one
+     * receiving
+     * \param adder Address in the package's header
+     * \param valid Whether the package's checksum matched
+     */
+    void route(const uint8_t adder[4], bool valid);
+
+    /**
+     * \brief Count an exchange of module
+     */
+    void record(const R502Interface &module, esp_err_t err,
+        int64_t elapsed_us);
+
+    /**
+     * \brief Take module off the bus, from its deinit
+     */
+    void remove(R502Interface &module);
+
+    bool initialized = false;
+    uart_port_t uart_num;
+    gpio_num_t pin_txd;
+    gpio_num_t pin_rxd;
+    R502_baud_t baud = R502_baud_57600;
+    QueueHandle_t uart_queue = nullptr;
+    // Shared by every module as its bus mutex
+    SemaphoreHandle_t mutex = nullptr;
+
+    // Guards modules, stats and count, routing happens with mutex held but
+    // get_stats may be called from anywhere
+    SemaphoreHandle_t stats_mutex = nullptr;
+    R502Interface *modules[max_modules] = {};
+    R502_bus_stats_t stats[max_modules] = {};
+    int count = 0;
+    uint32_t unrouted = 0;
+};
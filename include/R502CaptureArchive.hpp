@@ -0,0 +1,334 @@
+/**
+ * \file R502CaptureArchive.hpp
+ * \brief Indexed archive of captured images, written as they upload and read
+ * in place from a mapping of the file
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <array>
+#include <vector>
+
+#include "R502Interface.hpp"
+
+/**
+ * \brief Start of an archive file
+ */
+struct R502_capture_file_header_t {
+    char magic[4]; //!< 'R' 'C' 'A' 'P'
+    uint16_t version;
+    uint16_t capture_header_size; //!< sizeof(R502_capture_header_t)
+    uint32_t count; //!< Captures in the index
+    uint32_t reserved;
+    /// Where the index starts, 0 while a writer has the archive open
+    uint64_t index_offset;
+    uint64_t reserved2;
+};
+
+/**
+ * \brief Metadata in front of every image in an archive
+ */
+struct R502_capture_header_t {
+    char magic[4]; //!< 'C' 'A' 'P' 'T'
+    /// Header, image and padding, 0 while the image is being written
+    uint32_t record_size;
+    int64_t timestamp_us; //!< Time of capture, as given to the writer
+    uint32_t sequence; //!< Order the writer took the capture in
+    uint8_t adder[4]; //!< Address of the module
+    uint8_t baud; //!< R502_baud_t of the link
+    uint8_t data_len; //!< R502_data_len_t of the link
+    uint8_t format; //!< R502_image_format_t of the image
+    uint8_t reserved0;
+    uint16_t width; //!< pixels
+    uint16_t height; //!< pixels
+    uint32_t bytes; //!< Size of the image
+    uint16_t frames; //!< Data packages it arrived in
+    uint8_t pixel_min; //!< Darkest pixel, as an 8 bit value
+    uint8_t pixel_max; //!< Brightest pixel, as an 8 bit value
+    uint16_t pixel_mean; //!< Mean pixel value, 8.8 fixed point
+    uint16_t pixel_stddev; //!< Standard deviation, 8.8 fixed point
+    uint8_t reserved[20];
+};
+
+/**
+ * \brief One entry of the archive's index
+ */
+struct R502_capture_index_t {
+    int64_t timestamp_us;
+    uint32_t module; //!< Module address, most significant byte first
+    uint32_t sequence;
+    uint64_t offset; //!< Of the capture's header
+};
+
+static_assert(sizeof(R502_capture_file_header_t) == 32,
+    "archive file header layout");
+static_assert(sizeof(R502_capture_header_t) == 64, "capture header layout");
+static_assert(sizeof(R502_capture_index_t) == 24, "index entry layout");
+
+/**
+ * \brief What a capture is recorded with, besides its image
+ */
+struct R502_capture_meta_t {
+    int64_t timestamp_us;
+    R502_link_config_t link;
+    R502_image_format_t format; //!< How the image is stored
+};
+
+/**
+ * \brief A capture read in place, image points into the archive
+ */
+struct R502_capture_view_t {
+    /// nullptr if the index points at something that isn't a capture
+    const R502_capture_header_t *header;
+    R502ByteSpan image;
+};
+
+/**
+ * \brief Positions [first, last) in one of the reader's orders
+ */
+struct R502_capture_range_t {
+    size_t first;
+    size_t last;
+};
+
+/**
+ * \brief Appends captures to an archive, streaming each image from up_image
+ * straight to the backend
+ *
+ * The archive is laid out so it can be read without parsing or copying:
+ *
+ *  Part        | Layout
+ *  ----------- | -----------------------------------------------------------
+ *  File header | R502_capture_file_header_t
+ *  Capture     | R502_capture_header_t, image, zero padding to 8 bytes
+ *  Index       | count R502_capture_index_t by time, count by module and time
+ *
+ * Everything is little endian, as the ESP32 and common hosts are, and 8 byte
+ * aligned so the headers can be used where they're mapped. The index is
+ * written by close. An archive that was closed is reopened by reading its
+ * index and cutting it off, one that wasn't is recovered by walking the
+ * capture headers, dropping a capture cut short.
+ *
+ * A capture's header is written as it begins and completed when it ends,
+ * with the quality stats counted from the frames as they passed. The writer
+ * keeps one index entry, 24 bytes, per capture in RAM until close
+ */
+class R502CaptureArchiveWriter {
+public:
+    virtual ~R502CaptureArchiveWriter() {}
+
+    /**
+     * \brief Start a new archive, or reopen one to append to it
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_VERSION: Not an archive, or another version
+     *         Any error from the backend
+     */
+    esp_err_t open();
+
+    /**
+     * \brief Start a capture, its image follows as frames
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_STATE: Not open, or a capture is in progress
+     *         Any error from the backend
+     */
+    esp_err_t begin(const R502_capture_meta_t &meta);
+
+    /**
+     * \brief Append a frame to the capture in progress, as an up_image
+     * consumer. A failed write is reported by end
+     */
+    void operator()(R502ByteSpan frame);
+
+    /**
+     * \brief Complete the capture in progress
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_STATE: No capture is in progress
+     *         ESP_ERR_INVALID_SIZE: No frames arrived
+     *         Any error from the backend, the capture is dropped
+     */
+    esp_err_t end();
+
+    /**
+     * \brief Drop the capture in progress, if any
+     */
+    esp_err_t cancel();
+
+    /**
+     * \brief Upload the image in img_buffer into the archive
+     * \param iface Interface to the module the image was taken on
+     * \param timestamp_us Time the image was taken
+     * \param format How to store the image
+     * \param res OUT confirmation code
+     * \retval ESP_OK: successful if res is R502_ok, otherwise nothing was
+     *         recorded
+     *         See end and R502Interface::up_image for all other return values
+     */
+    esp_err_t capture(R502Interface &iface, int64_t timestamp_us,
+        R502_image_format_t format, R502_conf_code_t &res);
+
+    /**
+     * \brief Write the index, after which the archive can be read
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_STATE: Not open
+     *         Any error from the backend
+     *
+     * A capture in progress is dropped. Call open to append again
+     */
+    esp_err_t close();
+
+    /**
+     * \brief Captures in the archive
+     */
+    size_t count() const { return index.size(); }
+
+    static const uint16_t format_version = 1;
+    static const size_t alignment = 8;
+
+protected:
+    /**
+     * \brief Read len bytes at offset from the backend
+     * \retval ESP_OK, ESP_ERR_INVALID_SIZE if fewer are stored, or a
+     * backend error
+     */
+    virtual esp_err_t read_at(size_t offset, uint8_t *data, size_t len) = 0;
+
+    /**
+     * \brief Overwrite len bytes at offset, which are already stored. The
+     * data is durable once this returns
+     */
+    virtual esp_err_t write_at(size_t offset, const uint8_t *data,
+        size_t len) = 0;
+
+    /**
+     * \brief Add len bytes at the end of the backend
+     */
+    virtual esp_err_t append(const uint8_t *data, size_t len) = 0;
+
+    /**
+     * \brief Bytes stored in the backend
+     */
+    virtual size_t size() = 0;
+
+    /**
+     * \brief Drop everything stored from new_size on
+     */
+    virtual esp_err_t truncate(size_t new_size) = 0;
+
+private:
+    static const char *TAG;
+
+    /**
+     * \brief Rebuild the index by walking the capture headers from offset,
+     * dropping whatever follows the last complete capture
+     */
+    esp_err_t recover(size_t offset, size_t total);
+
+    /**
+     * \brief Write the file header, with the index at index_offset
+     */
+    esp_err_t write_file_header(uint64_t index_offset);
+
+    bool opened = false;
+    bool capturing = false;
+    esp_err_t capture_err = ESP_OK;
+    size_t end_offset = 0; // of the last complete capture
+    uint32_t next_sequence = 0;
+    R502_capture_header_t current = {};
+    uint32_t histogram[16] = {}; // of the 4 bit pixels of current
+    std::vector<R502_capture_index_t> index; // sorted only when written
+};
+
+/**
+ * \brief Keeps the archive in a file, for hosts or a mounted VFS such as an
+ * SD card
+ */
+class R502FileCaptureArchiveWriter : public R502CaptureArchiveWriter {
+public:
+    /**
+     * \param _path Path of the archive file, created if it doesn't exist
+     */
+    R502FileCaptureArchiveWriter(const char *_path);
+    ~R502FileCaptureArchiveWriter();
+
+protected:
+    esp_err_t read_at(size_t offset, uint8_t *data, size_t len) override;
+    esp_err_t write_at(size_t offset, const uint8_t *data,
+        size_t len) override;
+    esp_err_t append(const uint8_t *data, size_t len) override;
+    size_t size() override;
+    esp_err_t truncate(size_t new_size) override;
+
+private:
+    /**
+     * \brief The open file, opened on first use
+     */
+    FILE *get_file();
+
+    const char *path;
+    FILE *file = nullptr;
+};
+
+/**
+ * \brief Looks up captures in an archive that's mapped into memory, without
+ * copying anything
+ *
+ * On a host, mmap the archive file. On the ESP32, esp_partition_mmap a
+ * partition the archive was copied to, or read it into PSRAM. Only the
+ * headers and index entries looked at are touched, so opening is O(1) and
+ * each lookup is O(log n) however large the archive is. The mapping must
+ * stay valid, and unchanged, while the reader and its views are in use
+ */
+class R502CaptureArchiveReader {
+public:
+    /**
+     * \brief Use the archive at data
+     * \param data Start of the archive, 8 byte aligned
+     * \param size Length of the archive
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_ARG: data isn't aligned
+     *         ESP_ERR_INVALID_VERSION: Not an archive, or another version
+     *         ESP_ERR_INVALID_STATE: The archive wasn't closed, so it has no
+     *         index. Open and close it with a writer to recover it
+     *         ESP_ERR_INVALID_SIZE: The index runs past size
+     */
+    esp_err_t open(const void *data, size_t size);
+
+    /**
+     * \brief Captures in the archive
+     */
+    size_t count() const { return n; }
+
+    /**
+     * \brief Capture at position pos in time order
+     */
+    R502_capture_view_t by_time(size_t pos) const;
+
+    /**
+     * \brief Capture at position pos in order of module, then time
+     */
+    R502_capture_view_t by_module(size_t pos) const;
+
+    /**
+     * \brief Positions in time order of the captures taken in
+     * [from_us, to_us)
+     */
+    R502_capture_range_t time_range(int64_t from_us, int64_t to_us) const;
+
+    /**
+     * \brief Positions in module order of the captures of the module at
+     * adder taken in [from_us, to_us)
+     */
+    R502_capture_range_t module_range(const std::array<uint8_t, 4> &adder,
+        int64_t from_us = INT64_MIN, int64_t to_us = INT64_MAX) const;
+
+private:
+    R502_capture_view_t view(const R502_capture_index_t &entry) const;
+
+    const uint8_t *base = nullptr;
+    size_t length = 0;
+    size_t n = 0;
+    const R502_capture_index_t *time_index = nullptr;
+    const R502_capture_index_t *module_index = nullptr;
+};
@@ -0,0 +1,177 @@
+/**
+ * \file R502CommandBatch.hpp
+ * \brief Commands sent back to back, with their acknowledgements checked
+ * afterwards
+ */
+
+#pragma once
+#include <stdint.h>
+#include <array>
+
+#include "R502Interface.hpp"
+
+/**
+ * \brief Outcome of one command of a batch
+ */
+struct R502_batch_result_t {
+    esp_err_t err; //!< See R502Interface::vfy_pass for all possible values
+    R502_conf_code_t conf_code; //!< Confirmation code, if err is ESP_OK
+};
+
+/**
+ * \brief Where a batch sends its packages and reads the acknowledgements
+ *
+ * R502CommandBatch::execute(int) uses the interface's uart, tests can run a
+ * batch against a simulated module instead
+ */
+class R502BatchPort {
+public:
+    virtual ~R502BatchPort() {}
+
+    /**
+     * \brief Send a finished package
+     * \retval See R502Interface::send_package
+     */
+    virtual esp_err_t send(const R502FrameEncoder &frame) = 0;
+
+    /**
+     * \brief Receive the next acknowledgement
+     * \param pkg OUT Package to read it into
+     * \param data_length Bytes after the header
+     * \param instr_code Instruction it acknowledges, for the timeout
+     * \retval See R502Interface::receive_package
+     */
+    virtual esp_err_t receive(R502_DataPkg_t &pkg, int data_length,
+        uint8_t instr_code) = 0;
+
+    /**
+     * \brief Throw away what arrives until the line is quiet, after an
+     * acknowledgement went missing
+     * \param in_flight Instructions sent but not acknowledged, any of them
+     * may still answer late
+     * \param count Number of in_flight instructions
+     */
+    virtual void resync(const uint8_t *in_flight, int count) = 0;
+};
+
+/**
+ * \brief Commands that only return a confirmation code, sent without
+ * waiting for each one's acknowledgement
+ *
+ * Add commands, then execute. Up to window commands are sent ahead of the
+ * acknowledgement being waited on, so the module works on one while the
+ * next is on the wire. Acknowledgements carry nothing to tell them apart and
+ * are matched in order. If one goes missing there's no telling which
+ * command the module dropped, so every command sent since the pipeline was
+ * last empty fails with its error. The line is resynced and the rest of the
+ * batch carries on. Nothing is retried, check each result. The commands a
+ * batch can hold are all safe to send again.
+ *
+ * Keep window small. The module buffers what arrives while it's busy, but
+ * how much it can hold isn't documented
+ */
+class R502CommandBatch {
+public:
+    static const int max_commands = 16;
+    /// Commands in flight by default
+    static const int default_window = 2;
+
+    R502CommandBatch(R502Interface &_iface) : iface(_iface) {}
+    // Encoders point into their own storage, so they can't be copied
+    R502CommandBatch(const R502CommandBatch &) = delete;
+    R502CommandBatch(R502CommandBatch &&) = delete;
+    R502CommandBatch &operator=(const R502CommandBatch &) = delete;
+    R502CommandBatch &operator=(R502CommandBatch &&) = delete;
+
+    /**
+     * \brief Add AuraLedConfig, to drive the ring LED
+     * \param ctrl What the LED does
+     * \param speed Speed of breathing or flashing, 0 to 255
+     * \param colour Colour
+     * \param times Number of breaths or flashes, 0 for endless
+     * \retval ESP_OK: successful
+     *         ESP_ERR_NO_MEM: The batch is full
+     */
+    esp_err_t led_config(R502_led_ctrl_t ctrl, uint8_t speed,
+        R502_led_colour_t colour, uint8_t times);
+
+    /**
+     * \brief Add a notepad write, see R502Interface::write_notepad
+     * \param content Page content, sent from here so it must stay valid
+     * until execute returns
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_ARG: page_number out of range
+     *         ESP_ERR_NO_MEM: The batch is full
+     */
+    esp_err_t write_notepad(uint8_t page_number,
+        const std::array<uint8_t, R502_notepad_page_size> &content);
+
+    /**
+     * \brief Add a security level change, see
+     * R502Interface::set_security_level
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_ARG: security_level out of range
+     *         ESP_ERR_NO_MEM: The batch is full
+     */
+    esp_err_t set_security_level(uint8_t security_level);
+
+    /**
+     * \brief Send every command and collect their acknowledgements
+     * \param window Most commands sent ahead of their acknowledgements, 1
+     * sends them one at a time like separate calls
+     * \retval ESP_OK: Every command was acknowledged, their confirmation
+     *         codes are in get_result
+     *         ESP_ERR_INVALID_ARG: window is less than 1
+     *         ESP_ERR_INVALID_STATE: The interface is idle
+     *         Otherwise the first error of a command
+     *
+     * Holds the bus for the whole batch
+     */
+    esp_err_t execute(int window = default_window);
+
+    /**
+     * \brief Run the batch through port instead of the interface's uart
+     */
+    esp_err_t execute(R502BatchPort &port, int window = default_window);
+
+    /**
+     * \brief Number of commands added
+     */
+    int size() const { return count; }
+
+    /**
+     * \brief Outcome of the command added index'th, after execute
+     */
+    const R502_batch_result_t &get_result(int index) const {
+        return results[index];
+    }
+
+    /**
+     * \brief Number of commands that failed or weren't confirmed R502_ok,
+     * after execute
+     */
+    int get_failed() const;
+
+    /**
+     * \brief Remove every command, to build another batch
+     */
+    void clear() { count = 0; }
+
+private:
+    static const char *TAG;
+
+    class UartPort;
+
+    /**
+     * \brief Start the next command's package
+     * \retval nullptr if the batch is full
+     */
+    R502FrameEncoder *add(uint8_t instr_code);
+
+    R502Interface &iface;
+    int count = 0;
+    // Encoders aren't assignable, so each one is built in place by add
+    alignas(R502FrameEncoder) uint8_t
+        frame_storage[max_commands][sizeof(R502FrameEncoder)];
+    R502_batch_result_t results[max_commands];
+};
@@ -0,0 +1,293 @@
+/**
+ * \file R502CommandScheduler.hpp
+ * \brief Runs jobs on the module by priority class, interleaving long jobs
+ * with urgent ones at package exchange boundaries
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "R502Interface.hpp"
+
+/**
+ * \brief Priority class of a job, lower runs first
+ */
+typedef enum {
+    R502_priority_high = 0, //!< Someone is waiting, e.g. identify at a door
+    R502_priority_normal = 1,
+    R502_priority_background = 2, //!< Uploads, index syncs, housekeeping
+} R502_priority_t;
+
+static const int R502_priority_classes = 3;
+
+/**
+ * \brief Module memory a job step writes, or that a job's later steps read
+ */
+typedef enum {
+    R502_mem_image = 1, //!< img_buffer
+    R502_mem_char_1 = 2, //!< Character buffer 1
+    R502_mem_char_2 = 4, //!< Character buffer 2
+    R502_mem_library = 8, //!< Stored templates
+} R502_module_mem_t;
+
+/**
+ * \brief Scheduling counters of one priority class
+ */
+struct R502_sched_stats_t {
+    uint32_t jobs; //!< Jobs started
+    uint32_t preemptions; //!< Times a job was set aside for a higher class
+    uint32_t restarts; //!< Times a job started over because a higher class
+                       //!< overwrote module memory it relied on
+    int64_t total_wait_us; //!< Queueing delay summed over jobs, from submit
+                           //!< to first step
+    int64_t max_wait_us; //!< Longest queueing delay
+};
+
+/**
+ * \brief Work for R502CommandScheduler, as a sequence of steps
+ *
+ * Each step should be one package exchange, the scheduler can switch to a
+ * job of a higher class between any two. Once sent UpImage streams the
+ * whole image, so an upload is one step, the longest a high priority job
+ * can wait.
+ *
+ * A job that relies on module memory an earlier step filled reports it in
+ * depends_on. If a job that ran in between overwrote that memory, the job
+ * is restarted instead of resumed
+ */
+class R502Job {
+public:
+    virtual ~R502Job() {}
+
+    /**
+     * \brief Run the next step
+     * \param iface Interface to send the step's commands on
+     * \param done OUT set true once the job has finished
+     * \retval Anything but ESP_OK ends the job with that result
+     */
+    virtual esp_err_t step(R502Interface &iface, bool &done) = 0;
+
+    /**
+     * \brief Go back to the first step
+     */
+    virtual void restart() = 0;
+
+    /**
+     * \brief R502_module_mem_t flags of memory the next steps rely on
+     */
+    virtual uint32_t depends_on() const { return 0; }
+
+    /**
+     * \brief R502_module_mem_t flags of memory the last step overwrote
+     */
+    virtual uint32_t overwrote() const { return 0; }
+
+    /**
+     * \brief Wait for the job to finish, from the task that submitted it
+     * \param timeout_ms How long to wait
+     * \retval ESP_ERR_TIMEOUT: Not finished within timeout_ms
+     *         ESP_ERR_INVALID_STATE: The scheduler stopped first
+     *         Otherwise what the job's last step returned
+     *
+     * Waits on the submitting task's notification value
+     */
+    esp_err_t wait(int timeout_ms);
+
+    /**
+     * \brief Whether the job has finished
+     */
+    bool is_done() const { return done; }
+
+private:
+    friend class R502CommandScheduler;
+
+    std::atomic<bool> done{true};
+    esp_err_t result = ESP_OK;
+    TaskHandle_t waiter = nullptr;
+    int64_t submitted_us = 0;
+};
+
+/**
+ * \brief Capture a finger and search the library for it
+ *
+ * Polls gen_image until a finger is placed, one step per poll
+ */
+class R502IdentifyJob : public R502Job {
+public:
+    /**
+     * \param _start_page First library position to search
+     * \param _page_num Number of positions to search
+     * \param _max_polls gen_image attempts before giving up with
+     * R502_err_no_finger
+     */
+    R502IdentifyJob(uint16_t _start_page, uint16_t _page_num,
+        int _max_polls = 50);
+
+    esp_err_t step(R502Interface &iface, bool &done) override;
+    void restart() override;
+    uint32_t depends_on() const override;
+    uint32_t overwrote() const override;
+
+    /// Confirmation code of the last command, R502_ok if a match was found
+    R502_conf_code_t get_conf_code() const { return conf_code; }
+    uint16_t get_page_id() const { return page_id; }
+    uint16_t get_match_score() const { return match_score; }
+
+private:
+    enum { capture, extract, match } stage = capture;
+    uint32_t last_write = 0;
+    const uint16_t start_page;
+    const uint16_t page_num;
+    const int max_polls;
+    int polls = 0;
+    R502_conf_code_t conf_code = R502_fail;
+    uint16_t page_id = 0;
+    uint16_t match_score = 0;
+};
+
+/**
+ * \brief Capture a finger and upload its image into a buffer
+ */
+class R502UploadJob : public R502Job {
+public:
+    /**
+     * \param _data_len The module's data package length, see up_image
+     * \param _buffer Where to put the image
+     * \param _capacity Size of buffer in bytes
+     * \param _format Layout of the image in buffer
+     * \param _max_polls gen_image attempts before giving up with
+     * R502_err_no_finger
+     */
+    R502UploadJob(R502_data_len_t _data_len, uint8_t *_buffer,
+        size_t _capacity, R502_image_format_t _format, int _max_polls = 50);
+
+    esp_err_t step(R502Interface &iface, bool &done) override;
+    void restart() override;
+    uint32_t depends_on() const override;
+    uint32_t overwrote() const override;
+
+    /// Confirmation code of the last command
+    R502_conf_code_t get_conf_code() const { return conf_code; }
+    /// What the upload received, see R502Interface::up_image
+    const R502_image_info_t &get_info() const { return info; }
+
+private:
+    enum { capture, upload } stage = capture;
+    uint32_t last_write = 0;
+    const R502_data_len_t data_len;
+    uint8_t *buffer;
+    const size_t capacity;
+    const R502_image_format_t format;
+    const int max_polls;
+    int polls = 0;
+    R502_conf_code_t conf_code = R502_fail;
+    R502_image_info_t info = {};
+};
+
+/**
+ * \brief Rebuild the interface's template index, one index page per step
+ *
+ * The pages are collected aside and only replace the index once all are
+ * read. A store or delete run in between restarts the sync
+ */
+class R502IndexSyncJob : public R502Job {
+public:
+    esp_err_t step(R502Interface &iface, bool &done) override;
+    void restart() override;
+    uint32_t depends_on() const override;
+
+    /// Confirmation code of the last command
+    R502_conf_code_t get_conf_code() const { return conf_code; }
+
+private:
+    // 0 reads the library size, then page + 1 reads each index page
+    int stage = 0;
+    R502TemplateIndex index;
+    R502_conf_code_t conf_code = R502_fail;
+};
+
+/**
+ * \brief Runs submitted jobs in a task, the highest priority class first
+ *
+ * After each step of a job the scheduler checks the higher classes. A job
+ * waiting there runs next, and the job it interrupted resumes once no
+ * higher class has work, or starts over if its module memory was
+ * overwritten meanwhile. Jobs of a class run in submit order, one at a time.
+ *
+ * Commands may still be sent on the interface from other tasks, they are
+ * interleaved by the bus mutex and aren't tracked for overwritten memory
+ */
+class R502CommandScheduler {
+public:
+    /**
+     * \param _iface Interface to the module, must be initialized before start
+     * \param _queue_len Jobs each class can hold waiting
+     */
+    R502CommandScheduler(R502Interface &_iface, int _queue_len = 8);
+    ~R502CommandScheduler();
+
+    /**
+     * \brief Start the task that runs jobs
+     * \param priority Priority of the task
+     * \retval ESP_OK: successful
+     *         ESP_ERR_NO_MEM: Couldn't create the queues or task
+     */
+    esp_err_t start(UBaseType_t priority = 5);
+
+    /**
+     * \brief Stop the task once the step in progress is done. Jobs not
+     * finished end with ESP_ERR_INVALID_STATE
+     */
+    void stop();
+
+    /**
+     * \brief Queue a job to run
+     * \param job The job, must stay alive until it's done
+     * \param priority Class to run it in
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_ARG: Invalid priority
+     *         ESP_ERR_INVALID_STATE: The scheduler isn't running, or job is
+     *         already queued
+     *         ESP_ERR_NO_MEM: The class's queue is full
+     */
+    esp_err_t submit(R502Job &job, R502_priority_t priority);
+
+    /**
+     * \brief Scheduling counters of one priority class
+     */
+    R502_sched_stats_t get_stats(R502_priority_t priority) const;
+
+private:
+    static void scheduler_task(void *arg);
+
+    /**
+     * \brief Class whose job runs next, taking it off its queue if needed
+     * \retval The class, or -1 if there's nothing to run
+     */
+    int next_class();
+
+    /**
+     * \brief End the job of class cls and wake whoever waits on it
+     */
+    void finish(int cls, esp_err_t err);
+
+    R502Interface &iface;
+    const int queue_len;
+    QueueHandle_t queues[R502_priority_classes] = {};
+    // Job in progress in each class, only touched by the scheduler task
+    R502Job *active[R502_priority_classes] = {};
+    int last_class = -1;
+    TaskHandle_t task = nullptr;
+
+    std::atomic<bool> running;
+    std::atomic<bool> task_alive;
+
+    SemaphoreHandle_t stats_mutex = nullptr;
+    R502_sched_stats_t stats[R502_priority_classes] = {};
+};
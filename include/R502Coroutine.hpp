@@ -0,0 +1,406 @@
+/**
+ * \file R502Coroutine.hpp
+ * \brief C++20 coroutine task type and the schedulers that resume them
+ *
+ * Needs a compiler with coroutine support, build with -std=gnu++20
+ * -fcoroutines. See R502AsyncSensor.hpp for the awaitable commands
+ */
+
+#pragma once
+#if !defined(__cpp_impl_coroutine)
+#error "R502Coroutine.hpp needs C++20 coroutines, build with -std=gnu++20 -fcoroutines"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <coroutine>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "R502FrameEncoder.hpp"
+
+/**
+ * \brief Byte stream to one module, as seen by the coroutine API
+ *
+ * None of the calls may block, the scheduler checks available() to decide
+ * when to resume a coroutine waiting for data. A link that reports arriving
+ * data and touches, with rx_events and wake_on_irq, lets R502TaskScheduler
+ * sleep until they happen, otherwise it checks the link every tick
+ */
+class R502AsyncLink {
+public:
+    virtual ~R502AsyncLink() {}
+
+    /**
+     * \brief Queue bytes for sending
+     */
+    virtual esp_err_t write(const uint8_t *data, size_t len) = 0;
+
+    /**
+     * \brief Queue a package given as segments, in order
+     *
+     * Writes each segment on its own. A transport with a gather write, like
+     * writev on a host socket, can override this to send them in one call
+     */
+    virtual esp_err_t write_segments(const R502_segment_t *segments,
+        int count)
+    {
+        for(int i = 0; i < count; i++){
+            esp_err_t err = write(segments[i].data, segments[i].len);
+            if(err) return err;
+        }
+        return ESP_OK;
+    }
+
+    /**
+     * \brief Number of received bytes ready to read
+     */
+    virtual size_t available() = 0;
+
+    /**
+     * \brief Read up to len received bytes
+     * \retval Number of bytes read, or -1 on error
+     */
+    virtual int read(uint8_t *data, size_t len) = 0;
+
+    /**
+     * \brief Throw away received bytes nobody is waiting for
+     */
+    virtual void discard() = 0;
+
+    /**
+     * \brief Whether the touch irq fired since the last call
+     */
+    virtual bool take_irq() = 0;
+
+    /**
+     * \brief Take the link for one package exchange, without waiting
+     * \retval false if another exchange has it
+     */
+    virtual bool try_acquire() = 0;
+
+    /**
+     * \brief Give the link back after try_acquire
+     */
+    virtual void release() = 0;
+
+    /**
+     * \brief Queue that gets an event as data arrives, nullptr if there is
+     * none
+     *
+     * Only read by a scheduler while one of its coroutines holds the link
+     * and waits for data, whoever holds the link owns its events
+     */
+    virtual QueueHandle_t rx_events() { return nullptr; }
+
+    /**
+     * \brief Give wake when the touch irq fires, until called with nullptr
+     * \retval false if the link can't
+     */
+    virtual bool wake_on_irq(SemaphoreHandle_t wake) { return false; }
+};
+
+class R502Scheduler;
+
+/**
+ * \brief Lazily started coroutine returning T, co_await it to run it
+ *
+ * The awaiting coroutine is resumed directly when the task finishes, so a
+ * chain of awaits costs no trips through the scheduler
+ */
+template<typename T>
+class R502Task;
+
+namespace R502Detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<P> handle) noexcept
+        {
+            std::coroutine_handle<> next = handle.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    // Built without exceptions, there is nothing to propagate
+    void unhandled_exception() { abort(); }
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+    T value{};
+    R502Task<T> get_return_object();
+    void return_value(T _value) { value = std::move(_value); }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    R502Task<void> get_return_object();
+    void return_void() {}
+};
+
+} // namespace R502Detail
+
+template<typename T>
+class R502Task {
+public:
+    typedef R502Detail::Promise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle_t;
+
+    explicit R502Task(handle_t _handle) : handle(_handle) {}
+    R502Task(R502Task &&other) noexcept : handle(other.handle) {
+        other.handle = nullptr;
+    }
+    R502Task &operator=(R502Task &&other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    R502Task(const R502Task &) = delete;
+    R502Task &operator=(const R502Task &) = delete;
+    ~R502Task() {
+        if(handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return !handle || handle.done(); }
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() {
+        if constexpr (!std::is_void<T>::value) {
+            return std::move(handle.promise().value);
+        }
+    }
+
+private:
+    friend class R502Scheduler;
+    handle_t handle;
+};
+
+namespace R502Detail {
+
+template<typename T>
+R502Task<T> Promise<T>::get_return_object()
+{
+    return R502Task<T>(
+        std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline R502Task<void> Promise<void>::get_return_object()
+{
+    return R502Task<void>(
+        std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace R502Detail
+
+/**
+ * \brief Resumes coroutines once what they wait for has happened
+ *
+ * Coroutines park themselves by awaiting wait_rx, wait_irq, sleep_until or
+ * acquire. run_once checks each parked coroutine and resumes those whose
+ * data has arrived or whose deadline has passed, so one task can drive any
+ * number of workflows on any number of modules. When nothing is ready the
+ * scheduler idles until the nearest deadline, how is up to the subclass
+ */
+class R502Scheduler {
+public:
+    virtual ~R502Scheduler();
+
+    /**
+     * \brief Start a workflow, the scheduler owns it until it finishes
+     */
+    void spawn(R502Task<void> task);
+
+    /**
+     * \brief Resume every coroutine that is ready, or idle if none are
+     * \param max_wait_ms Longest time to idle for
+     * \retval Number of workflows still running
+     */
+    size_t run_once(int max_wait_ms);
+
+    /**
+     * \brief Run until every spawned workflow has finished
+     */
+    void run();
+
+    /**
+     * \brief Number of workflows still running
+     */
+    size_t pending() const;
+
+    /**
+     * \brief Current time in microseconds, the clock deadlines are set on
+     */
+    virtual int64_t now_us() = 0;
+
+    /// Awaitables ///
+
+    enum wait_kind_t { wait_rx_kind, wait_irq_kind, wait_time_kind,
+        wait_link_kind };
+
+    struct Waiter {
+        R502Scheduler &scheduler;
+        wait_kind_t kind;
+        R502AsyncLink *link;
+        size_t bytes;
+        int64_t deadline_us;
+        bool fired;
+
+        bool await_ready() {
+            fired = scheduler.check(*this);
+            return fired;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            scheduler.park(*this, handle);
+        }
+        /// true if the wait was satisfied, false if it timed out
+        bool await_resume() { return fired; }
+    };
+
+    /**
+     * \brief Wait until link has bytes to read
+     * \retval true once they're available, false at the deadline
+     */
+    Waiter wait_rx(R502AsyncLink &link, size_t bytes, int64_t deadline_us) {
+        return Waiter{*this, wait_rx_kind, &link, bytes, deadline_us, false};
+    }
+
+    /**
+     * \brief Wait until the link's touch irq fires
+     * \retval true if it fired, false at the deadline
+     */
+    Waiter wait_irq(R502AsyncLink &link, int64_t deadline_us) {
+        return Waiter{*this, wait_irq_kind, &link, 0, deadline_us, false};
+    }
+
+    /**
+     * \brief Wait until a point in time, always returns false
+     */
+    Waiter sleep_until(int64_t deadline_us) {
+        return Waiter{*this, wait_time_kind, nullptr, 0, deadline_us, false};
+    }
+
+    /**
+     * \brief Wait until link is free for a package exchange and take it,
+     * give it back with R502AsyncLink::release
+     */
+    Waiter acquire(R502AsyncLink &link) {
+        return Waiter{*this, wait_link_kind, &link, 0, INT64_MAX, false};
+    }
+
+protected:
+    /**
+     * \brief Wait until until_us, or until woken sooner
+     */
+    virtual void idle(int64_t until_us) = 0;
+
+    /**
+     * \brief Number of parked coroutines, for idle to see what they wait for
+     */
+    size_t parked_count() const { return parked.size(); }
+    const Waiter &parked_waiter(size_t i) const { return *parked[i].waiter; }
+
+    /**
+     * \brief Check the parked coroutines again, for an idle that arms its
+     * wakeups after run_once checked them
+     * \retval true if any can be resumed
+     */
+    bool recheck();
+
+private:
+    struct parked_t {
+        std::coroutine_handle<> handle;
+        // lives in the suspended coroutine's frame until it is resumed
+        Waiter *waiter;
+    };
+
+    /**
+     * \brief Whether what waiter waits for has happened, takes the link or
+     * the irq if so
+     */
+    bool check(Waiter &waiter);
+    void park(Waiter &waiter, std::coroutine_handle<> handle);
+    void reap();
+
+    std::vector<parked_t> parked;
+    std::vector<R502Task<void>> workflows;
+};
+
+/**
+ * \brief Scheduler for a FreeRTOS task
+ *
+ * Idles by blocking the calling task on a queue set, until the nearest
+ * deadline or until an awaited link's rx_events queue gets an event or its
+ * touch irq fires. Links that can't report these, and links another task
+ * holds, are checked every tick instead. Call notify from another task to
+ * end the wait early
+ */
+class R502TaskScheduler : public R502Scheduler {
+public:
+    R502TaskScheduler();
+    ~R502TaskScheduler();
+
+    int64_t now_us() override;
+
+    /**
+     * \brief Wake the task running the scheduler
+     */
+    void notify();
+
+protected:
+    void idle(int64_t until_us) override;
+
+private:
+    /**
+     * \brief Make wake_set hold at least length events
+     * \retval false if it couldn't be created
+     */
+    bool reserve_set(UBaseType_t length);
+
+    // Given by notify and the irqs of awaited links, always in wake_set
+    SemaphoreHandle_t wake = nullptr;
+    QueueSetHandle_t wake_set = nullptr;
+    UBaseType_t wake_set_length = 0;
+    // what the current idle added to wake_set or armed
+    std::vector<QueueHandle_t> rx_queues;
+    std::vector<R502AsyncLink *> irq_links;
+};
+
+/**
+ * \brief Scheduler on a simulated clock, for running workflows on a host
+ * or in tests against an R502AsyncLink that answers immediately
+ *
+ * Idling jumps the clock to the deadline instead of sleeping, so timeouts
+ * are deterministic and take no real time
+ */
+class R502HostScheduler : public R502Scheduler {
+public:
+    int64_t now_us() override;
+
+    /**
+     * \brief Move the simulated clock forward
+     */
+    void advance(int64_t us);
+
+protected:
+    void idle(int64_t until_us) override;
+
+private:
+    int64_t clock_us = 0;
+};
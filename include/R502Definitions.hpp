@@ -10,8 +10,14 @@
 /// Constants ///
 static const int R502_character_file_size = 384; // bytes
 static const int R502_image_size = 36 * 1024; // Why isn't this 72 according to docs?
+static const int R502_image_width = 192; // pixels
+static const int R502_image_height = 192; // pixels
 static const int R502_cs_len = 2;
 static const int R502_max_data_len = 256;
+static const int R502_index_table_len = 32; // bytes, one bit per template
+static const int R502_index_table_pages = 4;
+static const int R502_notepad_page_size = 32; // bytes
+static const int R502_notepad_pages = 16;
 
 /**
  * \brief Package identifiers
@@ -50,6 +56,7 @@ typedef enum {
     R502_ic_write_notepad = 0x18,
     R502_ic_read_notepad = 0x19,
     R502_ic_template_num = 0x1D,
+    R502_ic_read_index_table = 0x1F,
     R502_ic_led_config = 0x35
 } R502_instr_code_t;
 
@@ -114,6 +121,58 @@ typedef enum {
     R502_data_len_256 = 3,
 } R502_data_len_t;
 
+/**
+ * \brief Number of bytes in a data package of length data_len
+ */
+constexpr int R502_data_len_bytes(R502_data_len_t data_len)
+{
+    return 32 << data_len;
+}
+
+/**
+ * \brief Optional groups of commands, see R502FixedInterface
+ *
+ * Initialization, system parameters and capturing an image into a character
+ * buffer are always available
+ */
+typedef enum {
+    R502_cmds_image = 0x1, //!< up_image
+    R502_cmds_library = 0x2, //!< search, store, delete and the template index
+    R502_cmds_notepad = 0x4, //!< write_notepad and read_notepad
+    R502_cmds_random = 0x8, //!< get_random_code
+    R502_cmds_all = 0xF
+} R502_cmd_group_t;
+
+/**
+ * \brief Character file buffers in the module, used by image processing and
+ * template storage commands
+ */
+typedef enum {
+    R502_char_buffer_1 = 1,
+    R502_char_buffer_2 = 2,
+} R502_char_buffer_t;
+
+/**
+ * \brief What the ring LED does, for AuraLedConfig
+ */
+typedef enum {
+    R502_led_breathing = 1,
+    R502_led_flashing = 2,
+    R502_led_on = 3,
+    R502_led_off = 4,
+    R502_led_fade_on = 5,
+    R502_led_fade_off = 6,
+} R502_led_ctrl_t;
+
+/**
+ * \brief Colour of the ring LED, for AuraLedConfig
+ */
+typedef enum {
+    R502_led_red = 1,
+    R502_led_blue = 2,
+    R502_led_purple = 3,
+} R502_led_colour_t;
+
 ///// Return Data Structures /////
 
 /**
@@ -129,6 +188,75 @@ struct R502_sys_para_t {
     R502_baud_t baud_setting;
 };
 
+/**
+ * \brief Timestamps of bringing up the link to the module, from 
+ * esp_timer_get_time, so in microseconds since the esp32 booted
+ */
+struct R502_boot_timing_t {
+    int64_t init_start_us; //!< init or warm_init was called
+    int64_t link_ready_us; //!< module was ready for commands
+    int64_t first_capture_us; //!< first gen_image with R502_ok, -1 until then
+    bool warm; //!< stored link settings were correct
+    int round_trips; //!< commands sent before the module answered
+};
+
+/**
+ * \brief Timestamps of the last idle period, from esp_timer_get_time
+ *
+ * Wake-to-capture latency is first_capture_us - touch_us, of which
+ * link_ready_us - touch_us is spent restoring the link
+ */
+struct R502_wake_timing_t {
+    int64_t idle_start_us; //!< enter_idle was called
+    int64_t touch_us; //!< touch irq woke the esp32, -1 until then
+    int64_t link_ready_us; //!< exit_idle had the module answering, or -1
+    int64_t first_capture_us; //!< first gen_image with R502_ok after waking
+    int round_trips; //!< commands exit_idle sent before the module answered
+};
+
+/**
+ * \brief Part of the image for up_image to deliver, and at what resolution
+ *
+ * Coordinates are in pixels of the full 192 x 192 image. width and height
+ * must be multiples of decimation
+ */
+struct R502_image_window_t {
+    uint8_t x; //!< First column
+    uint8_t y; //!< First row
+    uint8_t width; //!< Columns in the window
+    uint8_t height; //!< Rows in the window
+    uint8_t decimation; //!< Keep 1 in decimation pixels each way, 1 for all
+    /// Deliver the mean of each decimation x decimation block instead of
+    /// its top left pixel
+    bool average;
+};
+
+/**
+ * \brief How an assembled image is laid out in memory
+ */
+typedef enum {
+    /// As the module sends it, two 4 bit pixels per byte, the first in the
+    /// low nibble
+    R502_image_packed = 0,
+    /// One pixel per byte, the 4 bit value in the high nibble, as
+    /// set_up_image_cb gets them
+    R502_image_8bit = 1,
+} R502_image_format_t;
+
+/**
+ * \brief What up_image actually received, rather than what the
+ * documentation says the image is
+ */
+struct R502_image_info_t {
+    uint16_t width; //!< Pixels per row, the sensor's row length
+    uint16_t height; //!< Rows, from the number of pixels received
+    /// Bytes of the image in its format. More than the buffer's capacity if
+    /// it didn't fit
+    uint32_t bytes;
+    uint16_t frames; //!< Data packages received
+    R502_image_format_t format;
+};
+
 ///// Command Packages /////
 
 /// System Commands ///
@@ -171,6 +299,76 @@ struct R502_SetSysPara_t {
     uint8_t checksum[R502_cs_len]; //!< checksum
 };
 
+/**
+ * \brief Data section of the ReadIndexTable command
+ */
+struct R502_ReadIndexTable_t {
+    uint8_t instr_code; //!< instruction code
+    uint8_t index_page; //!< Which page of 256 templates to read, 0 to 3
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
+/**
+ * \brief Data section of the WriteNotepad command
+ */
+struct R502_WriteNotepad_t {
+    uint8_t instr_code; //!< instruction code
+    uint8_t page_number; //!< Notepad page to write, 0 to 15
+    uint8_t content[R502_notepad_page_size]; //!< Bytes to write
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
+/**
+ * \brief Data section of the ReadNotepad command
+ */
+struct R502_ReadNotepad_t {
+    uint8_t instr_code; //!< instruction code
+    uint8_t page_number; //!< Notepad page to read, 0 to 15
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
+/**
+ * \brief Data section of the Img2Tz command
+ */
+struct R502_Img2Tz_t {
+    uint8_t instr_code; //!< instruction code
+    uint8_t buffer_id; //!< Character buffer to generate the file into
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
+/**
+ * \brief Data section of the Search command
+ */
+struct R502_Search_t {
+    uint8_t instr_code; //!< instruction code
+    uint8_t buffer_id; //!< Character buffer to search with
+    uint8_t start_page[2]; //!< First library position to search
+    uint8_t page_num[2]; //!< Number of library positions to search
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
+/// Fingerprint Library Commands ///
+
+/**
+ * \brief Data section of the Store command
+ */
+struct R502_Store_t {
+    uint8_t instr_code; //!< instruction code
+    uint8_t buffer_id; //!< Character buffer to store from
+    uint8_t page_id[2]; //!< Library position to store the template at
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
+/**
+ * \brief Data section of the DeletChar command
+ */
+struct R502_DeletChar_t {
+    uint8_t instr_code; //!< instruction code
+    uint8_t page_id[2]; //!< First library position to delete
+    uint8_t number_of_templates[2]; //!< Number of templates to delete
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
 ///// Acknowledgement Packages /////
 
 /**
@@ -202,16 +400,72 @@ struct R502_TemplateNumAck_t {
     uint8_t checksum[R502_cs_len]; //!< checksum
 };
 
-///// Data Packages /////
+/**
+ * \brief Data section of a ReadIndexTable acknowledge package from R502
+ */
+struct R502_ReadIndexTableAck_t {
+    uint8_t conf_code; //!< confirmation code
+    uint8_t index[R502_index_table_len]; //!< One bit per template, 1 if used
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
 
 /**
- * \brief Data section of a data package with 256 bytes of data
+ * \brief Data section of a ReadNotepad acknowledge package from R502
  */
-struct R502_Data_t {
-    uint8_t content[R502_max_data_len];
+struct R502_ReadNotepadAck_t {
+    uint8_t conf_code; //!< confirmation code
+    uint8_t content[R502_notepad_page_size]; //!< Contents of the page
     uint8_t checksum[R502_cs_len]; //!< checksum
 };
 
+/**
+ * \brief Data section of a Search acknowledge package from R502
+ */
+struct R502_SearchAck_t {
+    uint8_t conf_code; //!< confirmation code
+    uint8_t page_id[2]; //!< Library position of the matching template
+    uint8_t match_score[2]; //!< How closely it matched
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
+/**
+ * \brief Data section of a Match acknowledge package from R502
+ */
+struct R502_MatchAck_t {
+    uint8_t conf_code; //!< confirmation code
+    uint8_t match_score[2]; //!< How closely the two templates matched
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
+/**
+ * \brief Data section of a GetRandomCode acknowledge package from R502
+ */
+struct R502_GetRandomCodeAck_t {
+    uint8_t conf_code; //!< confirmation code
+    uint8_t random_number[4]; //!< 32 bit random number, big endian
+    uint8_t checksum[R502_cs_len]; //!< checksum
+};
+
+///// Data Packages /////
+
+/**
+ * \brief Data package with DataLen bytes of image data
+ *
+ * Not part of R502_DataPkg_t, so command packages aren't sized for the
+ * longest data package
+ */
+template<int DataLen>
+struct R502_DataPkgN_t {
+    uint8_t start[2]; //!< Two byte header, all packages are the same
+    uint8_t adder[4]; //!< Module address, default 0xff, 0xff, 0xff, 0xff
+    uint8_t pid; //!< Package id
+    uint8_t length[2]; //!< length in bytes of data section of this package
+    struct {
+        uint8_t content[DataLen];
+        uint8_t checksum[R502_cs_len]; //!< checksum
+    } data; //!< Data and checksum of the package
+};
+
 
 
 /**
@@ -227,9 +481,20 @@ struct R502_DataPkg_t {
         R502_VfyPwd_t vfy_pwd;
         R502_SetPwd_t set_pwd;
         R502_SetSysPara_t set_sys_para;
+        R502_ReadIndexTable_t read_index_table;
+        R502_WriteNotepad_t write_notepad;
+        R502_ReadNotepad_t read_notepad;
+        R502_Img2Tz_t img_2_tz;
+        R502_Search_t search;
+        R502_Store_t store;
+        R502_DeletChar_t delet_char;
         R502_GeneralAck_t general_ack;
         R502_ReadSysParaAck_t read_sys_para_ack;
         R502_TemplateNumAck_t template_num_ack;
-        R502_Data_t data;
+        R502_ReadIndexTableAck_t read_index_table_ack;
+        R502_ReadNotepadAck_t read_notepad_ack;
+        R502_GetRandomCodeAck_t get_random_code_ack;
+        R502_SearchAck_t search_ack;
+        R502_MatchAck_t match_ack;
     } data; //!< Data and checksum of the package
 };
\ No newline at end of file
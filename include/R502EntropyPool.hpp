@@ -0,0 +1,142 @@
+/**
+ * \file R502EntropyPool.hpp
+ * \brief Random bytes from a host CSPRNG, seeded by the module's random
+ * number generator
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "R502Interface.hpp"
+
+/**
+ * \brief Counters of how the pool has been used
+ */
+struct R502_entropy_stats_t {
+    uint32_t bytes_served; //!< Random bytes handed out by fill
+    uint32_t bytes_mixed; //!< Bytes from the module mixed into the state
+    uint32_t refills; //!< Refills that mixed in new bytes
+    uint32_t refill_errors; //!< Refills that failed to talk to the module
+    uint32_t starved; //!< Calls to fill made while the pool was empty
+};
+
+/**
+ * \brief Pool of random bytes for nonces, served from memory
+ *
+ * GetRandomCode only returns 4 bytes per round trip, far too slow to ask for
+ * every nonce. Instead the module's output is mixed into the key of a
+ * ChaCha20 generator, and fill() generates from that key without touching
+ * the uart.
+ *
+ * fill() takes no lock. The key is published with a sequence counter, a
+ * reader copies it and retries if a reseed happened meanwhile, and each call
+ * claims its own block counter so no two readers produce the same output.
+ *
+ * The pool counts the module bytes mixed in against the bytes served. When
+ * the count drops below the low-water mark the refill task is woken to mix
+ * in more, so a steady stream of nonces never waits on the module. An empty
+ * pool keeps serving output from the last key, counted in
+ * R502_entropy_stats_t::starved
+ */
+class R502EntropyPool {
+public:
+    /**
+     * \param _iface Interface to the module, must be initialized before start
+     * \param _capacity Most module bytes the pool counts as mixed in
+     * \param _low_water Refill once fewer than this many bytes are left
+     */
+    R502EntropyPool(R502Interface &_iface, size_t _capacity = 256,
+        size_t _low_water = 64);
+    ~R502EntropyPool();
+
+    /**
+     * \brief Fill the pool from the module, then start the refill task
+     * \param res OUT confirmation code provided by the R502
+     * \param priority Priority of the refill task
+     * \retval ESP_OK: successful
+     *         ESP_ERR_NO_MEM: Couldn't create the refill task
+     *         See R502Interface::vfy_pass for all other return values
+     */
+    esp_err_t start(R502_conf_code_t &res, UBaseType_t priority = 5);
+
+    /**
+     * \brief Stop the refill task, waiting for a refill in progress
+     */
+    void stop();
+
+    /**
+     * \brief Fill out with random bytes, without talking to the module
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_STATE: The pool was never seeded
+     */
+    esp_err_t fill(uint8_t *out, size_t len);
+
+    /**
+     * \brief Mix bytes from the module into the pool until it is full
+     * \param res OUT confirmation code provided by the R502
+     * \retval See R502Interface::vfy_pass for all possible return values
+     *
+     * Called by the refill task, may be called directly when no task runs
+     */
+    esp_err_t refill(R502_conf_code_t &res);
+
+    /**
+     * \brief Module bytes left before the pool counts as empty
+     */
+    int level() const;
+
+    R502_entropy_stats_t get_stats() const;
+
+    static const int key_words = 8;
+    static const int block_size = 64;
+
+    /**
+     * \brief One ChaCha20 block, as in RFC 8439 section 2.3
+     * \param key 256 bit key, as little endian words
+     * \param counter Block counter
+     * \param nonce 96 bit nonce, as little endian words
+     * \param out OUT the block, as little endian words
+     */
+    static void chacha20_block(const uint32_t key[key_words],
+        uint32_t counter, const uint32_t nonce[3], uint32_t out[16]);
+
+private:
+
+    static void refill_task(void *arg);
+    void request_refill();
+
+    /**
+     * \brief Mix new bytes into the key and publish it
+     */
+    void reseed(const uint8_t *material, size_t len);
+
+    R502Interface &iface;
+    const int capacity;
+    const int low_water;
+
+    // Key of the generator, valid while sequence is even
+    std::atomic<uint32_t> key[key_words];
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> counter;
+    uint32_t reseeds = 0;
+    std::atomic<bool> seeded;
+
+    std::atomic<int> entropy;
+    std::atomic<bool> refill_pending;
+    std::atomic<bool> running;
+    std::atomic<bool> task_alive;
+    TaskHandle_t task = nullptr;
+    // Serializes refills, fill never takes it
+    SemaphoreHandle_t refill_mutex = nullptr;
+
+    std::atomic<uint32_t> bytes_served;
+    std::atomic<uint32_t> bytes_mixed;
+    std::atomic<uint32_t> refills;
+    std::atomic<uint32_t> refill_errors;
+    std::atomic<uint32_t> starved;
+};
@@ -0,0 +1,199 @@
+/**
+ * \file R502FixedInterface.hpp
+ * \brief R502Interface with its data package length and command groups fixed
+ * at compile time
+ */
+
+#pragma once
+#include "R502Interface.hpp"
+
+/**
+ * \brief R502Interface for a module whose data package length is known at
+ * build time, limited to the command groups the application uses
+ *
+ * \tparam DataLen Data package length the module is set to, see
+ * set_data_package_length
+ * \tparam Commands R502_cmd_group_t flags of the optional commands to allow.
+ * Calling a command of another group fails to compile, so its code is never
+ * linked in
+ *
+ * The frame size and frame count of up_image are constants, and its receive
+ * buffer and the uart driver's are sized for DataLen instead of 256 bytes.
+ * The expanding set_up_image_cb callback isn't available, use the up_image
+ * consumers instead. Helpers taking an R502Interface, like R502NotepadStore,
+ * still reach every command through it
+ */
+template<R502_data_len_t DataLen, uint32_t Commands = R502_cmds_all>
+class R502FixedInterface : public R502Interface {
+public:
+    /// Bytes of image data in each data package
+    static const int data_len = R502_data_len_bytes(DataLen);
+    /// Data packages making up one image
+    static const int frames_per_image = R502_image_size / 2 / data_len;
+
+    R502FixedInterface() : R502Interface(data_len) {}
+
+    /**
+     * \brief Whether every command group in groups is enabled
+     */
+    static constexpr bool enabled(uint32_t groups) {
+        return (Commands & groups) == groups;
+    }
+
+    /**
+     * \brief Set the module's data package length to DataLen
+     * \param res OUT confirmation code provided by the R502
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t set_data_package_length(R502_conf_code_t &res) {
+        return R502Interface::set_data_package_length(DataLen, res);
+    }
+
+    /// Fingerprint Processing Commands ///
+
+    /**
+     * \brief Upload the image in img_buffer, handing each data package to
+     * consumer as it arrives
+     * \param res OUT confirmation code
+     * \param consumer Called with the data_len bytes of each data package,
+     * see R502Interface::up_image
+     * \retval See vfy_pass for description of all possible return values
+     */
+    template<typename F>
+    esp_err_t up_image(R502_conf_code_t &res, F &&consumer) {
+        static_assert(enabled(R502_cmds_image), "R502_cmds_image is disabled");
+        return up_image_frames<data_len>(data_len, res, consumer);
+    }
+
+    /**
+     * \brief Upload a window of the image, see R502Interface::up_image
+     */
+    template<typename F>
+    esp_err_t up_image(const R502_image_window_t &window,
+        R502_conf_code_t &res, F &&row_consumer)
+    {
+        static_assert(enabled(R502_cmds_image), "R502_cmds_image is disabled");
+        R502ImageWindow<F &> windowed(window, row_consumer);
+        if(!windowed.valid()){
+            ESP_LOGE(TAG, "invalid image window");
+            return ESP_ERR_INVALID_ARG;
+        }
+        return up_image_frames<data_len>(data_len, res, windowed);
+    }
+
+    /**
+     * \brief Upload the image into one buffer, see R502Interface::up_image
+     */
+    esp_err_t up_image(R502_conf_code_t &res, uint8_t *buffer,
+        size_t capacity, R502_image_format_t format, R502_image_info_t &info)
+    {
+        static_assert(enabled(R502_cmds_image), "R502_cmds_image is disabled");
+        R502ImageAssembler assembler(buffer, capacity, format);
+        esp_err_t err = up_image_frames<data_len>(data_len, res, assembler);
+        info = assembler.get_info();
+        if(err) return err;
+        if(assembler.overflowed()) return ESP_ERR_INVALID_SIZE;
+        return ESP_OK;
+    }
+
+    /**
+     * \brief Download an image to img_buffer, see R502Interface::down_image
+     */
+    esp_err_t down_image(const uint8_t *image, size_t len,
+        R502_conf_code_t &res)
+    {
+        static_assert(enabled(R502_cmds_image), "R502_cmds_image is disabled");
+        return R502Interface::down_image(DataLen, image, len, res);
+    }
+
+    /// Fingerprint Library Commands ///
+
+    esp_err_t search(R502_char_buffer_t buffer_id, uint16_t start_page,
+        uint16_t page_num, R502_conf_code_t &res, uint16_t &page_id,
+        uint16_t &match_score)
+    {
+        static_assert(enabled(R502_cmds_library),
+            "R502_cmds_library is disabled");
+        return R502Interface::search(buffer_id, start_page, page_num, res,
+            page_id, match_score);
+    }
+
+    esp_err_t store(R502_char_buffer_t buffer_id, uint16_t page_id,
+        R502_conf_code_t &res)
+    {
+        static_assert(enabled(R502_cmds_library),
+            "R502_cmds_library is disabled");
+        return R502Interface::store(buffer_id, page_id, res);
+    }
+
+    esp_err_t delete_char(uint16_t page_id, uint16_t count,
+        R502_conf_code_t &res)
+    {
+        static_assert(enabled(R502_cmds_library),
+            "R502_cmds_library is disabled");
+        return R502Interface::delete_char(page_id, count, res);
+    }
+
+    esp_err_t empty(R502_conf_code_t &res) {
+        static_assert(enabled(R502_cmds_library),
+            "R502_cmds_library is disabled");
+        return R502Interface::empty(res);
+    }
+
+    esp_err_t template_num(R502_conf_code_t &res, uint16_t &template_num) {
+        static_assert(enabled(R502_cmds_library),
+            "R502_cmds_library is disabled");
+        return R502Interface::template_num(res, template_num);
+    }
+
+    esp_err_t read_index_table(uint8_t index_page, R502_conf_code_t &res,
+        std::array<uint8_t, R502_index_table_len> &table)
+    {
+        static_assert(enabled(R502_cmds_library),
+            "R502_cmds_library is disabled");
+        return R502Interface::read_index_table(index_page, res, table);
+    }
+
+    esp_err_t sync_template_index(R502_conf_code_t &res) {
+        static_assert(enabled(R502_cmds_library),
+            "R502_cmds_library is disabled");
+        return R502Interface::sync_template_index(res);
+    }
+
+    esp_err_t find_free_page(R502_conf_code_t &res, uint16_t &page_id) {
+        static_assert(enabled(R502_cmds_library),
+            "R502_cmds_library is disabled");
+        return R502Interface::find_free_page(res, page_id);
+    }
+
+    /// Notepad Commands ///
+
+    esp_err_t write_notepad(uint8_t page_number,
+        const std::array<uint8_t, R502_notepad_page_size> &content,
+        R502_conf_code_t &res)
+    {
+        static_assert(enabled(R502_cmds_notepad),
+            "R502_cmds_notepad is disabled");
+        return R502Interface::write_notepad(page_number, content, res);
+    }
+
+    esp_err_t read_notepad(uint8_t page_number, R502_conf_code_t &res,
+        std::array<uint8_t, R502_notepad_page_size> &content)
+    {
+        static_assert(enabled(R502_cmds_notepad),
+            "R502_cmds_notepad is disabled");
+        return R502Interface::read_notepad(page_number, res, content);
+    }
+
+    /// Other Commands ///
+
+    esp_err_t get_random_code(R502_conf_code_t &res, uint32_t &number) {
+        static_assert(enabled(R502_cmds_random),
+            "R502_cmds_random is disabled");
+        return R502Interface::get_random_code(res, number);
+    }
+
+private:
+    // Expands each frame into a worst-case buffer, up_image replaces it
+    using R502Interface::set_up_image_cb;
+};
@@ -0,0 +1,195 @@
+/**
+ * \file R502FrameEncoder.hpp
+ * \brief Builds a package as a list of segments, so payloads go to the wire
+ * from where they already are
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "esp_err.h"
+#include "R502Definitions.hpp"
+
+/**
+ * \brief One contiguous piece of a package, laid out like struct iovec
+ */
+struct R502_segment_t {
+    const uint8_t *data;
+    size_t len;
+};
+
+/**
+ * \brief A package as header, command fields, payload and checksum segments
+ *
+ * The header and any command fields, the instruction code and its
+ * parameters, are copied into the encoder. Payloads are only referenced and
+ * must stay valid until the package is sent. The checksum is summed as they
+ * are added, so a payload is read once, on its way to the wire
+ *
+ * Add fields, then payloads, then call finish. A package that is too long or
+ * built out of order is marked invalid instead
+ */
+class R502FrameEncoder {
+public:
+    /// Command fields kept in the encoder, Search has the most with six
+    static const int max_fields = 8;
+    /// Payloads a package can reference
+    static const int max_payloads = 2;
+    /// Header and fields, payloads, checksum
+    static const int max_segments = max_payloads + 2;
+    /// Package data without its checksum, as the length field allows
+    static const int max_data_len = R502_max_data_len;
+
+    /**
+     * \brief Start a package
+     * \param adder Module address
+     * \param pid Package id
+     */
+    R502FrameEncoder(const uint8_t adder[4], R502_pid_t pid) {
+        head[0] = 0xEF;
+        head[1] = 0x01;
+        memcpy(head + 2, adder, 4);
+        head[6] = pid;
+        head[head_size] = 0;
+        segs[0] = {head, head_size};
+    }
+
+    /**
+     * \brief Send a package already filled in an R502_DataPkg_t, with its
+     * length and checksum set
+     */
+    explicit R502FrameEncoder(const R502_DataPkg_t &pkg) {
+        int length_field = (pkg.length[0] << 8) | pkg.length[1];
+        memcpy(head, &pkg, head_size + 1);
+        ok = length_field > R502_cs_len &&
+            head_size + length_field <= sizeof(R502_DataPkg_t);
+        data_len = ok ? length_field - R502_cs_len : 0;
+        segs[0] = {(const uint8_t *)&pkg, length()};
+        count = 1;
+        finished = true;
+    }
+
+    /**
+     * \brief Append a command field byte
+     */
+    void add_field(uint8_t field) {
+        add_fields(&field, 1);
+    }
+
+    /**
+     * \brief Append a two byte command field, high byte first
+     */
+    void add_field16(uint16_t field) {
+        uint8_t bytes[2] = {(uint8_t)(field >> 8), (uint8_t)field};
+        add_fields(bytes, 2);
+    }
+
+    /**
+     * \brief Copy command fields into the package
+     */
+    void add_fields(const uint8_t *fields, size_t len) {
+        if(finished || count > 0 || fields_len + len > max_fields){
+            ok = false;
+            return;
+        }
+        memcpy(head + head_size + fields_len, fields, len);
+        fields_len += len;
+        data_len += len;
+        sum += sum_bytes(fields, len);
+    }
+
+    /**
+     * \brief Reference len bytes of data as the next part of the package
+     */
+    void add_payload(const uint8_t *data, size_t len) {
+        if(finished || count == max_payloads ||
+            data_len + len > max_data_len)
+        {
+            ok = false;
+            return;
+        }
+        if(len == 0) return;
+        segs[1 + count++] = {data, len};
+        data_len += len;
+        sum += sum_bytes(data, len);
+    }
+
+    /**
+     * \brief Fill in the length and checksum, after which the package can
+     * be sent
+     */
+    void finish() {
+        if(finished) return;
+        finished = true;
+        if(data_len == 0) ok = false;
+        uint16_t length = data_len + R502_cs_len;
+        head[7] = length >> 8;
+        head[8] = length & 0xff;
+        sum += head[6] + head[7] + head[8];
+        checksum[0] = (sum >> 8) & 0xff;
+        checksum[1] = sum & 0xff;
+
+        segs[0].len = head_size + fields_len;
+        segs[count + 1] = {checksum, R502_cs_len};
+        count += 2;
+    }
+
+    /**
+     * \brief Whether the package was built in order and fits its length
+     * field, and is finished
+     */
+    bool valid() const { return ok && finished; }
+
+    const R502_segment_t *segments() const { return segs; }
+    int segment_count() const { return count; }
+
+    /**
+     * \brief Total bytes of the package, start code to checksum
+     */
+    size_t length() const { return head_size + data_len + R502_cs_len; }
+
+    R502_pid_t pid() const { return (R502_pid_t)head[6]; }
+
+    /**
+     * \brief Instruction code of a command package, 0 for a package of
+     * payload only
+     */
+    uint8_t instr_code() const { return head[head_size]; }
+
+    /**
+     * \brief Hand each segment in order to write(const uint8_t *, size_t),
+     * stopping at the first error it returns
+     */
+    template<typename W>
+    esp_err_t write(W &&write_segment) const {
+        if(!valid()) return ESP_ERR_INVALID_ARG;
+        for(int i = 0; i < count; i++){
+            esp_err_t err = write_segment(segs[i].data, segs[i].len);
+            if(err) return err;
+        }
+        return ESP_OK;
+    }
+
+private:
+    // start, adder, pid, length
+    static const size_t head_size = 9;
+
+    static uint32_t sum_bytes(const uint8_t *data, size_t len) {
+        uint32_t s = 0;
+        for(size_t i = 0; i < len; i++){
+            s += data[i];
+        }
+        return s;
+    }
+
+    uint8_t head[head_size + max_fields];
+    uint8_t checksum[R502_cs_len];
+    R502_segment_t segs[max_segments];
+    int count = 0;
+    size_t fields_len = 0;
+    size_t data_len = 0;
+    uint32_t sum = 0;
+    bool finished = false;
+    bool ok = true;
+};
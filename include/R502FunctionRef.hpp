@@ -0,0 +1,73 @@
+/**
+ * \file R502FunctionRef.hpp
+ * \brief Non-owning callback and byte span types, neither ever allocates
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+
+/**
+ * \brief View of bytes owned by someone else, valid for the duration of the
+ * call it is passed to
+ */
+class R502ByteSpan {
+public:
+    R502ByteSpan() : ptr(nullptr), len(0) {}
+    R502ByteSpan(const uint8_t *_ptr, size_t _len) : ptr(_ptr), len(_len) {}
+
+    const uint8_t *data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    const uint8_t *begin() const { return ptr; }
+    const uint8_t *end() const { return ptr + len; }
+    uint8_t operator[](size_t i) const { return ptr[i]; }
+
+private:
+    const uint8_t *ptr;
+    size_t len;
+};
+
+template<typename Signature> class R502FunctionRef;
+
+/**
+ * \brief Reference to any callable, the allocation-free alternative to
+ * std::function for callbacks that are only used during the call they are
+ * passed to
+ *
+ * Holds a pointer to the callable and a pointer to a function that calls it,
+ * so the callable has to outlive the R502FunctionRef. Never store one that
+ * was made from a temporary lambda
+ */
+template<typename R, typename... Args>
+class R502FunctionRef<R(Args...)> {
+public:
+    template<typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type,
+            R502FunctionRef>::value>::type>
+    R502FunctionRef(F &&f) :
+        obj((void *)&f),
+        call(&invoke<typename std::remove_reference<F>::type>) {}
+
+    R502FunctionRef(R (*f)(Args...)) :
+        obj((void *)f), call(&invoke_pointer) {}
+
+    R operator()(Args... args) const {
+        return call(obj, std::forward<Args>(args)...);
+    }
+
+private:
+    template<typename F>
+    static R invoke(void *obj, Args... args) {
+        return (*(F *)obj)(std::forward<Args>(args)...);
+    }
+
+    static R invoke_pointer(void *obj, Args... args) {
+        return ((R (*)(Args...))obj)(std::forward<Args>(args)...);
+    }
+
+    void *obj;
+    R (*call)(void *, Args...);
+};
@@ -0,0 +1,71 @@
+/**
+ * \file R502ImageAssembler.hpp
+ * \brief up_image consumer that puts the whole image in one buffer
+ */
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "R502Definitions.hpp"
+#include "R502FunctionRef.hpp"
+
+/**
+ * \brief Copies up_image frames, in order, into a contiguous buffer
+ *
+ * Counts what actually arrives, so a bigger image than R502_image_size is
+ * measured correctly even when it doesn't fit. Frames past the end of the
+ * buffer are counted and dropped
+ */
+class R502ImageAssembler {
+public:
+    R502ImageAssembler(uint8_t *_buffer, size_t _capacity,
+        R502_image_format_t _format) : buffer(_buffer), capacity(_capacity),
+        format(_format) {}
+
+    void operator()(R502ByteSpan frame) {
+        frames++;
+        size_t len = format == R502_image_packed ? frame.size() :
+            frame.size() * 2;
+        if(bytes + len > capacity){
+            overflow = true;
+        }
+        else if(format == R502_image_packed){
+            memcpy(buffer + bytes, frame.data(), len);
+        }
+        else{
+            uint8_t *out = buffer + bytes;
+            for(size_t i = 0; i < frame.size(); i++){
+                out[i*2] = (frame[i] & 0xf) << 4;
+                out[i*2+1] = frame[i] & 0xf0;
+            }
+        }
+        bytes += len;
+    }
+
+    /**
+     * \brief Whether more arrived than fits in the buffer
+     */
+    bool overflowed() const { return overflow; }
+
+    /**
+     * \brief Geometry and size of what arrived so far
+     */
+    R502_image_info_t get_info() const {
+        size_t pixels = format == R502_image_packed ? bytes * 2 : bytes;
+        R502_image_info_t info;
+        info.width = R502_image_width;
+        info.height = pixels / R502_image_width;
+        info.bytes = bytes;
+        info.frames = frames;
+        info.format = format;
+        return info;
+    }
+
+private:
+    uint8_t *buffer;
+    size_t capacity;
+    R502_image_format_t format;
+    size_t bytes = 0;
+    int frames = 0;
+    bool overflow = false;
+};
@@ -0,0 +1,159 @@
+/**
+ * \file R502ImageBatch.hpp
+ * \brief Processes batches of packed images on a pool of threads, for hosts
+ * re-processing uploaded images in bulk
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "R502Definitions.hpp"
+#include "R502FunctionRef.hpp"
+
+/**
+ * \brief Measurements of one image
+ */
+struct R502_image_stats_t {
+    uint32_t histogram[16]; //!< Pixels of each 4 bit value
+    uint8_t pixel_min; //!< Darkest pixel, as an 8 bit value
+    uint8_t pixel_max; //!< Brightest pixel, as an 8 bit value
+    uint16_t pixel_mean; //!< Mean pixel value, 8.8 fixed point
+    uint16_t pixel_stddev; //!< Standard deviation, 8.8 fixed point
+    /// Mean squared difference between horizontally and vertically
+    /// neighbouring 8 bit pixels, high for sharp ridges
+    uint32_t sharpness;
+    /// 0 to 100, for ranking images against each other. Full marks need a
+    /// standard deviation of 64 and a root mean square neighbour difference
+    /// of 32, in 8 bit pixel values
+    uint8_t quality;
+};
+
+/**
+ * \brief One image of a batch, with where to put its results
+ */
+struct R502_batch_image_t {
+    /// As up_image receives it: rows of R502_image_width / 2 bytes, two 4
+    /// bit pixels per byte, the first in the low nibble
+    R502ByteSpan packed;
+    /// OUT the image contrast stretched to 0-255, one pixel per byte, room
+    /// for twice packed's bytes. nullptr to skip
+    uint8_t *normalized;
+    /// OUT the image shrunk by thumbnail_scale in both directions, averaging
+    /// each block, one 8 bit pixel per byte, rows of thumbnail_width.
+    /// nullptr to skip
+    uint8_t *thumbnail;
+    R502_image_stats_t stats; //!< OUT
+    /// OUT whether packed was whole rows, no more than R502_image_height of
+    /// them. Nothing else is set when it wasn't
+    bool valid;
+};
+
+/**
+ * \brief Throughput of the last batch
+ */
+struct R502_batch_stats_t {
+    uint32_t images;
+    int64_t elapsed_us; //!< From process being called to it returning
+    uint32_t images_per_second;
+    uint32_t steals; //!< Chunks of images a thread took from another's queue
+};
+
+/**
+ * \brief Runs the image kernels over batches on a work-stealing thread pool
+ *
+ * process splits a batch into chunks of images, dealt out to the threads'
+ * queues. Each thread works from the back of its own queue and, once that's
+ * empty, steals from the front of the others', so a thread given slower
+ * images doesn't hold up the batch. Every thread has its own arena for the
+ * expanded image and histogram, allocated once with the pool, so processing
+ * allocates nothing.
+ *
+ * The histogram counts packed bytes rather than pixels, and normalizing
+ * looks up both pixels of a byte in one table. Expanding, neighbour
+ * differences and thumbnails are plain byte loops the compiler vectorizes.
+ * Uses only R502Definitions.hpp and std::thread, so it builds on a Linux
+ * host as well as on the ESP32's two cores
+ */
+class R502ImageBatch {
+public:
+    static const int thumbnail_scale = 4;
+    static const int thumbnail_width = R502_image_width / thumbnail_scale;
+    /// Scratch process_one needs, 4 byte aligned
+    static const size_t arena_size =
+        R502_image_width * R502_image_height + 256 * sizeof(uint32_t);
+
+    /**
+     * \param threads Threads in the pool, 0 for one per core
+     */
+    explicit R502ImageBatch(int threads = 0);
+    ~R502ImageBatch();
+
+    R502ImageBatch(const R502ImageBatch &) = delete;
+    R502ImageBatch &operator=(const R502ImageBatch &) = delete;
+
+    /**
+     * \brief Process count images, returning when all are done
+     *
+     * Not to be called from several threads at once
+     */
+    void process(R502_batch_image_t *images, size_t count);
+
+    /**
+     * \brief Throughput of the last batch
+     */
+    const R502_batch_stats_t &get_stats() const { return stats; }
+
+    /**
+     * \brief Threads in the pool
+     */
+    int get_threads() const { return workers.size(); }
+
+    /**
+     * \brief Process one image on the calling thread
+     * \param image The image, and where to put its results
+     * \param arena arena_size bytes of scratch
+     */
+    static void process_one(R502_batch_image_t &image, uint8_t *arena);
+
+private:
+    struct chunk_t {
+        size_t first;
+        size_t last;
+    };
+
+    struct worker_t {
+        std::thread thread;
+        std::mutex mutex; // guards chunks
+        std::deque<chunk_t> chunks;
+        std::vector<uint8_t> arena;
+        uint32_t steals = 0;
+    };
+
+    /**
+     * \brief Body of worker id's thread
+     */
+    void run(int id);
+
+    /**
+     * \brief Take a chunk from worker id's queue, or steal one
+     * \retval Whether there was one left anywhere
+     */
+    bool next_chunk(int id, chunk_t &chunk);
+
+    std::vector<std::unique_ptr<worker_t>> workers;
+    // Guards the fields below, and wakes the workers and process
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    R502_batch_image_t *images = nullptr;
+    size_t remaining = 0;
+    uint32_t generation = 0; // of the batch, so a worker takes each once
+    bool stopping = false;
+    R502_batch_stats_t stats = {};
+};
@@ -0,0 +1,132 @@
+/**
+ * \file R502ImageCapture.hpp
+ * \brief Background capture of whole images into a pair of buffers
+ */
+
+#pragma once
+#include <atomic>
+#include "R502Interface.hpp"
+
+/**
+ * \brief An image filled by R502ImageCapture, the application's until it
+ * is released
+ */
+struct R502_captured_image_t {
+    uint8_t *data; //!< The image, info.bytes long
+    R502_image_info_t info; //!< What was actually received
+    int64_t captured_us; //!< esp_timer_get_time() when gen_image succeeded
+    int index; //!< Which buffer, for release
+};
+
+/**
+ * \brief Counters of an R502ImageCapture
+ */
+struct R502_capture_stats_t {
+    uint32_t captures; //!< Images handed to the application
+    uint32_t no_finger; //!< gen_image polls that found no finger
+    uint32_t errors; //!< Captures that failed on the link or the module
+    uint32_t resizes; //!< Buffers grown because an image didn't fit
+};
+
+/**
+ * \brief Captures images in a task, into one buffer while the application
+ * works on the other
+ *
+ * The capture task polls gen_image until a finger is on the sensor, uploads
+ * the image into a free buffer, and queues it for acquire. Once the
+ * application releases a buffer it is filled again, so with two buffers one
+ * capture is always in flight while the last image is being processed.
+ *
+ * Buffers are placed in PSRAM when there is some, and internal RAM
+ * otherwise. They start at the documented image size. An image that turns
+ * out bigger grows its buffer and is captured again
+ */
+class R502ImageCapture {
+public:
+    /**
+     * \param _iface Interface to the module, must be initialized before start
+     * \param _format Layout of the delivered images
+     */
+    R502ImageCapture(R502Interface &_iface,
+        R502_image_format_t _format = R502_image_8bit);
+    ~R502ImageCapture();
+
+    /**
+     * \brief Allocate the buffers and start the capture task
+     * \param _data_len The module's data package length, see up_image
+     * \param priority Priority of the capture task
+     * \retval ESP_OK: successful
+     *         ESP_ERR_NO_MEM: Couldn't allocate the buffers, queues or task
+     *
+     * Images acquired before are invalid once this is called
+     */
+    esp_err_t start(R502_data_len_t _data_len, UBaseType_t priority = 5);
+
+    /**
+     * \brief Stop the capture task, waiting for a capture in progress
+     *
+     * An acquired image stays valid until the next start or until the
+     * capture is destroyed
+     */
+    void stop();
+
+    /**
+     * \brief Take the oldest captured image
+     * \param image OUT the image, give it back with release
+     * \param timeout_ms How long to wait for one
+     * \retval ESP_OK: successful
+     *         ESP_ERR_TIMEOUT: No image within timeout_ms
+     *         ESP_ERR_INVALID_STATE: start hasn't been called
+     */
+    esp_err_t acquire(R502_captured_image_t &image, int timeout_ms);
+
+    /**
+     * \brief Hand an acquired image's buffer back to be filled again
+     */
+    void release(const R502_captured_image_t &image);
+
+    /**
+     * \brief Whether the buffers are in PSRAM
+     */
+    bool in_psram() const;
+
+    R502_capture_stats_t get_stats() const;
+
+private:
+    static const int buffer_count = 2;
+    static const int finger_poll_ms = 50;
+
+    static void capture_task(void *arg);
+
+    /**
+     * \brief Fill buffers[index] with a new image
+     * \retval true if it holds one, false to try again
+     */
+    bool capture(int index);
+
+    /**
+     * \brief Replace buffers[index] with one of size bytes
+     */
+    bool allocate(int index, size_t size);
+
+    R502Interface &iface;
+    const R502_image_format_t format;
+    R502_data_len_t data_len = R502_data_len_128;
+
+    uint8_t *buffers[buffer_count] = {};
+    size_t capacities[buffer_count] = {};
+    bool psram = false;
+    R502_captured_image_t images[buffer_count];
+
+    // Buffer indices, free to fill and filled for acquire
+    QueueHandle_t free_queue = nullptr;
+    QueueHandle_t ready_queue = nullptr;
+
+    std::atomic<bool> running;
+    std::atomic<bool> task_alive;
+
+    std::atomic<uint32_t> captures;
+    std::atomic<uint32_t> no_finger;
+    std::atomic<uint32_t> errors;
+    std::atomic<uint32_t> resizes;
+};
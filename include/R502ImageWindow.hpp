@@ -0,0 +1,129 @@
+/**
+ * \file R502ImageWindow.hpp
+ * \brief up_image consumer that crops and decimates the image as its frames
+ * stream in
+ */
+
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include "R502Definitions.hpp"
+#include "R502FunctionRef.hpp"
+
+/**
+ * \brief Turns up_image frames into the rows of an R502_image_window_t
+ *
+ * Pass it to up_image as the consumer. Each frame is placed in the image by
+ * its offset, the image being 192 rows of 96 bytes with two 4 bit pixels per
+ * byte, the first in the low nibble. Only the pixels the window keeps are
+ * read, and a frame with none of them isn't read at all
+ *
+ * Rows are handed to the row consumer as row_consumer(int row, R502ByteSpan
+ * pixels) once complete, with row counted from the top of the window and one
+ * 8 bit pixel per byte, scaled like the set_up_image_cb data
+ */
+template<typename F>
+class R502ImageWindow {
+public:
+    R502ImageWindow(const R502_image_window_t &_window, F _row_consumer) :
+        window(_window), row_consumer(_row_consumer) {}
+
+    /**
+     * \brief Whether the window fits the image and divides by its decimation
+     */
+    bool valid() const {
+        int d = window.decimation;
+        return d >= 1 && window.width > 0 && window.height > 0 &&
+            window.x + window.width <= R502_image_width &&
+            window.y + window.height <= R502_image_height &&
+            window.width % d == 0 && window.height % d == 0;
+    }
+
+    /**
+     * \brief Pixels in each delivered row
+     */
+    int out_width() const { return window.width / window.decimation; }
+
+    /**
+     * \brief Number of rows delivered per image
+     */
+    int out_height() const { return window.height / window.decimation; }
+
+    /**
+     * \brief Number of frames that held nothing of the window
+     */
+    int get_skipped_frames() const { return skipped_frames; }
+
+    void operator()(R502ByteSpan frame) {
+        int start = offset;
+        int end = offset + frame.size();
+        offset = end;
+
+        const int d = window.decimation;
+        const int window_end = window.x + window.width;
+        int first_row = std::max<int>(start / row_bytes, window.y);
+        int last_row = std::min<int>((end - 1) / row_bytes,
+            window.y + window.height - 1);
+        bool touched = false;
+        for(int row = first_row; row <= last_row; row++){
+            int in_block = (row - window.y) % d;
+            if(!window.average && in_block != 0) continue;
+
+            // Columns of the window that are in this frame
+            int row_start = row * row_bytes;
+            int begin = std::max<int>(window.x, (start - row_start) * 2);
+            int stop = std::min<int>(window_end, (end - row_start) * 2);
+            if(begin >= stop) continue;
+            touched = true;
+
+            const uint8_t *bytes = frame.data();
+            int base = row_start - start;
+            if(window.average){
+                for(int c = begin; c < stop; c++){
+                    acc[(c - window.x) / d] += pixel(bytes, base, c);
+                }
+            }
+            else{
+                // Only the columns decimation keeps
+                int c = begin + (d - (begin - window.x) % d) % d;
+                for(; c < stop; c += d){
+                    line[(c - window.x) / d] = pixel(bytes, base, c) << 4;
+                }
+            }
+            if(stop == window_end){
+                finish_row(row, in_block);
+            }
+        }
+        if(!touched){
+            skipped_frames++;
+        }
+    }
+
+private:
+    static const int row_bytes = R502_image_width / 2;
+
+    static uint8_t pixel(const uint8_t *bytes, int base, int column) {
+        uint8_t byte = bytes[base + column / 2];
+        return (column & 1) ? byte >> 4 : byte & 0xf;
+    }
+
+    void finish_row(int row, int in_block) {
+        const int d = window.decimation;
+        if(window.average){
+            if(in_block != d - 1) return;
+            for(int i = 0; i < out_width(); i++){
+                line[i] = (acc[i] << 4) / (d * d);
+                acc[i] = 0;
+            }
+        }
+        row_consumer((row - window.y) / d, R502ByteSpan(line, out_width()));
+    }
+
+    R502_image_window_t window;
+    F row_consumer;
+    int offset = 0;
+    int skipped_frames = 0;
+    uint8_t line[R502_image_width];
+    // Up to 192 x 192 pixels of 15 each per block, too many for 16 bits
+    uint32_t acc[R502_image_width] = {};
+};
@@ -1,16 +1,32 @@
+#pragma once
 #include <stdio.h>
 #include <cstring>
 #include <array>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "esp_timer.h"
 #include "esp_log.h"
+#include "esp_sleep.h"
 #include <functional>
+#include <algorithm>
 #include <cmath> // for min and max
 
 #include "R502Definitions.hpp"
+#include "R502TemplateIndex.hpp"
+#include "R502LinkStore.hpp"
+#include "R502TimeoutModel.hpp"
+#include "R502RetryPolicy.hpp"
+#include "R502FunctionRef.hpp"
+#include "R502Trace.hpp"
+#include "R502ImageWindow.hpp"
+#include "R502ImageAssembler.hpp"
+#include "R502FrameEncoder.hpp"
+
+class R502Bus;
 
 /**
  * @mainpage ESP32 R502 Interface
@@ -23,6 +39,19 @@
  * R502 module via UART
  */
 
+/**
+ * \brief How R502Interface::enter_idle saves power
+ */
+struct R502_idle_config_t {
+    /// Output switching the module's main supply, GPIO_NUM_NC to leave the
+    /// module powered. The touch sensor must stay powered separately
+    gpio_num_t pin_power;
+    int power_on_level; //!< Level of pin_power that powers the module
+    /// Put the esp32 in light sleep while waiting for a touch, instead of
+    /// only blocking the waiting task
+    bool light_sleep;
+};
+
 /**
  * \brief Provides command-level api to interact with the R502 fingerprint
  * scanner module
@@ -31,6 +60,10 @@ class R502Interface {
 public:
     typedef std::function<void(std::array<uint8_t, R502_max_data_len * 2> &data, 
         int data_len)> up_image_cb_t;
+    /// Consumer of up_image frames that doesn't allocate, see up_image
+    typedef R502FunctionRef<void(R502ByteSpan frame)> up_image_frame_ref_t;
+
+    R502Interface() {}
 
     /**
      * \brief initialize interface, must call first
@@ -43,6 +76,30 @@ public:
         gpio_num_t _pin_rxd, gpio_num_t _pin_irq, 
         R502_baud_t _baud = R502_baud_57600);
 
+    /**
+     * \brief initialize interface with the link settings saved by a previous
+     * session, instead of waiting a fixed delay for the module to start
+     * \param _uart_num The uart hardware port to use for communication
+     * \param _pin_txd Pin to transmit to R502
+     * \param _pin_rxd Pin to receive from R502
+     * \param _pin_irq Pin to receive inturrupt requests from R502 on
+     * \param store Where the baud rate, data package length and module address
+     * are loaded from. Settings changed later by set_baud_rate and
+     * set_data_package_length are saved back to it. Must outlive the interface
+     * \retval ESP_OK: successful, the module answered
+     *         ESP_ERR_NOT_FOUND: No response from the module at any baud rate,
+     *         the interface is still initialized and can be retried or deinit
+     *         Any error from configuring the uart or gpio hardware
+     *
+     * Listens for the module's power-on byte and probes it with ReadSysPara in
+     * between, so a module that is already running answers the first probe.
+     * That single round trip checks the stored settings. Only if it fails are
+     * the other baud rates probed, and the settings found are saved for next
+     * time. See get_boot_timing for how long it took
+     */
+    esp_err_t warm_init(uart_port_t _uart_num, gpio_num_t _pin_txd, 
+        gpio_num_t _pin_rxd, gpio_num_t _pin_irq, R502LinkStore &store);
+
     /**
      * \brief Deinitialize interface, free hardware uart and gpio resources
      */
@@ -59,6 +116,98 @@ public:
      */
     void set_up_image_cb(up_image_cb_t _up_image_cb);
 
+    /**
+     * \brief Return the host-side index of occupied template library slots
+     *
+     * Kept up to date by store, delete_char and empty. Check is_synced()
+     * before trusting it, or use sync_template_index/find_free_page
+     */
+    const R502TemplateIndex &get_template_index();
+
+    /**
+     * \brief Return timestamps of the last init or warm_init, and of the first
+     * successful capture after it
+     */
+    const R502_boot_timing_t &get_boot_timing();
+
+    /**
+     * \brief Return the baud rate, data package length and address in use
+     */
+    R502_link_config_t get_link_config();
+
+    /**
+     * \brief Return the model deciding how long to wait for each response, 
+     * with the latency it has learned per instruction
+     */
+    const R502TimeoutModel &get_timeout_model();
+
+    /**
+     * \brief Set how commands that are safe to repeat are retried after a
+     * timeout, short response or checksum failure
+     *
+     * Defaults to 3 attempts, with a 10ms backoff doubling up to 100ms. Set
+     * max_attempts to 1 to turn retries off
+     */
+    void set_retry_config(const R502_retry_config_t &config);
+
+    /**
+     * \brief Return counters of link errors and retries
+     */
+    const R502_retry_stats_t &get_retry_stats();
+
+    /**
+     * \brief Put the module and the uart in their low-power states until
+     * the next touch
+     * \param config What to power down, copied. If pin_power is used it
+     * must already be configured as an output powering the module
+     * \retval ESP_OK: successful, commands fail with ESP_ERR_INVALID_STATE
+     *         until exit_idle
+     *         ESP_ERR_INVALID_STATE: init hasn't been called
+     *         ESP_ERR_NOT_SUPPORTED: The module is on an R502Bus, whose uart
+     *         the other modules still use
+     *         Any error from configuring the uart or gpio hardware. The
+     *         steps already taken are undone and the interface isn't idle,
+     *         but a module that was switched off is still starting again
+     *
+     * The uart stops receiving, and with pin_power set the module is
+     * switched off and txd stops driving its rx pin. The touch irq, which
+     * the module raises even when switched off, is the wake source
+     */
+    esp_err_t enter_idle(const R502_idle_config_t &config);
+
+    /**
+     * \brief Wait in the idle state for the touch irq
+     * \param timeout_ms Give up after this long
+     * \retval ESP_OK: A finger touched the sensor
+     *         ESP_ERR_TIMEOUT: No touch within timeout_ms
+     *         ESP_ERR_INVALID_STATE: Not idle
+     */
+    esp_err_t wait_for_touch(int timeout_ms);
+
+    /**
+     * \brief Leave the idle state and restore the link
+     * \retval ESP_OK: successful, the module answered
+     *         ESP_ERR_NOT_FOUND: The module didn't answer. The interface
+     *         isn't idle anymore, commands can be retried
+     *         Any error from configuring the uart or gpio hardware
+     *
+     * The link settings are unchanged, so a single ReadSysPara round trip
+     * verifies it. A module that was switched off is given until its ready
+     * byte to start
+     */
+    esp_err_t exit_idle();
+
+    /**
+     * \brief Whether the interface is between enter_idle and exit_idle
+     */
+    bool is_idle();
+
+    /**
+     * \brief Return timestamps of the last idle period, to see what waking
+     * costs in capture latency
+     */
+    const R502_wake_timing_t &get_wake_timing();
+
     /// System Commands ///
 
     /**
@@ -80,6 +229,8 @@ public:
      * \param baud baud rate to set
      * \param res OUT confirmation code provided by the R502
      * \retval See vfy_pass for description of all possible return values
+     *         ESP_ERR_NOT_SUPPORTED: The module is on an R502Bus, every
+     *         module on it must use the bus's baud rate
      */
     esp_err_t set_baud_rate(R502_baud_t baud, R502_conf_code_t &res);
 
@@ -90,6 +241,19 @@ public:
      * \retval See vfy_pass for description of all possible return values
      */
     esp_err_t set_security_level(uint8_t security_level, R502_conf_code_t &res);
+
+    /**
+     * \brief Give the module a new address, used by every package after
+     * \param new_adder Address to set
+     * \param res OUT confirmation code provided by the R502
+     * \retval See vfy_pass for description of all possible return values
+     *
+     * The module acknowledges from its new address, so only one module may
+     * answer to the current one. See R502Bus::add to assign addresses on a
+     * shared line
+     */
+    esp_err_t set_adder(const std::array<uint8_t, 4> &new_adder,
+        R502_conf_code_t &res);
     
     /**
      * \brief Set data package length for transferring images with up_image and
@@ -122,6 +286,71 @@ public:
      */
     esp_err_t template_num(R502_conf_code_t &res, uint16_t &template_num);
 
+    /**
+     * \brief Read one page of the template index table
+     * \param index_page Which group of 256 templates to read, 0 to 3
+     * \param res OUT confirmation code provided by the R502
+     * \param table OUT one bit per template, bit 0 of byte 0 is the first
+     * template of the page. A set bit means the slot is used
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t read_index_table(uint8_t index_page, R502_conf_code_t &res,
+        std::array<uint8_t, R502_index_table_len> &table);
+
+    /**
+     * \brief Write one 32 byte page of the module's notepad flash
+     * \param page_number Page to write, 0 to 15
+     * \param content Bytes to write
+     * \param res OUT confirmation code provided by the R502
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t write_notepad(uint8_t page_number, 
+        const std::array<uint8_t, R502_notepad_page_size> &content,
+        R502_conf_code_t &res);
+
+    /**
+     * \brief Read one 32 byte page of the module's notepad flash
+     * \param page_number Page to read, 0 to 15
+     * \param res OUT confirmation code provided by the R502
+     * \param content OUT contents of the page
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t read_notepad(uint8_t page_number, R502_conf_code_t &res,
+        std::array<uint8_t, R502_notepad_page_size> &content);
+
+    /**
+     * \brief Read a random number from the module's generator
+     * \param res OUT confirmation code provided by the R502
+     * \param number OUT 32 bit random number
+     * \retval See vfy_pass for description of all possible return values
+     *
+     * One round trip per 4 bytes, see R502EntropyPool for more than that
+     */
+    esp_err_t get_random_code(R502_conf_code_t &res, uint32_t &number);
+
+    /**
+     * \brief Rebuild the template index from the module's index table
+     * \param res OUT confirmation code provided by the R502
+     * \retval See vfy_pass for description of all possible return values
+     *
+     * Costs one read_sys_para plus one read_index_table per page in use.
+     * Called automatically by find_free_page when the index isn't synced
+     */
+    esp_err_t sync_template_index(R502_conf_code_t &res);
+
+    /**
+     * \brief Find the lowest free page id in the template library
+     * \param res OUT confirmation code provided by the R502, R502_ok if no
+     * resync was needed
+     * \param page_id OUT lowest free page id
+     * \retval ESP_ERR_NOT_FOUND: The library is full
+     *         See vfy_pass for description of all other return values
+     *
+     * Answers from the template index without talking to the module, unless
+     * the index has to be resynced first
+     */
+    esp_err_t find_free_page(R502_conf_code_t &res, uint16_t &page_id);
+
     /// Fingerprint Processing Commands ///
 
     /**
@@ -141,7 +370,250 @@ public:
      */
     esp_err_t up_image(R502_data_len_t data_len, R502_conf_code_t &res);
 
+    /**
+     * \brief Upload the image in img_buffer, handing each data package to
+     * consumer as it arrives
+     * \param data_len See up_image
+     * \param res OUT confirmation code
+     * \param consumer Called with the payload of each data package, straight
+     * from the receive buffer. Each byte holds two 4 bit pixels, the first in
+     * the low nibble
+     * \retval See vfy_pass for description of all possible return values
+     *
+     * Unlike set_up_image_cb, nothing is copied or expanded and nothing is
+     * allocated, and the call to consumer is inlined
+     */
+    template<typename F>
+    esp_err_t up_image(R502_data_len_t data_len, R502_conf_code_t &res,
+        F &&consumer)
+    {
+        esp_err_t err = check_data_len(data_len);
+        if(err) return err;
+        return up_image_frames<R502_max_data_len>(
+            R502_data_len_bytes(data_len), res, consumer);
+    }
+
+    /**
+     * \brief Upload the image in img_buffer, delivering only a window of it
+     * at full or reduced resolution
+     * \param data_len See up_image
+     * \param window Part of the image to deliver, and its decimation
+     * \param res OUT confirmation code
+     * \param row_consumer Called as row_consumer(int row, R502ByteSpan
+     * pixels) for each row of the window, top to bottom, with one 8 bit pixel
+     * per byte
+     * \retval ESP_ERR_INVALID_ARG: window doesn't fit in the image, or isn't
+     *         a multiple of its decimation
+     *         See vfy_pass for description of all other return values
+     *
+     * Rows are put together as the frames arrive, see R502ImageWindow. Only
+     * the kept pixels are expanded, frames outside the window are skipped
+     */
+    template<typename F>
+    esp_err_t up_image(R502_data_len_t data_len, 
+        const R502_image_window_t &window, R502_conf_code_t &res, 
+        F &&row_consumer)
+    {
+        R502ImageWindow<F &> windowed(window, row_consumer);
+        if(!windowed.valid()){
+            ESP_LOGE(TAG, "invalid image window");
+            return ESP_ERR_INVALID_ARG;
+        }
+        return up_image(data_len, res, windowed);
+    }
+
+    /**
+     * \brief As the template up_image, for callers that can't be templates
+     */
+    esp_err_t up_image(R502_data_len_t data_len, R502_conf_code_t &res,
+        up_image_frame_ref_t consumer);
+
+    /**
+     * \brief Upload the image in img_buffer into one contiguous buffer
+     * \param data_len See up_image
+     * \param res OUT confirmation code
+     * \param buffer Where to put the image
+     * \param capacity Size of buffer in bytes
+     * \param format Packed as received, or one pixel per byte
+     * \param info OUT geometry and size of the image that arrived
+     * \retval ESP_ERR_INVALID_SIZE: The image didn't fit, info.bytes is the
+     *         capacity it needs. The whole image was still received
+     *         See vfy_pass for description of all other return values
+     *
+     * The size comes from the data packages received, not R502_image_size
+     */
+    esp_err_t up_image(R502_data_len_t data_len, R502_conf_code_t &res,
+        uint8_t *buffer, size_t capacity, R502_image_format_t format,
+        R502_image_info_t &info);
+
+    /**
+     * \brief Download an image from image to img_buffer
+     * \param data_len The configured data_package_length of the module, see
+     * up_image
+     * \param image The image packed as up_image receives it, two 4 bit pixels
+     * per byte
+     * \param len Bytes in image, R502_image_size / 2 for a whole image
+     * \param res OUT confirmation code
+     * \retval ESP_ERR_INVALID_ARG: len is 0
+     *         See vfy_pass for description of all other return values
+     *
+     * Each data package is sent straight from image, nothing is copied. The
+     * module doesn't acknowledge data packages, res only says whether it
+     * accepted the transfer
+     */
+    esp_err_t down_image(R502_data_len_t data_len, const uint8_t *image,
+        size_t len, R502_conf_code_t &res);
+
+    /**
+     * \brief Generate a character file from the image in img_buffer
+     * \param buffer_id Character buffer to store the file in
+     * \param res OUT confirmation code
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t img_2_tz(R502_char_buffer_t buffer_id, R502_conf_code_t &res);
+
+    /**
+     * \brief Compare the templates in character buffers 1 and 2
+     * \param res OUT confirmation code, R502_err_no_match if they differ
+     * \param match_score OUT how closely they matched
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t match(R502_conf_code_t &res, uint16_t &match_score);
+
+    /**
+     * \brief Check the image in img_buffer against the template at page_id
+     * alone, for when the user has already claimed an identity
+     * \param page_id Library position of the claimed template
+     * \param res OUT confirmation code, R502_ok if it matched,
+     * R502_err_no_match if it didn't, otherwise why the image couldn't be
+     * extracted or the template loaded
+     * \param match_score OUT how closely it matched
+     * \retval See vfy_pass for description of all possible return values
+     *
+     * Extracts the image into character buffer 1, loads the template into
+     * character buffer 2 with load_char and compares them with match, three
+     * short commands where search would compare against every template. The
+     * template stays in buffer 2, so a retry with a new capture skips the
+     * load, see is_resident
+     */
+    esp_err_t verify(uint16_t page_id, R502_conf_code_t &res,
+        uint16_t &match_score);
+
+    /**
+     * \brief Whether character buffer 2 holds the template at page_id, as
+     * last loaded by verify or load_char
+     *
+     * Commands through this interface that write buffer 2 or page_id, and
+     * powering the module down, forget it
+     */
+    bool is_resident(uint16_t page_id) const {
+        return resident_page == page_id;
+    }
+
+    /// Fingerprint Library Commands ///
+
+    /**
+     * \brief Search part of the library for the template in a character
+     * buffer
+     * \param buffer_id Character buffer to search with
+     * \param start_page First library position to search
+     * \param page_num Number of library positions to search
+     * \param res OUT confirmation code, R502_err_not_found if nothing matched
+     * \param page_id OUT library position of the match
+     * \param match_score OUT how closely it matched
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t search(R502_char_buffer_t buffer_id, uint16_t start_page,
+        uint16_t page_num, R502_conf_code_t &res, uint16_t &page_id,
+        uint16_t &match_score);
+
+    /**
+     * \brief Store the template in a character buffer into the library
+     * \param buffer_id Character buffer holding the template
+     * \param page_id Library position to store the template at
+     * \param res OUT confirmation code
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t store(R502_char_buffer_t buffer_id, uint16_t page_id,
+        R502_conf_code_t &res);
+
+    /**
+     * \brief Delete count templates from the library, starting at page_id
+     * \param page_id First library position to delete
+     * \param count Number of templates to delete
+     * \param res OUT confirmation code
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t delete_char(uint16_t page_id, uint16_t count,
+        R502_conf_code_t &res);
+
+    /**
+     * \brief Delete every template in the library
+     * \param res OUT confirmation code
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t empty(R502_conf_code_t &res);
+
+    /**
+     * \brief Load the template at page_id of the library into a character
+     * buffer
+     * \param buffer_id Character buffer to load it into
+     * \param page_id Library position to load
+     * \param res OUT confirmation code
+     * \retval See vfy_pass for description of all possible return values
+     */
+    esp_err_t load_char(R502_char_buffer_t buffer_id, uint16_t page_id,
+        R502_conf_code_t &res);
+
+    /**
+     * \brief Upload the character file in a character buffer
+     * \param buffer_id Character buffer to upload
+     * \param res OUT confirmation code
+     * \param char_file OUT the character file
+     * \retval ESP_ERR_INVALID_SIZE: The module sent more or less than a
+     *         character file
+     *         See vfy_pass for description of all other return values
+     *
+     * The file arrives in data packages of the module's data package length
+     */
+    esp_err_t up_char(R502_char_buffer_t buffer_id, R502_conf_code_t &res,
+        std::array<uint8_t, R502_character_file_size> &char_file);
+
+    /**
+     * \brief Download a character file into a character buffer, e.g. to
+     * store it in the library
+     * \param buffer_id Character buffer to download into
+     * \param char_file The character file, as up_char received it
+     * \param res OUT confirmation code
+     * \retval See vfy_pass for description of all possible return values
+     *
+     * The data packages are sent straight from char_file, the module only
+     * acknowledges the command
+     */
+    esp_err_t down_char(R502_char_buffer_t buffer_id,
+        const std::array<uint8_t, R502_character_file_size> &char_file,
+        R502_conf_code_t &res);
+
 private:
+    // The coroutine API builds its packages and learns timeouts here too
+    friend class R502AsyncSensor;
+    friend class R502UartLink;
+    // Installs the index it rebuilt in steps
+    friend class R502IndexSyncJob;
+    // Pipelines packages on the bus it holds
+    friend class R502CommandBatch;
+    template<R502_data_len_t DataLen, uint32_t Commands>
+    friend class R502FixedInterface;
+    // Shares its uart with the modules on it
+    friend class R502Bus;
+
+    /**
+     * \brief Interface that never receives data packages longer than
+     * _max_data_len bytes
+     */
+    explicit R502Interface(int _max_data_len) : 
+        max_data_len(_max_data_len) {}
+
     static const char *TAG;
 
     /**
@@ -162,13 +634,89 @@ private:
     esp_err_t set_sys_para(R502_para_num parameter_num, int value, 
         R502_conf_code_t &res);
 
+    /**
+     * \brief Read system parameters, waiting at most read_delay_ms
+     */
+    esp_err_t read_sys_para(R502_conf_code_t &res, R502_sys_para_t &sys_para,
+        int read_delay_ms);
+
+    /**
+     * \brief Check data_len is a valid length this interface can receive
+     * \retval ESP_OK: valid
+     *         ESP_ERR_INVALID_ARG: not an R502_data_len_t, or longer than
+     *         max_data_len
+     */
+    esp_err_t check_data_len(R502_data_len_t data_len);
+
+    /**
+     * \brief Send UpImage and hand each data package to consumer
+     * \param data_len Bytes of data in each data package, at most Capacity
+     *
+     * Capacity sizes the receive buffer. When data_len is a constant too, the
+     * frame size and frame count are compile-time constants
+     */
+    template<int Capacity, typename F>
+    esp_err_t up_image_frames(int data_len, R502_conf_code_t &res, 
+        F &consumer);
+
+    /**
+     * \brief Install the uart driver with its event queue
+     */
+    esp_err_t install_uart_driver();
+
+    /**
+     * \brief Configure the irq pin and add its interrupt handler
+     */
+    esp_err_t install_irq(gpio_num_t _pin_irq);
+
+    /**
+     * \brief Configure the uart and irq hardware, without talking to the
+     * module
+     */
+    esp_err_t init_hardware(uart_port_t _uart_num, gpio_num_t _pin_txd, 
+        gpio_num_t _pin_rxd, gpio_num_t _pin_irq, R502_baud_t _baud);
+
+    /**
+     * \brief Undo the hardware steps of enter_idle, for exit_idle or an
+     * enter_idle that failed part way
+     * \param powered_down Whether idle_config.pin_power was used
+     * \param light_sleep Whether the irq pin was set up as a wakeup source
+     */
+    esp_err_t restore_link(bool powered_down, bool light_sleep);
+
+    /**
+     * \brief Wait for the module to answer a ReadSysPara probe
+     * \param timeout_ms Give up after this long
+     * \param sys_para OUT parameters returned by the answering probe
+     * \param round_trips IN/OUT incremented for each probe sent
+     * \retval ESP_OK: module answered
+     *         ESP_ERR_NOT_FOUND: No answer before timeout_ms
+     */
+    esp_err_t wait_until_ready(int timeout_ms, R502_sys_para_t &sys_para,
+        int &round_trips);
+
+    /**
+     * \brief Probe each baud rate other than the current one until the
+     * module answers, leaving the uart at that baud rate
+     * \retval ESP_OK: module answered
+     *         ESP_ERR_NOT_FOUND: No answer at any baud rate
+     */
+    esp_err_t discover_baud_rate(R502_sys_para_t &sys_para);
+
+    /**
+     * \brief Save the current link settings to link_store, if there is one
+     */
+    void save_link_config();
+
     /**
      * \brief Send a command to the module, and read its acknowledgement
      * \param pkg data to send
      * \param receivePkg OUT package to read response data into
      * \param data_rec_length number of data bytes to receive into
      * receivePkg.data
-     * \param read_delay_ms Max number of ms to wait for a response
+     * \param read_delay_ms Max number of ms to wait for a response, by
+     * default the timeout model decides from the instruction code. Commands
+     * with an explicit delay are never retried
      * \retval ESP_OK: successful
      *         ESP_ERR_INVALID_STATE: Error sending or recieving via UART
      *         ESP_ERR_INVALID_SIZE: Not all data was sent out
@@ -178,17 +726,52 @@ private:
      */
     esp_err_t send_command_package(const R502_DataPkg_t &pkg,
         R502_DataPkg_t &receivePkg, int data_rec_length, 
-        int read_delay_ms = default_read_delay);
+        int read_delay_ms = model_read_delay);
 
     /**
-     * \brief Send a filled package to the module
-     * \param pkg A filled package, depends on length being filled
+     * \brief Send a command built by an R502FrameEncoder, see
+     * send_command_package
+     * \param idempotent Whether the command may be repeated after a lost
+     * response, see R502RetryPolicy::is_idempotent
+     */
+    esp_err_t send_command_frame(const R502FrameEncoder &frame,
+        bool idempotent, R502_DataPkg_t &receivePkg, int data_rec_length,
+        int read_delay_ms = model_read_delay);
+
+    /**
+     * \brief Make a single attempt at a command, see send_command_package
+     */
+    esp_err_t send_and_receive(const R502FrameEncoder &frame,
+        R502_DataPkg_t &receivePkg, int data_rec_length, int read_delay_ms);
+
+    /**
+     * \brief Discard received bytes until a package boundary
+     * \param window_ms Discard for at least this long, then until the line
+     * goes quiet
+     * \retval Number of bytes discarded
+     */
+    int drain_to_boundary(int window_ms);
+
+    /**
+     * \brief Send a package to the module
+     * \param frame A finished package
      * \retval ESP_OK: successful
                ESP_ERR_INVALID_ARG: Package length not set correctly
      *         ESP_ERR_INVALID_STATE: Error sending or recieving via UART
      *         ESP_ERR_INVALID_SIZE: Not all data was sent out
+     *
+     * Each segment is written to the uart on its own, so payloads go from
+     * their buffers to the fifo without being gathered first
+     */
+    esp_err_t send_package(const R502FrameEncoder &frame);
+
+    /**
+     * \brief Send data as data packages of data_len bytes, the last one as
+     * an end of data package
+     * \retval See send_package
      */
-    esp_err_t send_package(const R502_DataPkg_t &pkg);
+    esp_err_t send_data_packages(const uint8_t *data, size_t len,
+        int data_len);
 
     /**
      * \brief Receive a package from the module
@@ -198,10 +781,47 @@ private:
      * \retval ESP_OK: successful
      *         ESP_ERR_INVALID_STATE: Error sending or recieving via UART
      *         ESP_ERR_NOT_FOUND: No data was received
-     *         ESP_ERR_INVALID_SIZE: Less than data_rec_length was received
+     *         ESP_ERR_INVALID_RESPONSE: Package was cut short, or its header
+     *         is incorrect
+     *         ESP_ERR_INVALID_CRC: Package had failed CRC
+     *
+     * Blocks on the uart event queue rather than on a byte count. Bytes in
+     * front of the start code are skipped, then the header is read and only
+     * the length it announces. On an R502Bus, packages from other addresses
+     * are skipped too and counted against their module
      */
     esp_err_t receive_package(const R502_DataPkg_t &rec_pkg, 
-        int data_length, int read_delay_ms = default_read_delay);
+        int data_length, int read_delay_ms);
+
+    /**
+     * \brief Take another module's package off a shared line and hand it
+     * to the bus
+     * \param header The package's header, already read
+     * \param deadline esp_timer_get_time() value to give up at
+     * \retval ESP_OK: The rest of the package was read
+     *         ESP_ERR_TIMEOUT: deadline passed first
+     *         See wait_for_rx for the other values
+     */
+    esp_err_t skip_package(const R502_DataPkg_t &header, int64_t deadline);
+
+    /**
+     * \brief Wait on the uart event queue until length bytes are buffered
+     * \param length Number of bytes needed
+     * \param deadline esp_timer_get_time() value to give up at
+     * \retval ESP_OK: length bytes are buffered
+     *         ESP_ERR_TIMEOUT: deadline passed first
+     *         ESP_ERR_INVALID_RESPONSE: The receive buffer overflowed and was
+     *         flushed
+     */
+    esp_err_t wait_for_rx(int length, int64_t deadline);
+
+    /**
+     * \brief Drop bytes in front of the first start code in buf
+     * \param buf Received bytes
+     * \param len Number of bytes in buf
+     * \retval Number of bytes dropped
+     */
+    int sync_to_start(uint8_t *buf, int len);
 
     void set_headers(R502_DataPkg_t &package, R502_pid_t pid,
         uint16_t length);
@@ -220,36 +840,71 @@ private:
     esp_err_t verify_headers(const R502_DataPkg_t &pkg, uint16_t length);
 
     /**
-     * \brief Return the total number of bytes in a filled package
-     * \param pkg Package to measure
-     * This uses the filled length parameter, so it doesn't need to know what
-     * type of package data it is. But length needs to be properly filled before
-     * calling
-     * Includes start, adder, pid, length, data and checksum bytes
+     * \brief Holds the bus mutex for its lifetime, so commands from other
+     * tasks can't interleave with a package exchange
      */
-    uint16_t package_length(const R502_DataPkg_t &pkg);
+    class BusLock {
+    public:
+        BusLock(SemaphoreHandle_t _mutex) : mutex(_mutex) {
+            if(mutex) xSemaphoreTakeRecursive(mutex, portMAX_DELAY);
+        }
+        ~BusLock() {
+            if(mutex) xSemaphoreGiveRecursive(mutex);
+        }
+    private:
+        SemaphoreHandle_t mutex;
+    };
 
     uint16_t conv_8_to_16(const uint8_t in[2]);
     void conv_16_to_8(const uint16_t in, uint8_t out[2]);
 
-    void busy_delay(int64_t microseconds);
-
     static void IRAM_ATTR irq_intr(void *arg);
 
     // callbacks
     up_image_cb_t up_image_cb = nullptr;
 
+    // host-side copy of the module's index table
+    R502TemplateIndex template_index;
+    // Library page in character buffer 2, -1 if it holds something else
+    int resident_page = -1;
+
     // parameters
     uint8_t adder[4] = {0xFF, 0xFF, 0xFF, 0xFF};
 
     // shouldn't need these here. Try not to store data members for parameters
-    R502_baud_t cur_baud;
-    int cur_data_pkg_len = 128;
+    R502_baud_t cur_baud = R502_baud_57600;
+    R502_data_len_t cur_data_len = R502_data_len_128;
+    // longest data package the receive buffers have room for
+    const int max_data_len = R502_max_data_len;
+
+    // learns how long the module takes to respond to each instruction
+    R502TimeoutModel timeout_model;
+    R502RetryPolicy retry_policy;
+
+    // where warm_init found the link settings, null after init
+    R502LinkStore *link_store = nullptr;
+    R502_boot_timing_t boot_timing = {0, -1, -1, false, 0};
+
+    // low-power idle, see enter_idle
+    bool idle = false;
+    R502_idle_config_t idle_config;
+    R502_wake_timing_t wake_timing = {-1, -1, -1, -1, 0};
+    volatile int64_t last_irq_us = -1;
+    // task blocked in wait_for_touch, woken by irq_intr
+    volatile TaskHandle_t irq_waiter = nullptr;
+    // given by irq_intr for an R502TaskScheduler idling on R502UartLink
+    volatile SemaphoreHandle_t irq_wake = nullptr;
 
     bool initialized = false;
-    int interrupt = 0;
+    volatile int interrupt = 0;
+
+    // the bus sharing its uart, null if the uart is this interface's own
+    R502Bus *bus = nullptr;
 
     uart_port_t uart_num;
+    QueueHandle_t uart_queue = nullptr;
+    // Recursive, up_image holds it across its command and data packages
+    SemaphoreHandle_t bus_mutex = nullptr;
     gpio_num_t pin_txd;
     gpio_num_t pin_rxd;
     gpio_num_t pin_irq;
@@ -261,10 +916,90 @@ private:
     // Private constants
     const uint8_t start[2] = {0xEF, 0x01};
     static const uint16_t system_identifier_code = 9;
-    static const int default_read_delay = 200; // ms
-    static const int read_delay_gen_image = 2000; // ms
-    // The slowest speed is transfering 256 byte payload at 9600 baud
-    static const int min_uart_buffer_size = 256;
+    // read delay that lets timeout_model decide
+    static const int model_read_delay = -1;
+    static const int probe_read_delay = 50; // ms
+    static const int ready_listen_time = 20; // ms
+    static const int warm_ready_timeout = 1000; // ms
+    static const uint8_t power_on_ready_byte = 0x55;
+    // The driver needs more than the 128 byte hardware fifo
+    static const int min_uart_buffer_size = 129;
+    static const int uart_queue_size = 20;
     static const int header_size = 
         sizeof(R502_DataPkg_t) - sizeof(R502_DataPkg_t::data);
-};
\ No newline at end of file
+    // Room for two whole packages, so the next arrives while the last is
+    // read out
+    static constexpr int uart_buffer_size(int data_len) {
+        return std::max<int>(2 * (header_size + data_len + R502_cs_len),
+            min_uart_buffer_size);
+    }
+};
+
+template<int Capacity, typename F>
+esp_err_t R502Interface::up_image_frames(int data_len, R502_conf_code_t &res,
+    F &consumer)
+{
+    R502_DataPkg_t pkg;
+    R502_GeneralCommand_t *data = &pkg.data.general;
+
+    // The data packages follow the acknowledgement, nothing may cut in
+    BusLock lock(bus_mutex);
+
+    // TODO: Check stored parameters to see if the R502 has an image ready
+    // to send. If not, still perform the transfer, but send a warning
+
+    // Fill package
+    set_headers(pkg, R502_pid_command, sizeof(R502_GeneralCommand_t));
+    data->instr_code = R502_ic_up_image;
+    fill_checksum(pkg);
+
+    // Send package, get response
+    R502_DataPkg_t receive_pkg;
+    R502_GeneralAck_t *receive_data = &receive_pkg.data.general_ack;
+    esp_err_t err = send_command_package(pkg, receive_pkg, 
+        sizeof(*receive_data));
+    if(err) return err;
+
+    res = (R502_conf_code_t)receive_data->conf_code;
+    if(res != R502_ok){ 
+        // The esp side of things is ok, but the module isn't ready to send
+        return ESP_OK;
+    }
+
+    // receive data packages
+    R502_DataPkgN_t<Capacity> data_pkg;
+    R502_pid_t pid = R502_pid_data;
+    const uint8_t *rec_data = data_pkg.data.content;
+    int bytes_received = 0;
+    int frames = 0;
+    const int package_len = data_len + R502_cs_len + header_size;
+    // Packed, an image is R502_image_size / 2 bytes
+    const int max_frames = R502_image_size / 2 / data_len;
+    const uint8_t key = R502TimeoutModel::data_package_key;
+    while(pid == R502_pid_data){
+        if(frames++ == max_frames){
+            ESP_LOGE(TAG, "more data packages than any image holds");
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        int read_delay_ms = timeout_model.timeout_ms(key, 0, package_len, 
+            cur_baud);
+        int64_t start = esp_timer_get_time();
+        // Same header layout, receive_package only reads package_len bytes
+        err = receive_package((R502_DataPkg_t &)data_pkg, package_len, 
+            read_delay_ms);
+        if(err == ESP_ERR_NOT_FOUND || err == ESP_ERR_INVALID_RESPONSE){
+            timeout_model.record_timeout(key);
+        }
+        if(err) return err;
+        timeout_model.record(key, esp_timer_get_time() - start, 0, 
+            package_len, cur_baud);
+        bytes_received += data_len;
+
+        pid = (R502_pid_t)data_pkg.pid;
+        R502Trace::record(R502_trace_callback, pid, frames);
+        consumer(R502ByteSpan(rec_data, data_len));
+    }
+    ESP_LOGI(TAG, "bytes received %d", bytes_received);
+
+    return ESP_OK;
+}
@@ -0,0 +1,121 @@
+/**
+ * \file R502LibraryMaintenance.hpp
+ * \brief Bulk deletes and compaction of the template library, in as few
+ * commands as possible
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "R502Interface.hpp"
+#include "R502FunctionRef.hpp"
+
+/**
+ * \brief One delete_char command, count pages from page_id
+ */
+struct R502_delete_run_t {
+    uint16_t page_id;
+    uint16_t count;
+};
+
+/**
+ * \brief Commands sent by maintenance since the last reset_stats
+ */
+struct R502_maintenance_stats_t {
+    uint32_t pages_deleted; //!< Occupied pages deleted by delete_pages
+    uint32_t delete_commands; //!< delete_char and empty commands sent
+    uint32_t moves; //!< Templates moved by compact
+    uint32_t round_trips; //!< Commands sent, not counting index syncs
+    /// Commands saved against one delete_char per page, and a load_char,
+    /// store and delete_char per move
+    uint32_t round_trips_saved;
+};
+
+/**
+ * \brief Deletes sets of templates and closes the gaps they leave
+ *
+ * delete_pages sorts the pages and merges them into runs for delete_char,
+ * also merging across pages the template index says are free already, since
+ * deleting those changes nothing. Deleting every occupied page is a single
+ * empty.
+ *
+ * compact moves the highest templates down into the lowest free pages with
+ * load_char and store, which copy on the module without the template
+ * passing through the host, and deletes the pages they came from together
+ * at the end, one delete_char for a finished compaction. Afterwards the
+ * library is a dense prefix from page 0, and find_free_page is the page
+ * after it
+ */
+class R502LibraryMaintenance {
+public:
+    /**
+     * \param _iface Interface to the module, must be initialized before
+     * delete_pages or compact
+     */
+    R502LibraryMaintenance(R502Interface &_iface) : iface(_iface) {}
+
+    /**
+     * \brief Delete the templates at page_ids
+     * \param page_ids Pages to delete, in any order, repeats and free or out
+     * of range pages are ignored
+     * \param count Number of page_ids
+     * \param res OUT confirmation code, R502_ok if every delete succeeded
+     * \retval ESP_OK: successful, or stopped at a failed command, which res
+     *         tells
+     *         See R502Interface::vfy_pass for all other return values
+     */
+    esp_err_t delete_pages(const uint16_t *page_ids, size_t count,
+        R502_conf_code_t &res);
+
+    /// Told of every template compact moves, from its old page to its new
+    typedef R502FunctionRef<void(uint16_t from, uint16_t to)> moved_cb_t;
+
+    /**
+     * \brief Move templates down into the free pages below them, until the
+     * occupied pages are a dense prefix
+     * \param moved Called for each template moved, so the application can
+     * update what it keeps per page id
+     * \param res OUT confirmation code, R502_ok if every command succeeded
+     * \param max_moves Most templates to move in this call, so it can be run
+     * a few at a time when the module is otherwise idle
+     * \retval ESP_OK: successful, or stopped at a failed command, which res
+     *         tells
+     *         See R502Interface::vfy_pass for all other return values
+     *
+     * Uses character buffer 2. moved is called once a copy is stored, the
+     * old pages are deleted before compact returns. Until then a search may
+     * match either copy, so don't identify from another task meanwhile
+     */
+    esp_err_t compact(moved_cb_t moved, R502_conf_code_t &res,
+        int max_moves = 0x7fffffff);
+
+    const R502_maintenance_stats_t &get_stats() const { return stats; }
+    void reset_stats() { stats = {}; }
+
+    /**
+     * \brief Plan the delete_char commands for pages
+     * \param index Template index of the library
+     * \param pages IN pages to delete, OUT sorted, without repeats and with
+     * only the occupied pages left
+     * \param runs OUT the commands, lowest pages first
+     */
+    static void plan_deletes(const R502TemplateIndex &index,
+        std::vector<uint16_t> &pages, std::vector<R502_delete_run_t> &runs);
+
+private:
+    /**
+     * \brief Sync the template index if it isn't
+     */
+    esp_err_t prepare(R502_conf_code_t &res);
+
+    /**
+     * \brief Delete pages, checked and sorted by plan_deletes, with empty
+     * if they are the whole library
+     */
+    esp_err_t delete_planned(const std::vector<uint16_t> &pages,
+        const std::vector<R502_delete_run_t> &runs, R502_conf_code_t &res);
+
+    R502Interface &iface;
+    R502_maintenance_stats_t stats = {};
+};
@@ -0,0 +1,112 @@
+/**
+ * \file R502LinkStore.hpp
+ * \brief Persist the negotiated link settings of an R502 module across resets
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#include "R502Definitions.hpp"
+
+/**
+ * \brief Link settings needed to talk to a module without rediscovering them
+ */
+struct R502_link_config_t {
+    R502_baud_t baud;
+    R502_data_len_t data_package_length;
+    uint8_t adder[4];
+};
+
+/**
+ * \brief Storage for the last known link settings, used by
+ * R502Interface::warm_init
+ *
+ * Records are serialized to a small versioned blob with a checksum, so a
+ * corrupt or stale record is reported as ESP_ERR_INVALID_CRC or
+ * ESP_ERR_INVALID_VERSION instead of being trusted
+ */
+class R502LinkStore {
+public:
+    virtual ~R502LinkStore() {}
+
+    /**
+     * \brief Load the stored link settings
+     * \param config OUT stored settings
+     * \retval ESP_OK: successful
+     *         ESP_ERR_NOT_FOUND: Nothing has been stored yet
+     *         ESP_ERR_INVALID_CRC: The stored record is corrupt
+     *         ESP_ERR_INVALID_VERSION: The stored record has an unknown
+     *         format, or a baud or data package length outside R502_baud_t
+     *         or R502_data_len_t
+     */
+    esp_err_t load(R502_link_config_t &config);
+
+    /**
+     * \brief Store the link settings
+     * \param config Settings to store
+     * \retval ESP_OK: successful
+     *         ESP_FAIL or backend error: The record couldn't be written
+     */
+    esp_err_t save(const R502_link_config_t &config);
+
+    /// Size in bytes of a serialized record
+    static const size_t record_size = 10;
+
+protected:
+    /**
+     * \brief Read a serialized record from the backend
+     * \retval ESP_OK or ESP_ERR_NOT_FOUND if there is no record
+     */
+    virtual esp_err_t read_record(uint8_t (&record)[record_size]) = 0;
+
+    /**
+     * \brief Write a serialized record to the backend
+     */
+    virtual esp_err_t write_record(const uint8_t (&record)[record_size]) = 0;
+
+private:
+    static const uint8_t record_version = 1;
+};
+
+/**
+ * \brief Keeps the link settings in NVS, for use on target
+ *
+ * nvs_flash_init must have been called before use
+ */
+class R502NvsLinkStore : public R502LinkStore {
+public:
+    /**
+     * \param _nvs_namespace NVS namespace, max 15 characters
+     * \param _key NVS key, max 15 characters. Use one key per module
+     */
+    R502NvsLinkStore(const char *_nvs_namespace = "r502",
+        const char *_key = "link");
+
+protected:
+    esp_err_t read_record(uint8_t (&record)[record_size]) override;
+    esp_err_t write_record(const uint8_t (&record)[record_size]) override;
+
+private:
+    const char *nvs_namespace;
+    const char *key;
+};
+
+/**
+ * \brief Keeps the link settings in a file, for hosts or a mounted VFS
+ */
+class R502FileLinkStore : public R502LinkStore {
+public:
+    /**
+     * \param _path Path of the file to keep the record in
+     */
+    R502FileLinkStore(const char *_path);
+
+protected:
+    esp_err_t read_record(uint8_t (&record)[record_size]) override;
+    esp_err_t write_record(const uint8_t (&record)[record_size]) override;
+
+private:
+    const char *path;
+};
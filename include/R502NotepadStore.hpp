@@ -0,0 +1,169 @@
+/**
+ * \file R502NotepadStore.hpp
+ * \brief Small key-value store kept in the module's notepad flash
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <string>
+#include <vector>
+
+#include "R502Interface.hpp"
+
+/**
+ * \brief Counters of notepad traffic saved by the cache
+ */
+struct R502_notepad_stats_t {
+    uint32_t pages_read; //!< Pages read from the module
+    uint32_t pages_written; //!< Dirty pages written back
+    uint32_t pages_skipped; //!< Pages a flush didn't need to write
+    uint32_t flushes; //!< Calls to flush that wrote anything
+};
+
+/**
+ * \brief Key-value store for per-module metadata, kept on the module itself
+ * so it travels with the hardware
+ *
+ * load() reads the notepad pages once into a cache, after which get() costs
+ * no uart traffic. set() and erase() only change the cache, flush() writes
+ * back the pages whose bytes changed, so several updates are batched into
+ * one write per page touched.
+ *
+ * Entries are packed into a byte stream that spans the pages. Each page keeps
+ * 28 bytes of the stream, the generation of the flush that wrote it and a
+ * CRC16 over its page number and the rest, so a torn page write or a page
+ * from another layout is detected on load. The stream header holds the
+ * generation of the last flush and a CRC16 over the whole stream, and is
+ * written last. A flush interrupted between pages leaves pages newer than
+ * the header, or a stream that fails its CRC, so load rejects a mix of old
+ * and new pages instead of returning it. A notepad that has never been
+ * written (all 0x00 or 0xFF) loads as empty.
+ */
+class R502NotepadStore {
+public:
+    static const int max_key_len = 15;
+    static const int max_value_len = 64;
+    /// Bytes of stream per page, the rest is the page generation and CRC
+    static const int page_payload = R502_notepad_page_size - 4;
+
+    /**
+     * \param _iface Interface to the module, must be initialized before load
+     * \param _first_page First notepad page to use
+     * \param _page_count Number of pages to use, so other users of the
+     * notepad can keep the rest
+     */
+    R502NotepadStore(R502Interface &_iface, uint8_t _first_page = 0,
+        uint8_t _page_count = R502_notepad_pages);
+
+    /**
+     * \brief Read the notepad pages into the cache
+     * \param res OUT confirmation code provided by the R502
+     * \retval ESP_OK: successful, the store is loaded, possibly empty
+     *         ESP_ERR_INVALID_CRC: A page or the stream failed its CRC, or
+     *         an interrupted flush left pages of two generations. The store
+     *         is loaded empty so it can be rewritten
+     *         ESP_ERR_INVALID_VERSION: The notepad holds another format
+     *         See R502Interface::vfy_pass for all other return values
+     */
+    esp_err_t load(R502_conf_code_t &res);
+
+    /**
+     * \brief Read a value from the cache
+     * \param key Key to look up
+     * \param value OUT buffer for the value
+     * \param len IN size of value, OUT length of the stored value
+     * \retval ESP_OK: successful
+     *         ESP_ERR_NOT_FOUND: No such key
+     *         ESP_ERR_INVALID_SIZE: value is too small, len is set to the
+     *         size needed
+     *         ESP_ERR_INVALID_STATE: load hasn't succeeded yet
+     */
+    esp_err_t get(const char *key, uint8_t *value, size_t &len) const;
+
+    /**
+     * \brief Set a value in the cache, written to the module by flush
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_ARG: key or value is too long, or key is empty
+     *         ESP_ERR_NO_MEM: The store would no longer fit in its pages
+     *         ESP_ERR_INVALID_STATE: load hasn't succeeded yet
+     */
+    esp_err_t set(const char *key, const uint8_t *value, size_t len);
+
+    /**
+     * \brief Remove a key from the cache, removed from the module by flush
+     * \retval ESP_OK: successful
+     *         ESP_ERR_NOT_FOUND: No such key
+     *         ESP_ERR_INVALID_STATE: load hasn't succeeded yet
+     */
+    esp_err_t erase(const char *key);
+
+    /**
+     * \brief Write every page whose contents changed since the last load or
+     * flush, and the first page, whose header starts the new generation
+     * \param res OUT confirmation code provided by the R502
+     * \retval See R502Interface::vfy_pass for all possible return values
+     */
+    esp_err_t flush(R502_conf_code_t &res);
+
+    /**
+     * \brief Whether the cache has changes that flush would write
+     */
+    bool is_dirty() const;
+
+    /**
+     * \brief Bytes left for more entries, each costs 2 plus key and value
+     */
+    size_t bytes_free() const;
+
+    const R502_notepad_stats_t &get_stats() const;
+
+private:
+    typedef std::array<uint8_t, R502_notepad_page_size> page_t;
+
+    struct entry_t {
+        std::string key;
+        std::vector<uint8_t> value;
+    };
+
+    /**
+     * \brief Serialize the entries into page images, with their CRCs
+     * \param next_generation Generation of the flush writing the images.
+     * Pages whose stream bytes are unchanged keep the cached image, and
+     * their older generation
+     * \retval Number of pages the stream needs
+     */
+    int encode(uint16_t next_generation, std::vector<page_t> &images) const;
+
+    /**
+     * \brief Parse the entries out of the cached pages
+     */
+    esp_err_t decode();
+
+    size_t stream_size() const;
+    uint16_t page_crc(uint8_t page_number, const page_t &page) const;
+    uint16_t page_generation(const page_t &page) const;
+    std::vector<entry_t>::iterator find(const char *key);
+    std::vector<entry_t>::const_iterator find(const char *key) const;
+
+    static constexpr uint8_t stream_magic = 'N';
+    static constexpr uint8_t stream_version = 2;
+    static const int stream_header_size = 8;
+    // A kept page this many generations old is rewritten, so it can't wrap
+    // around to look newer than the header
+    static const uint16_t max_page_age = 0x4000;
+
+    R502Interface &iface;
+    uint8_t first_page;
+    uint8_t page_count;
+
+    // what the module holds, as of the last load or flush
+    std::vector<page_t> pages;
+    std::vector<entry_t> entries;
+    // of the last load or flush, 0 for a blank notepad
+    uint16_t generation = 0;
+    bool loaded = false;
+    bool dirty = false;
+    R502_notepad_stats_t stats = {0, 0, 0, 0};
+};
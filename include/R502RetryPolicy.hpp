@@ -0,0 +1,94 @@
+/**
+ * \file R502RetryPolicy.hpp
+ * \brief Decide which failed commands can be repeated, and keep statistics
+ */
+
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "R502Definitions.hpp"
+
+/**
+ * \brief How failed commands are retried
+ */
+struct R502_retry_config_t {
+    int max_attempts; //!< Attempts per command including the first, 1 = off
+    int base_backoff_ms; //!< Wait before the first retry
+    int max_backoff_ms; //!< Waits double per retry up to this
+};
+
+/**
+ * \brief Counters of link errors and how retries dealt with them
+ */
+struct R502_retry_stats_t {
+    uint32_t commands; //!< Commands sent, not counting retries
+    uint32_t retries; //!< Extra attempts made
+    uint32_t recovered; //!< Commands that succeeded after a retry
+    uint32_t exhausted; //!< Commands that failed on every attempt
+    uint32_t not_retryable; //!< Failed commands that weren't safe to repeat
+    uint32_t timeouts; //!< Attempts that got no response
+    uint32_t short_reads; //!< Attempts that got part of a response
+    uint32_t crc_errors; //!< Attempts with a bad checksum
+    uint32_t drained_bytes; //!< Stale bytes thrown away while resyncing
+};
+
+/**
+ * \brief Retry policy of R502Interface::send_command_package
+ *
+ * Only transient link errors are retried: no response, a short or malformed
+ * response, and checksum failures. A command is only repeated if doing it
+ * twice has the same effect as doing it once. Store, Empty and the like are
+ * never repeated, because the first attempt may have reached the module even
+ * though its acknowledgement was lost
+ */
+class R502RetryPolicy {
+public:
+    R502RetryPolicy();
+
+    /**
+     * \brief Whether the command in pkg is safe to send again
+     */
+    static bool is_idempotent(const R502_DataPkg_t &pkg);
+
+    /**
+     * \brief Whether err is a link error a retry could fix
+     */
+    static bool is_transient(esp_err_t err);
+
+    /**
+     * \brief Record the result of one attempt and decide whether to retry
+     * \param err Result of the attempt
+     * \param attempt Number of this attempt, starting at 1
+     * \param idempotent Whether the command may be repeated
+     * \retval true if the command should be sent again
+     */
+    bool should_retry(esp_err_t err, int attempt, bool idempotent);
+
+    /**
+     * \brief Record the final result of a command
+     * \param err Result of the last attempt
+     * \param attempts Number of attempts made
+     */
+    void record_outcome(esp_err_t err, int attempts);
+
+    /**
+     * \brief Record stale bytes thrown away while resyncing
+     */
+    void record_drained(int bytes);
+
+    /**
+     * \brief How long to wait before the given retry
+     * \param attempt Number of the failed attempt, starting at 1
+     */
+    int backoff_ms(int attempt) const;
+
+    void set_config(const R502_retry_config_t &_config);
+    const R502_retry_config_t &get_config() const;
+    const R502_retry_stats_t &get_stats() const;
+    void reset_stats();
+
+private:
+    R502_retry_config_t config;
+    R502_retry_stats_t stats;
+};
@@ -0,0 +1,207 @@
+/**
+ * \file R502SearchPlanner.hpp
+ * \brief Searches the library's most used pages first, and keeps them
+ * together at the low page ids
+ */
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "R502Interface.hpp"
+#include "R502FunctionRef.hpp"
+
+/**
+ * \brief How the planner picks and fills the hot range
+ */
+struct R502_planner_config_t {
+    /// Pages in the hot range searched first
+    uint16_t hot_pages;
+    /// Identifications after which a hit counts half as much as a new one
+    uint16_t half_life;
+    /// Share of recent hits, 0 to 100, the hot range must have had to be
+    /// searched first. Below it a miss, and a second search, is too likely
+    uint8_t min_hot_share;
+};
+
+/**
+ * \brief A contiguous run of library pages, as search takes them
+ */
+struct R502_search_range_t {
+    uint16_t start_page;
+    uint16_t page_num; //!< 0 if there is no range
+};
+
+/**
+ * \brief How identifications went since the last reset
+ */
+struct R502_planner_stats_t {
+    uint32_t identifies; //!< identify calls that reached the module
+    uint32_t hot_hits; //!< Matched in the hot range, with a single search
+    uint32_t fallbacks; //!< Searched the hot range, then the rest
+    uint32_t full_searches; //!< Searched everything at once
+    uint32_t pages_searched; //!< Summed page_num of every search sent
+    uint32_t moves; //!< Templates moved by compact
+};
+
+/**
+ * \brief Plans the search ranges of identifications from how often and how
+ * recently each page matched
+ *
+ * Every match adds to its page's score, and older matches count for less,
+ * halving every half_life identifications. identify searches the hot range,
+ * the hot_pages long window with the highest total score, and only searches
+ * the rest of the library when it misses. When the hot range hasn't had
+ * min_hot_share of the hits, e.g. while the scores are still being learnt,
+ * the whole library is searched at once instead.
+ *
+ * The module's search time grows with the pages it compares against, so for
+ * a population where a few users identify most often the mean latency drops
+ * towards that of a hot_pages library. The placement side keeps those users
+ * at page ids below hot_pages: enroll_page puts new templates above them,
+ * and compact moves the highest scoring templates into them.
+ *
+ * Scores live on the host only, and start over on reset or a reboot. Only
+ * deletions made through forget and moves made by compact are known to the
+ * planner, call forget when templates are deleted any other way
+ */
+class R502SearchPlanner {
+public:
+    /**
+     * \param _iface Interface to the module, must be initialized before
+     * identify, enroll_page or compact
+     */
+    R502SearchPlanner(R502Interface &_iface);
+
+    void set_config(const R502_planner_config_t &_config);
+    const R502_planner_config_t &get_config() const { return config; }
+
+    /**
+     * \brief Forget every score and set the library size
+     * \param capacity Number of usable page ids, finger_library_size from
+     * read_sys_para
+     *
+     * identify, enroll_page and compact call this with the template index's
+     * capacity if it hasn't been called yet
+     */
+    void reset(uint16_t capacity);
+
+    /**
+     * \brief Search the library for the template in buffer_id, hot range
+     * first
+     * \param buffer_id Character buffer holding the template to search for
+     * \param res OUT confirmation code of the last search, R502_ok if a match
+     * was found
+     * \param page_id OUT where the match is
+     * \param match_score OUT how closely it matched
+     * \retval See R502Interface::vfy_pass for all possible return values
+     *
+     * A match is recorded with record_hit
+     */
+    esp_err_t identify(R502_char_buffer_t buffer_id, R502_conf_code_t &res,
+        uint16_t &page_id, uint16_t &match_score);
+
+    /**
+     * \brief Count a match on page_id that didn't come from identify, e.g.
+     * from R502Interface::verify
+     */
+    void record_hit(uint16_t page_id);
+
+    /**
+     * \brief Drop the scores of count pages from page_id, after deleting
+     * their templates
+     */
+    void forget(uint16_t page_id, uint16_t count = 1);
+
+    /**
+     * \brief Score of page_id, in matches weighted by their age
+     */
+    float score(uint16_t page_id) const;
+
+    /**
+     * \brief The range identify would search first, page_num 0 if it would
+     * search the whole library
+     */
+    R502_search_range_t hot_range() const;
+
+    /**
+     * \brief Pick the page for a new template
+     * \param res OUT confirmation code of syncing the template index,
+     * R502_ok if it didn't need syncing
+     * \param page_id OUT the lowest free page past the hot pages, or the
+     * lowest free page if only hot pages are free
+     * \retval ESP_ERR_NOT_FOUND: The library is full
+     *         See R502Interface::vfy_pass for all other return values
+     *
+     * A new template has no score, so it doesn't take a page a frequent user
+     * may be moved into by compact
+     */
+    esp_err_t enroll_page(R502_conf_code_t &res, uint16_t &page_id);
+
+    /// Told of every template compact moves, from its old page to its new.
+    /// swapped if the template that was at to went to from in the same move
+    typedef R502FunctionRef<void(uint16_t from, uint16_t to, bool swapped)>
+        moved_cb_t;
+
+    /**
+     * \brief Move the hot_pages highest scoring templates into the pages
+     * below hot_pages
+     * \param moved Called for each template moved, so the application can
+     * update what it keeps per page id
+     * \param res OUT confirmation code, R502_ok if every move succeeded
+     * \param max_moves Most templates to move in this call, so it can be run
+     * a few at a time when the module is otherwise idle
+     * \retval ESP_OK: Moves stopped at max_moves or when done, or at a
+     *         failed command, which res tells
+     *         See R502Interface::vfy_pass for all other return values
+     *
+     * A template in the way is moved to a free page above the hot pages, or
+     * swapped with the one moving in when the library is full. Uses both
+     * character buffers. A swap exists only in the character buffers between
+     * its two stores, so a power loss there loses a template
+     */
+    esp_err_t compact(moved_cb_t moved, R502_conf_code_t &res,
+        int max_moves = 0x7fffffff);
+
+    const R502_planner_stats_t &get_stats() const { return stats; }
+
+private:
+    /**
+     * \brief reset with the template index's capacity, syncing the index
+     * first if needed
+     */
+    esp_err_t prepare(R502_conf_code_t &res);
+
+    /**
+     * \brief Move the template at from to the free page to
+     */
+    esp_err_t move(uint16_t from, uint16_t to, moved_cb_t moved,
+        R502_conf_code_t &res);
+
+    /**
+     * \brief Swap the templates at a and b
+     */
+    esp_err_t swap(uint16_t a, uint16_t b, moved_cb_t moved,
+        R502_conf_code_t &res);
+
+    /**
+     * \brief Lowest free page at or after first, -1 if none
+     */
+    int free_page_from(uint16_t first) const;
+
+    /**
+     * \brief Age every score by one identification
+     */
+    void tick();
+
+    R502Interface &iface;
+    R502_planner_config_t config;
+    // Each hit adds weight, which grows by 2^(1 / half_life) per
+    // identification, so older hits shrink relative to new ones without
+    // touching every score. Everything is scaled back down before it
+    // overflows
+    std::vector<float> scores;
+    float weight = 1;
+    float growth = 1;
+    float total = 0;
+    R502_planner_stats_t stats = {};
+};
@@ -0,0 +1,248 @@
+/**
+ * \file R502TemplateArchive.hpp
+ * \brief Append-only archive of templates, stored once per content and
+ * mapped to the library slots of any number of modules
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <array>
+#include <vector>
+
+#include "R502Interface.hpp"
+
+typedef std::array<uint8_t, R502_character_file_size> R502_char_file_t;
+
+/**
+ * \brief What the last backup or restore did
+ */
+struct R502_archive_stats_t {
+    uint32_t slots_checked; //!< Library slots compared against the archive
+    uint32_t slots_pulled; //!< Templates uploaded from the module
+    uint32_t slots_pushed; //!< Templates downloaded and stored to the module
+    uint32_t slots_deleted; //!< Slots deleted on the module by restore, or
+                            //!< found emptied by backup
+    uint32_t blobs_added; //!< Templates the archive didn't hold yet
+};
+
+/**
+ * \brief Backs up and restores template libraries, keeping each distinct
+ * template once however many slots and modules hold it
+ *
+ * Templates are keyed by a 64 bit FNV-1a hash of their character file. The
+ * archive is a log of records that is only ever appended to:
+ *
+ *  Record | Layout
+ *  ------ | -------------------------------------------------------------
+ *  Header | 'R' 'T' 'A' version
+ *  Blob   | 'B', hash (8), CRC16 of the 9 bytes before, character file
+ *  Slot   | 'S', module id (4), slot (2), hash (8), CRC16 of the 15 before
+ *
+ * A slot record maps a library slot of a module to a template, the last one
+ * for a slot wins and hash 0 records the slot as empty. open() reads only
+ * the record headers into a sorted index, a blob's character file is read
+ * when it's restored. A record cut short by a crash while appending is
+ * dropped on open.
+ *
+ * backup pulls only slots the archive has no template for, restore pushes
+ * only slots whose template differs from the one recorded. What the archive
+ * knows of a module is what its last backup or restore saw. A slot
+ * overwritten since by another host is only noticed by a full backup, which
+ * records what the module holds now, or a verified restore, which puts back
+ * what the archive holds
+ */
+class R502TemplateArchive {
+public:
+    virtual ~R502TemplateArchive() {}
+
+    /**
+     * \brief Build the index from the records, starting a new archive if
+     * there are none
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_VERSION: Not an archive, or another version
+     *         ESP_ERR_INVALID_CRC: A record header is corrupt
+     *         Any error from the backend
+     */
+    esp_err_t open();
+
+    /**
+     * \brief Record the module's library in the archive
+     * \param iface Interface to the module
+     * \param module_id Identifies the module within the archive
+     * \param res OUT confirmation code of the last command
+     * \param full Pull every occupied slot, not only those the archive has
+     * no template for
+     * \retval ESP_OK: successful if res is R502_ok, otherwise the module
+     *         refused a command and the backup stopped there
+     *         ESP_ERR_INVALID_STATE: open hasn't succeeded
+     *         ESP_ERR_INVALID_CRC: A template with the same hash but other
+     *         content is already archived
+     *         See R502Interface::vfy_pass for all other return values
+     *
+     * Uses character buffer 1
+     */
+    esp_err_t backup(R502Interface &iface, uint32_t module_id,
+        R502_conf_code_t &res, bool full = false);
+
+    /**
+     * \brief Make the module's library what the archive recorded for
+     * source_id
+     * \param iface Interface to the module
+     * \param module_id The module's id, to know what it already holds
+     * \param source_id Module whose library to restore, may be module_id
+     * \param res OUT confirmation code of the last command
+     * \param verify Upload every occupied slot that should hold a template
+     * and compare it, instead of trusting what the archive recorded for
+     * module_id
+     * \retval ESP_OK: successful if res is R502_ok, otherwise the module
+     *         refused a command and the restore stopped there
+     *         ESP_ERR_INVALID_STATE: open hasn't succeeded
+     *         ESP_ERR_INVALID_SIZE: source_id has slots past the end of the
+     *         module's library
+     *         ESP_ERR_INVALID_CRC: An archived template is corrupt
+     *         See R502Interface::vfy_pass for all other return values
+     *
+     * Slots source_id doesn't have are deleted. Uses character buffer 1
+     */
+    esp_err_t restore(R502Interface &iface, uint32_t module_id,
+        uint32_t source_id, R502_conf_code_t &res, bool verify = false);
+
+    /**
+     * \brief Add a template, if it isn't archived yet
+     * \param char_file The template
+     * \param hash OUT its hash
+     * \retval ESP_OK: successful
+     *         ESP_ERR_INVALID_CRC: A template with the same hash but other
+     *         content is already archived
+     *         Any error from the backend
+     */
+    esp_err_t put(const R502_char_file_t &char_file, uint64_t &hash);
+
+    /**
+     * \brief Read an archived template
+     * \retval ESP_OK: successful
+     *         ESP_ERR_NOT_FOUND: No template has hash
+     *         ESP_ERR_INVALID_CRC: The template read doesn't match its hash
+     *         Any error from the backend
+     */
+    esp_err_t get(uint64_t hash, R502_char_file_t &char_file);
+
+    /**
+     * \brief Hash of the template recorded at slot of module_id, 0 if the
+     * slot is empty or unknown
+     */
+    uint64_t lookup(uint32_t module_id, uint16_t slot) const;
+
+    /**
+     * \brief Number of distinct templates archived
+     */
+    size_t blob_count() const { return blobs.size(); }
+
+    /**
+     * \brief Number of occupied slots recorded for module_id
+     */
+    size_t slot_count(uint32_t module_id) const;
+
+    const R502_archive_stats_t &get_stats() const { return stats; }
+
+    /**
+     * \brief Hash a template is keyed by, never 0
+     */
+    static uint64_t content_hash(const R502_char_file_t &char_file);
+
+    static const uint8_t format_version = 1;
+    static const size_t header_size = 4;
+    static const size_t blob_header_size = 11;
+    static const size_t blob_record_size =
+        blob_header_size + R502_character_file_size;
+    static const size_t slot_record_size = 17;
+
+protected:
+    /**
+     * \brief Read len bytes at offset from the backend
+     * \retval ESP_OK, ESP_ERR_INVALID_SIZE if fewer are stored, or a
+     * backend error
+     */
+    virtual esp_err_t read_at(size_t offset, uint8_t *data, size_t len) = 0;
+
+    /**
+     * \brief Add len bytes at the end of the backend
+     */
+    virtual esp_err_t append(const uint8_t *data, size_t len) = 0;
+
+    /**
+     * \brief Bytes stored in the backend
+     */
+    virtual size_t size() = 0;
+
+    /**
+     * \brief Drop everything stored from new_size on
+     */
+    virtual esp_err_t truncate(size_t new_size) = 0;
+
+private:
+    static const char *TAG;
+
+    struct blob_entry_t {
+        uint64_t hash;
+        size_t offset; // of the character file
+    };
+
+    struct slot_entry_t {
+        uint32_t module_id;
+        uint16_t slot;
+        uint64_t hash;
+    };
+
+    /**
+     * \brief Record what slot of module_id holds, if it changed
+     */
+    esp_err_t set_slot(uint32_t module_id, uint16_t slot, uint64_t hash);
+
+    /**
+     * \brief Update the index without appending a record
+     */
+    void index_slot(uint32_t module_id, uint16_t slot, uint64_t hash);
+
+    std::vector<blob_entry_t>::const_iterator find_blob(uint64_t hash) const;
+    std::vector<slot_entry_t>::const_iterator find_slot(uint32_t module_id,
+        uint16_t slot) const;
+
+    static uint16_t crc16(const uint8_t *data, size_t len);
+
+    bool opened = false;
+    // Both sorted, by hash and by module id then slot
+    std::vector<blob_entry_t> blobs;
+    std::vector<slot_entry_t> slots;
+    R502_archive_stats_t stats = {};
+};
+
+/**
+ * \brief Keeps the archive in a file, for hosts or a mounted VFS such as an
+ * SD card
+ */
+class R502FileTemplateArchive : public R502TemplateArchive {
+public:
+    /**
+     * \param _path Path of the archive file, created if it doesn't exist
+     */
+    R502FileTemplateArchive(const char *_path);
+    ~R502FileTemplateArchive();
+
+protected:
+    esp_err_t read_at(size_t offset, uint8_t *data, size_t len) override;
+    esp_err_t append(const uint8_t *data, size_t len) override;
+    size_t size() override;
+    esp_err_t truncate(size_t new_size) override;
+
+private:
+    /**
+     * \brief The open file, opened on first use
+     */
+    FILE *get_file();
+
+    const char *path;
+    FILE *file = nullptr;
+};
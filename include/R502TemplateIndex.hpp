@@ -0,0 +1,133 @@
+/**
+ * \file R502TemplateIndex.hpp
+ * \brief Host-side bitmap of which template library slots are occupied
+ */
+
+#pragma once
+#include <stdint.h>
+#include <array>
+
+#include "R502Definitions.hpp"
+
+/**
+ * \brief Bitmap index of the occupied page ids in the module's template
+ * library
+ *
+ * Mirrors the module's index table so free slots and library statistics can
+ * be found without talking to the module. A summary word keeps one bit per
+ * bitmap word that still has a free slot, so finding the lowest free slot is
+ * two count-trailing-zeros operations regardless of how full the library is.
+ *
+ * The index doesn't talk to the module itself, R502Interface keeps it in sync
+ * as templates are stored, deleted and emptied
+ */
+class R502TemplateIndex {
+public:
+    /// Maximum number of slots the module can report in its index table
+    static const int max_capacity =
+        R502_index_table_pages * R502_index_table_len * 8;
+
+    /**
+     * \brief Clear the index and set the library size
+     * \param _capacity Number of usable page ids, finger_library_size from
+     * read_sys_para. Clamped to max_capacity
+     *
+     * The index is left unsynced until mark_synced is called
+     */
+    void reset(uint16_t _capacity);
+
+    /**
+     * \brief Load one page of the module's index table into the bitmap
+     * \param index_page Index table page, 0 to R502_index_table_pages - 1
+     * \param table Index table as returned by ReadIndexTable
+     */
+    void load_page(uint8_t index_page,
+        const std::array<uint8_t, R502_index_table_len> &table);
+
+    /**
+     * \brief Flag the index as matching the module
+     */
+    void mark_synced();
+
+    /**
+     * \brief Flag the index as no longer trusted, forcing a resync
+     */
+    void invalidate();
+
+    /**
+     * \brief Whether the index is believed to match the module
+     */
+    bool is_synced() const;
+
+    /**
+     * \brief Record a template stored at page_id
+     */
+    void mark_used(uint16_t page_id);
+
+    /**
+     * \brief Record count templates deleted starting at page_id
+     */
+    void mark_free(uint16_t page_id, uint16_t count = 1);
+
+    /**
+     * \brief Record the whole library being emptied
+     */
+    void clear();
+
+    /**
+     * \brief Whether page_id holds a template
+     */
+    bool is_used(uint16_t page_id) const;
+
+    /**
+     * \brief Return the lowest free page id
+     * \retval Free page id, or -1 if the library is full
+     */
+    int find_free() const;
+
+    /**
+     * \brief Return the lowest free page id and mark it used
+     * \retval Allocated page id, or -1 if the library is full
+     */
+    int allocate();
+
+    /**
+     * \brief Number of usable page ids in the library
+     */
+    uint16_t capacity() const;
+
+    /**
+     * \brief Number of occupied page ids
+     */
+    uint16_t used_count() const;
+
+    /**
+     * \brief Number of free page ids
+     */
+    uint16_t free_count() const;
+
+    /**
+     * \brief Number of occupied page ids in [page_id, page_id + count)
+     */
+    uint16_t used_in_range(uint16_t page_id, uint16_t count) const;
+
+private:
+    static const int word_bits = 32;
+    static const int word_count = max_capacity / word_bits;
+
+    /**
+     * \brief Bits of word that are past the end of the library
+     */
+    uint32_t out_of_range_mask(int word) const;
+
+    /**
+     * \brief Recompute the summary bit for word
+     */
+    void update_summary(int word);
+
+    std::array<uint32_t, word_count> used = {};
+    // bit n set if used[n] has at least one free slot in range
+    uint32_t free_summary = 0;
+    uint16_t cap = 0;
+    bool synced = false;
+};
@@ -0,0 +1,104 @@
+/**
+ * \file R502TimeoutModel.hpp
+ * \brief Per-instruction response timeouts, learned from observed latency
+ */
+
+#pragma once
+#include <stdint.h>
+#include <array>
+
+#include "R502Definitions.hpp"
+
+/**
+ * \brief Latency learned for one instruction code
+ *
+ * Latency is the time the module spends processing, the time spent on the
+ * wire is subtracted before it is recorded
+ */
+struct R502_latency_stats_t {
+    uint32_t samples; //!< Number of responses measured
+    uint32_t timeouts; //!< Number of responses that never arrived
+    int32_t smoothed_us; //!< EWMA of the latency
+    int32_t variation_us; //!< EWMA of the deviation from smoothed_us
+    int32_t last_us; //!< Most recent latency
+    int32_t max_us; //!< Largest latency seen
+    /// Timeouts since the last response, each doubling the allowance
+    uint32_t backoff;
+};
+
+/**
+ * \brief Decides how long to wait for each response from the module
+ *
+ * A timeout is the time to clock the expected bytes over the wire at the
+ * current baud rate, plus a processing allowance for the instruction. Until
+ * enough responses have been measured the allowance is the instruction's
+ * ceiling. After that it is the smoothed latency plus four times its
+ * variation, the same envelope TCP uses for its retransmit timer, clamped
+ * between the instruction's floor and ceiling. Each missed response doubles
+ * the clamped envelope, still up to the ceiling, until a response arrives,
+ * so a slow command never gets stuck behind a tight estimate.
+ */
+class R502TimeoutModel {
+public:
+    /// Key used for the data packages of multi-package transfers
+    static const uint8_t data_package_key = 0;
+
+    R502TimeoutModel();
+
+    /**
+     * \brief Return how long to wait for a response
+     * \param instr_code Instruction code of the command, or data_package_key
+     * \param tx_bytes Bytes still to be sent when the wait starts
+     * \param rx_bytes Bytes in the expected response
+     * \param baud Current baud setting
+     */
+    int timeout_ms(uint8_t instr_code, int tx_bytes, int rx_bytes,
+        R502_baud_t baud) const;
+
+    /**
+     * \brief Record a response that arrived
+     * \param instr_code Instruction code of the command, or data_package_key
+     * \param elapsed_us Time from the start of the wait to the last byte
+     * \param tx_bytes,rx_bytes,baud As passed to timeout_ms
+     */
+    void record(uint8_t instr_code, int64_t elapsed_us, int tx_bytes,
+        int rx_bytes, R502_baud_t baud);
+
+    /**
+     * \brief Record a response that didn't arrive before its timeout
+     */
+    void record_timeout(uint8_t instr_code);
+
+    /**
+     * \brief Return what has been learned about an instruction
+     */
+    const R502_latency_stats_t &get_stats(uint8_t instr_code) const;
+
+    /**
+     * \brief Return the processing allowance bounds of an instruction
+     * \param instr_code Instruction code of the command, or data_package_key
+     * \param floor_ms OUT smallest allowance ever used
+     * \param ceiling_ms OUT allowance used before anything is learned
+     */
+    void get_allowance(uint8_t instr_code, int &floor_ms,
+        int &ceiling_ms) const;
+
+    /**
+     * \brief Forget everything learned, for example after the module changed
+     */
+    void reset();
+
+    /**
+     * \brief Time to send bytes at baud, 10 bits per byte with start and stop
+     */
+    static int64_t wire_time_us(int bytes, R502_baud_t baud);
+
+private:
+    static const int table_size = 0x40;
+    // Responses needed before the learned envelope replaces the ceiling
+    static const uint32_t min_samples = 4;
+
+    int slot(uint8_t instr_code) const;
+
+    std::array<R502_latency_stats_t, table_size + 1> stats;
+};
@@ -0,0 +1,96 @@
+/**
+ * \file R502Trace.hpp
+ * \brief Trace points on the package exchange path, compiled out unless
+ * R502_TRACE is defined to 1
+ *
+ * With tracing on, each point stores an 8 byte binary record with a
+ * microsecond timestamp in a ring buffer, nothing is formatted. Print the
+ * buffer with R502BufferTrace::dump and convert the log to a Chrome
+ * trace-event JSON timeline, which Perfetto opens too, with
+ * tools/r502_trace_to_json.py
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef R502_TRACE
+#define R502_TRACE 0
+#endif
+
+#ifndef R502_TRACE_RECORDS
+/// Records kept by R502BufferTrace, the oldest are overwritten first
+#define R502_TRACE_RECORDS 512
+#endif
+
+/**
+ * \brief Where in a package exchange a trace record was taken
+ */
+typedef enum {
+    R502_trace_tx_start = 0, //!< code: instruction, arg: package length
+    R502_trace_tx_end = 1, //!< Package handed to the uart, as tx_start
+    R502_trace_rx_header = 2, //!< code: pid, arg: announced length
+    R502_trace_rx_complete = 3, //!< code: pid, arg: bytes received
+    R502_trace_checksum_ok = 4, //!< code: pid, arg: announced length
+    R502_trace_callback = 5, //!< Frame handed to up_image consumer. code:
+                             //!< pid, arg: frame number
+} R502_trace_event_t;
+
+/**
+ * \brief One trace point, as stored and as dumped
+ */
+struct R502_trace_record_t {
+    uint32_t time_us; //!< Low 32 bits of esp_timer_get_time()
+    uint8_t event; //!< R502_trace_event_t
+    uint8_t code;
+    uint16_t arg;
+};
+
+/**
+ * \brief Trace backend that records nothing, its calls compile away
+ */
+struct R502NullTrace {
+    static void record(R502_trace_event_t event, uint8_t code, uint16_t arg) {}
+};
+
+/**
+ * \brief Trace backend that timestamps each point into a ring buffer
+ *
+ * Recording is lock-free and safe from any task. Reading while another task
+ * records may return a record that's being overwritten, read once the
+ * traced exchange is done
+ */
+class R502BufferTrace {
+public:
+    static void record(R502_trace_event_t event, uint8_t code, uint16_t arg);
+
+    /**
+     * \brief Move up to max records out of the buffer, oldest first
+     * \retval Number of records copied to out
+     */
+    static size_t read(R502_trace_record_t *out, size_t max);
+
+    /**
+     * \brief Print every buffered record as hex, on lines starting with
+     * "R502T:", and empty the buffer
+     */
+    static void dump();
+
+    /**
+     * \brief Number of records overwritten before they were read, as of the
+     * last read
+     */
+    static uint32_t dropped();
+
+    /**
+     * \brief Throw away every buffered record
+     */
+    static void clear();
+};
+
+/// Backend the trace points use, chosen by R502_TRACE
+#if R502_TRACE
+typedef R502BufferTrace R502Trace;
+#else
+typedef R502NullTrace R502Trace;
+#endif
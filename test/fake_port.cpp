@@ -0,0 +1,239 @@
+#include "fake_port.hpp"
+#include <algorithm>
+
+FakePort *FakePort::active = nullptr;
+
+esp_err_t FakePort::init(R502Interface &iface)
+{
+    // The last uart, the module under test in test_uart.cpp is on UART_NUM_1
+    return iface.init((uart_port_t)(UART_NUM_MAX - 1),
+        (gpio_num_t)UART_PIN_NO_CHANGE, (gpio_num_t)UART_PIN_NO_CHANGE,
+        GPIO_NUM_NC);
+}
+
+void FakePort::write(const uint8_t *data, size_t len)
+{
+    // The interface may write a package in several pieces
+    tx.insert(tx.end(), data, data + len);
+    while(tx.size() >= 9){
+        size_t total = 9 + (tx[7] << 8 | tx[8]);
+        if(tx.size() < total) return;
+        if(tx[6] == R502_pid_command){
+            command(tx.data() + 9);
+        }
+        else{
+            // down_char's data packages, not acknowledged
+            char_buffers[down_buffer].insert(char_buffers[down_buffer].end(),
+                tx.begin() + 9, tx.begin() + total - R502_cs_len);
+        }
+        tx.erase(tx.begin(), tx.begin() + total);
+    }
+}
+
+void FakePort::command(const uint8_t *content)
+{
+    const uint8_t ok = R502_ok;
+    switch(content[0]){
+    case R502_ic_set_sys_para:
+        if(content[1] == R502_para_num_data_pkg_len){
+            data_len = 32 << content[2];
+        }
+        break;
+    case R502_ic_write_notepad:
+        std::copy(content + 2, content + 2 + R502_notepad_page_size,
+            notepad[content[1]].begin());
+        break;
+    case R502_ic_read_notepad: {
+        uint8_t ack[1 + R502_notepad_page_size] = {R502_ok};
+        std::copy(notepad[content[1]].begin(), notepad[content[1]].end(),
+            ack + 1);
+        reply(R502_pid_ack, ack, sizeof(ack));
+        return;
+    }
+    case R502_ic_get_random_code: {
+        // Counts up, the tests only care how many were asked for
+        uint32_t number = random_codes++;
+        const uint8_t ack[] = {R502_ok, (uint8_t)(number >> 24),
+            (uint8_t)(number >> 16), (uint8_t)(number >> 8), (uint8_t)number};
+        reply(R502_pid_ack, ack, sizeof(ack));
+        return;
+    }
+    case R502_ic_read_sys_para: {
+        const uint8_t ack[] = {R502_ok, 0, 0, 0, 9,
+            (uint8_t)(library_size >> 8), (uint8_t)library_size, 0, 3,
+            0xFF, 0xFF, 0xFF, 0xFF, 0, (uint8_t)(__builtin_ctz(data_len) - 5),
+            0, R502_baud_57600};
+        reply(R502_pid_ack, ack, sizeof(ack));
+        return;
+    }
+    case R502_ic_read_index_table: {
+        uint8_t ack[1 + R502_index_table_len] = {R502_ok};
+        const int first = content[1] * R502_index_table_len * 8;
+        for(const auto &entry : library){
+            int bit = entry.first - first;
+            if(bit < 0 || bit >= R502_index_table_len * 8) continue;
+            ack[1 + bit / 8] |= 1 << (bit % 8);
+        }
+        reply(R502_pid_ack, ack, sizeof(ack));
+        return;
+    }
+    case R502_ic_load_char: {
+        uint16_t page = content[2] << 8 | content[3];
+        if(!library.count(page)){
+            const uint8_t err = R502_err_reading_template;
+            reply(R502_pid_ack, &err, 1);
+            return;
+        }
+        char_buffers[content[1] - 1] = library[page];
+        break;
+    }
+    case R502_ic_store:
+        library[content[2] << 8 | content[3]] = char_buffers[content[1] - 1];
+        stores++;
+        break;
+    case R502_ic_delet_char: {
+        uint16_t page = content[1] << 8 | content[2];
+        uint16_t count = content[3] << 8 | content[4];
+        library.erase(library.lower_bound(page),
+            library.lower_bound(page + count));
+        break;
+    }
+    case R502_ic_empty:
+        library.clear();
+        break;
+    case R502_ic_down_char:
+        down_buffer = content[1] - 1;
+        char_buffers[down_buffer].clear();
+        break;
+    case R502_ic_up_char: {
+        reply(R502_pid_ack, &ok, 1);
+        std::vector<uint8_t> file = char_buffers[content[1] - 1];
+        if(file.empty()){
+            for(size_t i = 0; i < char_file_size; i++){
+                file.push_back(i * 13);
+            }
+        }
+        // Always whole packages, the last one padded
+        file.resize((file.size() + data_len - 1) / data_len * data_len);
+        for(size_t off = 0; off < file.size(); off += data_len){
+            bool last = off + data_len >= file.size();
+            reply(last ? R502_pid_end_of_data : R502_pid_data,
+                file.data() + off, data_len);
+        }
+        return;
+    }
+    default:
+        break;
+    }
+    reply(R502_pid_ack, &ok, 1);
+}
+
+void FakePort::reply(uint8_t pid, const uint8_t *content, size_t len)
+{
+    int length = len + R502_cs_len;
+    const uint8_t header[] = {0xEF, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, pid,
+        (uint8_t)(length >> 8), (uint8_t)length};
+    rx.insert(rx.end(), header, header + sizeof(header));
+    int sum = pid + (length >> 8) + (length & 0xff);
+    for(size_t i = 0; i < len; i++){
+        rx.push_back(content[i]);
+        sum += content[i];
+    }
+    rx.push_back(sum >> 8);
+    rx.push_back(sum);
+}
+
+extern "C" {
+int __real_uart_write_bytes(uart_port_t uart_num, const void *src,
+    size_t size);
+int __real_uart_read_bytes(uart_port_t uart_num, void *buf,
+    uint32_t length, TickType_t ticks_to_wait);
+esp_err_t __real_uart_get_buffered_data_len(uart_port_t uart_num,
+    size_t *size);
+esp_err_t __real_uart_flush(uart_port_t uart_num);
+esp_err_t __real_gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode);
+esp_err_t __real_gpio_set_intr_type(gpio_num_t gpio_num,
+    gpio_int_type_t intr_type);
+esp_err_t __real_gpio_intr_enable(gpio_num_t gpio_num);
+esp_err_t __real_gpio_isr_handler_add(gpio_num_t gpio_num,
+    gpio_isr_t isr_handler, void *args);
+esp_err_t __real_gpio_isr_handler_remove(gpio_num_t gpio_num);
+
+int __wrap_uart_write_bytes(uart_port_t uart_num, const void *src,
+    size_t size)
+{
+    if(!FakePort::active){
+        return __real_uart_write_bytes(uart_num, src, size);
+    }
+    FakePort::active->write((const uint8_t *)src, size);
+    return size;
+}
+
+int __wrap_uart_read_bytes(uart_port_t uart_num, void *buf,
+    uint32_t length, TickType_t ticks_to_wait)
+{
+    if(!FakePort::active){
+        return __real_uart_read_bytes(uart_num, buf, length, ticks_to_wait);
+    }
+    std::deque<uint8_t> &rx = FakePort::active->rx;
+    uint32_t read = 0;
+    for(; read < length && !rx.empty(); read++){
+        ((uint8_t *)buf)[read] = rx.front();
+        rx.pop_front();
+    }
+    return read;
+}
+
+esp_err_t __wrap_uart_get_buffered_data_len(uart_port_t uart_num,
+    size_t *size)
+{
+    if(!FakePort::active){
+        return __real_uart_get_buffered_data_len(uart_num, size);
+    }
+    *size = FakePort::active->rx.size();
+    return ESP_OK;
+}
+
+esp_err_t __wrap_uart_flush(uart_port_t uart_num)
+{
+    if(!FakePort::active) return __real_uart_flush(uart_num);
+    FakePort::active->rx.clear();
+    return ESP_OK;
+}
+
+esp_err_t __wrap_gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    if(!FakePort::active) return __real_gpio_set_direction(gpio_num, mode);
+    return ESP_OK;
+}
+
+esp_err_t __wrap_gpio_set_intr_type(gpio_num_t gpio_num,
+    gpio_int_type_t intr_type)
+{
+    if(!FakePort::active){
+        return __real_gpio_set_intr_type(gpio_num, intr_type);
+    }
+    return ESP_OK;
+}
+
+esp_err_t __wrap_gpio_intr_enable(gpio_num_t gpio_num)
+{
+    if(!FakePort::active) return __real_gpio_intr_enable(gpio_num);
+    return ESP_OK;
+}
+
+esp_err_t __wrap_gpio_isr_handler_add(gpio_num_t gpio_num,
+    gpio_isr_t isr_handler, void *args)
+{
+    if(!FakePort::active){
+        return __real_gpio_isr_handler_add(gpio_num, isr_handler, args);
+    }
+    return ESP_OK;
+}
+
+esp_err_t __wrap_gpio_isr_handler_remove(gpio_num_t gpio_num)
+{
+    if(!FakePort::active) return __real_gpio_isr_handler_remove(gpio_num);
+    return ESP_OK;
+}
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <vector>
+#include "R502Interface.hpp"
+
+/**
+ * \brief Pretend module behind the uart driver, for the tests that need
+ * more of a module than the interface's parameter checks
+ *
+ * Acknowledges every command with R502_ok. Keeps a notepad and a template
+ * library with two character buffers, answers up_char with a character file
+ * split into data packages of the interface's length, takes down_char's data
+ * packages, counts get_random_code calls, and follows set_sys_para of the
+ * data package length.
+ *
+ * The uart and gpio functions the interface calls are wrapped at link time,
+ * see CMakeLists.txt. While a FakePort is active they go to it, otherwise to
+ * the driver, so the hardware tests are unaffected
+ */
+class FakePort {
+public:
+    /// Bytes waiting for the interface to read
+    std::deque<uint8_t> rx;
+    int data_len = 128;
+    /// Bytes of character file sent per up_char of an empty character
+    /// buffer, byte i is i * 13
+    size_t char_file_size = R502_character_file_size;
+    /// Templates stored on the module, by page id
+    std::map<uint16_t, std::vector<uint8_t>> library;
+    /// finger_library_size answered by read_sys_para
+    uint16_t library_size = 32;
+    /// store commands answered
+    uint32_t stores = 0;
+    std::array<std::array<uint8_t, R502_notepad_page_size>,
+        R502_notepad_pages> notepad = {};
+    /// get_random_code commands answered
+    std::atomic<uint32_t> random_codes{0};
+
+    FakePort() { active = this; }
+    ~FakePort() { active = nullptr; }
+
+    /**
+     * \brief Initialize iface on a uart the module under test in
+     * test_uart.cpp doesn't use, talking to this port
+     */
+    esp_err_t init(R502Interface &iface);
+
+    /**
+     * \brief Take bytes the interface wrote, answering each whole command
+     */
+    void write(const uint8_t *data, size_t len);
+
+    static FakePort *active;
+
+private:
+    void command(const uint8_t *content);
+    void reply(uint8_t pid, const uint8_t *content, size_t len);
+
+    std::vector<uint8_t> tx;
+    std::array<std::vector<uint8_t>, 2> char_buffers;
+    // Index into char_buffers down_char's data packages go to
+    int down_buffer = 0;
+};
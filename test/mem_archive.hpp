@@ -0,0 +1,57 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "R502TemplateArchive.hpp"
+#include "R502CaptureArchive.hpp"
+
+/**
+ * \brief Keeps an archive in RAM, so tests can inspect, cut short and
+ * corrupt it, and the test app needs no filesystem
+ * \tparam Archive Archive whose byte backend this provides
+ */
+template<typename Archive>
+class MemArchive : public Archive {
+public:
+    std::vector<uint8_t> stored;
+    int reads = 0;
+
+protected:
+    esp_err_t read_at(size_t offset, uint8_t *data, size_t len) override
+    {
+        reads++;
+        if(offset + len > stored.size()) return ESP_ERR_INVALID_SIZE;
+        memcpy(data, stored.data() + offset, len);
+        return ESP_OK;
+    }
+
+    esp_err_t append(const uint8_t *data, size_t len) override
+    {
+        stored.insert(stored.end(), data, data + len);
+        return ESP_OK;
+    }
+
+    size_t size() override { return stored.size(); }
+
+    esp_err_t truncate(size_t new_size) override
+    {
+        stored.resize(new_size);
+        return ESP_OK;
+    }
+};
+
+typedef MemArchive<R502TemplateArchive> MemTemplateArchive;
+
+/**
+ * \brief Capture archive in RAM, its header is overwritten in place
+ */
+class MemCaptureArchiveWriter : public MemArchive<R502CaptureArchiveWriter> {
+protected:
+    esp_err_t write_at(size_t offset, const uint8_t *data,
+        size_t len) override
+    {
+        if(offset + len > stored.size()) return ESP_ERR_INVALID_SIZE;
+        memcpy(stored.data() + offset, data, len);
+        return ESP_OK;
+    }
+};
@@ -0,0 +1,206 @@
+#include "unity.h"
+
+// Only built by toolchains with coroutine support, see CMakeLists.txt
+#if defined(__cpp_impl_coroutine)
+#include <deque>
+#include <vector>
+#include "R502AsyncSensor.hpp"
+
+/**
+ * \brief Link to a pretend module that answers each command at once
+ */
+class ScriptedLink : public R502AsyncLink {
+public:
+    std::deque<uint8_t> rx;
+    std::vector<uint8_t> commands;
+    std::vector<bool> library = std::vector<bool>(200, false);
+    bool mute = false;
+    bool irq = false;
+    bool held = false;
+
+    esp_err_t write(const uint8_t *data, size_t len) override {
+        uint8_t instr_code = data[9];
+        commands.push_back(instr_code);
+        if(mute) return ESP_OK;
+        switch(instr_code){
+            case R502_ic_search:
+                for(int i = 0; i < library.size(); i++){
+                    if(library[i]){
+                        ack(R502_ok, {0, (uint8_t)i, 0, 100});
+                        return ESP_OK;
+                    }
+                }
+                ack(R502_err_not_found, {0, 0, 0, 0});
+                break;
+            case R502_ic_store:
+                library[(data[11] << 8) | data[12]] = true;
+                ack(R502_ok, {});
+                break;
+            case R502_ic_template_num: {
+                int count = 0;
+                for(bool used : library) count += used;
+                ack(R502_ok, {(uint8_t)(count >> 8), (uint8_t)count});
+                break;
+            }
+            default:
+                ack(R502_ok, {});
+                break;
+        }
+        return ESP_OK;
+    }
+    size_t available() override { return rx.size(); }
+    int read(uint8_t *data, size_t len) override {
+        int read = 0;
+        while(read < len && !rx.empty()){
+            data[read++] = rx.front();
+            rx.pop_front();
+        }
+        return read;
+    }
+    void discard() override { rx.clear(); }
+    bool take_irq() override {
+        bool fired = irq;
+        irq = false;
+        return fired;
+    }
+    bool try_acquire() override {
+        if(held) return false;
+        held = true;
+        return true;
+    }
+    void release() override { held = false; }
+
+private:
+    void ack(uint8_t conf_code, std::vector<uint8_t> extra) {
+        extra.insert(extra.begin(), conf_code);
+        int len = extra.size() + R502_cs_len;
+        std::vector<uint8_t> pkg = {0xEF, 0x01, 0xFF, 0xFF, 0xFF, 0xFF,
+            R502_pid_ack, (uint8_t)(len >> 8), (uint8_t)len};
+        int sum = R502_pid_ack + (len >> 8) + (len & 0xff);
+        for(uint8_t byte : extra){
+            pkg.push_back(byte);
+            sum += byte;
+        }
+        pkg.push_back((sum >> 8) & 0xff);
+        pkg.push_back(sum & 0xff);
+        rx.insert(rx.end(), pkg.begin(), pkg.end());
+    }
+};
+
+static R502Task<void> enroll(R502AsyncSensor &sensor, uint16_t page_id,
+    esp_err_t &outcome)
+{
+    outcome = co_await sensor.wait_for_finger(5000);
+    if(outcome) co_return;
+    R502_async_result_t res = co_await sensor.gen_image();
+    if(res.err || res.conf_code != R502_ok){
+        outcome = res.err ? res.err : ESP_FAIL;
+        co_return;
+    }
+    res = co_await sensor.img_2_tz(R502_char_buffer_1);
+    if(res.err || res.conf_code != R502_ok){
+        outcome = res.err ? res.err : ESP_FAIL;
+        co_return;
+    }
+    R502_async_search_t found = co_await sensor.search(R502_char_buffer_1,
+        0, 200);
+    if(found.err || found.conf_code != R502_err_not_found){
+        // already enrolled
+        outcome = found.err ? found.err : ESP_ERR_INVALID_STATE;
+        co_return;
+    }
+    res = co_await sensor.store(R502_char_buffer_1, page_id);
+    outcome = res.err ? res.err : (res.conf_code == R502_ok ? ESP_OK : ESP_FAIL);
+}
+
+TEST_CASE("Async workflows on two sensors", "[async sensor]")
+{
+    R502HostScheduler scheduler;
+    R502Interface iface_a, iface_b;
+    ScriptedLink link_a, link_b;
+    R502AsyncSensor sensor_a(scheduler, iface_a, link_a);
+    R502AsyncSensor sensor_b(scheduler, iface_b, link_b);
+
+    esp_err_t outcome_a = ESP_FAIL, outcome_b = ESP_FAIL;
+    scheduler.spawn(enroll(sensor_a, 3, outcome_a));
+    scheduler.spawn(enroll(sensor_b, 7, outcome_b));
+    // Both wait for a finger without blocking each other
+    TEST_ASSERT_EQUAL(2, scheduler.run_once(0));
+    TEST_ASSERT_TRUE(link_a.commands.empty());
+
+    link_b.irq = true;
+    scheduler.run_once(0);
+    TEST_ASSERT_EQUAL(1, scheduler.pending());
+    TEST_ESP_OK(outcome_b);
+    TEST_ASSERT_TRUE(link_b.library[7]);
+
+    link_a.irq = true;
+    scheduler.run();
+    TEST_ESP_OK(outcome_a);
+    TEST_ASSERT_TRUE(link_a.library[3]);
+    const uint8_t expected[] = {R502_ic_gen_img, R502_ic_img_2_tz,
+        R502_ic_search, R502_ic_store};
+    TEST_ASSERT_EQUAL(sizeof(expected), link_a.commands.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, link_a.commands.data(),
+        sizeof(expected));
+
+    // Enrolling again finds the template
+    link_a.irq = true;
+    scheduler.spawn(enroll(sensor_a, 4, outcome_a));
+    scheduler.run();
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, outcome_a);
+}
+
+static R502Task<void> count_templates(R502AsyncSensor &sensor,
+    uint16_t &count, esp_err_t &outcome)
+{
+    R502_async_result_t res = co_await sensor.template_num(count);
+    outcome = res.err;
+}
+
+TEST_CASE("Async exchanges share a link", "[async sensor]")
+{
+    R502HostScheduler scheduler;
+    R502Interface iface;
+    ScriptedLink link;
+    link.library[1] = true;
+    link.library[2] = true;
+    R502AsyncSensor sensor(scheduler, iface, link);
+
+    uint16_t counts[3] = {0, 0, 0};
+    esp_err_t outcomes[3] = {ESP_FAIL, ESP_FAIL, ESP_FAIL};
+    for(int i = 0; i < 3; i++){
+        scheduler.spawn(count_templates(sensor, counts[i], outcomes[i]));
+    }
+    scheduler.run();
+    for(int i = 0; i < 3; i++){
+        TEST_ESP_OK(outcomes[i]);
+        TEST_ASSERT_EQUAL(2, counts[i]);
+    }
+    TEST_ASSERT_EQUAL(3, link.commands.size());
+}
+
+TEST_CASE("Async timeouts run on the scheduler clock", "[async sensor]")
+{
+    R502HostScheduler scheduler;
+    R502Interface iface;
+    ScriptedLink link;
+    link.mute = true;
+    R502AsyncSensor sensor(scheduler, iface, link);
+
+    esp_err_t outcome = ESP_OK;
+    link.irq = true;
+    scheduler.spawn(enroll(sensor, 0, outcome));
+    scheduler.run();
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, outcome);
+    TEST_ASSERT_GREATER_THAN(0, scheduler.now_us());
+
+    // No touch at all
+    scheduler.spawn(enroll(sensor, 0, outcome));
+    int64_t start = scheduler.now_us();
+    scheduler.run();
+    TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, outcome);
+    TEST_ASSERT_EQUAL(5000 * 1000, scheduler.now_us() - start);
+}
+
+#endif
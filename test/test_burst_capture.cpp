@@ -0,0 +1,40 @@
+#include "unity.h"
+#include "fake_port.hpp"
+#include "R502BurstCapture.hpp"
+
+TEST_CASE("Burst capture takes nothing that can't fit its budget",
+    "[burst capture]")
+{
+    FakePort port;
+    R502Interface iface;
+    TEST_ESP_OK(port.init(iface));
+    R502BurstCapture burst(iface);
+    R502_burst_config_t config = {};
+    config.mode = R502_burst_image;
+    config.budget_ms = 200;
+    config.max_captures = 3;
+    config.target_quality = 101;
+    config.extract_best = true;
+    config.buffer = R502_char_buffer_1;
+    R502_burst_result_t result;
+
+    // Uploading an image alone takes seconds at 57600 baud
+    TEST_ESP_OK(burst.run(config, result));
+    TEST_ASSERT_EQUAL(0, result.captures);
+    TEST_ASSERT_EQUAL(-1, result.best);
+    TEST_ASSERT_LESS_OR_EQUAL(config.budget_ms, result.elapsed_us / 1000);
+
+    // Nothing learned yet, gen_image alone is allowed 600ms
+    config.mode = R502_burst_extract;
+    TEST_ESP_OK(burst.run(config, result));
+    TEST_ASSERT_EQUAL(0, result.captures);
+    TEST_ASSERT_EQUAL(-1, result.best);
+
+    // With room for it, the first extraction that passes ends the burst
+    config.budget_ms = 2000;
+    TEST_ESP_OK(burst.run(config, result));
+    TEST_ASSERT_EQUAL(1, result.captures);
+    TEST_ASSERT_EQUAL(0, result.best);
+    TEST_ASSERT_EQUAL(R502_ok, result.res);
+    TEST_ESP_OK(iface.deinit());
+}
@@ -0,0 +1,140 @@
+#include "unity.h"
+#include <vector>
+#include "R502CaptureArchive.hpp"
+#include "mem_archive.hpp"
+
+static const std::array<uint8_t, 4> module_a = {0xFF, 0xFF, 0xFF, 0xFF};
+static const std::array<uint8_t, 4> module_b = {0x00, 0x00, 0x00, 0x02};
+
+/**
+ * \brief Write a capture of two 3 byte frames, every pixel value seed
+ */
+static void write_capture(R502CaptureArchiveWriter &writer,
+    const std::array<uint8_t, 4> &adder, int64_t timestamp_us, uint8_t seed,
+    R502_image_format_t format = R502_image_packed)
+{
+    R502_capture_meta_t meta = {};
+    meta.timestamp_us = timestamp_us;
+    meta.link.baud = R502_baud_57600;
+    meta.link.data_package_length = R502_data_len_128;
+    memcpy(meta.link.adder, adder.data(), adder.size());
+    meta.format = format;
+    TEST_ESP_OK(writer.begin(meta));
+    uint8_t frame[3];
+    memset(frame, seed * 0x11, sizeof(frame));
+    writer(R502ByteSpan(frame, sizeof(frame)));
+    writer(R502ByteSpan(frame, sizeof(frame)));
+    TEST_ESP_OK(writer.end());
+}
+
+TEST_CASE("Capture archive looks up by time and module", "[capture archive]")
+{
+    MemCaptureArchiveWriter writer;
+    R502_capture_meta_t meta = {};
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, writer.begin(meta));
+    TEST_ESP_OK(writer.open());
+    // Out of time order, as captures from several modules can be
+    write_capture(writer, module_a, 300, 3);
+    write_capture(writer, module_b, 100, 1);
+    write_capture(writer, module_a, 200, 2, R502_image_8bit);
+    write_capture(writer, module_b, 400, 4);
+    TEST_ESP_OK(writer.close());
+
+    R502CaptureArchiveReader reader;
+    TEST_ESP_OK(reader.open(writer.stored.data(), writer.stored.size()));
+    TEST_ASSERT_EQUAL(4, reader.count());
+    for(size_t i = 0; i < reader.count(); i++){
+        TEST_ASSERT_EQUAL((i + 1) * 100,
+            reader.by_time(i).header->timestamp_us);
+    }
+
+    R502_capture_range_t range = reader.time_range(150, 400);
+    TEST_ASSERT_EQUAL(1, range.first);
+    TEST_ASSERT_EQUAL(3, range.last);
+
+    range = reader.module_range(module_a);
+    TEST_ASSERT_EQUAL(2, range.last - range.first);
+    R502_capture_view_t view = reader.by_module(range.first);
+    TEST_ASSERT_EQUAL(200, view.header->timestamp_us);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(module_a.data(), view.header->adder, 4);
+    TEST_ASSERT_EQUAL(R502_image_8bit, view.header->format);
+    TEST_ASSERT_EQUAL(12, view.image.size());
+    TEST_ASSERT_EQUAL(0x20, view.image[0]);
+    TEST_ASSERT_EQUAL(2, view.header->frames);
+    TEST_ASSERT_EQUAL(0x20, view.header->pixel_min);
+    TEST_ASSERT_EQUAL(0x20, view.header->pixel_max);
+    TEST_ASSERT_EQUAL(0x20 << 8, view.header->pixel_mean);
+    TEST_ASSERT_EQUAL(0, view.header->pixel_stddev);
+
+    // Views point into the mapping rather than copying out of it
+    view = reader.by_time(3);
+    TEST_ASSERT_TRUE(view.image.data() > writer.stored.data() &&
+        view.image.data() < writer.stored.data() + writer.stored.size());
+    TEST_ASSERT_EQUAL(6, view.image.size());
+    TEST_ASSERT_EQUAL(0x44, view.image[5]);
+
+    range = reader.module_range(module_b, 200);
+    TEST_ASSERT_EQUAL(1, range.last - range.first);
+    TEST_ASSERT_EQUAL(400, reader.by_module(range.first).header->timestamp_us);
+    range = reader.module_range({1, 2, 3, 4});
+    TEST_ASSERT_EQUAL(range.first, range.last);
+    TEST_ASSERT_NULL(reader.by_time(4).header);
+}
+
+TEST_CASE("Capture archive appends after reopening", "[capture archive]")
+{
+    MemCaptureArchiveWriter writer;
+    TEST_ESP_OK(writer.open());
+    write_capture(writer, module_a, 100, 1);
+    TEST_ESP_OK(writer.close());
+
+    // A closed archive reopens from its index
+    TEST_ESP_OK(writer.open());
+    TEST_ASSERT_EQUAL(1, writer.count());
+    R502CaptureArchiveReader reader;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE,
+        reader.open(writer.stored.data(), writer.stored.size()));
+    write_capture(writer, module_a, 200, 2);
+    size_t good_size = writer.stored.size();
+
+    // One that wasn't closed is recovered from its capture headers, and a
+    // capture cut short is dropped
+    R502_capture_meta_t meta = {};
+    TEST_ESP_OK(writer.begin(meta));
+    uint8_t frame[5] = {};
+    writer(R502ByteSpan(frame, sizeof(frame)));
+    TEST_ESP_OK(writer.open());
+    TEST_ASSERT_EQUAL(good_size, writer.stored.size());
+    TEST_ASSERT_EQUAL(2, writer.count());
+    write_capture(writer, module_a, 300, 3);
+    TEST_ESP_OK(writer.close());
+
+    TEST_ESP_OK(reader.open(writer.stored.data(), writer.stored.size()));
+    TEST_ASSERT_EQUAL(3, reader.count());
+    TEST_ASSERT_EQUAL(2, reader.by_time(2).header->sequence);
+}
+
+TEST_CASE("Capture archive reader checks the mapping", "[capture archive]")
+{
+    MemCaptureArchiveWriter writer;
+    TEST_ESP_OK(writer.open());
+    write_capture(writer, module_a, 100, 1);
+    TEST_ESP_OK(writer.close());
+
+    R502CaptureArchiveReader reader;
+    std::vector<uint8_t> &stored = writer.stored;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE,
+        reader.open(stored.data(), stored.size() - 1));
+    std::vector<uint8_t> shifted(stored.size() + 1);
+    memcpy(shifted.data() + 1, stored.data(), stored.size());
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+        reader.open(shifted.data() + 1, stored.size()));
+
+    // A corrupt capture header gives an empty view rather than a bad image
+    TEST_ESP_OK(reader.open(stored.data(), stored.size()));
+    stored[sizeof(R502_capture_file_header_t)] = 'X';
+    TEST_ASSERT_NULL(reader.by_time(0).header);
+    stored[0] = 'X';
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_VERSION,
+        reader.open(stored.data(), stored.size()));
+}
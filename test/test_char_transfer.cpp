@@ -0,0 +1,67 @@
+#include "unity.h"
+#include "fake_port.hpp"
+#include "R502TemplateArchive.hpp"
+
+static void set_data_len(R502Interface &iface, FakePort &port,
+    R502_data_len_t data_len)
+{
+    R502_conf_code_t conf_code;
+    TEST_ESP_OK(iface.set_data_package_length(data_len, conf_code));
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(R502_data_len_bytes(data_len), port.data_len);
+}
+
+TEST_CASE("UpChar receives every data package length", "[char transfer]")
+{
+    FakePort port;
+    R502Interface iface;
+    TEST_ESP_OK(port.init(iface));
+    const R502_data_len_t lengths[] = {R502_data_len_32, R502_data_len_64,
+        R502_data_len_128};
+    for(R502_data_len_t data_len : lengths){
+        set_data_len(iface, port, data_len);
+        R502_conf_code_t conf_code;
+        R502_char_file_t char_file = {};
+        TEST_ESP_OK(iface.up_char(R502_char_buffer_1, conf_code, char_file));
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+        for(size_t i = 0; i < char_file.size(); i++){
+            TEST_ASSERT_EQUAL((uint8_t)(i * 13), char_file[i]);
+        }
+        TEST_ASSERT_TRUE(port.rx.empty());
+    }
+
+    // 267 byte packages, received whole. The second one doesn't fit the
+    // character file, and is drained so the next command lines up
+    set_data_len(iface, port, R502_data_len_256);
+    R502_conf_code_t conf_code;
+    R502_char_file_t char_file = {};
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE,
+        iface.up_char(R502_char_buffer_1, conf_code, char_file));
+    TEST_ASSERT_TRUE(port.rx.empty());
+    for(int i = 0; i < 256; i++){
+        TEST_ASSERT_EQUAL((uint8_t)(i * 13), char_file[i]);
+    }
+    set_data_len(iface, port, R502_data_len_128);
+    TEST_ESP_OK(iface.up_char(R502_char_buffer_1, conf_code, char_file));
+    TEST_ESP_OK(iface.deinit());
+}
+
+TEST_CASE("UpChar rejects a character file of the wrong size",
+    "[char transfer]")
+{
+    FakePort port;
+    R502Interface iface;
+    TEST_ESP_OK(port.init(iface));
+    R502_conf_code_t conf_code;
+    R502_char_file_t char_file;
+
+    port.char_file_size = R502_character_file_size + 128;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE,
+        iface.up_char(R502_char_buffer_1, conf_code, char_file));
+    TEST_ASSERT_TRUE(port.rx.empty());
+
+    port.char_file_size = R502_character_file_size - 128;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE,
+        iface.up_char(R502_char_buffer_1, conf_code, char_file));
+    TEST_ESP_OK(iface.deinit());
+}
@@ -0,0 +1,190 @@
+#include "unity.h"
+#include <stdio.h>
+#include <deque>
+#include <vector>
+#include "R502CommandBatch.hpp"
+
+/**
+ * \brief Module on a simulated clock, commands and acknowledgements take
+ * their wire time at 57600 baud and each command process_us to carry out
+ */
+class SimulatedModule : public R502BatchPort {
+public:
+    SimulatedModule(int64_t _process_us) : process_us(_process_us) {}
+
+    esp_err_t send(const R502FrameEncoder &frame) override {
+        std::vector<uint8_t> bytes;
+        frame.write([&](const uint8_t *data, size_t len){
+            bytes.insert(bytes.end(), data, data + len);
+            return ESP_OK;
+        });
+        int sum = 0;
+        for(size_t i = 6; i < bytes.size() - 2; i++){
+            sum += bytes[i];
+        }
+        if(bytes[bytes.size() - 2] != ((sum >> 8) & 0xff) ||
+            bytes[bytes.size() - 1] != (sum & 0xff))
+        {
+            return ESP_ERR_INVALID_CRC;
+        }
+        commands.push_back(bytes[9]);
+
+        // The host's line, then the module one command at a time
+        line_free_us = std::max(line_free_us, now_us) + 
+            wire_us(bytes.size());
+        int64_t start_us = std::max(line_free_us, module_free_us);
+        module_free_us = start_us + process_us + wire_us(ack_bytes);
+        if(commands.size() - 1 != drop){
+            acks.push_back(module_free_us);
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t receive(R502_DataPkg_t &pkg, int data_length,
+        uint8_t instr_code) override
+    {
+        if(acks.empty()){
+            now_us += timeout_us;
+            return ESP_ERR_NOT_FOUND;
+        }
+        now_us = std::max(now_us, acks.front());
+        acks.pop_front();
+        acked.push_back(instr_code);
+        pkg.data.general_ack.conf_code = R502_ok;
+        return ESP_OK;
+    }
+
+    void resync(const uint8_t *in_flight, int count) override {
+        now_us = std::max(now_us, module_free_us);
+        acks.clear();
+        resynced.insert(resynced.end(), in_flight, in_flight + count);
+    }
+
+    static int64_t wire_us(int bytes) {
+        return (int64_t)bytes * 10 * 1000000 / 57600;
+    }
+
+    int64_t now_us = 0;
+    std::vector<uint8_t> commands;
+    // Instruction each acknowledgement was received for
+    std::vector<uint8_t> acked;
+    // Instructions in flight at each resync
+    std::vector<uint8_t> resynced;
+    // Index of a command the module ignores, -1 for none
+    size_t drop = -1;
+
+private:
+    static const int ack_bytes = 12;
+    static const int64_t timeout_us = 100000;
+    const int64_t process_us;
+    int64_t line_free_us = 0;
+    int64_t module_free_us = 0;
+    std::deque<int64_t> acks;
+};
+
+static void fill_feedback_batch(R502CommandBatch &batch,
+    const std::array<uint8_t, R502_notepad_page_size> &page)
+{
+    batch.clear();
+    batch.led_config(R502_led_flashing, 50, R502_led_blue, 3);
+    for(int i = 0; i < 4; i++){
+        batch.write_notepad(i, page);
+    }
+    batch.set_security_level(3);
+    batch.led_config(R502_led_on, 0, R502_led_purple, 0);
+    batch.led_config(R502_led_fade_off, 100, R502_led_purple, 0);
+}
+
+TEST_CASE("Batch is checked in order", "[command batch]")
+{
+    R502Interface iface;
+    R502CommandBatch batch(iface);
+    std::array<uint8_t, R502_notepad_page_size> page = {};
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, batch.set_security_level(6));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, 
+        batch.write_notepad(R502_notepad_pages, page));
+    fill_feedback_batch(batch, page);
+    TEST_ASSERT_EQUAL(8, batch.size());
+
+    SimulatedModule module(5000);
+    TEST_ESP_OK(batch.execute(module));
+    TEST_ASSERT_EQUAL(0, batch.get_failed());
+    const uint8_t expected[] = {R502_ic_led_config, R502_ic_write_notepad,
+        R502_ic_write_notepad, R502_ic_write_notepad, R502_ic_write_notepad,
+        R502_ic_set_sys_para, R502_ic_led_config, R502_ic_led_config};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, module.commands.data(), 8);
+
+    for(int i = 0; i < R502CommandBatch::max_commands - 8; i++){
+        TEST_ESP_OK(batch.set_security_level(3));
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, batch.set_security_level(3));
+}
+
+TEST_CASE("Batch fails what it can't match", "[command batch]")
+{
+    R502Interface iface;
+    R502CommandBatch batch(iface);
+    std::array<uint8_t, R502_notepad_page_size> page = {};
+    fill_feedback_batch(batch, page);
+
+    // Sent one at a time only the dropped command fails
+    SimulatedModule one_at_a_time(5000);
+    one_at_a_time.drop = 2;
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, batch.execute(one_at_a_time, 1));
+    TEST_ASSERT_EQUAL(1, batch.get_failed());
+    for(int i = 0; i < batch.size(); i++){
+        const R502_batch_result_t &result = batch.get_result(i);
+        TEST_ASSERT_EQUAL(i == 2 ? ESP_ERR_NOT_FOUND : ESP_OK, result.err);
+        TEST_ASSERT_EQUAL(i == 2 ? R502_fail : R502_ok, result.conf_code);
+    }
+    // The rest carried on after the resync, each with its own ack
+    TEST_ASSERT_EQUAL(8, one_at_a_time.commands.size());
+    TEST_ASSERT_EQUAL(7, one_at_a_time.acked.size());
+    std::vector<uint8_t> expected_acks = one_at_a_time.commands;
+    expected_acks.erase(expected_acks.begin() + 2);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected_acks.data(),
+        one_at_a_time.acked.data(), 7);
+    TEST_ASSERT_EQUAL(1, one_at_a_time.resynced.size());
+    TEST_ASSERT_EQUAL(R502_ic_write_notepad, one_at_a_time.resynced[0]);
+
+    // Pipelined, the acknowledgements after it could belong to any command.
+    // The window never empties before the last ack goes missing, so every
+    // command fails
+    SimulatedModule pipelined(5000);
+    pipelined.drop = 2;
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, batch.execute(pipelined, 3));
+    TEST_ASSERT_EQUAL(8, batch.get_failed());
+    for(int i = 0; i < batch.size(); i++){
+        TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, batch.get_result(i).err);
+    }
+    TEST_ASSERT_EQUAL(8, pipelined.commands.size());
+    TEST_ASSERT_EQUAL(7, pipelined.acked.size());
+    const uint8_t in_flight[] = {R502_ic_led_config};
+    TEST_ASSERT_EQUAL(1, pipelined.resynced.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(in_flight, pipelined.resynced.data(), 1);
+}
+
+TEST_CASE("Batch pipelining", "[command batch][benchmark]")
+{
+    R502Interface iface;
+    R502CommandBatch batch(iface);
+    std::array<uint8_t, R502_notepad_page_size> page = {};
+    fill_feedback_batch(batch, page);
+
+    // Processing times the module might take, from LED-fast to flash-slow
+    const int64_t process_us[] = {1000, 5000, 20000};
+    for(int64_t process : process_us){
+        int64_t elapsed_us[4];
+        for(int window = 1; window <= 4; window++){
+            SimulatedModule module(process);
+            TEST_ESP_OK(batch.execute(module, window));
+            elapsed_us[window - 1] = module.now_us;
+        }
+        printf("process %d us: one at a time %d us, window 2 %d us, "
+            "window 3 %d us, window 4 %d us\n", (int)process, 
+            (int)elapsed_us[0], (int)elapsed_us[1], (int)elapsed_us[2], 
+            (int)elapsed_us[3]);
+        TEST_ASSERT_LESS_THAN(elapsed_us[0],
+            elapsed_us[R502CommandBatch::default_window - 1]);
+    }
+}
@@ -0,0 +1,117 @@
+#include "unity.h"
+#include <vector>
+#include "R502CommandScheduler.hpp"
+
+/**
+ * \brief Job that never talks to the module, it logs its steps and holds
+ * img_buffer after its first one
+ */
+class LoggedJob : public R502Job {
+public:
+    LoggedJob(char _name, int _steps, std::vector<char> &_log) : 
+        name(_name), steps(_steps), log(_log) {}
+
+    esp_err_t step(R502Interface &iface, bool &done) override {
+        log.push_back(name);
+        vTaskDelay(1);
+        done = ++stage == steps;
+        return ESP_OK;
+    }
+    void restart() override {
+        if(stage) restarts++;
+        stage = 0;
+    }
+    uint32_t depends_on() const override {
+        return stage > 0 ? R502_mem_image : 0;
+    }
+    uint32_t overwrote() const override {
+        return stage == 1 ? R502_mem_image : 0;
+    }
+
+    int restarts = 0;
+
+private:
+    const char name;
+    const int steps;
+    std::vector<char> &log;
+    int stage = 0;
+};
+
+TEST_CASE("Scheduler runs classes in priority order", "[command scheduler]")
+{
+    R502Interface iface;
+    R502CommandScheduler scheduler(iface);
+    std::vector<char> log;
+    LoggedJob first('f', 3, log);
+    LoggedJob background('b', 2, log);
+    LoggedJob normal('n', 2, log);
+    LoggedJob high('h', 2, log);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, 
+        scheduler.submit(high, R502_priority_high));
+
+    // The rest queue up while the first job runs
+    TEST_ESP_OK(scheduler.start());
+    TEST_ESP_OK(scheduler.submit(first, R502_priority_high));
+    TEST_ESP_OK(scheduler.submit(background, R502_priority_background));
+    TEST_ESP_OK(scheduler.submit(normal, R502_priority_normal));
+    TEST_ESP_OK(scheduler.submit(high, R502_priority_high));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, 
+        scheduler.submit(high, R502_priority_high));
+    TEST_ESP_OK(background.wait(1000));
+    TEST_ASSERT_TRUE(high.is_done());
+    TEST_ASSERT_TRUE(normal.is_done());
+    TEST_ASSERT_EQUAL(9, log.size());
+    TEST_ASSERT_EQUAL_STRING_LEN("fffhhnnbb", log.data(), 9);
+    scheduler.stop();
+
+    TEST_ASSERT_EQUAL(2, scheduler.get_stats(R502_priority_high).jobs);
+    TEST_ASSERT_EQUAL(1, scheduler.get_stats(R502_priority_normal).jobs);
+    TEST_ASSERT_EQUAL(1, scheduler.get_stats(R502_priority_background).jobs);
+    for(int cls = 0; cls < R502_priority_classes; cls++){
+        R502_sched_stats_t stats = scheduler.get_stats((R502_priority_t)cls);
+        TEST_ASSERT_EQUAL(0, stats.preemptions);
+    }
+    TEST_ASSERT_GREATER_THAN(
+        scheduler.get_stats(R502_priority_high).max_wait_us,
+        scheduler.get_stats(R502_priority_background).max_wait_us);
+}
+
+TEST_CASE("Scheduler preempts and restarts", "[command scheduler]")
+{
+    R502Interface iface;
+    R502CommandScheduler scheduler(iface);
+    std::vector<char> log;
+    LoggedJob background('b', 20, log);
+    LoggedJob high('h', 2, log);
+    TEST_ESP_OK(scheduler.start());
+    TEST_ESP_OK(scheduler.submit(background, R502_priority_background));
+    vTaskDelay(5);
+    TEST_ESP_OK(scheduler.submit(high, R502_priority_high));
+    TEST_ESP_OK(high.wait(1000));
+    TEST_ASSERT_FALSE(background.is_done());
+    TEST_ESP_OK(background.wait(1000));
+
+    // The high job replaced img_buffer, which the background job relied on
+    TEST_ASSERT_EQUAL(1, background.restarts);
+    R502_sched_stats_t stats = scheduler.get_stats(R502_priority_background);
+    TEST_ASSERT_EQUAL(1, stats.preemptions);
+    TEST_ASSERT_EQUAL(1, stats.restarts);
+    TEST_ASSERT_EQUAL('b', log.back());
+    scheduler.stop();
+}
+
+TEST_CASE("Scheduler fails jobs left at stop", "[command scheduler]")
+{
+    R502Interface iface;
+    R502CommandScheduler scheduler(iface);
+    std::vector<char> log;
+    LoggedJob forever('f', 1000, log);
+    LoggedJob queued('q', 1, log);
+    TEST_ESP_OK(scheduler.start());
+    TEST_ESP_OK(scheduler.submit(forever, R502_priority_normal));
+    TEST_ESP_OK(scheduler.submit(queued, R502_priority_normal));
+    vTaskDelay(2);
+    scheduler.stop();
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, forever.wait(100));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, queued.wait(100));
+}
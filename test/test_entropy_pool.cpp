@@ -0,0 +1,99 @@
+#include "unity.h"
+#include <string.h>
+#include "R502EntropyPool.hpp"
+#include "fake_port.hpp"
+
+TEST_CASE("Entropy pool needs seeding first", "[entropy pool]")
+{
+    R502Interface iface;
+    R502EntropyPool pool(iface);
+    uint8_t nonce[16];
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, pool.fill(nonce, sizeof(nonce)));
+    TEST_ASSERT_EQUAL(0, pool.level());
+    TEST_ASSERT_EQUAL(0, pool.get_stats().bytes_served);
+}
+
+TEST_CASE("Entropy pool ChaCha20 matches RFC 8439", "[entropy pool]")
+{
+    // Section 2.3.2, key 00 01 .. 1f, nonce 00 00 00 09 00 00 00 4a 00 00
+    // 00 00, block counter 1
+    uint8_t key_bytes[32];
+    for(size_t i = 0; i < sizeof(key_bytes); i++){
+        key_bytes[i] = i;
+    }
+    const uint8_t nonce_bytes[12] = {0x00, 0x00, 0x00, 0x09, 0x00, 0x00,
+        0x00, 0x4a, 0x00, 0x00, 0x00, 0x00};
+    uint32_t key[R502EntropyPool::key_words];
+    uint32_t nonce[3];
+    memcpy(key, key_bytes, sizeof(key));
+    memcpy(nonce, nonce_bytes, sizeof(nonce));
+
+    uint32_t block[16];
+    R502EntropyPool::chacha20_block(key, 1, nonce, block);
+    const uint8_t expected[R502EntropyPool::block_size] = {
+        0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+        0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+        0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03,
+        0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+        0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09,
+        0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+        0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9,
+        0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, (uint8_t *)block,
+        sizeof(expected));
+}
+
+// Wait for the refill task to finish refills refills
+static bool wait_refills(R502EntropyPool &pool, uint32_t refills)
+{
+    for(int i = 0; i < 100; i++){
+        if(pool.get_stats().refills >= refills) return true;
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+    return false;
+}
+
+TEST_CASE("Entropy pool refills below the low-water mark", 
+    "[entropy pool]")
+{
+    FakePort port;
+    R502Interface iface;
+    TEST_ESP_OK(port.init(iface));
+    R502EntropyPool pool(iface, 64, 32);
+    R502_conf_code_t conf_code;
+
+    // Filled to capacity, 4 bytes per get_random_code
+    TEST_ESP_OK(pool.start(conf_code));
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(16, port.random_codes);
+    TEST_ASSERT_EQUAL(64, pool.level());
+    TEST_ASSERT_EQUAL(64, pool.get_stats().bytes_mixed);
+
+    // Down to the mark, which isn't below it yet
+    uint8_t out[32];
+    TEST_ESP_OK(pool.fill(out, 32));
+    TEST_ASSERT_EQUAL(32, pool.level());
+    TEST_ASSERT_FALSE(wait_refills(pool, 2));
+    TEST_ASSERT_EQUAL(16, port.random_codes);
+
+    // One byte more, the task tops it up with the 33 bytes missing, in 9
+    // codes
+    TEST_ESP_OK(pool.fill(out, 1));
+    TEST_ASSERT_TRUE(wait_refills(pool, 2));
+    TEST_ASSERT_EQUAL(25, port.random_codes);
+    TEST_ASSERT_EQUAL(64, pool.level());
+    R502_entropy_stats_t stats = pool.get_stats();
+    TEST_ASSERT_EQUAL(100, stats.bytes_mixed);
+    TEST_ASSERT_EQUAL(33, stats.bytes_served);
+    TEST_ASSERT_EQUAL(0, stats.starved);
+    TEST_ASSERT_EQUAL(0, stats.refill_errors);
+
+    // Without the task, the pool runs dry and says so
+    pool.stop();
+    uint8_t big[64];
+    TEST_ESP_OK(pool.fill(big, sizeof(big)));
+    TEST_ASSERT_EQUAL(0, pool.level());
+    TEST_ASSERT_EQUAL(1, pool.get_stats().starved);
+    TEST_ASSERT_EQUAL(25, port.random_codes);
+    TEST_ESP_OK(iface.deinit());
+}
@@ -0,0 +1,91 @@
+#include "unity.h"
+#include <vector>
+#include "R502FrameEncoder.hpp"
+
+static const uint8_t adder[4] = {0xff, 0xff, 0xff, 0xff};
+
+static std::vector<uint8_t> gather(const R502FrameEncoder &frame)
+{
+    std::vector<uint8_t> bytes;
+    frame.write([&](const uint8_t *data, size_t len){
+        bytes.insert(bytes.end(), data, data + len);
+        return ESP_OK;
+    });
+    return bytes;
+}
+
+TEST_CASE("Frame encoder matches the package layout", "[frame encoder]")
+{
+    uint8_t content[32];
+    for(int i = 0; i < 32; i++){
+        content[i] = i * 5;
+    }
+    R502FrameEncoder frame(adder, R502_pid_command);
+    frame.add_field(R502_ic_write_notepad);
+    frame.add_field(3);
+    frame.add_payload(content, sizeof(content));
+    frame.finish();
+    TEST_ASSERT_TRUE(frame.valid());
+    TEST_ASSERT_EQUAL(R502_ic_write_notepad, frame.instr_code());
+    TEST_ASSERT_EQUAL(9 + 2 + 32 + 2, frame.length());
+
+    // Header with fields, the payload in place, checksum
+    TEST_ASSERT_EQUAL(3, frame.segment_count());
+    TEST_ASSERT_EQUAL_PTR(content, frame.segments()[1].data);
+
+    std::vector<uint8_t> bytes = gather(frame);
+    TEST_ASSERT_EQUAL(frame.length(), bytes.size());
+    const uint8_t head[] = {0xEF, 0x01, 0xff, 0xff, 0xff, 0xff, 
+        R502_pid_command, 0, 36, R502_ic_write_notepad, 3};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(head, bytes.data(), sizeof(head));
+    int sum = 0;
+    for(size_t i = 6; i < bytes.size() - 2; i++){
+        sum += bytes[i];
+    }
+    TEST_ASSERT_EQUAL((sum >> 8) & 0xff, bytes[bytes.size() - 2]);
+    TEST_ASSERT_EQUAL(sum & 0xff, bytes[bytes.size() - 1]);
+}
+
+TEST_CASE("Frame encoder wraps a filled package", "[frame encoder]")
+{
+    R502_DataPkg_t pkg = {};
+    const uint8_t filled[] = {0xEF, 0x01, 0xff, 0xff, 0xff, 0xff, 
+        R502_pid_command, 0, 3, R502_ic_gen_img, 0, 5};
+    memcpy(&pkg, filled, sizeof(filled));
+    R502FrameEncoder frame(pkg);
+    TEST_ASSERT_TRUE(frame.valid());
+    TEST_ASSERT_EQUAL(1, frame.segment_count());
+    TEST_ASSERT_EQUAL(sizeof(filled), frame.length());
+    TEST_ASSERT_EQUAL(R502_ic_gen_img, frame.instr_code());
+
+    pkg.length[1] = 0;
+    R502FrameEncoder empty(pkg);
+    TEST_ASSERT_FALSE(empty.valid());
+}
+
+TEST_CASE("Frame encoder rejects misbuilt packages", "[frame encoder]")
+{
+    uint8_t data[R502_max_data_len + 1] = {};
+
+    // Fields after a payload
+    R502FrameEncoder late(adder, R502_pid_command);
+    late.add_payload(data, 4);
+    late.add_field(R502_ic_gen_img);
+    late.finish();
+    TEST_ASSERT_FALSE(late.valid());
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, late.write(
+        [](const uint8_t *, size_t){ return ESP_OK; }));
+
+    R502FrameEncoder big(adder, R502_pid_data);
+    big.add_payload(data, sizeof(data));
+    big.finish();
+    TEST_ASSERT_FALSE(big.valid());
+
+    R502FrameEncoder nothing(adder, R502_pid_data);
+    nothing.finish();
+    TEST_ASSERT_FALSE(nothing.valid());
+
+    R502FrameEncoder unfinished(adder, R502_pid_command);
+    unfinished.add_field(R502_ic_gen_img);
+    TEST_ASSERT_FALSE(unfinished.valid());
+}
@@ -0,0 +1,118 @@
+#include "unity.h"
+#include <stdio.h>
+#include <array>
+#include <functional>
+#include "esp_timer.h"
+#include "R502Definitions.hpp"
+#include "R502FunctionRef.hpp"
+
+static int add_one(int x)
+{
+    return x + 1;
+}
+
+TEST_CASE("Function ref calls lambdas and functions", "[function ref]")
+{
+    int offset = 10;
+    auto add_offset = [&](int x){ return x + offset; };
+    R502FunctionRef<int(int)> ref(add_offset);
+    TEST_ASSERT_EQUAL(15, ref(5));
+    // refers to the lambda, doesn't copy it
+    offset = 20;
+    TEST_ASSERT_EQUAL(25, ref(5));
+
+    R502FunctionRef<int(int)> pointer(add_one);
+    TEST_ASSERT_EQUAL(6, pointer(5));
+
+    R502FunctionRef<int(int)> copy(ref);
+    TEST_ASSERT_EQUAL(25, copy(5));
+}
+
+TEST_CASE("Byte span views bytes", "[function ref]")
+{
+    const uint8_t bytes[] = {1, 2, 3};
+    R502ByteSpan span(bytes, sizeof(bytes));
+    TEST_ASSERT_EQUAL(3, span.size());
+    TEST_ASSERT_EQUAL(2, span[1]);
+    int sum = 0;
+    for(uint8_t b : span){
+        sum += b;
+    }
+    TEST_ASSERT_EQUAL(6, sum);
+    TEST_ASSERT_TRUE(R502ByteSpan().empty());
+}
+
+// The frame loop of up_image, without the uart
+template<typename F>
+static void deliver_frames(const uint8_t *frame, int frame_len, int frames,
+    F &consumer)
+{
+    for(int i = 0; i < frames; i++){
+        consumer(R502ByteSpan(frame, frame_len));
+    }
+}
+
+TEST_CASE("Up image callback overhead", "[function ref][benchmark]")
+{
+    const int frames = 2000;
+    const int frame_len = 128;
+    std::array<uint8_t, frame_len> frame;
+    for(int i = 0; i < frame_len; i++){
+        frame[i] = i * 37;
+    }
+    // captured by value, more than std::function keeps inline
+    const int64_t weights[4] = {1, 3, 5, 7};
+    volatile uint32_t sink = 0;
+
+    // Before: expand into the 512 byte buffer, then a type-erased call
+    std::function<void(std::array<uint8_t, R502_max_data_len * 2> &, int)> cb =
+        [weights, &sink](std::array<uint8_t, R502_max_data_len * 2> &data,
+            int data_len)
+        {
+            uint32_t sum = 0;
+            for(int i = 0; i < data_len; i++){
+                sum += data[i] * weights[i & 3];
+            }
+            sink = sink + sum;
+        };
+    std::array<uint8_t, R502_max_data_len * 2> expanded;
+    auto legacy = [&](R502ByteSpan packed){
+        for(size_t i = 0; i < packed.size(); i++){
+            expanded[i*2] = (packed[i] & 0xf) << 4;
+            expanded[i*2+1] = packed[i] & 0xf0;
+        }
+        cb(expanded, packed.size() * 2);
+    };
+
+    // After: the packed frame, read in place
+    auto consume = [weights, &sink](R502ByteSpan packed){
+        uint32_t sum = 0;
+        for(size_t i = 0; i < packed.size(); i++){
+            sum += ((packed[i] & 0xf) << 4) * weights[(i*2) & 3];
+            sum += (packed[i] & 0xf0) * weights[(i*2+1) & 3];
+        }
+        sink = sink + sum;
+    };
+    R502FunctionRef<void(R502ByteSpan)> ref(consume);
+
+    int64_t start = esp_timer_get_time();
+    deliver_frames(frame.data(), frame_len, frames, legacy);
+    int64_t legacy_us = esp_timer_get_time() - start;
+    uint32_t legacy_sum = sink;
+
+    sink = 0;
+    start = esp_timer_get_time();
+    deliver_frames(frame.data(), frame_len, frames, ref);
+    int64_t ref_us = esp_timer_get_time() - start;
+    TEST_ASSERT_EQUAL(legacy_sum, sink);
+
+    sink = 0;
+    start = esp_timer_get_time();
+    deliver_frames(frame.data(), frame_len, frames, consume);
+    int64_t inline_us = esp_timer_get_time() - start;
+    TEST_ASSERT_EQUAL(legacy_sum, sink);
+
+    printf("per frame of %d bytes: std::function %d ns, function ref %d ns, "
+        "inlined %d ns\n", frame_len, (int)(legacy_us * 1000 / frames),
+        (int)(ref_us * 1000 / frames), (int)(inline_us * 1000 / frames));
+}
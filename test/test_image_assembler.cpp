@@ -0,0 +1,61 @@
+#include "unity.h"
+#include <array>
+#include "R502ImageAssembler.hpp"
+
+static const int packed_size = R502_image_size / 2;
+
+TEST_CASE("Image assembler copies packed frames", "[image assembler]")
+{
+    std::array<uint8_t, packed_size> image;
+    for(int i = 0; i < packed_size; i++){
+        image[i] = i * 13;
+    }
+    static std::array<uint8_t, packed_size> buffer;
+    R502ImageAssembler assembler(buffer.data(), buffer.size(),
+        R502_image_packed);
+    for(int offset = 0; offset < packed_size; offset += 128){
+        assembler(R502ByteSpan(image.data() + offset, 128));
+    }
+    TEST_ASSERT_FALSE(assembler.overflowed());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(image.data(), buffer.data(), packed_size);
+
+    R502_image_info_t info = assembler.get_info();
+    TEST_ASSERT_EQUAL(R502_image_width, info.width);
+    TEST_ASSERT_EQUAL(R502_image_height, info.height);
+    TEST_ASSERT_EQUAL(packed_size, info.bytes);
+    TEST_ASSERT_EQUAL(packed_size / 128, info.frames);
+    TEST_ASSERT_EQUAL(R502_image_packed, info.format);
+}
+
+TEST_CASE("Image assembler expands to 8 bit", "[image assembler]")
+{
+    // Two pixels, 0x2 then 0xa
+    uint8_t frame[64];
+    memset(frame, 0xa2, sizeof(frame));
+    std::array<uint8_t, 128> buffer;
+    R502ImageAssembler assembler(buffer.data(), buffer.size(),
+        R502_image_8bit);
+    assembler(R502ByteSpan(frame, sizeof(frame)));
+    TEST_ASSERT_FALSE(assembler.overflowed());
+    TEST_ASSERT_EQUAL(0x20, buffer[0]);
+    TEST_ASSERT_EQUAL(0xa0, buffer[1]);
+    TEST_ASSERT_EQUAL(0xa0, buffer[127]);
+    TEST_ASSERT_EQUAL(128, assembler.get_info().bytes);
+}
+
+TEST_CASE("Image assembler measures what doesn't fit", "[image assembler]")
+{
+    // An image taller than documented
+    const int frames = packed_size / 128 + 6;
+    uint8_t frame[128] = {};
+    static std::array<uint8_t, packed_size> buffer;
+    R502ImageAssembler assembler(buffer.data(), buffer.size(),
+        R502_image_packed);
+    for(int i = 0; i < frames; i++){
+        assembler(R502ByteSpan(frame, sizeof(frame)));
+    }
+    TEST_ASSERT_TRUE(assembler.overflowed());
+    R502_image_info_t info = assembler.get_info();
+    TEST_ASSERT_EQUAL(frames * 128, info.bytes);
+    TEST_ASSERT_EQUAL(frames * 256 / R502_image_width, info.height);
+}
@@ -0,0 +1,136 @@
+#include "unity.h"
+#include <vector>
+#include "R502ImageBatch.hpp"
+
+static const size_t row_bytes = R502_image_width / 2;
+
+/**
+ * \brief A packed image with pseudo random pixels, different for each seed
+ */
+static std::vector<uint8_t> make_packed(uint32_t seed)
+{
+    std::vector<uint8_t> packed(R502_image_size / 2);
+    for(size_t i = 0; i < packed.size(); i++){
+        seed = seed * 1103515245 + 12345;
+        packed[i] = seed >> 16;
+    }
+    return packed;
+}
+
+TEST_CASE("Image batch kernel measures an image", "[image batch]")
+{
+    // Left half of every row black, right half white
+    std::vector<uint8_t> packed(R502_image_size / 2);
+    for(size_t i = 0; i < packed.size(); i++){
+        packed[i] = i % row_bytes < row_bytes / 2 ? 0x00 : 0xff;
+    }
+    std::vector<uint8_t> normalized(packed.size() * 2);
+    std::vector<uint8_t> thumbnail(R502ImageBatch::thumbnail_width *
+        R502_image_height / R502ImageBatch::thumbnail_scale);
+    std::vector<uint8_t> arena(R502ImageBatch::arena_size);
+    R502_batch_image_t image = {};
+    image.packed = R502ByteSpan(packed.data(), packed.size());
+    image.normalized = normalized.data();
+    image.thumbnail = thumbnail.data();
+    R502ImageBatch::process_one(image, arena.data());
+
+    TEST_ASSERT_TRUE(image.valid);
+    const R502_image_stats_t &stats = image.stats;
+    TEST_ASSERT_EQUAL(R502_image_size / 2, stats.histogram[0]);
+    TEST_ASSERT_EQUAL(R502_image_size / 2, stats.histogram[15]);
+    TEST_ASSERT_EQUAL(0, stats.pixel_min);
+    TEST_ASSERT_EQUAL(0xf0, stats.pixel_max);
+    TEST_ASSERT_EQUAL(120 << 8, stats.pixel_mean);
+    TEST_ASSERT_EQUAL(120 << 8, stats.pixel_stddev);
+    // One edge of 240 per row, over every neighbouring pair
+    TEST_ASSERT_EQUAL(240 * 240 / (2 * (R502_image_width - 1)),
+        stats.sharpness);
+
+    TEST_ASSERT_EQUAL(0, normalized[0]);
+    TEST_ASSERT_EQUAL(255, normalized[R502_image_width - 1]);
+    TEST_ASSERT_EQUAL(0, thumbnail[0]);
+    TEST_ASSERT_EQUAL(0xf0, thumbnail[R502ImageBatch::thumbnail_width - 1]);
+
+    // Only whole rows are accepted
+    image.packed = R502ByteSpan(packed.data(), row_bytes * 3 + 1);
+    R502ImageBatch::process_one(image, arena.data());
+    TEST_ASSERT_FALSE(image.valid);
+    image.packed = R502ByteSpan(packed.data(), row_bytes * 3);
+    image.normalized = nullptr;
+    image.thumbnail = nullptr;
+    R502ImageBatch::process_one(image, arena.data());
+    TEST_ASSERT_TRUE(image.valid);
+}
+
+TEST_CASE("Image batch matches one at a time", "[image batch]")
+{
+    std::vector<uint8_t> inputs[3] = {make_packed(1), make_packed(2),
+        make_packed(3)};
+    const size_t count = 24;
+    std::vector<R502_batch_image_t> images(count);
+    std::vector<uint8_t> thumbnails(count * R502ImageBatch::thumbnail_width *
+        R502_image_height / R502ImageBatch::thumbnail_scale);
+    for(size_t i = 0; i < count; i++){
+        images[i] = {};
+        const std::vector<uint8_t> &input = inputs[i % 3];
+        // Some shorter images, so threads finish their chunks unevenly
+        size_t len = i % 4 == 0 ? row_bytes * 16 : input.size();
+        images[i].packed = R502ByteSpan(input.data(), len);
+        images[i].thumbnail = thumbnails.data() +
+            i * thumbnails.size() / count;
+    }
+
+    R502ImageBatch batch(3);
+    TEST_ASSERT_EQUAL(3, batch.get_threads());
+    batch.process(images.data(), images.size());
+    TEST_ASSERT_EQUAL(count, batch.get_stats().images);
+
+    std::vector<uint8_t> arena(R502ImageBatch::arena_size);
+    std::vector<uint8_t> thumbnail(thumbnails.size() / count);
+    for(size_t i = 0; i < count; i++){
+        R502_batch_image_t expected = {};
+        expected.packed = images[i].packed;
+        expected.thumbnail = thumbnail.data();
+        R502ImageBatch::process_one(expected, arena.data());
+        TEST_ASSERT_TRUE(images[i].valid);
+        const R502_image_stats_t &stats = images[i].stats;
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.stats.histogram,
+            stats.histogram, sizeof(stats.histogram));
+        TEST_ASSERT_EQUAL(expected.stats.pixel_mean, stats.pixel_mean);
+        TEST_ASSERT_EQUAL(expected.stats.pixel_stddev, stats.pixel_stddev);
+        TEST_ASSERT_EQUAL(expected.stats.sharpness, stats.sharpness);
+        TEST_ASSERT_EQUAL(expected.stats.quality, stats.quality);
+        size_t rows = images[i].packed.size() / row_bytes /
+            R502ImageBatch::thumbnail_scale;
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(thumbnail.data(), images[i].thumbnail,
+            rows * R502ImageBatch::thumbnail_width);
+    }
+
+    // The pool is reused, and an empty batch returns at once
+    batch.process(images.data(), 0);
+    TEST_ASSERT_EQUAL(0, batch.get_stats().images);
+    batch.process(images.data(), 5);
+    TEST_ASSERT_EQUAL(5, batch.get_stats().images);
+}
+
+TEST_CASE("Image batch throughput", "[image batch][benchmark]")
+{
+    std::vector<uint8_t> inputs[3] = {make_packed(1), make_packed(2),
+        make_packed(3)};
+    std::vector<R502_batch_image_t> images(48);
+    for(size_t i = 0; i < images.size(); i++){
+        images[i] = {};
+        images[i].packed = R502ByteSpan(inputs[i % 3].data(),
+            inputs[i % 3].size());
+    }
+
+    R502ImageBatch single(1);
+    single.process(images.data(), images.size());
+    R502ImageBatch pool;
+    pool.process(images.data(), images.size());
+    printf("1 thread: %d images/s, %d threads: %d images/s, %d steals\n",
+        (int)single.get_stats().images_per_second, pool.get_threads(),
+        (int)pool.get_stats().images_per_second,
+        (int)pool.get_stats().steals);
+    TEST_ASSERT_GREATER_THAN(0, single.get_stats().images_per_second);
+}
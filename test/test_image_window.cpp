@@ -0,0 +1,150 @@
+#include "unity.h"
+#include <stdio.h>
+#include <array>
+#include "R502ImageWindow.hpp"
+
+static const int packed_size = R502_image_size / 2;
+
+static uint8_t test_pixel(int row, int column)
+{
+    return (row * 7 + column * 3) & 0xf;
+}
+
+// Pack the test pattern as the module sends it, first pixel in the low nibble
+static void fill_image(std::array<uint8_t, packed_size> &image)
+{
+    for(int i = 0; i < packed_size; i++){
+        int row = i / (R502_image_width / 2);
+        int column = (i % (R502_image_width / 2)) * 2;
+        image[i] = test_pixel(row, column) | test_pixel(row, column + 1) << 4;
+    }
+}
+
+template<typename W>
+static void deliver(const std::array<uint8_t, packed_size> &image, 
+    int frame_len, W &window)
+{
+    for(int offset = 0; offset < packed_size; offset += frame_len){
+        window(R502ByteSpan(image.data() + offset, frame_len));
+    }
+}
+
+TEST_CASE("Image window crops", "[image window]")
+{
+    std::array<uint8_t, packed_size> image;
+    fill_image(image);
+
+    // Odd x, and rows split across frames
+    R502_image_window_t crop = {33, 40, 101, 64, 1, false};
+    int rows = 0;
+    int wrong = 0;
+    auto check = [&](int row, R502ByteSpan pixels){
+        TEST_ASSERT_EQUAL(rows, row);
+        TEST_ASSERT_EQUAL(101, pixels.size());
+        for(size_t i = 0; i < pixels.size(); i++){
+            if(pixels[i] != test_pixel(40 + row, 33 + i) << 4) wrong++;
+        }
+        rows++;
+    };
+    R502ImageWindow<decltype(check) &> window(crop, check);
+    TEST_ASSERT_TRUE(window.valid());
+    deliver(image, 128, window);
+    TEST_ASSERT_EQUAL(64, rows);
+    TEST_ASSERT_EQUAL(0, wrong);
+    // 40 rows above and 88 below the window, 96 bytes each
+    TEST_ASSERT_EQUAL(40 * 96 / 128 + 88 * 96 / 128, 
+        window.get_skipped_frames());
+}
+
+TEST_CASE("Image window decimates", "[image window]")
+{
+    std::array<uint8_t, packed_size> image;
+    fill_image(image);
+
+    R502_image_window_t half = {0, 0, R502_image_width, R502_image_height, 2,
+        false};
+    int rows = 0;
+    int wrong = 0;
+    auto sampled = [&](int row, R502ByteSpan pixels){
+        TEST_ASSERT_EQUAL(96, pixels.size());
+        for(size_t i = 0; i < pixels.size(); i++){
+            if(pixels[i] != test_pixel(row * 2, i * 2) << 4) wrong++;
+        }
+        rows++;
+    };
+    R502ImageWindow<decltype(sampled) &> window(half, sampled);
+    deliver(image, 32, window);
+    TEST_ASSERT_EQUAL(96, rows);
+    TEST_ASSERT_EQUAL(0, wrong);
+
+    // Box averaged, over a window that doesn't start on a block boundary
+    R502_image_window_t boxed = {5, 9, 90, 60, 3, true};
+    rows = 0;
+    auto averaged = [&](int row, R502ByteSpan pixels){
+        TEST_ASSERT_EQUAL(30, pixels.size());
+        for(size_t i = 0; i < pixels.size(); i++){
+            int sum = 0;
+            for(int r = 0; r < 3; r++){
+                for(int c = 0; c < 3; c++){
+                    sum += test_pixel(9 + row * 3 + r, 5 + i * 3 + c);
+                }
+            }
+            if(pixels[i] != (sum << 4) / 9) wrong++;
+        }
+        rows++;
+    };
+    R502ImageWindow<decltype(averaged) &> box_window(boxed, averaged);
+    TEST_ASSERT_TRUE(box_window.valid());
+    deliver(image, 256, box_window);
+    TEST_ASSERT_EQUAL(20, rows);
+    TEST_ASSERT_EQUAL(0, wrong);
+
+    R502_image_window_t uneven = {0, 0, 100, 100, 3, true};
+    R502ImageWindow<decltype(averaged) &> invalid(uneven, averaged);
+    TEST_ASSERT_FALSE(invalid.valid());
+}
+
+TEST_CASE("Image window averages large blocks", "[image window]")
+{
+    std::array<uint8_t, packed_size> image;
+    // All 15, the largest block sums
+    image.fill(0xff);
+
+    // 96 x 96 blocks sum to 138240, well past 16 bits
+    R502_image_window_t quarters = {0, 0, R502_image_width, 
+        R502_image_height, 96, true};
+    int rows = 0;
+    int wrong = 0;
+    auto averaged = [&](int row, R502ByteSpan pixels){
+        TEST_ASSERT_EQUAL(2, pixels.size());
+        for(size_t i = 0; i < pixels.size(); i++){
+            if(pixels[i] != 15 << 4) wrong++;
+        }
+        rows++;
+    };
+    R502ImageWindow<decltype(averaged) &> window(quarters, averaged);
+    TEST_ASSERT_TRUE(window.valid());
+    deliver(image, 128, window);
+    TEST_ASSERT_EQUAL(2, rows);
+    TEST_ASSERT_EQUAL(0, wrong);
+
+    // The whole image as one pixel, of the test pattern's mean
+    fill_image(image);
+    R502_image_window_t whole = {0, 0, R502_image_width, R502_image_height,
+        R502_image_width, true};
+    int sum = 0;
+    for(int r = 0; r < R502_image_height; r++){
+        for(int c = 0; c < R502_image_width; c++){
+            sum += test_pixel(r, c);
+        }
+    }
+    int mean = -1;
+    auto single = [&](int row, R502ByteSpan pixels){
+        TEST_ASSERT_EQUAL(1, pixels.size());
+        mean = pixels[0];
+    };
+    R502ImageWindow<decltype(single) &> whole_window(whole, single);
+    TEST_ASSERT_TRUE(whole_window.valid());
+    deliver(image, 256, whole_window);
+    TEST_ASSERT_EQUAL((sum << 4) / (R502_image_size), mean);
+}
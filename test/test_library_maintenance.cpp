@@ -0,0 +1,57 @@
+#include "unity.h"
+#include <vector>
+#include "R502LibraryMaintenance.hpp"
+
+TEST_CASE("Deletes merge into runs", "[library maintenance]")
+{
+    R502TemplateIndex index;
+    index.reset(200);
+    for(int page = 0; page < 60; page++){
+        if(page != 12 && page != 13) index.mark_used(page);
+    }
+
+    // Unsorted, repeated, free and out of range pages
+    std::vector<uint16_t> pages = {7, 5, 6, 6, 11, 14, 15, 40, 13, 250, 42,
+        59};
+    std::vector<R502_delete_run_t> runs;
+    R502LibraryMaintenance::plan_deletes(index, pages, runs);
+    const uint16_t expected_pages[] = {5, 6, 7, 11, 14, 15, 40, 42, 59};
+    TEST_ASSERT_EQUAL(sizeof(expected_pages) / sizeof(uint16_t),
+        pages.size());
+    TEST_ASSERT_EQUAL_UINT16_ARRAY(expected_pages, pages.data(),
+        pages.size());
+
+    // 11 and 14 join over the free 12 and 13, 41 is occupied
+    TEST_ASSERT_EQUAL(5, runs.size());
+    TEST_ASSERT_EQUAL(5, runs[0].page_id);
+    TEST_ASSERT_EQUAL(3, runs[0].count);
+    TEST_ASSERT_EQUAL(11, runs[1].page_id);
+    TEST_ASSERT_EQUAL(5, runs[1].count);
+    TEST_ASSERT_EQUAL(40, runs[2].page_id);
+    TEST_ASSERT_EQUAL(1, runs[2].count);
+    TEST_ASSERT_EQUAL(42, runs[3].page_id);
+    TEST_ASSERT_EQUAL(1, runs[3].count);
+    TEST_ASSERT_EQUAL(59, runs[4].page_id);
+    TEST_ASSERT_EQUAL(1, runs[4].count);
+}
+
+TEST_CASE("Deletes merge over the free end of the library",
+    "[library maintenance]")
+{
+    R502TemplateIndex index;
+    index.reset(200);
+    index.mark_used(3);
+    index.mark_used(100);
+    index.mark_used(199);
+
+    std::vector<uint16_t> pages = {199, 100, 3};
+    std::vector<R502_delete_run_t> runs;
+    R502LibraryMaintenance::plan_deletes(index, pages, runs);
+    TEST_ASSERT_EQUAL(1, runs.size());
+    TEST_ASSERT_EQUAL(3, runs[0].page_id);
+    TEST_ASSERT_EQUAL(197, runs[0].count);
+
+    pages.clear();
+    R502LibraryMaintenance::plan_deletes(index, pages, runs);
+    TEST_ASSERT_EQUAL(0, runs.size());
+}
@@ -0,0 +1,83 @@
+#include "unity.h"
+#include <cstring>
+#include "R502LinkStore.hpp"
+
+/**
+ * \brief Keeps the record in RAM, so tests can inspect and corrupt it
+ */
+class MemLinkStore : public R502LinkStore {
+public:
+    uint8_t stored[record_size];
+    bool has_record = false;
+
+protected:
+    esp_err_t read_record(uint8_t (&record)[record_size]) override
+    {
+        if(!has_record) return ESP_ERR_NOT_FOUND;
+        memcpy(record, stored, record_size);
+        return ESP_OK;
+    }
+
+    esp_err_t write_record(const uint8_t (&record)[record_size]) override
+    {
+        memcpy(stored, record, record_size);
+        has_record = true;
+        return ESP_OK;
+    }
+};
+
+TEST_CASE("Save and load link config", "[link store]")
+{
+    MemLinkStore store;
+    R502_link_config_t config;
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, store.load(config));
+
+    R502_link_config_t saved = { R502_baud_115200, R502_data_len_256,
+        {0x12, 0x34, 0x56, 0x78} };
+    TEST_ESP_OK(store.save(saved));
+    TEST_ESP_OK(store.load(config));
+    TEST_ASSERT_EQUAL(R502_baud_115200, config.baud);
+    TEST_ASSERT_EQUAL(R502_data_len_256, config.data_package_length);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(saved.adder, config.adder, 4);
+}
+
+TEST_CASE("Reject corrupt link config", "[link store]")
+{
+    MemLinkStore store;
+    R502_link_config_t config = { R502_baud_57600, R502_data_len_128,
+        {0xff, 0xff, 0xff, 0xff} };
+    TEST_ESP_OK(store.save(config));
+
+    store.stored[2] ^= 0x01;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, store.load(config));
+
+    // valid checksum, unknown version
+    store.stored[2] ^= 0x01;
+    store.stored[1] += 1;
+    store.stored[9] += 1;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_VERSION, store.load(config));
+}
+
+TEST_CASE("Reject link config with unknown settings", "[link store]")
+{
+    MemLinkStore store;
+    R502_link_config_t config = { R502_baud_57600, R502_data_len_128,
+        {0xff, 0xff, 0xff, 0xff} };
+    TEST_ESP_OK(store.save(config));
+
+    // valid checksum, baud 8 isn't an R502_baud_t
+    store.stored[2] = 8;
+    store.stored[9] += 8 - R502_baud_57600;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_VERSION, store.load(config));
+
+    // valid checksum, data package length 4 isn't an R502_data_len_t
+    TEST_ESP_OK(store.save(config));
+    store.stored[3] = 4;
+    store.stored[9] += 4 - R502_data_len_128;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_VERSION, store.load(config));
+
+    // still usable once saved again
+    TEST_ESP_OK(store.save(config));
+    TEST_ESP_OK(store.load(config));
+    TEST_ASSERT_EQUAL(R502_baud_57600, config.baud);
+}
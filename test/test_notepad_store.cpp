@@ -0,0 +1,189 @@
+#include "unity.h"
+#include "R502NotepadStore.hpp"
+#include "fake_port.hpp"
+
+TEST_CASE("Notepad store needs a load first", "[notepad store]")
+{
+    R502Interface iface;
+    R502NotepadStore store(iface);
+    const uint8_t value[] = {1, 2, 3};
+    uint8_t out[4];
+    size_t len = sizeof(out);
+
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, store.get("key", out, len));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE,
+        store.set("key", value, sizeof(value)));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, store.erase("key"));
+    R502_conf_code_t conf_code;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, store.flush(conf_code));
+    TEST_ASSERT_FALSE(store.is_dirty());
+}
+
+TEST_CASE("Notepad store pages are clamped", "[notepad store]")
+{
+    R502Interface iface;
+    // Only 16 pages exist, the store keeps what fits from page 12 on
+    R502NotepadStore store(iface, 12, 16);
+    TEST_ASSERT_EQUAL(4 * R502NotepadStore::page_payload - 8,
+        store.bytes_free());
+}
+
+// CRC16-CCITT over the page number, payload and generation, as the store
+// computes it
+static void fix_crc(uint8_t page_number,
+    std::array<uint8_t, R502_notepad_page_size> &page)
+{
+    const int crc_offset = R502NotepadStore::page_payload + 2;
+    uint16_t crc = 0xffff;
+    for(int i = -1; i < crc_offset; i++){
+        crc ^= (i < 0 ? page_number : page[i]) << 8;
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    page[crc_offset] = crc >> 8;
+    page[crc_offset + 1] = crc & 0xff;
+}
+
+TEST_CASE("Notepad store round trips through the module", "[notepad store]")
+{
+    FakePort port;
+    R502Interface iface;
+    TEST_ESP_OK(port.init(iface));
+    R502_conf_code_t conf_code;
+    R502NotepadStore store(iface, 2, 4);
+    TEST_ESP_OK(store.load(conf_code));
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+
+    // Long enough to span pages
+    uint8_t serial[40];
+    for(size_t i = 0; i < sizeof(serial); i++){
+        serial[i] = i * 7;
+    }
+    const uint8_t owner[] = {'a', 'b', 'c'};
+    TEST_ESP_OK(store.set("serial", serial, sizeof(serial)));
+    TEST_ESP_OK(store.set("owner", owner, sizeof(owner)));
+    TEST_ESP_OK(store.flush(conf_code));
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(3, store.get_stats().pages_written);
+    // Pages outside the store are left alone
+    for(uint8_t byte : port.notepad[1]) TEST_ASSERT_EQUAL(0, byte);
+    TEST_ASSERT_EQUAL('N', port.notepad[2][0]);
+
+    R502NotepadStore reloaded(iface, 2, 4);
+    TEST_ESP_OK(reloaded.load(conf_code));
+    uint8_t out[R502NotepadStore::max_value_len];
+    size_t len = sizeof(out);
+    TEST_ESP_OK(reloaded.get("serial", out, len));
+    TEST_ASSERT_EQUAL(sizeof(serial), len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(serial, out, len);
+    len = sizeof(out);
+    TEST_ESP_OK(reloaded.get("owner", out, len));
+    TEST_ASSERT_EQUAL(sizeof(owner), len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(owner, out, len);
+    TEST_ASSERT_EQUAL(store.bytes_free(), reloaded.bytes_free());
+    TEST_ESP_OK(iface.deinit());
+}
+
+TEST_CASE("Notepad store rejects a bad magic, version or CRC",
+    "[notepad store]")
+{
+    FakePort port;
+    R502Interface iface;
+    TEST_ESP_OK(port.init(iface));
+    R502_conf_code_t conf_code;
+    R502NotepadStore store(iface);
+    TEST_ESP_OK(store.load(conf_code));
+    const uint8_t value[] = {1, 2, 3};
+    TEST_ESP_OK(store.set("key", value, sizeof(value)));
+    TEST_ESP_OK(store.flush(conf_code));
+    const std::array<uint8_t, R502_notepad_page_size> good = port.notepad[0];
+    const size_t empty_free = 16 * R502NotepadStore::page_payload - 8;
+
+    // Each with a valid CRC, so only the header is wrong
+    port.notepad[0][0] = 'X';
+    fix_crc(0, port.notepad[0]);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_VERSION, store.load(conf_code));
+    TEST_ASSERT_EQUAL(empty_free, store.bytes_free());
+
+    port.notepad[0] = good;
+    port.notepad[0][1]++;
+    fix_crc(0, port.notepad[0]);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_VERSION, store.load(conf_code));
+
+    port.notepad[0] = good;
+    port.notepad[0][5] ^= 0x01;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, store.load(conf_code));
+    TEST_ASSERT_EQUAL(empty_free, store.bytes_free());
+    uint8_t out[4];
+    size_t len = sizeof(out);
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, store.get("key", out, len));
+
+    // The same page at another page number fails its CRC too
+    port.notepad[1] = good;
+    R502NotepadStore moved(iface, 1);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, moved.load(conf_code));
+
+    port.notepad[0] = good;
+    TEST_ESP_OK(store.load(conf_code));
+    len = sizeof(out);
+    TEST_ESP_OK(store.get("key", out, len));
+    TEST_ASSERT_EQUAL(sizeof(value), len);
+    TEST_ESP_OK(iface.deinit());
+}
+
+TEST_CASE("Notepad store rejects an interrupted flush", "[notepad store]")
+{
+    FakePort port;
+    R502Interface iface;
+    TEST_ESP_OK(port.init(iface));
+    R502_conf_code_t conf_code;
+    R502NotepadStore store(iface, 0, 4);
+    TEST_ESP_OK(store.load(conf_code));
+
+    // Three pages of stream, each of which the next flush changes
+    uint8_t value[40];
+    for(size_t i = 0; i < sizeof(value); i++){
+        value[i] = i;
+    }
+    TEST_ESP_OK(store.set("a", value, sizeof(value)));
+    TEST_ESP_OK(store.set("b", value, 20));
+    TEST_ESP_OK(store.flush(conf_code));
+    const auto old_pages = port.notepad;
+    value[0] = 0xff;
+    value[39] = 0xff;
+    TEST_ESP_OK(store.set("a", value, sizeof(value)));
+    TEST_ESP_OK(store.flush(conf_code));
+    const auto new_pages = port.notepad;
+    TEST_ASSERT_EQUAL(5, store.get_stats().pages_written);
+
+    // Stopped before the header, each page still passes its own CRC
+    port.notepad[0] = old_pages[0];
+    R502NotepadStore reloaded(iface, 0, 4);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, reloaded.load(conf_code));
+    TEST_ASSERT_EQUAL(4 * R502NotepadStore::page_payload - 8,
+        reloaded.bytes_free());
+
+    // Pages left over from before the header, as if written out of order
+    port.notepad = new_pages;
+    port.notepad[1] = old_pages[1];
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, reloaded.load(conf_code));
+
+    // The finished flush loads, and the next one after a rejected load
+    // makes the notepad consistent again
+    port.notepad = new_pages;
+    TEST_ESP_OK(reloaded.load(conf_code));
+    uint8_t out[R502NotepadStore::max_value_len];
+    size_t len = sizeof(out);
+    TEST_ESP_OK(reloaded.get("a", out, len));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(value, out, sizeof(value));
+    port.notepad[0] = old_pages[0];
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, reloaded.load(conf_code));
+    TEST_ESP_OK(reloaded.set("a", value, 1));
+    TEST_ESP_OK(reloaded.flush(conf_code));
+    TEST_ESP_OK(store.load(conf_code));
+    len = sizeof(out);
+    TEST_ESP_OK(store.get("a", out, len));
+    TEST_ASSERT_EQUAL(1, len);
+    TEST_ESP_OK(iface.deinit());
+}
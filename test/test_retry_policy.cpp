@@ -0,0 +1,79 @@
+#include "unity.h"
+#include <cstring>
+#include "R502RetryPolicy.hpp"
+
+static R502_DataPkg_t command(R502_instr_code_t instr_code)
+{
+    R502_DataPkg_t pkg;
+    memset(&pkg, 0, sizeof(pkg));
+    pkg.data.general.instr_code = instr_code;
+    return pkg;
+}
+
+TEST_CASE("Classify idempotent commands", "[retry policy]")
+{
+    TEST_ASSERT_TRUE(R502RetryPolicy::is_idempotent(
+        command(R502_ic_read_sys_para)));
+    TEST_ASSERT_TRUE(R502RetryPolicy::is_idempotent(
+        command(R502_ic_template_num)));
+    TEST_ASSERT_FALSE(R502RetryPolicy::is_idempotent(command(R502_ic_store)));
+    TEST_ASSERT_FALSE(R502RetryPolicy::is_idempotent(command(R502_ic_empty)));
+    TEST_ASSERT_FALSE(R502RetryPolicy::is_idempotent(
+        command(R502_ic_up_image)));
+
+    R502_DataPkg_t pkg = command(R502_ic_set_sys_para);
+    pkg.data.set_sys_para.parameter_number = R502_para_num_security_level;
+    TEST_ASSERT_TRUE(R502RetryPolicy::is_idempotent(pkg));
+    pkg.data.set_sys_para.parameter_number = R502_para_num_baud_control;
+    TEST_ASSERT_FALSE(R502RetryPolicy::is_idempotent(pkg));
+}
+
+TEST_CASE("Retry transient errors only", "[retry policy]")
+{
+    R502RetryPolicy policy;
+    policy.set_config({3, 10, 100});
+
+    TEST_ASSERT_TRUE(policy.should_retry(ESP_ERR_INVALID_CRC, 1, true));
+    TEST_ASSERT_TRUE(policy.should_retry(ESP_ERR_NOT_FOUND, 2, true));
+    // out of attempts
+    TEST_ASSERT_FALSE(policy.should_retry(ESP_ERR_INVALID_RESPONSE, 3, true));
+    policy.record_outcome(ESP_ERR_INVALID_RESPONSE, 3);
+
+    // not a link error
+    TEST_ASSERT_FALSE(policy.should_retry(ESP_ERR_INVALID_STATE, 1, true));
+    policy.record_outcome(ESP_ERR_INVALID_STATE, 1);
+    // not safe to repeat
+    TEST_ASSERT_FALSE(policy.should_retry(ESP_ERR_INVALID_CRC, 1, false));
+    policy.record_outcome(ESP_ERR_INVALID_CRC, 1);
+
+    TEST_ASSERT_TRUE(policy.should_retry(ESP_ERR_INVALID_CRC, 1, true));
+    policy.record_outcome(ESP_OK, 2);
+
+    const R502_retry_stats_t &stats = policy.get_stats();
+    TEST_ASSERT_EQUAL(4, stats.commands);
+    TEST_ASSERT_EQUAL(3, stats.retries);
+    TEST_ASSERT_EQUAL(1, stats.recovered);
+    TEST_ASSERT_EQUAL(1, stats.exhausted);
+    TEST_ASSERT_EQUAL(1, stats.not_retryable);
+    TEST_ASSERT_EQUAL(3, stats.crc_errors);
+    TEST_ASSERT_EQUAL(1, stats.timeouts);
+    TEST_ASSERT_EQUAL(1, stats.short_reads);
+
+    policy.reset_stats();
+    TEST_ASSERT_EQUAL(0, policy.get_stats().commands);
+}
+
+TEST_CASE("Retry backoff is bounded", "[retry policy]")
+{
+    R502RetryPolicy policy;
+    policy.set_config({10, 10, 50});
+    TEST_ASSERT_EQUAL(10, policy.backoff_ms(1));
+    TEST_ASSERT_EQUAL(20, policy.backoff_ms(2));
+    TEST_ASSERT_EQUAL(40, policy.backoff_ms(3));
+    TEST_ASSERT_EQUAL(50, policy.backoff_ms(4));
+    TEST_ASSERT_EQUAL(50, policy.backoff_ms(9));
+
+    // at least one attempt is always made
+    policy.set_config({0, 10, 50});
+    TEST_ASSERT_EQUAL(1, policy.get_config().max_attempts);
+}
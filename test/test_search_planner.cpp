@@ -0,0 +1,61 @@
+#include "unity.h"
+#include "R502SearchPlanner.hpp"
+
+TEST_CASE("Hot range follows the most matched pages", "[search planner]")
+{
+    R502Interface iface;
+    R502SearchPlanner planner(iface);
+    planner.set_config({16, 64, 50});
+    planner.reset(200);
+
+    // Nothing learnt yet, search everything
+    TEST_ASSERT_EQUAL(0, planner.hot_range().page_num);
+
+    for(int i = 0; i < 30; i++){
+        planner.record_hit(120 + i % 8);
+    }
+    planner.record_hit(3);
+    R502_search_range_t hot = planner.hot_range();
+    TEST_ASSERT_EQUAL(16, hot.page_num);
+    TEST_ASSERT_LESS_OR_EQUAL(120, hot.start_page);
+    TEST_ASSERT_GREATER_OR_EQUAL(127, hot.start_page + hot.page_num - 1);
+
+    // Too few of the hits in any window
+    for(int i = 0; i < 200; i += 20){
+        for(int j = 0; j < 6; j++){
+            planner.record_hit(i);
+        }
+    }
+    TEST_ASSERT_EQUAL(0, planner.hot_range().page_num);
+
+    // Forgotten pages no longer count
+    for(int i = 0; i < 200; i += 20){
+        if(i < 120 || i > 127) planner.forget(i);
+    }
+    planner.forget(3);
+    TEST_ASSERT_EQUAL(0, planner.score(3));
+    TEST_ASSERT_EQUAL(16, planner.hot_range().page_num);
+}
+
+TEST_CASE("Older matches count for less", "[search planner]")
+{
+    R502Interface iface;
+    R502SearchPlanner planner(iface);
+    planner.set_config({8, 10, 50});
+    planner.reset(100);
+
+    planner.record_hit(10);
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 1, planner.score(10));
+    for(int i = 0; i < 10; i++){
+        planner.record_hit(90);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 0.5, planner.score(10));
+    TEST_ASSERT_GREATER_THAN(1, planner.score(90));
+
+    // Scores stay comparable however many identifications go by
+    for(int i = 0; i < 5000; i++){
+        planner.record_hit(50);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 14.93, planner.score(50));
+    TEST_ASSERT_EQUAL(50 - 8 + 1, planner.hot_range().start_page);
+}
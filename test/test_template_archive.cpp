@@ -0,0 +1,171 @@
+#include "unity.h"
+#include <vector>
+#include "R502TemplateArchive.hpp"
+#include "mem_archive.hpp"
+#include "fake_port.hpp"
+
+static R502_char_file_t make_char_file(uint8_t seed)
+{
+    R502_char_file_t char_file;
+    for(size_t i = 0; i < char_file.size(); i++){
+        char_file[i] = seed + i * 7;
+    }
+    return char_file;
+}
+
+TEST_CASE("Template archive stores each template once", "[template archive]")
+{
+    MemTemplateArchive archive;
+    uint64_t hash = 0;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE,
+        archive.put(make_char_file(1), hash));
+    TEST_ESP_OK(archive.open());
+
+    uint64_t first = 0;
+    uint64_t second = 0;
+    TEST_ESP_OK(archive.put(make_char_file(1), first));
+    size_t one_blob = archive.stored.size();
+    TEST_ESP_OK(archive.put(make_char_file(1), hash));
+    TEST_ASSERT_TRUE(hash == first);
+    TEST_ASSERT_EQUAL(one_blob, archive.stored.size());
+    TEST_ESP_OK(archive.put(make_char_file(2), second));
+    TEST_ASSERT_TRUE(first != second);
+    TEST_ASSERT_EQUAL(2, archive.blob_count());
+    TEST_ASSERT_EQUAL(R502TemplateArchive::header_size +
+        2 * R502TemplateArchive::blob_record_size, archive.stored.size());
+
+    R502_char_file_t read;
+    TEST_ESP_OK(archive.get(second, read));
+    TEST_ASSERT_TRUE(read == make_char_file(2));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, archive.get(first + 1, read));
+}
+
+TEST_CASE("Template archive reopens from its headers", "[template archive]")
+{
+    MemTemplateArchive archive;
+    TEST_ESP_OK(archive.open());
+    uint64_t hashes[3];
+    for(int i = 0; i < 3; i++){
+        TEST_ESP_OK(archive.put(make_char_file(i), hashes[i]));
+    }
+
+    // Reopening reads one byte and one header per record, not the blobs
+    archive.reads = 0;
+    TEST_ESP_OK(archive.open());
+    TEST_ASSERT_EQUAL(3, archive.blob_count());
+    TEST_ASSERT_EQUAL(1 + 2 * 3, archive.reads);
+    R502_char_file_t read;
+    TEST_ESP_OK(archive.get(hashes[1], read));
+    TEST_ASSERT_TRUE(read == make_char_file(1));
+}
+
+TEST_CASE("Template archive drops a record cut short", "[template archive]")
+{
+    MemTemplateArchive archive;
+    TEST_ESP_OK(archive.open());
+    uint64_t kept = 0;
+    uint64_t torn = 0;
+    TEST_ESP_OK(archive.put(make_char_file(1), kept));
+    size_t good_size = archive.stored.size();
+    TEST_ESP_OK(archive.put(make_char_file(2), torn));
+    archive.stored.resize(archive.stored.size() - 100);
+
+    TEST_ESP_OK(archive.open());
+    TEST_ASSERT_EQUAL(good_size, archive.stored.size());
+    TEST_ASSERT_EQUAL(1, archive.blob_count());
+    R502_char_file_t read;
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, archive.get(torn, read));
+
+    // A corrupt blob is caught by its hash when it's read
+    archive.stored[good_size - 1] ^= 0x01;
+    TEST_ESP_OK(archive.open());
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, archive.get(kept, read));
+
+    // A corrupt header stops the open
+    archive.stored[R502TemplateArchive::header_size + 3] ^= 0x01;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, archive.open());
+    archive.stored[0] = 'X';
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_VERSION, archive.open());
+}
+
+static std::vector<uint8_t> make_template(uint8_t seed)
+{
+    R502_char_file_t char_file = make_char_file(seed);
+    return std::vector<uint8_t>(char_file.begin(), char_file.end());
+}
+
+TEST_CASE("Template archive backs up and restores a module",
+    "[template archive]")
+{
+    FakePort port;
+    R502Interface iface;
+    TEST_ESP_OK(port.init(iface));
+    MemTemplateArchive archive;
+    TEST_ESP_OK(archive.open());
+    R502_conf_code_t conf_code;
+
+    // The same template twice, stored once
+    port.library[0] = make_template(1);
+    port.library[3] = make_template(2);
+    port.library[7] = make_template(1);
+    TEST_ESP_OK(archive.backup(iface, 1, conf_code));
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(3, archive.get_stats().slots_pulled);
+    TEST_ASSERT_EQUAL(2, archive.blob_count());
+    TEST_ASSERT_EQUAL(3, archive.slot_count(1));
+    TEST_ASSERT_TRUE(archive.lookup(1, 0) == archive.lookup(1, 7));
+
+    // A second backup only pulls slots the archive doesn't know
+    port.library[4] = make_template(3);
+    TEST_ESP_OK(archive.backup(iface, 1, conf_code));
+    TEST_ASSERT_EQUAL(1, archive.get_stats().slots_pulled);
+
+    // Onto an empty module, then again with nothing left to push
+    const std::map<uint16_t, std::vector<uint8_t>> backed_up = port.library;
+    port.library.clear();
+    TEST_ESP_OK(archive.restore(iface, 2, 1, conf_code));
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(4, archive.get_stats().slots_pushed);
+    TEST_ASSERT_TRUE(port.library == backed_up);
+    TEST_ESP_OK(archive.restore(iface, 2, 1, conf_code));
+    TEST_ASSERT_EQUAL(0, archive.get_stats().slots_pushed);
+
+    // Slots the source doesn't have are deleted
+    port.library[9] = make_template(4);
+    TEST_ESP_OK(archive.restore(iface, 2, 1, conf_code));
+    TEST_ASSERT_EQUAL(1, archive.get_stats().slots_deleted);
+    TEST_ASSERT_TRUE(port.library == backed_up);
+    TEST_ESP_OK(iface.deinit());
+}
+
+TEST_CASE("Template archive verified restore finds overwritten slots",
+    "[template archive]")
+{
+    FakePort port;
+    R502Interface iface;
+    TEST_ESP_OK(port.init(iface));
+    MemTemplateArchive archive;
+    TEST_ESP_OK(archive.open());
+    R502_conf_code_t conf_code;
+    port.library[0] = make_template(1);
+    port.library[5] = make_template(2);
+    TEST_ESP_OK(archive.backup(iface, 1, conf_code));
+    const std::map<uint16_t, std::vector<uint8_t>> backed_up = port.library;
+
+    // Overwritten behind the archive's back, restoring the module from its
+    // own backup trusts the record and misses it
+    port.library[5] = make_template(9);
+    TEST_ESP_OK(archive.restore(iface, 1, 1, conf_code));
+    TEST_ASSERT_EQUAL(0, archive.get_stats().slots_pushed);
+    TEST_ASSERT_TRUE(port.library != backed_up);
+
+    // Comparing what the module holds puts back only that slot
+    uint32_t stores = port.stores;
+    TEST_ESP_OK(archive.restore(iface, 1, 1, conf_code, true));
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(2, archive.get_stats().slots_pulled);
+    TEST_ASSERT_EQUAL(1, archive.get_stats().slots_pushed);
+    TEST_ASSERT_EQUAL(stores + 1, port.stores);
+    TEST_ASSERT_TRUE(port.library == backed_up);
+    TEST_ESP_OK(iface.deinit());
+}
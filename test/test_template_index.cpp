@@ -0,0 +1,80 @@
+#include "unity.h"
+#include <array>
+#include "R502TemplateIndex.hpp"
+
+TEST_CASE("Allocate lowest free slot", "[template index]")
+{
+    R502TemplateIndex index;
+    index.reset(200);
+    TEST_ASSERT_EQUAL(200, index.capacity());
+    TEST_ASSERT_EQUAL(0, index.used_count());
+    TEST_ASSERT_FALSE(index.is_synced());
+
+    for(int i = 0; i < 40; i++){
+        TEST_ASSERT_EQUAL(i, index.allocate());
+    }
+    TEST_ASSERT_EQUAL(40, index.used_count());
+    TEST_ASSERT_EQUAL(160, index.free_count());
+
+    // freed slots are handed out again, lowest first
+    index.mark_free(33);
+    index.mark_free(5);
+    TEST_ASSERT_EQUAL(5, index.find_free());
+    TEST_ASSERT_EQUAL(5, index.allocate());
+    TEST_ASSERT_EQUAL(33, index.allocate());
+    TEST_ASSERT_EQUAL(40, index.allocate());
+}
+
+TEST_CASE("Full library", "[template index]")
+{
+    R502TemplateIndex index;
+    // capacity that doesn't end on a word boundary
+    index.reset(70);
+    for(int i = 0; i < 70; i++){
+        TEST_ASSERT_EQUAL(i, index.allocate());
+    }
+    TEST_ASSERT_EQUAL(-1, index.find_free());
+    TEST_ASSERT_EQUAL(-1, index.allocate());
+    TEST_ASSERT_EQUAL(0, index.free_count());
+
+    // out of range page ids are ignored
+    index.mark_used(70);
+    TEST_ASSERT_FALSE(index.is_used(70));
+    TEST_ASSERT_EQUAL(70, index.used_count());
+
+    index.clear();
+    TEST_ASSERT_EQUAL(0, index.used_count());
+    TEST_ASSERT_EQUAL(0, index.find_free());
+}
+
+TEST_CASE("Load index table pages", "[template index]")
+{
+    R502TemplateIndex index;
+    index.reset(300);
+
+    std::array<uint8_t, R502_index_table_len> table = {};
+    table[0] = 0x05; // page ids 0 and 2
+    table[31] = 0x80; // page id 255
+    index.load_page(0, table);
+    table.fill(0xff);
+    index.load_page(1, table); // 256 to 299, rest is past capacity
+    index.mark_synced();
+
+    TEST_ASSERT_TRUE(index.is_synced());
+    TEST_ASSERT_TRUE(index.is_used(0));
+    TEST_ASSERT_FALSE(index.is_used(1));
+    TEST_ASSERT_TRUE(index.is_used(2));
+    TEST_ASSERT_TRUE(index.is_used(255));
+    TEST_ASSERT_EQUAL(3 + 44, index.used_count());
+    TEST_ASSERT_EQUAL(1, index.find_free());
+
+    TEST_ASSERT_EQUAL(2, index.used_in_range(0, 3));
+    TEST_ASSERT_EQUAL(1, index.used_in_range(250, 6));
+    TEST_ASSERT_EQUAL(44, index.used_in_range(256, 1000));
+
+    index.mark_free(250, 20);
+    TEST_ASSERT_EQUAL(2 + 30, index.used_count());
+
+    index.invalidate();
+    TEST_ASSERT_FALSE(index.is_synced());
+}
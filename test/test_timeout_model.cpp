@@ -0,0 +1,89 @@
+#include "unity.h"
+#include "R502TimeoutModel.hpp"
+
+TEST_CASE("Timeout includes wire time", "[timeout model]")
+{
+    R502TimeoutModel model;
+    // 12 byte command and response at 9600 baud is 25ms on the wire
+    TEST_ASSERT_EQUAL(25000, R502TimeoutModel::wire_time_us(24, 
+        R502_baud_9600));
+
+    int floor_ms = 0;
+    int ceiling_ms = 0;
+    model.get_allowance(R502_ic_template_num, floor_ms, ceiling_ms);
+    TEST_ASSERT_EQUAL(25 + ceiling_ms, 
+        model.timeout_ms(R502_ic_template_num, 12, 12, R502_baud_9600));
+
+    // a slower baud rate waits longer for the same command
+    TEST_ASSERT_GREATER_THAN(
+        model.timeout_ms(R502_ic_template_num, 12, 12, R502_baud_115200),
+        model.timeout_ms(R502_ic_template_num, 12, 12, R502_baud_9600));
+}
+
+TEST_CASE("Timeout tightens with measurements", "[timeout model]")
+{
+    R502TimeoutModel model;
+    int initial = model.timeout_ms(R502_ic_read_sys_para, 12, 28, 
+        R502_baud_57600);
+    int64_t wire_us = R502TimeoutModel::wire_time_us(40, R502_baud_57600);
+
+    // module consistently answers 5ms after the command is sent
+    for(int i = 0; i < 20; i++){
+        model.record(R502_ic_read_sys_para, wire_us + 5000, 12, 28, 
+            R502_baud_57600);
+    }
+    const R502_latency_stats_t &stats = 
+        model.get_stats(R502_ic_read_sys_para);
+    TEST_ASSERT_EQUAL(20, stats.samples);
+    TEST_ASSERT_EQUAL(5000, stats.last_us);
+
+    int learned = model.timeout_ms(R502_ic_read_sys_para, 12, 28, 
+        R502_baud_57600);
+    TEST_ASSERT_LESS_THAN(initial, learned);
+
+    // never tighter than the floor
+    int floor_ms = 0;
+    int ceiling_ms = 0;
+    model.get_allowance(R502_ic_read_sys_para, floor_ms, ceiling_ms);
+    TEST_ASSERT_GREATER_OR_EQUAL(floor_ms, learned);
+
+    // other instructions are unaffected
+    TEST_ASSERT_EQUAL(0, model.get_stats(R502_ic_template_num).samples);
+}
+
+TEST_CASE("Timeout backs off after a miss", "[timeout model]")
+{
+    R502TimeoutModel model;
+    int64_t wire_us = R502TimeoutModel::wire_time_us(24, R502_baud_57600);
+    for(int i = 0; i < 20; i++){
+        model.record(R502_ic_gen_img, wire_us + 100000, 12, 12, 
+            R502_baud_57600);
+    }
+    // Without bytes to send or receive the timeout is only the allowance,
+    // which the floor holds above the learned 100ms
+    int learned = model.timeout_ms(R502_ic_gen_img, 0, 0, R502_baud_57600);
+
+    model.record_timeout(R502_ic_gen_img);
+    TEST_ASSERT_EQUAL(1, model.get_stats(R502_ic_gen_img).timeouts);
+    int backed_off = model.timeout_ms(R502_ic_gen_img, 0, 0,
+        R502_baud_57600);
+    TEST_ASSERT_GREATER_OR_EQUAL(2 * learned, backed_off);
+
+    // a response ends the back off
+    model.record(R502_ic_gen_img, wire_us + 100000, 12, 12,
+        R502_baud_57600);
+    TEST_ASSERT_EQUAL(learned,
+        model.timeout_ms(R502_ic_gen_img, 0, 0, R502_baud_57600));
+
+    int floor_ms = 0;
+    int ceiling_ms = 0;
+    model.get_allowance(R502_ic_gen_img, floor_ms, ceiling_ms);
+    for(int i = 0; i < 10; i++){
+        model.record_timeout(R502_ic_gen_img);
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(ceiling_ms + 5, 
+        model.timeout_ms(R502_ic_gen_img, 12, 12, R502_baud_57600));
+
+    model.reset();
+    TEST_ASSERT_EQUAL(0, model.get_stats(R502_ic_gen_img).timeouts);
+}
@@ -0,0 +1,33 @@
+#include "unity.h"
+#include "R502Trace.hpp"
+
+TEST_CASE("Trace buffer keeps records in order", "[trace]")
+{
+    R502BufferTrace::clear();
+    R502BufferTrace::record(R502_trace_tx_start, 0x0F, 12);
+    R502BufferTrace::record(R502_trace_tx_end, 0x0F, 12);
+    R502BufferTrace::record(R502_trace_rx_header, 0x07, 19);
+
+    R502_trace_record_t out[4];
+    TEST_ASSERT_EQUAL(3, R502BufferTrace::read(out, 4));
+    TEST_ASSERT_EQUAL(R502_trace_tx_start, out[0].event);
+    TEST_ASSERT_EQUAL(0x0F, out[0].code);
+    TEST_ASSERT_EQUAL(12, out[0].arg);
+    TEST_ASSERT_EQUAL(R502_trace_rx_header, out[2].event);
+    TEST_ASSERT_TRUE(out[1].time_us - out[0].time_us < 1000);
+    TEST_ASSERT_EQUAL(0, R502BufferTrace::read(out, 4));
+}
+
+TEST_CASE("Trace buffer overwrites the oldest records", "[trace]")
+{
+    R502BufferTrace::clear();
+    uint32_t dropped = R502BufferTrace::dropped();
+    for(int i = 0; i < R502_TRACE_RECORDS + 5; i++){
+        R502BufferTrace::record(R502_trace_callback, 0x02, i);
+    }
+    R502_trace_record_t out[1];
+    TEST_ASSERT_EQUAL(1, R502BufferTrace::read(out, 1));
+    TEST_ASSERT_EQUAL(5, out[0].arg);
+    TEST_ASSERT_EQUAL(dropped + 5, R502BufferTrace::dropped());
+    R502BufferTrace::clear();
+}
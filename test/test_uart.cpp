@@ -2,9 +2,22 @@
 #include "unity.h"
 #include <array>
 #include "R502Interface.hpp"
+#include "R502FixedInterface.hpp"
+#include "R502NotepadStore.hpp"
+#include "R502EntropyPool.hpp"
+#include "R502ImageCapture.hpp"
+#include "R502CommandScheduler.hpp"
+#include "R502CommandBatch.hpp"
+#include "R502Bus.hpp"
+#include "R502TemplateArchive.hpp"
+#include "mem_archive.hpp"
+#include "R502BurstCapture.hpp"
+#include "R502SearchPlanner.hpp"
+#include "R502LibraryMaintenance.hpp"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp32/rom/uart.h"
+#include "nvs_flash.h"
 
 #define PIN_TXD  (GPIO_NUM_4)
 #define PIN_NC_1 (GPIO_NUM_16)
@@ -19,9 +32,12 @@
 
 // The object under test
 static R502Interface R502;
+// For the tests that put it on a bus
+static R502Bus bus;
 
 void tearDown(){
     R502.deinit();
+    bus.deinit();
 }
 
 void wait_with_message(char *message){
@@ -76,6 +92,38 @@ TEST_CASE("Reinitialize", "[initialization]")
     TEST_ASSERT_EQUAL(conf_code, R502_ok);
 }
 
+TEST_CASE("WarmInit", "[initialization]")
+{
+    esp_err_t err = nvs_flash_init();
+    TEST_ESP_OK(err);
+    R502NvsLinkStore store("r502_test");
+
+    // First boot finds and saves the link settings
+    err = R502.warm_init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ, store);
+    TEST_ESP_OK(err);
+    R502_link_config_t config;
+    err = store.load(config);
+    TEST_ESP_OK(err);
+    err = R502.deinit();
+    TEST_ESP_OK(err);
+
+    // Second boot should need only a single round trip
+    err = R502.warm_init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ, store);
+    TEST_ESP_OK(err);
+    const R502_boot_timing_t &timing = R502.get_boot_timing();
+    TEST_ASSERT_TRUE(timing.warm);
+    TEST_ASSERT_EQUAL(1, timing.round_trips);
+    TEST_ASSERT_EQUAL(-1, timing.first_capture_us);
+    printf("warm start ready in %d ms\n", 
+        (int)((timing.link_ready_us - timing.init_start_us) / 1000));
+
+    std::array<uint8_t, 4> pass = {0x00, 0x00, 0x00, 0x00};
+    R502_conf_code_t conf_code = R502_fail;
+    err = R502.vfy_pass(pass, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+}
+
 TEST_CASE("VfyPwd", "[system command]")
 {
     esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
@@ -306,6 +354,689 @@ TEST_CASE("UpImage", "[fingerprint processing command]")
     TEST_ASSERT_EQUAL(R502_image_size, up_image_size);
 }
 
+TEST_CASE("UpImageFrames", "[fingerprint processing command]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_sys_para_t sys_para;
+    R502_conf_code_t conf_code;
+    err = R502.read_sys_para(conf_code, sys_para);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+
+    // Inlined consumer, gets the packed 4 bit pixels
+    int packed_size = 0;
+    err = R502.up_image(sys_para.data_package_length, conf_code, 
+        [&](R502ByteSpan frame){ packed_size += frame.size(); });
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(R502_image_size, packed_size * 2);
+
+    // Same through a non-owning reference
+    packed_size = 0;
+    auto count = [&](R502ByteSpan frame){ packed_size += frame.size(); };
+    R502Interface::up_image_frame_ref_t consumer(count);
+    err = R502.up_image(sys_para.data_package_length, conf_code, consumer);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(R502_image_size, packed_size * 2);
+}
+
+TEST_CASE("UpImageWindow", "[fingerprint processing command]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_sys_para_t sys_para;
+    R502_conf_code_t conf_code;
+    err = R502.read_sys_para(conf_code, sys_para);
+    TEST_ESP_OK(err);
+
+    // Central crop at full resolution
+    R502_image_window_t center = {48, 48, 96, 96, 1, false};
+    int rows = 0;
+    int pixels = 0;
+    auto count = [&](int row, R502ByteSpan line){
+        rows++;
+        pixels += line.size();
+    };
+    int64_t start = esp_timer_get_time();
+    err = R502.up_image(sys_para.data_package_length, center, conf_code, 
+        count);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(96, rows);
+    TEST_ASSERT_EQUAL(96 * 96, pixels);
+    printf("center crop in %d ms\n", 
+        (int)((esp_timer_get_time() - start) / 1000));
+
+    // Whole image, box averaged down to half resolution
+    R502_image_window_t half = {0, 0, R502_image_width, R502_image_height, 2,
+        true};
+    rows = 0;
+    pixels = 0;
+    err = R502.up_image(sys_para.data_package_length, half, conf_code, count);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(96, rows);
+    TEST_ASSERT_EQUAL(96 * 96, pixels);
+
+    R502_image_window_t outside = {100, 0, 100, 10, 1, false};
+    err = R502.up_image(sys_para.data_package_length, outside, conf_code, 
+        count);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, err);
+}
+
+TEST_CASE("UpImageBuffer", "[fingerprint processing command]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_sys_para_t sys_para;
+    R502_conf_code_t conf_code;
+    err = R502.read_sys_para(conf_code, sys_para);
+    TEST_ESP_OK(err);
+
+    static uint8_t image[R502_image_size];
+    R502_image_info_t info;
+    err = R502.up_image(sys_para.data_package_length, conf_code, image,
+        sizeof(image), R502_image_8bit, info);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(R502_image_width, info.width);
+    TEST_ASSERT_EQUAL(info.width * info.height, info.bytes);
+    printf("image %dx%d, %d bytes in %d frames\n", info.width, info.height,
+        (int)info.bytes, info.frames);
+
+    // Too small a buffer still reports the size that arrived
+    err = R502.up_image(sys_para.data_package_length, conf_code, image,
+        1000, R502_image_packed, info);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, err);
+    TEST_ASSERT_EQUAL(R502_image_size / 2, info.bytes);
+}
+
+TEST_CASE("DownImage", "[fingerprint processing command]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_sys_para_t sys_para;
+    R502_conf_code_t conf_code;
+    err = R502.read_sys_para(conf_code, sys_para);
+    TEST_ESP_OK(err);
+
+    // Send an image back, then read it again
+    static uint8_t image[R502_image_size / 2];
+    for(int i = 0; i < sizeof(image); i++){
+        image[i] = (i / (R502_image_width / 2)) & 0xf ? 0xff : 0x00;
+    }
+    int64_t start = esp_timer_get_time();
+    err = R502.down_image(sys_para.data_package_length, image, sizeof(image),
+        conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    printf("image downloaded in %d ms\n", 
+        (int)((esp_timer_get_time() - start) / 1000));
+
+    static uint8_t uploaded[R502_image_size / 2];
+    R502_image_info_t info;
+    err = R502.up_image(sys_para.data_package_length, conf_code, uploaded,
+        sizeof(uploaded), R502_image_packed, info);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(sizeof(image), info.bytes);
+
+    err = R502.down_image(sys_para.data_package_length, image, 0, conf_code);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, err);
+}
+
+TEST_CASE("DoubleBufferCapture", "[fingerprint processing command][userInput]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_sys_para_t sys_para;
+    R502_conf_code_t conf_code;
+    err = R502.read_sys_para(conf_code, sys_para);
+    TEST_ESP_OK(err);
+
+    R502ImageCapture capture(R502);
+    err = capture.start(sys_para.data_package_length);
+    TEST_ESP_OK(err);
+    printf("buffers in %s\n", capture.in_psram() ? "PSRAM" : "internal RAM");
+
+    printf("Place finger on sensor\n");
+    R502_captured_image_t first;
+    err = capture.acquire(first, 10000);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_image_size, first.info.bytes);
+
+    // The second buffer fills while the first is held
+    R502_captured_image_t second;
+    err = capture.acquire(second, 5000);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_NOT_EQUAL(first.index, second.index);
+    printf("second image %d ms after the first\n",
+        (int)((second.captured_us - first.captured_us) / 1000));
+    capture.release(first);
+    capture.release(second);
+    capture.stop();
+
+    R502_capture_stats_t stats = capture.get_stats();
+    TEST_ASSERT_EQUAL(0, stats.errors);
+    TEST_ASSERT_GREATER_OR_EQUAL(2, stats.captures);
+}
+
+TEST_CASE("SchedulerIdentifyDuringUpload", "[fingerprint processing command][userInput]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_sys_para_t sys_para;
+    R502_conf_code_t conf_code;
+    err = R502.read_sys_para(conf_code, sys_para);
+    TEST_ESP_OK(err);
+
+    R502CommandScheduler scheduler(R502);
+    err = scheduler.start();
+    TEST_ESP_OK(err);
+
+    printf("Place finger on sensor\n");
+    static uint8_t image[R502_image_size / 2];
+    R502UploadJob upload(sys_para.data_package_length, image, sizeof(image),
+        R502_image_packed, 500);
+    R502IndexSyncJob sync;
+    R502IdentifyJob identify(0, sys_para.finger_library_size);
+    err = scheduler.submit(upload, R502_priority_background);
+    TEST_ESP_OK(err);
+    err = scheduler.submit(sync, R502_priority_background);
+    TEST_ESP_OK(err);
+    err = scheduler.submit(identify, R502_priority_high);
+    TEST_ESP_OK(err);
+
+    err = identify.wait(10000);
+    TEST_ESP_OK(err);
+    err = upload.wait(10000);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, upload.get_conf_code());
+    err = sync.wait(10000);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_TRUE(R502.get_template_index().is_synced());
+    scheduler.stop();
+
+    for(int cls = 0; cls < R502_priority_classes; cls++){
+        R502_sched_stats_t stats = scheduler.get_stats((R502_priority_t)cls);
+        printf("class %d: %d jobs, max wait %d ms, %d preempted, "
+            "%d restarted\n", cls, stats.jobs, 
+            (int)(stats.max_wait_us / 1000), stats.preemptions, 
+            stats.restarts);
+    }
+}
+
+TEST_CASE("CommandBatch", "[system command][benchmark]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+
+    // The notepad is the user's, put back what the batch overwrites
+    std::array<std::array<uint8_t, R502_notepad_page_size>, 4> saved;
+    R502_conf_code_t conf_code;
+    for(int i = 0; i < 4; i++){
+        err = R502.read_notepad(i, conf_code, saved[i]);
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    }
+
+    std::array<uint8_t, R502_notepad_page_size> page;
+    page.fill(0xa5);
+    R502CommandBatch batch(R502);
+    batch.led_config(R502_led_flashing, 50, R502_led_blue, 3);
+    for(int i = 0; i < 4; i++){
+        batch.write_notepad(i, page);
+    }
+    batch.set_security_level(3);
+    batch.led_config(R502_led_fade_off, 100, R502_led_purple, 0);
+
+    // One at a time, as separate calls would send them, then pipelined
+    int64_t elapsed_us[2];
+    const int windows[2] = {1, R502CommandBatch::default_window};
+    for(int i = 0; i < 2; i++){
+        int64_t start = esp_timer_get_time();
+        err = batch.execute(windows[i]);
+        elapsed_us[i] = esp_timer_get_time() - start;
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(0, batch.get_failed());
+    }
+    printf("%d commands one at a time in %d ms, pipelined in %d ms\n", 
+        batch.size(), (int)(elapsed_us[0] / 1000), 
+        (int)(elapsed_us[1] / 1000));
+
+    std::array<uint8_t, R502_notepad_page_size> read;
+    err = R502.read_notepad(3, conf_code, read);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(page.data(), read.data(), page.size());
+
+    for(int i = 0; i < 4; i++){
+        err = R502.write_notepad(i, saved[i], conf_code);
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    }
+}
+
+TEST_CASE("BusAddressing", "[system command]")
+{
+    esp_err_t err = bus.init(UART_NUM_1, PIN_TXD, PIN_RXD);
+    TEST_ESP_OK(err);
+    // The module starts at the default address and is given this one
+    const std::array<uint8_t, 4> address = {0x00, 0x00, 0x00, 0x01};
+    err = bus.add(R502, address, PIN_IRQ);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(address.data(), R502.get_module_address(),
+        address.size());
+
+    // Nothing answers at another address
+    R502Interface absent;
+    const std::array<uint8_t, 4> absent_address = {0x00, 0x00, 0x00, 0x02};
+    err = bus.add(absent, absent_address, PIN_NC_3);
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, err);
+    TEST_ASSERT_EQUAL(1, bus.size());
+
+    R502_conf_code_t conf_code = R502_fail;
+    uint16_t template_num = 0;
+    for(int i = 0; i < 5; i++){
+        err = R502.template_num(conf_code, template_num);
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    }
+    R502_bus_stats_t stats = bus.get_stats(R502);
+    printf("%d exchanges, %d failed, %d us on average\n", 
+        (int)stats.exchanges, (int)stats.failures, (int)(stats.total_us / 
+        (stats.exchanges - stats.failures)));
+    TEST_ASSERT_GREATER_OR_EQUAL(5, stats.exchanges);
+    TEST_ASSERT_EQUAL(0, stats.stray_packages);
+    TEST_ASSERT_EQUAL(0, bus.get_unrouted());
+
+    // Leave the module at the default address for the other tests
+    err = R502.set_adder(R502Bus::default_adder, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = bus.deinit();
+    TEST_ESP_OK(err);
+}
+
+TEST_CASE("TemplateArchive", "[fingerprint processing command][userInput]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_conf_code_t conf_code;
+    err = R502.empty(conf_code);
+    TEST_ESP_OK(err);
+
+    // The same template in two slots
+    wait_with_message("Place finger on sensor, then press enter\n");
+    err = R502.gen_image(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = R502.img_2_tz(R502_char_buffer_1, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    for(uint16_t page_id = 0; page_id < 2; page_id++){
+        err = R502.store(R502_char_buffer_1, page_id, conf_code);
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    }
+
+    MemTemplateArchive archive;
+    TEST_ESP_OK(archive.open());
+    const uint32_t module_id = 1;
+    err = archive.backup(R502, module_id, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(2, archive.get_stats().slots_pulled);
+    TEST_ASSERT_EQUAL(1, archive.blob_count());
+
+    // Nothing changed, nothing is pulled
+    int64_t start = esp_timer_get_time();
+    err = archive.backup(R502, module_id, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(0, archive.get_stats().slots_pulled);
+    printf("unchanged backup took %d ms\n",
+        (int)((esp_timer_get_time() - start) / 1000));
+
+    err = R502.empty(conf_code);
+    TEST_ESP_OK(err);
+    err = archive.restore(R502, module_id, module_id, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(2, archive.get_stats().slots_pushed);
+    uint16_t template_num = 0;
+    err = R502.template_num(conf_code, template_num);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(2, template_num);
+}
+
+TEST_CASE("BurstCapture", "[fingerprint processing command][userInput]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502BurstCapture burst(R502);
+    R502_burst_config_t config = {};
+    config.mode = R502_burst_extract;
+    config.budget_ms = 3000;
+    config.max_captures = 5;
+    config.buffer = R502_char_buffer_1;
+    R502_burst_result_t result;
+
+    wait_with_message("Place finger on sensor, then press enter\n");
+    err = burst.run(config, result);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, result.res);
+    TEST_ASSERT_EQUAL(result.captures - 1, result.best);
+    printf("extracted capture %d of %d in %d ms\n", result.best + 1,
+        result.captures, (int)(result.elapsed_us / 1000));
+
+    // Image mode keeps the best of several uploads, then extracts it
+    config.mode = R502_burst_image;
+    config.budget_ms = 20000;
+    config.max_captures = 3;
+    config.target_quality = 101;
+    config.extract_best = true;
+    wait_with_message("Keep finger on sensor, then press enter\n");
+    err = burst.run(config, result);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, result.best);
+    TEST_ASSERT_EQUAL(R502_ok, result.res);
+    TEST_ASSERT_EQUAL(R502_image_size / 2, burst.best_image().size());
+    printf("best of %d images was %d, quality %d, in %d ms\n",
+        result.captures, result.best + 1, result.best_quality,
+        (int)(result.elapsed_us / 1000));
+    TEST_ASSERT_LESS_OR_EQUAL(config.budget_ms, result.elapsed_us / 1000);
+
+    // Too short for a single upload, nothing is captured
+    config.budget_ms = 200;
+    err = burst.run(config, result);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(0, result.captures);
+    TEST_ASSERT_EQUAL(-1, result.best);
+    TEST_ASSERT_LESS_OR_EQUAL(config.budget_ms, result.elapsed_us / 1000);
+}
+
+TEST_CASE("VerifyVsSearch", "[fingerprint processing command][userInput][benchmark]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_conf_code_t conf_code;
+    R502_sys_para_t sys_para;
+    err = R502.read_sys_para(conf_code, sys_para);
+    TEST_ESP_OK(err);
+    const uint16_t library = sys_para.finger_library_size;
+    const uint16_t claimed = library - 1;
+    err = R502.empty(conf_code);
+    TEST_ESP_OK(err);
+
+    // Another finger's template fills the library in front of the claimed
+    // one, so search has to pass over all of them
+    std::array<uint8_t, R502_character_file_size> filler;
+    wait_with_message("Place finger on sensor, then press enter\n");
+    err = R502.gen_image(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = R502.img_2_tz(R502_char_buffer_1, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = R502.up_char(R502_char_buffer_1, conf_code, filler);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+
+    // This image stays in img_buffer for every measurement below
+    wait_with_message("Place a different finger on sensor, then press "
+        "enter\n");
+    err = R502.gen_image(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = R502.img_2_tz(R502_char_buffer_1, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = R502.store(R502_char_buffer_1, claimed, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+
+    const uint16_t levels[4] = {1, (uint16_t)(library / 10),
+        (uint16_t)(library / 2), library};
+    uint16_t filled = 1;
+    for(uint16_t level : levels){
+        if(level > filled){
+            err = R502.down_char(R502_char_buffer_2, filler, conf_code);
+            TEST_ESP_OK(err);
+            TEST_ASSERT_EQUAL(R502_ok, conf_code);
+        }
+        for(; filled < level; filled++){
+            err = R502.store(R502_char_buffer_2, filled - 1, conf_code);
+            TEST_ESP_OK(err);
+            TEST_ASSERT_EQUAL(R502_ok, conf_code);
+        }
+
+        // Both start from the image, so both include its extraction
+        uint16_t page_id = 0;
+        uint16_t match_score = 0;
+        int64_t start = esp_timer_get_time();
+        err = R502.img_2_tz(R502_char_buffer_1, conf_code);
+        TEST_ESP_OK(err);
+        err = R502.search(R502_char_buffer_1, 0, library, conf_code, page_id,
+            match_score);
+        int64_t search_us = esp_timer_get_time() - start;
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+        TEST_ASSERT_EQUAL(claimed, page_id);
+
+        // The first verify loads the template, a retry finds it resident
+        int64_t verify_us[2];
+        for(int i = 0; i < 2; i++){
+            TEST_ASSERT_EQUAL(i == 1, R502.is_resident(claimed));
+            start = esp_timer_get_time();
+            err = R502.verify(claimed, conf_code, match_score);
+            verify_us[i] = esp_timer_get_time() - start;
+            TEST_ESP_OK(err);
+            TEST_ASSERT_EQUAL(R502_ok, conf_code);
+        }
+        printf("%d of %d templates: search %d ms, verify %d ms, "
+            "verify retry %d ms\n", level, library, (int)(search_us / 1000),
+            (int)(verify_us[0] / 1000), (int)(verify_us[1] / 1000));
+    }
+
+    err = R502.empty(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_FALSE(R502.is_resident(claimed));
+}
+
+TEST_CASE("SearchPlanner", "[fingerprint processing command][userInput][benchmark]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_conf_code_t conf_code;
+    err = R502.empty(conf_code);
+    TEST_ESP_OK(err);
+    R502SearchPlanner planner(R502);
+    planner.set_config({8, 64, 50});
+
+    // A new template goes past the hot pages
+    uint16_t page_id = 0;
+    err = planner.enroll_page(conf_code, page_id);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(8, page_id);
+    wait_with_message("Place finger on sensor, then press enter\n");
+    err = R502.gen_image(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = R502.img_2_tz(R502_char_buffer_1, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = R502.store(R502_char_buffer_1, page_id, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+
+    // The first identify searches everything, then the page is hot
+    uint16_t match_score = 0;
+    int64_t elapsed_us[2];
+    for(int i = 0; i < 2; i++){
+        int64_t start = esp_timer_get_time();
+        err = planner.identify(R502_char_buffer_1, conf_code, page_id,
+            match_score);
+        elapsed_us[i] = esp_timer_get_time() - start;
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+        TEST_ASSERT_EQUAL(8, page_id);
+    }
+    TEST_ASSERT_EQUAL(1, planner.get_stats().full_searches);
+    TEST_ASSERT_EQUAL(1, planner.get_stats().hot_hits);
+    printf("full search %d ms, hot range search %d ms\n",
+        (int)(elapsed_us[0] / 1000), (int)(elapsed_us[1] / 1000));
+
+    int moves = 0;
+    auto moved = [&](uint16_t from, uint16_t to, bool swapped){
+        TEST_ASSERT_EQUAL(8, from);
+        TEST_ASSERT_EQUAL(0, to);
+        moves++;
+    };
+    err = planner.compact(moved, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(1, moves);
+    TEST_ASSERT_EQUAL(0, planner.hot_range().start_page);
+
+    // The template still matches, at its new page
+    err = R502.img_2_tz(R502_char_buffer_1, conf_code);
+    TEST_ESP_OK(err);
+    err = planner.identify(R502_char_buffer_1, conf_code, page_id,
+        match_score);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(0, page_id);
+}
+
+TEST_CASE("LibraryMaintenance", "[fingerprint processing command][userInput]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_conf_code_t conf_code;
+    err = R502.empty(conf_code);
+    TEST_ESP_OK(err);
+
+    // The same template in the first ten slots
+    wait_with_message("Place finger on sensor, then press enter\n");
+    err = R502.gen_image(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = R502.img_2_tz(R502_char_buffer_1, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    for(uint16_t page_id = 0; page_id < 10; page_id++){
+        err = R502.store(R502_char_buffer_1, page_id, conf_code);
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    }
+
+    R502LibraryMaintenance maintenance(R502);
+    const uint16_t departed[] = {8, 1, 3, 2, 5};
+    err = maintenance.delete_pages(departed, 5, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    R502_maintenance_stats_t stats = maintenance.get_stats();
+    TEST_ASSERT_EQUAL(5, stats.pages_deleted);
+    TEST_ASSERT_EQUAL(3, stats.delete_commands);
+    TEST_ASSERT_EQUAL(2, stats.round_trips_saved);
+
+    // 0, 4, 6, 7 and 9 are left, 9 and 7 move down to 1 and 2
+    maintenance.reset_stats();
+    int moves = 0;
+    auto moved = [&](uint16_t from, uint16_t to){ moves++; };
+    err = maintenance.compact(moved, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(2, moves);
+    TEST_ASSERT_EQUAL(1, maintenance.get_stats().delete_commands);
+    printf("%d round trips, %d saved\n", maintenance.get_stats().round_trips,
+        maintenance.get_stats().round_trips_saved);
+
+    uint16_t page_id = 0;
+    err = R502.find_free_page(conf_code, page_id);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(5, page_id);
+    err = R502.sync_template_index(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(5, R502.get_template_index().used_count());
+    TEST_ASSERT_EQUAL(5, R502.get_template_index().used_in_range(0, 5));
+}
+
+// Only what a capture-and-upload application needs
+typedef R502FixedInterface<R502_data_len_128, R502_cmds_image> R502Compact;
+
+struct up_image_stack_t {
+    bool compact;
+    esp_err_t err;
+    int packed_size;
+    UBaseType_t stack_free;
+    SemaphoreHandle_t done;
+};
+
+static void up_image_stack_task(void *arg)
+{
+    up_image_stack_t *run = (up_image_stack_t *)arg;
+    R502_conf_code_t conf_code;
+    auto count = [&](R502ByteSpan frame){ run->packed_size += frame.size(); };
+    if(run->compact){
+        R502Compact compact;
+        run->err = compact.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+        if(!run->err) run->err = compact.up_image(conf_code, count);
+        compact.deinit();
+    }
+    else{
+        run->err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+        if(!run->err){
+            run->err = R502.up_image(R502_data_len_128, conf_code, count);
+        }
+        R502.deinit();
+    }
+    run->stack_free = uxTaskGetStackHighWaterMark(nullptr);
+    xSemaphoreGive(run->done);
+    vTaskDelete(nullptr);
+}
+
+TEST_CASE("FixedInterfaceFootprint", "[fingerprint processing command][benchmark]")
+{
+    R502Compact compact;
+    esp_err_t err = compact.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_conf_code_t conf_code;
+    err = compact.set_data_package_length(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    int frames = 0;
+    err = compact.up_image(conf_code, [&](R502ByteSpan frame){ frames++; });
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(R502Compact::frames_per_image, frames);
+    err = compact.deinit();
+    TEST_ESP_OK(err);
+
+    // Same upload in a fresh task each, to compare their deepest stack use
+    const uint32_t stack_size = 8192;
+    UBaseType_t stack_free[2];
+    for(int compact_run = 0; compact_run < 2; compact_run++){
+        up_image_stack_t run = {compact_run == 1, ESP_FAIL, 0, 0,
+            xSemaphoreCreateBinary()};
+        xTaskCreate(up_image_stack_task, "up_image_stack", stack_size, &run,
+            5, nullptr);
+        xSemaphoreTake(run.done, portMAX_DELAY);
+        vSemaphoreDelete(run.done);
+        TEST_ESP_OK(run.err);
+        TEST_ASSERT_EQUAL(R502_image_size, run.packed_size * 2);
+        stack_free[compact_run] = run.stack_free;
+    }
+    printf("up_image stack used: R502Interface %d B, R502Compact %d B\n",
+        (int)(stack_size - stack_free[0]), (int)(stack_size - stack_free[1]));
+    printf("command package %d B, data package %d B vs %d B\n",
+        (int)sizeof(R502_DataPkg_t), (int)sizeof(R502_DataPkgN_t<128>),
+        (int)sizeof(R502_DataPkgN_t<R502_max_data_len>));
+    TEST_ASSERT_LESS_THAN(stack_size - stack_free[0],
+        stack_size - stack_free[1]);
+}
+
 TEST_CASE("UpImageAdvanced", "[fingerprint processing command]")
 {
     esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
@@ -358,4 +1089,175 @@ TEST_CASE("UpImageAdvanced", "[fingerprint processing command]")
     err = R502.set_baud_rate(starting_baud, conf_code);
     TEST_ESP_OK(err);
     TEST_ASSERT_EQUAL(R502_ok, conf_code);
-}
\ No newline at end of file
+}
+
+TEST_CASE("ReadIndexTable", "[system command]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_conf_code_t conf_code;
+    std::array<uint8_t, R502_index_table_len> table;
+    err = R502.read_index_table(0, conf_code, table);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+
+    // Only 4 pages of index table
+    err = R502.read_index_table(R502_index_table_pages, conf_code, table);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, err);
+
+    // The synced index should agree with the module's template count
+    err = R502.sync_template_index(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_TRUE(R502.get_template_index().is_synced());
+    uint16_t template_num = 0;
+    err = R502.template_num(conf_code, template_num);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(template_num, R502.get_template_index().used_count());
+    TEST_ASSERT_TRUE(R502.get_template_index().is_synced());
+
+    uint16_t page_id = 0;
+    err = R502.find_free_page(conf_code, page_id);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_FALSE(R502.get_template_index().is_used(page_id));
+}
+
+TEST_CASE("NotepadStore", "[system command]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_conf_code_t conf_code;
+
+    // The notepad is the user's, put back the pages the test writes
+    const int used_pages[] = {0, 1, 2, 3, 15};
+    std::array<std::array<uint8_t, R502_notepad_page_size>, 5> saved;
+    for(int i = 0; i < 5; i++){
+        err = R502.read_notepad(used_pages[i], conf_code, saved[i]);
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    }
+
+    std::array<uint8_t, R502_notepad_page_size> page;
+    page.fill(0xA5);
+    err = R502.write_notepad(15, page, conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    std::array<uint8_t, R502_notepad_page_size> read_page;
+    err = R502.read_notepad(15, conf_code, read_page);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(page.data(), read_page.data(), page.size());
+
+    // Keep the store away from the page used above
+    R502NotepadStore store(R502, 0, 4);
+    err = store.load(conf_code);
+    // An unrecognised notepad loads as empty
+    TEST_ASSERT_TRUE(err == ESP_OK || err == ESP_ERR_INVALID_CRC ||
+        err == ESP_ERR_INVALID_VERSION);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+
+    const uint8_t serial[] = {0x12, 0x34, 0x56};
+    err = store.set("serial", serial, sizeof(serial));
+    TEST_ESP_OK(err);
+    err = store.flush(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_FALSE(store.is_dirty());
+
+    // A second store sees the flushed value
+    R502NotepadStore reloaded(R502, 0, 4);
+    err = reloaded.load(conf_code);
+    TEST_ESP_OK(err);
+    uint8_t value[8];
+    size_t len = sizeof(value);
+    err = reloaded.get("serial", value, len);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(sizeof(serial), len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(serial, value, len);
+
+    // Flushing again without changes writes nothing
+    uint32_t written = reloaded.get_stats().pages_written;
+    err = reloaded.set("serial", serial, sizeof(serial));
+    TEST_ESP_OK(err);
+    err = reloaded.flush(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(written, reloaded.get_stats().pages_written);
+
+    for(int i = 0; i < 5; i++){
+        err = R502.write_notepad(used_pages[i], saved[i], conf_code);
+        TEST_ESP_OK(err);
+        TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    }
+}
+
+TEST_CASE("GetRandomCode", "[system command]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_conf_code_t conf_code;
+    uint32_t first = 0;
+    uint32_t second = 0;
+    err = R502.get_random_code(conf_code, first);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    err = R502.get_random_code(conf_code, second);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_NOT_EQUAL(first, second);
+
+    R502EntropyPool pool(R502, 64, 16);
+    err = pool.start(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+    TEST_ASSERT_EQUAL(64, pool.level());
+
+    // Draining past the low-water mark wakes the refill task
+    uint8_t nonce[16];
+    uint8_t last_nonce[16] = {0};
+    int64_t start = esp_timer_get_time();
+    for(int i = 0; i < 64; i++){
+        err = pool.fill(nonce, sizeof(nonce));
+        TEST_ESP_OK(err);
+        TEST_ASSERT_TRUE(memcmp(nonce, last_nonce, sizeof(nonce)) != 0);
+        memcpy(last_nonce, nonce, sizeof(nonce));
+    }
+    printf("64 nonces in %d us\n", (int)(esp_timer_get_time() - start));
+    vTaskDelay(500 / portTICK_PERIOD_MS);
+    R502_entropy_stats_t stats = pool.get_stats();
+    TEST_ASSERT_EQUAL(64 * sizeof(nonce), stats.bytes_served);
+    TEST_ASSERT_GREATER_THAN(1, stats.refills);
+    pool.stop();
+}
+
+TEST_CASE("IdleWake", "[system command][userInput]")
+{
+    esp_err_t err = R502.init(UART_NUM_1, PIN_TXD, PIN_RXD, PIN_IRQ);
+    TEST_ESP_OK(err);
+    R502_conf_code_t conf_code;
+
+    // The test rig has no supply switch, keep the module powered
+    R502_idle_config_t config = {GPIO_NUM_NC, 1, true};
+    err = R502.enter_idle(config);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_TRUE(R502.is_idle());
+    err = R502.gen_image(conf_code);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, err);
+    err = R502.wait_for_touch(100);
+    TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, err);
+
+    printf("Place finger on sensor\n");
+    err = R502.wait_for_touch(10000);
+    TEST_ESP_OK(err);
+    err = R502.exit_idle();
+    TEST_ESP_OK(err);
+    TEST_ASSERT_FALSE(R502.is_idle());
+    err = R502.gen_image(conf_code);
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL(R502_ok, conf_code);
+
+    const R502_wake_timing_t &timing = R502.get_wake_timing();
+    TEST_ASSERT_EQUAL(1, timing.round_trips);
+    printf("touch to capture in %d ms\n", 
+        (int)((timing.first_capture_us - timing.touch_us) / 1000));
+}
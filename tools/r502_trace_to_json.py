@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""Convert R502BufferTrace::dump output to a Chrome trace-event JSON file.
+
+Usage: r502_trace_to_json.py monitor.log [trace.json]
+
+Reads every "R502T:" line in the log, anything else is skipped, so a
+captured idf.py monitor session can be passed as is. Open the result in
+chrome://tracing or https://ui.perfetto.dev
+"""
+
+import json
+import re
+import sys
+
+TX_START, TX_END, RX_HEADER, RX_COMPLETE, CHECKSUM_OK, CALLBACK = range(6)
+
+INSTRUCTIONS = {
+    0x01: "GenImg", 0x02: "Img2Tz", 0x03: "Match", 0x04: "Search",
+    0x05: "RegModel", 0x06: "Store", 0x07: "LoadChar", 0x08: "UpChar",
+    0x09: "DownChar", 0x0A: "UpImage", 0x0B: "DownImage", 0x0C: "DeletChar",
+    0x0D: "Empty", 0x0E: "SetSysPara", 0x0F: "ReadSysPara", 0x12: "SetPwd",
+    0x13: "VfyPwd", 0x14: "GetRandomCode", 0x15: "SetAdder", 0x17: "Control",
+    0x18: "WriteNotepad", 0x19: "ReadNotepad", 0x1D: "TemplateNum",
+    0x1F: "ReadIndexTable", 0x35: "LedConfig",
+}
+PIDS = {0x01: "command", 0x02: "data", 0x07: "ack", 0x08: "end of data"}
+
+# One row per kind of activity
+TX_TID, RX_TID, CALLBACK_TID = 1, 2, 3
+
+RECORD = re.compile(r"R502T:([0-9a-fA-F]+)")
+
+
+def read_records(lines):
+    """Yield (time_us, event, code, arg), unwrapping the 32 bit timestamps"""
+    last = None
+    wraps = 0
+    for line in lines:
+        match = RECORD.search(line)
+        if not match:
+            continue
+        hex_records = match.group(1)
+        for i in range(0, len(hex_records) - 15, 16):
+            r = hex_records[i:i + 16]
+            time_us = int(r[0:8], 16)
+            # Records from different tasks can land slightly out of order,
+            # only a jump back of more than half the range is a wrap
+            if last is not None and last - time_us > 1 << 31:
+                wraps += 1
+            last = time_us
+            yield (time_us + (wraps << 32), int(r[8:10], 16),
+                   int(r[10:12], 16), int(r[12:16], 16))
+
+
+def to_events(records):
+    events = [
+        {"ph": "M", "pid": 1, "name": "process_name",
+         "args": {"name": "R502"}},
+        {"ph": "M", "pid": 1, "tid": TX_TID, "name": "thread_name",
+         "args": {"name": "uart tx"}},
+        {"ph": "M", "pid": 1, "tid": RX_TID, "name": "thread_name",
+         "args": {"name": "uart rx"}},
+        {"ph": "M", "pid": 1, "tid": CALLBACK_TID, "name": "thread_name",
+         "args": {"name": "up_image consumer"}},
+    ]
+    def incomplete(header):
+        # A header without its package means the rest never arrived
+        events.append({
+            "ph": "i", "s": "t", "pid": 1, "tid": RX_TID, "ts": header[0],
+            "name": "incomplete package"})
+
+    tx_start = None
+    rx_header = None
+    for time_us, event, code, arg in records:
+        if event == TX_START:
+            tx_start = (time_us, code, arg)
+        elif event == TX_END and tx_start:
+            start, instr, length = tx_start
+            events.append({
+                "ph": "X", "pid": 1, "tid": TX_TID, "ts": start,
+                "dur": time_us - start,
+                "name": INSTRUCTIONS.get(instr, "0x%02X" % instr),
+                "args": {"bytes": length}})
+            tx_start = None
+        elif event == RX_HEADER:
+            if rx_header:
+                incomplete(rx_header)
+            rx_header = (time_us, code, arg)
+        elif event == RX_COMPLETE and rx_header:
+            start, pid, length = rx_header
+            events.append({
+                "ph": "X", "pid": 1, "tid": RX_TID, "ts": start,
+                "dur": time_us - start,
+                "name": PIDS.get(pid, "pid 0x%02X" % pid),
+                "args": {"length": length, "bytes": arg}})
+            rx_header = None
+        elif event == CHECKSUM_OK:
+            events.append({
+                "ph": "i", "s": "t", "pid": 1, "tid": RX_TID, "ts": time_us,
+                "name": "checksum ok"})
+        elif event == CALLBACK:
+            events.append({
+                "ph": "i", "s": "t", "pid": 1, "tid": CALLBACK_TID,
+                "ts": time_us, "name": "frame %d" % arg})
+    if rx_header:
+        incomplete(rx_header)
+    return events
+
+
+def main():
+    if len(sys.argv) < 2 or len(sys.argv) > 3:
+        sys.exit(__doc__)
+    with open(sys.argv[1], errors="replace") as log:
+        events = to_events(read_records(log))
+    trace = {"traceEvents": events, "displayTimeUnit": "ms"}
+    if len(sys.argv) == 3:
+        with open(sys.argv[2], "w") as out:
+            json.dump(trace, out)
+    else:
+        json.dump(trace, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()